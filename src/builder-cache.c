@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/statfs.h>
+#include <sys/file.h>
 
 #include <gio/gio.h>
 #include <ostree.h>
@@ -41,14 +42,22 @@ struct BuilderCache
   GObject     parent;
   BuilderContext *context;
   GChecksum  *checksum;
+  GChecksum  *own_checksum;
   GFile      *app_dir;
   char       *branch;
   char       *stage;
   GHashTable *unused_stages;
   char       *last_parent;
   char       *current_checksum;
+  char       *base_checksum;
+  GHashTable *stage_checksums;
   OstreeRepo *repo;
+  OstreeRepo *push_repo;
+  GHashTable *shared_cache_refs;
+  gboolean    pushed_to_shared_cache;
   gboolean    disabled;
+  gboolean    checked_out;
+  gboolean    has_random_checksum;
   OstreeRepoDevInoCache *devino_to_csum_cache;
 };
 
@@ -67,6 +76,12 @@ enum {
   LAST_PROP
 };
 
+/* The name of the remote in the local cache repo for --cache-url */
+#define SHARED_CACHE_REMOTE "flatpak-builder-cache"
+
+/* Days a parsed manifest file is kept in the parse cache when unused */
+#define PARSE_CACHE_MAX_AGE 7
+
 #define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
                                    "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
 
@@ -74,6 +89,13 @@ static GPtrArray   *builder_cache_get_changes_to (BuilderCache *self,
                                                   GFile        *current_root,
                                                   GPtrArray   **removals,
                                                   GError      **error);
+static gboolean     diff_dirs (OstreeRepoDevInoCache *devino_to_csum_cache,
+                               GFile          *a,
+                               GFile          *b,
+                               GPtrArray      *changed,
+                               GPtrArray      *removed,
+                               GCancellable   *cancellable,
+                               GError        **error);
 
 
 static void
@@ -84,13 +106,19 @@ builder_cache_finalize (GObject *object)
   g_clear_object (&self->context);
   g_clear_object (&self->app_dir);
   g_clear_object (&self->repo);
+  g_clear_object (&self->push_repo);
   g_checksum_free (self->checksum);
+  g_checksum_free (self->own_checksum);
   g_free (self->branch);
   g_free (self->last_parent);
   g_free (self->stage);
   g_free (self->current_checksum);
+  g_free (self->base_checksum);
+  g_hash_table_unref (self->stage_checksums);
   if (self->unused_stages)
     g_hash_table_unref (self->unused_stages);
+  if (self->shared_cache_refs)
+    g_hash_table_unref (self->shared_cache_refs);
 
   if (self->devino_to_csum_cache)
     ostree_repo_devino_cache_unref (self->devino_to_csum_cache);
@@ -189,6 +217,8 @@ static void
 builder_cache_init (BuilderCache *self)
 {
   self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->own_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->stage_checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   self->devino_to_csum_cache = ostree_repo_devino_cache_new ();
 }
 
@@ -210,6 +240,14 @@ builder_cache_get_checksum (BuilderCache *self)
   return self->checksum;
 }
 
+/* Whether anything checksummed so far was random, i.e. the checksum
+   will never match again */
+gboolean
+builder_cache_has_random_checksum (BuilderCache *self)
+{
+  return self->has_random_checksum;
+}
+
 static void
 append_escaped_stage (GString *s,
                       const char *stage)
@@ -239,6 +277,226 @@ get_ref (BuilderCache *self, const char *stage)
   return g_string_free (s, FALSE);
 }
 
+static GFile *
+file_for_path_or_uri (const char *path_or_uri)
+{
+  if (strstr (path_or_uri, "://") != NULL)
+    return g_file_new_for_uri (path_or_uri);
+
+  return g_file_new_for_path (path_or_uri);
+}
+
+/* Sets up the shared cache repos from --cache-url and --push-cache.
+ * Stages are looked up in the former through a remote in the local
+ * cache repo. Stages are published to the latter by pulling them into
+ * it from the local cache, so it has to be a local directory (which
+ * can then be served to the other builders).
+ *
+ * The stages in the shared cache are not signed, so whatever the
+ * shared cache serves ends up in the build: it has to be trusted as
+ * much as the build machines themselves. Because of that, it is only
+ * looked up in local directories or over https, where ostree checks
+ * the server, and never over plain http. */
+static gboolean
+open_shared_cache (BuilderCache *self,
+                   GError      **error)
+{
+  const char *cache_url = builder_context_get_cache_url (self->context);
+  const char *push_url = builder_context_get_push_cache_url (self->context);
+
+  if (cache_url != NULL)
+    {
+      g_autoptr(GFile) cache_file = file_for_path_or_uri (cache_url);
+      g_autofree char *uri = g_file_get_uri (cache_file);
+      GVariantBuilder options;
+
+      if (!g_str_has_prefix (uri, "file:") &&
+          !g_str_has_prefix (uri, "https:"))
+        return flatpak_fail (error, "Shared cache %s is not a local directory or an https url", cache_url);
+
+      g_variant_builder_init (&options, G_VARIANT_TYPE ("a{sv}"));
+      g_variant_builder_add (&options, "{sv}", "gpg-verify", g_variant_new_boolean (FALSE));
+      g_variant_builder_add (&options, "{sv}", "gpg-verify-summary", g_variant_new_boolean (FALSE));
+
+      /* Re-add it every time, in case the url changed */
+      if (!ostree_repo_remote_change (self->repo, NULL,
+                                      OSTREE_REPO_REMOTE_CHANGE_DELETE_IF_EXISTS,
+                                      SHARED_CACHE_REMOTE, NULL, NULL,
+                                      NULL, error) ||
+          !ostree_repo_remote_change (self->repo, NULL,
+                                      OSTREE_REPO_REMOTE_CHANGE_ADD,
+                                      SHARED_CACHE_REMOTE, uri,
+                                      g_variant_builder_end (&options),
+                                      NULL, error))
+        return FALSE;
+    }
+
+  if (push_url != NULL)
+    {
+      g_autoptr(GFile) push_dir = file_for_path_or_uri (push_url);
+
+      if (!g_file_is_native (push_dir))
+        return flatpak_fail (error, "Can only push to a cache repo in a local directory, not %s", push_url);
+
+      self->push_repo = ostree_repo_new (push_dir);
+
+      if (!g_file_query_exists (push_dir, NULL))
+        {
+          if (!flatpak_mkdir_p (push_dir, NULL, error))
+            return FALSE;
+
+          /* archive, so that it can be served over http */
+          if (!ostree_repo_create (self->push_repo, OSTREE_REPO_MODE_ARCHIVE, NULL, error))
+            return FALSE;
+        }
+
+      if (!ostree_repo_open (self->push_repo, NULL, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Lists the stages in the shared cache from its summary, once per
+ * run, so that stages it doesn't have don't cost a round trip each */
+static GHashTable *
+get_shared_cache_refs (BuilderCache *self)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (self->shared_cache_refs != NULL)
+    return self->shared_cache_refs;
+
+  if (!ostree_repo_remote_list_refs (self->repo, SHARED_CACHE_REMOTE,
+                                     &self->shared_cache_refs, NULL, &error))
+    {
+      g_printerr ("Failed to list stages in shared cache, not using it: %s\n", error->message);
+      self->shared_cache_refs = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+  return self->shared_cache_refs;
+}
+
+/* Pulls @ref from the shared cache into the local cache. Returns the
+ * pulled commit, or %NULL if the shared cache doesn't have the stage. */
+static char *
+pull_from_shared_cache (BuilderCache *self,
+                        const char   *ref)
+{
+  const char *refs[] = { ref, NULL };
+  const char *commits[] = { NULL, NULL };
+  g_autofree char *remote_ref = NULL;
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+  char *commit = NULL;
+
+  if (builder_context_get_cache_url (self->context) == NULL)
+    return NULL;
+
+  commits[0] = g_hash_table_lookup (get_shared_cache_refs (self), ref);
+  if (commits[0] == NULL)
+    return NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "refs", g_variant_new_strv (refs, -1));
+  g_variant_builder_add (&builder, "{sv}", "override-commit-ids", g_variant_new_strv (commits, -1));
+  g_variant_builder_add (&builder, "{sv}", "flags", g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_NONE));
+  /* Restoring a content-addressed stage diffs it against its parent */
+  g_variant_builder_add (&builder, "{sv}", "depth",
+                         g_variant_new_int32 (builder_context_get_content_cache (self->context) ? 1 : 0));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_pull_with_options (self->repo, SHARED_CACHE_REMOTE, options,
+                                      NULL, NULL, &error))
+    {
+      g_printerr ("Failed to pull stage %s from shared cache: %s\n", self->stage, error->message);
+      return NULL;
+    }
+
+  remote_ref = g_strconcat (SHARED_CACHE_REMOTE, ":", ref, NULL);
+  if (!ostree_repo_resolve_rev (self->repo, remote_ref, FALSE, &commit, &error))
+    {
+      g_printerr ("Failed to look up stage %s in shared cache: %s\n", self->stage, error->message);
+      return NULL;
+    }
+
+  /* Make it a local stage, so it is found without a pull next time,
+     and drop the remote ref so it doesn't keep the commit alive */
+  if (!ostree_repo_set_ref_immediate (self->repo, NULL, ref, commit, NULL, &error) ||
+      !ostree_repo_set_ref_immediate (self->repo, SHARED_CACHE_REMOTE, ref, NULL, NULL, &error))
+    {
+      g_printerr ("Failed to look up stage %s in shared cache: %s\n", self->stage, error->message);
+      g_free (commit);
+      return NULL;
+    }
+
+  g_print ("Found stage %s in shared cache\n", self->stage);
+
+  return commit;
+}
+
+/* Publishes a just committed stage to the --push-cache repo. A failure
+ * here only means that other builders will have to build the stage
+ * themselves, so it isn't fatal. */
+static void
+push_to_shared_cache (BuilderCache *self,
+                      const char   *ref,
+                      const char   *commit)
+{
+  const char *refs[] = { ref, NULL };
+  g_autofree char *local_uri = g_file_get_uri (builder_context_get_cache_dir (self->context));
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "refs", g_variant_new_strv (refs, -1));
+  g_variant_builder_add (&builder, "{sv}", "flags", g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_NONE));
+  g_variant_builder_add (&builder, "{sv}", "depth",
+                         g_variant_new_int32 (builder_context_get_content_cache (self->context) ? 1 : 0));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_pull_with_options (self->push_repo, local_uri, options,
+                                      NULL, NULL, &error) ||
+      !ostree_repo_set_ref_immediate (self->push_repo, NULL, ref, commit, NULL, &error))
+    g_printerr ("Failed to push stage %s to shared cache: %s\n", self->stage, error->message);
+  else
+    self->pushed_to_shared_cache = TRUE;
+}
+
+/* Updates the summary of the --push-cache repo, which the other
+ * builders list its stages from, once at the end of the build rather
+ * than for each stage. Builders that push to the same repo take turns
+ * with a lock file in it, so they don't write the summary at once. */
+static gboolean
+update_shared_cache_summary (BuilderCache *self,
+                             GError      **error)
+{
+  g_autofree char *lock_path = NULL;
+  glnx_fd_close int lock_fd = -1;
+
+  if (!self->pushed_to_shared_cache)
+    return TRUE;
+
+  lock_path = g_build_filename (flatpak_file_get_path_cached (ostree_repo_get_path (self->push_repo)),
+                                "flatpak-builder.lock", NULL);
+  lock_fd = open (lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0)
+    return glnx_throw_errno_prefix (error, "open %s", lock_path);
+
+  if (TEMP_FAILURE_RETRY (flock (lock_fd, LOCK_EX)) != 0)
+    return glnx_throw_errno_prefix (error, "flock %s", lock_path);
+
+  if (!ostree_repo_regenerate_summary (self->push_repo, NULL, NULL, error))
+    return FALSE;
+
+  self->pushed_to_shared_cache = FALSE;
+
+  /* Closing the fd releases the lock */
+  return TRUE;
+}
+
 gboolean
 builder_cache_open (BuilderCache *self,
                     GError      **error)
@@ -298,6 +556,9 @@ builder_cache_open (BuilderCache *self,
                               NULL, error))
     return FALSE;
 
+  if (!open_shared_cache (self, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -350,7 +611,7 @@ builder_cache_checkout (BuilderCache *self, const char *commit, gboolean delete_
 gboolean
 builder_cache_has_checkout (BuilderCache *self)
 {
-  return self->disabled;
+  return self->disabled || self->checked_out;
 }
 
 void
@@ -377,12 +638,219 @@ builder_cache_get_current_ref (BuilderCache *self)
   return get_ref (self, self->stage);
 }
 
+static GPtrArray *get_changes (BuilderCache *self,
+                               GFile        *from,
+                               GFile        *to,
+                               GPtrArray   **removed_out,
+                               GError      **error);
+
+static void
+checksum_update_str (GChecksum  *checksum,
+                     const char *str)
+{
+  g_checksum_update (checksum, (const guchar *) str, strlen (str) + 1);
+}
+
+/* The checksum of a content-addressed stage only covers its own inputs,
+   the first stage (which has the sdk, runtime and build options) and
+   the stages it depends on, not everything built before it. */
+static char *
+get_content_checksum (BuilderCache *self,
+                      const char  **deps,
+                      GError      **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  int i;
+
+  checksum_update_str (checksum, self->base_checksum ? self->base_checksum : "");
+  checksum_update_str (checksum, g_checksum_get_string (self->own_checksum));
+
+  for (i = 0; deps[i] != NULL; i++)
+    {
+      const char *dep_checksum = g_hash_table_lookup (self->stage_checksums, deps[i]);
+
+      if (dep_checksum == NULL)
+        {
+          flatpak_fail (error, "Stage %s depends on %s, which has not been built", self->stage, deps[i]);
+          return NULL;
+        }
+
+      checksum_update_str (checksum, deps[i]);
+      checksum_update_str (checksum, dep_checksum);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Applies the changes that @commit made relative to its parent to the
+   checked out app dir, which may differ from that parent */
+static gboolean
+apply_commit_changes (BuilderCache *self,
+                      const char   *commit,
+                      const char   *parent,
+                      GError      **error)
+{
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) parent_root = NULL;
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(GPtrArray) removals = NULL;
+  int i;
+
+  if (!ostree_repo_read_commit (self->repo, commit, &root, NULL, NULL, error))
+    return FALSE;
+
+  if (parent != NULL &&
+      !ostree_repo_read_commit (self->repo, parent, &parent_root, NULL, NULL, error))
+    return FALSE;
+
+  changes = get_changes (self, parent_root, root, &removals, error);
+  if (changes == NULL)
+    return FALSE;
+
+  for (i = 0; i < removals->len; i++)
+    {
+      g_autoptr(GFile) dest = g_file_resolve_relative_path (self->app_dir, g_ptr_array_index (removals, i));
+
+      if (!flatpak_rm_rf (dest, NULL, error))
+        return FALSE;
+    }
+
+  /* The changes are sorted, so directories come before their contents */
+  for (i = 0; i < changes->len; i++)
+    {
+      const char *path = g_ptr_array_index (changes, i);
+      g_autoptr(GFile) src = g_file_resolve_relative_path (root, path);
+      g_autoptr(GFile) dest = g_file_resolve_relative_path (self->app_dir, path);
+      g_autoptr(GFileInfo) src_info = NULL;
+      GFileType dest_type;
+
+      src_info = g_file_query_info (src, OSTREE_GIO_FAST_QUERYINFO,
+                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    NULL, error);
+      if (src_info == NULL)
+        return FALSE;
+
+      dest_type = g_file_query_file_type (dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL);
+
+      if (g_file_info_get_file_type (src_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (dest_type != G_FILE_TYPE_DIRECTORY)
+            {
+              if (dest_type != G_FILE_TYPE_UNKNOWN &&
+                  !flatpak_rm_rf (dest, NULL, error))
+                return FALSE;
+
+              if (!g_file_make_directory (dest, NULL, error))
+                return FALSE;
+            }
+
+          /* An existing directory may only have changed its mode */
+          if (chmod (flatpak_file_get_path_cached (dest),
+                     g_file_info_get_attribute_uint32 (src_info, "unix::mode") & 07777) != 0)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          continue;
+        }
+
+      if (dest_type != G_FILE_TYPE_UNKNOWN &&
+          !flatpak_rm_rf (dest, NULL, error))
+        return FALSE;
+
+      if (!g_file_copy (src, dest,
+                        G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_ALL_METADATA,
+                        NULL, NULL, NULL, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Reuses a cached content-addressed stage on top of whatever was built
+   before it, by applying its changes to the app dir and committing the
+   result as the new version of the stage. */
+static gboolean
+restore_from_cache (BuilderCache *self,
+                    const char   *commit,
+                    const char   *parent,
+                    const char   *body,
+                    GError      **error)
+{
+  g_print ("Restoring stage %s from cache\n", self->stage);
+
+  if (!self->checked_out)
+    {
+      if (self->last_parent &&
+          !builder_cache_checkout (self, self->last_parent, TRUE, error))
+        return FALSE;
+
+      self->checked_out = TRUE;
+    }
+
+  if (!apply_commit_changes (self, commit, parent, error))
+    return FALSE;
+
+  if (g_strcmp0 (parent, self->last_parent) == 0)
+    {
+      /* Built on top of the same thing, so the app dir now matches it */
+      g_free (self->last_parent);
+      self->last_parent = g_strdup (commit);
+      return TRUE;
+    }
+
+  return builder_cache_commit (self, body, error);
+}
+
+static gboolean
+commit_has_subject (BuilderCache *self,
+                    const char   *commit,
+                    const char   *subject)
+{
+  g_autoptr(GVariant) variant = NULL;
+  const gchar *commit_subject;
+
+  if (commit == NULL ||
+      !ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                 &variant, NULL))
+    return FALSE;
+
+  g_variant_get (variant, "(a{sv}aya(say)&s&stayay)", NULL, NULL, NULL,
+                 &commit_subject, NULL, NULL, NULL, NULL);
+
+  return strcmp (commit_subject, subject) == 0;
+}
+
 gboolean
 builder_cache_lookup (BuilderCache *self,
-                      const char   *stage)
+                      const char   *stage,
+                      GError      **error)
+{
+  return builder_cache_lookup_with_deps (self, stage, NULL, error);
+}
+
+/* When content-addressed caching is enabled (--content-cache) and @deps
+ * is not %NULL, the stage checksum is based only on the stage's own
+ * inputs and those of the stages in @deps. A later stage can then be
+ * reused even if an unrelated earlier one was rebuilt, rather than
+ * every stage after the first miss being rebuilt. Otherwise (and
+ * always without --content-cache) this is the same as
+ * builder_cache_lookup().
+ *
+ * Returns %TRUE on a cache hit. On a miss %FALSE is returned without
+ * setting @error, which is only set if a stage that was found couldn't
+ * be restored from the cache. */
+gboolean
+builder_cache_lookup_with_deps (BuilderCache *self,
+                                const char   *stage,
+                                const char  **deps,
+                                GError      **error)
 {
+  gboolean content_cache = builder_context_get_content_cache (self->context);
   g_autofree char *commit = NULL;
   g_autofree char *ref = NULL;
+  g_autofree char *chained_checksum = NULL;
   g_autoptr(GString) s = g_string_new ("");
 
   g_free (self->stage);
@@ -391,12 +859,29 @@ builder_cache_lookup (BuilderCache *self,
   append_escaped_stage (s, stage);
   g_hash_table_remove (self->unused_stages, s->str);
 
+  chained_checksum = g_strdup (g_checksum_get_string (self->checksum));
+
   g_free (self->current_checksum);
-  self->current_checksum = g_strdup (g_checksum_get_string (self->checksum));
+  if (content_cache && deps != NULL)
+    {
+      self->current_checksum = get_content_checksum (self, deps, error);
+      if (self->current_checksum == NULL)
+        return FALSE;
+    }
+  else
+    self->current_checksum = g_strdup (chained_checksum);
+
+  if (content_cache)
+    {
+      if (self->base_checksum == NULL)
+        self->base_checksum = g_strdup (self->current_checksum);
+      g_hash_table_insert (self->stage_checksums, g_strdup (stage), g_strdup (self->current_checksum));
+    }
 
   /* Reset the checksum, but feed it previous checksum so we chain it */
   g_checksum_reset (self->checksum);
-  builder_cache_checksum_str (self, self->current_checksum);
+  builder_cache_checksum_str (self, chained_checksum);
+  g_checksum_reset (self->own_checksum);
 
   if (self->disabled)
     return FALSE;
@@ -405,39 +890,68 @@ builder_cache_lookup (BuilderCache *self,
   if (!ostree_repo_resolve_rev (self->repo, ref, TRUE, &commit, NULL))
     goto checkout;
 
+  if (!commit_has_subject (self, commit, self->current_checksum))
+    {
+      g_clear_pointer (&commit, g_free);
+      commit = pull_from_shared_cache (self, ref);
+    }
 
   if (commit != NULL)
     {
       g_autoptr(GVariant) variant = NULL;
       const gchar *subject;
+      const gchar *body;
 
       if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
                                      &variant, NULL))
         goto checkout;
 
       g_variant_get (variant, "(a{sv}aya(say)&s&stayay)", NULL, NULL, NULL,
-                     &subject, NULL, NULL, NULL, NULL);
+                     &subject, &body, NULL, NULL, NULL);
 
       if (strcmp (subject, self->current_checksum) == 0)
         {
-          g_free (self->last_parent);
-          self->last_parent = g_steal_pointer (&commit);
+          g_autofree char *parent = NULL;
+
+          parent = ostree_commit_get_parent (variant);
+
+          if (!content_cache ||
+              (!self->checked_out && g_strcmp0 (parent, self->last_parent) == 0))
+            {
+              g_free (self->last_parent);
+              self->last_parent = g_steal_pointer (&commit);
+
+              return TRUE;
+            }
+
+          if (!restore_from_cache (self, commit, parent, body, error))
+            {
+              g_prefix_error (error, "Failed to restore %s from cache: ", stage);
+              return FALSE;
+            }
 
           return TRUE;
         }
     }
 
 checkout:
-  if (self->last_parent)
+  if (self->last_parent && !self->checked_out)
     {
-      g_autoptr(GError) error = NULL;
       g_print ("Cache miss, checking out last cache hit\n");
 
-      if (!builder_cache_checkout (self, self->last_parent, TRUE, &error))
-        g_error ("Failed to check out cache: %s", error->message);
+      if (!builder_cache_checkout (self, self->last_parent, TRUE, error))
+        {
+          g_prefix_error (error, "Failed to check out cache: ");
+          return FALSE;
+        }
     }
 
-  self->disabled = TRUE; /* Don't use cache any more after first miss */
+  /* Don't use cache any more after first miss, unless
+     stages can be reused independently of the ones before */
+  if (content_cache)
+    self->checked_out = TRUE;
+  else
+    self->disabled = TRUE;
 
   return FALSE;
 }
@@ -568,55 +1082,384 @@ commit_filter (OstreeRepo *repo,
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
-gboolean
-builder_cache_commit (BuilderCache *self,
-                      const char   *body,
-                      GError      **error)
+#if OSTREE_CHECK_VERSION(2018, 9)
+
+/* Like flatpak_zero_mtime(), but doesn't recurse into directories */
+static gboolean
+zero_mtime_nofollow (GFile   *file,
+                     GError **error)
 {
-  const char *current = NULL;
-  OstreeRepoCommitModifier *modifier = NULL;
+  const struct timespec times[2] = { { 0, UTIME_OMIT }, { OSTREE_TIMESTAMP, } };
 
-  g_autoptr(OstreeMutableTree) mtree = NULL;
-  g_autoptr(GFile) root = NULL;
-  g_autofree char *commit_checksum = NULL;
-  g_autofree char *new_commit_checksum = NULL;
-  gboolean res = FALSE;
-  g_autofree char *ref = NULL;
-  g_autoptr(GFile) last_root = NULL;
-  g_autoptr(GFile) new_root = NULL;
-  g_autoptr(GPtrArray) changes = NULL;
-  g_autoptr(GPtrArray) removals = NULL;
-  g_autoptr(GVariantDict) metadata_dict = NULL;
-  g_autoptr(GVariant) metadata = NULL;
-  g_autoptr(GVariant) changesv = NULL;
-  g_autoptr(GVariant) removalsv = NULL;
-  g_autoptr(GVariant) changesvz = NULL;
-  g_autoptr(GVariant) removalsvz = NULL;
+  if (TEMP_FAILURE_RETRY (utimensat (AT_FDCWD, flatpak_file_get_path_cached (file),
+                                     times, AT_SYMLINK_NOFOLLOW)) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-  g_print ("Committing stage %s to cache\n", self->stage);
+  return TRUE;
+}
 
-  /* We set all mtimes to 0 during a commit, to simulate what would happen when
-     running via flatpak deploy (and also if we checked out from the cache). */
-  if (!flatpak_zero_mtime (AT_FDCWD, flatpak_file_get_path_cached (self->app_dir),
-                           NULL, NULL))
-    return FALSE;
+static gboolean
+path_is_in_dirs (GHashTable *dirs,
+                 const char *path)
+{
+  g_autofree char *dir = g_strdup (path);
+  char *slash;
 
-  if (!ostree_repo_prepare_transaction (self->repo, NULL, NULL, error))
-    return FALSE;
+  while ((slash = strrchr (dir, '/')) != NULL)
+    {
+      *slash = 0;
+      if (g_hash_table_contains (dirs, dir))
+        return TRUE;
+    }
 
-  mtree = ostree_mutable_tree_new ();
+  return FALSE;
+}
 
-  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
-                                              (OstreeRepoCommitFilter) commit_filter, NULL, NULL);
-  if (self->devino_to_csum_cache)
-    ostree_repo_commit_modifier_set_devino_cache (modifier, self->devino_to_csum_cache);
+static GPtrArray *
+split_path (const char *path,
+            char     ***elements_out)
+{
+  GPtrArray *split = g_ptr_array_new ();
+  char **elements = g_strsplit (path, "/", -1);
+  int i;
 
-  if (!ostree_repo_write_directory_to_mtree (self->repo, self->app_dir,
-                                             mtree, modifier, NULL, error))
-    goto out;
+  for (i = 0; elements[i] != NULL; i++)
+    g_ptr_array_add (split, elements[i]);
 
-  if (!ostree_repo_write_mtree (self->repo, mtree, &root, NULL, error))
-    goto out;
+  *elements_out = elements;
+  return split;
+}
+
+/* commit_filter() gives all directories the same mode and owner, and
+   xattrs are skipped, so they all share one dirmeta object */
+static char *
+write_dirmeta (BuilderCache *self,
+               GError      **error)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *csum = NULL;
+
+  info = g_file_query_info (self->app_dir, OSTREE_GIO_FAST_QUERYINFO,
+                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, error);
+  if (info == NULL)
+    return NULL;
+
+  commit_filter (self->repo, "/", info, NULL);
+
+  dirmeta = ostree_create_directory_metadata (info, NULL);
+  if (!ostree_repo_write_metadata (self->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &csum, NULL, error))
+    return NULL;
+
+  return ostree_checksum_from_bytes (csum);
+}
+
+/* Writes the changed @file at @path into @mtree, and into @new_mtree
+ * if its content is not already in the last commit. New directories
+ * are written as a whole and added to @written_dirs, so the paths
+ * below them can be skipped. */
+static gboolean
+mtree_write_changed_path (BuilderCache             *self,
+                          OstreeRepoCommitModifier *modifier,
+                          OstreeMutableTree        *mtree,
+                          OstreeMutableTree        *new_mtree,
+                          GFile                    *file,
+                          const char               *path,
+                          const char               *dirmeta_checksum,
+                          GHashTable               *written_dirs,
+                          GError                  **error)
+{
+  g_auto(GStrv) elements = NULL;
+  g_autoptr(GPtrArray) split = split_path (path, &elements);
+  const char *name = g_ptr_array_index (split, split->len - 1);
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(OstreeMutableTree) parent = NULL;
+  g_autoptr(OstreeMutableTree) new_parent = NULL;
+  g_autoptr(OstreeMutableTree) old_subdir = NULL;
+  g_autofree char *old_checksum = NULL;
+  g_autoptr(GError) lookup_error = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *checksum = NULL;
+  guint64 length;
+  GFileType type;
+
+  info = g_file_query_info (file, OSTREE_GIO_FAST_QUERYINFO,
+                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, error);
+  if (info == NULL)
+    return FALSE;
+
+  type = g_file_info_get_file_type (info);
+
+  if (!ostree_mutable_tree_ensure_parent_dirs (mtree, split, dirmeta_checksum, &parent, error))
+    return FALSE;
+
+  if (!ostree_mutable_tree_lookup (parent, name, &old_checksum, &old_subdir, &lookup_error) &&
+      !g_error_matches (lookup_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, g_steal_pointer (&lookup_error));
+      return FALSE;
+    }
+
+  if (type == G_FILE_TYPE_DIRECTORY)
+    {
+      g_autoptr(OstreeMutableTree) subdir = NULL;
+      g_autoptr(OstreeMutableTree) new_subdir = NULL;
+      g_autoptr(GFile) subdir_root = NULL;
+
+      /* The changed children of existing directories are listed too */
+      if (old_subdir != NULL)
+        return zero_mtime_nofollow (file, error);
+
+      if (old_checksum != NULL &&
+          !ostree_mutable_tree_remove (parent, name, FALSE, error))
+        return FALSE;
+
+      if (!flatpak_zero_mtime (AT_FDCWD, flatpak_file_get_path_cached (file), NULL, error))
+        return FALSE;
+
+      if (!ostree_mutable_tree_ensure_dir (parent, name, &subdir, error))
+        return FALSE;
+
+      if (!ostree_repo_write_directory_to_mtree (self->repo, file, subdir, modifier, NULL, error))
+        return FALSE;
+
+      /* Copy it into new_mtree from the repo, without reading the files again */
+      if (!ostree_repo_write_mtree (self->repo, subdir, &subdir_root, NULL, error))
+        return FALSE;
+
+      if (!ostree_mutable_tree_ensure_parent_dirs (new_mtree, split, dirmeta_checksum, &new_parent, error) ||
+          !ostree_mutable_tree_ensure_dir (new_parent, name, &new_subdir, error))
+        return FALSE;
+
+      if (!ostree_repo_write_directory_to_mtree (self->repo, subdir_root, new_subdir, NULL, NULL, error))
+        return FALSE;
+
+      g_hash_table_add (written_dirs, g_strdup (path));
+      return TRUE;
+    }
+
+  if (type != G_FILE_TYPE_REGULAR && type != G_FILE_TYPE_SYMBOLIC_LINK)
+    return flatpak_fail (error, "Unsupported file type for %s", path);
+
+  if (old_subdir != NULL &&
+      !ostree_mutable_tree_remove (parent, name, FALSE, error))
+    return FALSE;
+
+  if (!zero_mtime_nofollow (file, error))
+    return FALSE;
+
+  commit_filter (self->repo, path, info, NULL);
+
+  if (type == G_FILE_TYPE_REGULAR)
+    {
+      in = (GInputStream *) g_file_read (file, NULL, error);
+      if (in == NULL)
+        return FALSE;
+    }
+
+  if (!ostree_raw_file_to_content_stream (in, info, NULL, &content, &length, NULL, error))
+    return FALSE;
+
+  if (!ostree_repo_write_content (self->repo, NULL, content, length, &csum, NULL, error))
+    return FALSE;
+
+  checksum = ostree_checksum_from_bytes (csum);
+
+  if (!ostree_mutable_tree_replace_file (parent, name, checksum, error))
+    return FALSE;
+
+  if (g_strcmp0 (old_checksum, checksum) != 0)
+    {
+      if (!ostree_mutable_tree_ensure_parent_dirs (new_mtree, split, dirmeta_checksum, &new_parent, error) ||
+          !ostree_mutable_tree_replace_file (new_parent, name, checksum, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Builds the mtree for the app dir from the one of the last commit,
+ * only writing what changed since then. Unchanged files are hardlinks
+ * into the cache, which the devino cache recognizes without reading
+ * them, and unchanged subtrees keep their dirtree objects. @new_mtree_out
+ * gets just the new files, for checking them out afterwards. */
+static gboolean
+mtree_from_changes (BuilderCache             *self,
+                    OstreeRepoCommitModifier *modifier,
+                    OstreeMutableTree       **mtree_out,
+                    OstreeMutableTree       **new_mtree_out,
+                    GError                  **error)
+{
+  g_autoptr(GFile) last_root = NULL;
+  g_autoptr(GPtrArray) changed = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GHashTable) written_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(OstreeMutableTree) new_mtree = ostree_mutable_tree_new ();
+  g_autofree char *dirmeta_checksum = NULL;
+  int i;
+
+  if (!ostree_repo_read_commit (self->repo, self->last_parent, &last_root, NULL, NULL, error))
+    return FALSE;
+
+  if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (last_root), error))
+    return FALSE;
+
+  if (!diff_dirs (self->devino_to_csum_cache, last_root, self->app_dir,
+                  changed, removed, NULL, error))
+    return FALSE;
+
+  dirmeta_checksum = write_dirmeta (self, error);
+  if (dirmeta_checksum == NULL)
+    return FALSE;
+
+  mtree = ostree_mutable_tree_new_from_checksum (self->repo,
+                                                 ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (last_root)),
+                                                 ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (last_root)));
+  ostree_mutable_tree_set_metadata_checksum (new_mtree, dirmeta_checksum);
+
+  if (!zero_mtime_nofollow (self->app_dir, error))
+    return FALSE;
+
+  for (i = 0; i < changed->len; i++)
+    {
+      GFile *file = g_ptr_array_index (changed, i);
+      g_autofree char *path = g_file_get_relative_path (self->app_dir, file);
+
+      if (path_is_in_dirs (written_dirs, path))
+        continue;
+
+      if (!mtree_write_changed_path (self, modifier, mtree, new_mtree, file, path,
+                                     dirmeta_checksum, written_dirs, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < removed->len; i++)
+    {
+      g_autofree char *path = g_file_get_relative_path (self->app_dir, g_ptr_array_index (removed, i));
+      g_auto(GStrv) elements = NULL;
+      g_autoptr(GPtrArray) split = split_path (path, &elements);
+      g_autoptr(OstreeMutableTree) parent = NULL;
+      const char *name = g_ptr_array_index (split, split->len - 1);
+
+      g_ptr_array_set_size (split, split->len - 1);
+
+      if (!ostree_mutable_tree_walk (mtree, split, 0, &parent, error) ||
+          !ostree_mutable_tree_remove (parent, name, TRUE, error))
+        return FALSE;
+    }
+
+  *mtree_out = g_steal_pointer (&mtree);
+  *new_mtree_out = g_steal_pointer (&new_mtree);
+
+  return TRUE;
+}
+
+#endif
+
+static GFile *
+get_usage_file (BuilderCache *self)
+{
+  return g_file_get_child (builder_context_get_state_dir (self->context), "cache-usage");
+}
+
+/* Records the size of what committing a stage added to the cache, so
+ * that --cache-max-size doesn't have to walk every commit to find out
+ * how much the cached builds take. */
+static gboolean
+record_stage_size (BuilderCache *self,
+                   const char   *ref,
+                   guint64       size,
+                   GError      **error)
+{
+  g_autoptr(GFile) usage_file = get_usage_file (self);
+  g_autoptr(GKeyFile) usage = g_key_file_new ();
+
+  g_key_file_load_from_file (usage, flatpak_file_get_path_cached (usage_file),
+                             G_KEY_FILE_NONE, NULL);
+
+  g_key_file_set_uint64 (usage, "size", ref, size);
+
+  return g_key_file_save_to_file (usage, flatpak_file_get_path_cached (usage_file), error);
+}
+
+gboolean
+builder_cache_commit (BuilderCache *self,
+                      const char   *body,
+                      GError      **error)
+{
+  const char *current = NULL;
+  OstreeRepoCommitModifier *modifier = NULL;
+
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(OstreeMutableTree) new_mtree = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autofree char *commit_checksum = NULL;
+  g_autofree char *new_commit_checksum = NULL;
+  gboolean res = FALSE;
+  g_autofree char *ref = NULL;
+  g_autoptr(GFile) last_root = NULL;
+  g_autoptr(GFile) new_root = NULL;
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(GPtrArray) removals = NULL;
+  g_autoptr(GVariantDict) metadata_dict = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) changesv = NULL;
+  g_autoptr(GVariant) removalsv = NULL;
+  g_autoptr(GVariant) changesvz = NULL;
+  g_autoptr(GVariant) removalsvz = NULL;
+  g_autoptr(GError) my_error = NULL;
+  OstreeRepoTransactionStats stats;
+  gboolean incremental = FALSE;
+
+  g_print ("Committing stage %s to cache\n", self->stage);
+
+#if OSTREE_CHECK_VERSION(2018, 9)
+  /* Only with rofiles-fuse is the app dir made of hardlinks into the
+     cache, so that unchanged files can be found from the devino cache */
+  incremental = self->last_parent != NULL && builder_context_get_use_rofiles (self->context);
+#endif
+
+  /* We set all mtimes to 0 during a commit, to simulate what would happen when
+     running via flatpak deploy (and also if we checked out from the cache).
+     For incremental commits this is done for the changed files only. */
+  if (!incremental &&
+      !flatpak_zero_mtime (AT_FDCWD, flatpak_file_get_path_cached (self->app_dir),
+                           NULL, NULL))
+    return FALSE;
+
+  if (!ostree_repo_prepare_transaction (self->repo, NULL, NULL, error))
+    return FALSE;
+
+  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
+                                              (OstreeRepoCommitFilter) commit_filter, NULL, NULL);
+  if (self->devino_to_csum_cache)
+    ostree_repo_commit_modifier_set_devino_cache (modifier, self->devino_to_csum_cache);
+
+#if OSTREE_CHECK_VERSION(2018, 9)
+  if (incremental)
+    {
+      if (!mtree_from_changes (self, modifier, &mtree, &new_mtree, error))
+        goto out;
+    }
+  else
+#endif
+    {
+      mtree = ostree_mutable_tree_new ();
+
+      if (!ostree_repo_write_directory_to_mtree (self->repo, self->app_dir,
+                                                 mtree, modifier, NULL, error))
+        goto out;
+    }
+
+  if (!ostree_repo_write_mtree (self->repo, mtree, &root, NULL, error))
+    goto out;
 
   changes = builder_cache_get_changes_to (self, root, &removals, NULL);
 
@@ -642,14 +1485,19 @@ builder_cache_commit (BuilderCache *self,
   ref = builder_cache_get_current_ref (self);
   ostree_repo_transaction_set_ref (self->repo, NULL, ref, commit_checksum);
 
-  if (self->last_parent &&
-      !ostree_repo_read_commit (self->repo, self->last_parent, &last_root, NULL, NULL, error))
-    goto out;
+  if (new_mtree == NULL)
+    {
+      if (self->last_parent &&
+          !ostree_repo_read_commit (self->repo, self->last_parent, &last_root, NULL, NULL, error))
+        goto out;
 
-  if (!mtree_prune_old_files (mtree, OSTREE_REPO_FILE (last_root), error))
-    goto out;
+      if (!mtree_prune_old_files (mtree, OSTREE_REPO_FILE (last_root), error))
+        goto out;
+
+      new_mtree = g_object_ref (mtree);
+    }
 
-  if (!ostree_repo_write_mtree (self->repo, mtree, &new_root, NULL, error))
+  if (!ostree_repo_write_mtree (self->repo, new_mtree, &new_root, NULL, error))
     goto out;
 
   if (!ostree_repo_write_commit (self->repo, NULL, current, body, metadata,
@@ -657,9 +1505,14 @@ builder_cache_commit (BuilderCache *self,
                                  &new_commit_checksum, NULL, error))
     goto out;
 
-  if (!ostree_repo_commit_transaction (self->repo, NULL, NULL, error))
+  if (!ostree_repo_commit_transaction (self->repo, &stats, NULL, error))
     goto out;
 
+  /* Objects that were already in the cache, e.g. from another
+     manifest, aren't counted against this stage */
+  if (!record_stage_size (self, ref, stats.content_bytes_written, &my_error))
+    g_printerr ("Failed to record the size of stage %s: %s\n", self->stage, my_error->message);
+
   /* Check out the just commited cache so we hardlinks to the cache */
   if (builder_context_get_use_rofiles (self->context) &&
       !builder_cache_checkout (self, new_commit_checksum, FALSE, error))
@@ -668,6 +1521,9 @@ builder_cache_commit (BuilderCache *self,
   g_free (self->last_parent);
   self->last_parent = g_steal_pointer (&commit_checksum);
 
+  if (self->push_repo)
+    push_to_shared_cache (self, ref, self->last_parent);
+
   res = TRUE;
 
 out:
@@ -735,6 +1591,7 @@ get_file_checksum (OstreeRepoDevInoCache *devino_to_csum_cache,
       else
         {
           g_autoptr(GInputStream) in = NULL;
+          g_autoptr(GFileInfo) commit_info = g_file_info_dup (f_info);
 
           if (g_file_info_get_file_type (f_info) == G_FILE_TYPE_REGULAR)
             {
@@ -743,7 +1600,12 @@ get_file_checksum (OstreeRepoDevInoCache *devino_to_csum_cache,
                 return FALSE;
             }
 
-          if (!ostree_checksum_file_from_input (f_info, NULL, in,
+          /* Checksum the file the way it would be committed, so that
+             it matches the one in the repo if only the owner or mode
+             bits that the commit drops differ */
+          commit_filter (NULL, NULL, commit_info, NULL);
+
+          if (!ostree_checksum_file_from_input (commit_info, NULL, in,
                                                 OSTREE_OBJECT_TYPE_FILE,
                                                 &csum, cancellable, error))
             return FALSE;
@@ -828,11 +1690,14 @@ diff_add_dir_recurse (GFile          *d,
 }
 
 
+/* If @removed is not %NULL, files that exist in @a but not in @b are
+ * added to it (as children of @b). */
 static gboolean
 diff_dirs (OstreeRepoDevInoCache *devino_to_csum_cache,
            GFile          *a,
            GFile          *b,
            GPtrArray      *changed,
+           GPtrArray      *removed,
            GCancellable   *cancellable,
            GError        **error)
 {
@@ -882,7 +1747,8 @@ diff_dirs (OstreeRepoDevInoCache *devino_to_csum_cache,
           if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
             {
               g_clear_error (&temp_error);
-              /* Removed, ignore */
+              if (removed)
+                g_ptr_array_add (removed, g_object_ref (child_b));
             }
           else
             {
@@ -896,6 +1762,11 @@ diff_dirs (OstreeRepoDevInoCache *devino_to_csum_cache,
           if (child_a_type != child_b_type)
             {
               g_ptr_array_add (changed, g_object_ref (child_b));
+              if (child_b_type == G_FILE_TYPE_DIRECTORY)
+                {
+                  if (!diff_add_dir_recurse (child_b, changed, cancellable, error))
+                    return FALSE;
+                }
             }
           else
             {
@@ -913,7 +1784,7 @@ diff_dirs (OstreeRepoDevInoCache *devino_to_csum_cache,
 
               if (child_a_type == G_FILE_TYPE_DIRECTORY)
                 {
-                  if (!diff_dirs (devino_to_csum_cache, child_a, child_b, changed,
+                  if (!diff_dirs (devino_to_csum_cache, child_a, child_b, changed, removed,
                                   cancellable, error))
                     return FALSE;
                 }
@@ -1000,6 +1871,7 @@ builder_cache_get_outstanding_changes (BuilderCache *self,
                   last_root,
                   self->app_dir,
                   changed,
+                  NULL,
                   NULL, error))
     return FALSE;
 
@@ -1016,68 +1888,368 @@ builder_cache_get_outstanding_changes (BuilderCache *self,
   return TRUE;
 }
 
-static int
-cmpstringp (const void *p1, const void *p2)
+/* Returns the commit that @stage was last committed as or found in the
+ * cache as, or %NULL if there is none. */
+char *
+builder_cache_get_stage_commit (BuilderCache *self,
+                                const char   *stage)
 {
-  return strcmp (*(char * const *) p1, *(char * const *) p2);
+  g_autofree char *ref = get_ref (self, stage);
+  g_autofree char *commit = NULL;
+
+  if (!ostree_repo_resolve_rev (self->repo, ref, TRUE, &commit, NULL))
+    return NULL;
+
+  return g_steal_pointer (&commit);
 }
 
-static GPtrArray *
-get_changes (BuilderCache *self,
-             GFile       *from,
-             GFile       *to,
-             GPtrArray  **removed_out,
-             GError      **error)
+/* Checks out @commit (if not %NULL) into @dest, which is used as the app
+ * dir for a module that is built in parallel with others. As in
+ * builder_cache_checkout() the files are hardlinks into the cache if
+ * rofiles-fuse is used, and those are recorded in @devino_to_csum_cache
+ * so that builder_cache_get_staged_changes() doesn't have to read them. */
+gboolean
+builder_cache_checkout_staging (BuilderCache          *self,
+                                const char            *commit,
+                                GFile                 *dest,
+                                OstreeRepoDevInoCache *devino_to_csum_cache,
+                                GError               **error)
 {
-  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_object_unref);
-  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
-  g_autoptr(GPtrArray) changed_paths = g_ptr_array_new_with_free_func (g_free);
-  int i;
+  OstreeRepoCheckoutAtOptions options = { 0, };
 
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE,
-                         from,
-                         to,
-                         modified,
-                         removed,
-                         added,
-                         NULL, error))
-    return NULL;
+  if (!flatpak_rm_rf (dest, NULL, error))
+    return FALSE;
 
-  for (i = 0; i < added->len; i++)
-    {
-      char *path = g_file_get_relative_path (to, g_ptr_array_index (added, i));
-      g_ptr_array_add (changed_paths, path);
-    }
+  if (!flatpak_mkdir_p (dest, NULL, error))
+    return FALSE;
 
-  for (i = 0; i < modified->len; i++)
-    {
-      OstreeDiffItem *modified_item = g_ptr_array_index (modified, i);
-      char *path = g_file_get_relative_path (to, modified_item->target);
-      g_ptr_array_add (changed_paths, path);
-    }
+  if (commit == NULL)
+    return TRUE;
 
-  g_ptr_array_sort (changed_paths, cmpstringp);
+  /* See builder_cache_checkout() */
+  if (!builder_context_get_use_rofiles (self->context) ||
+      !builder_context_get_have_rofiles (self->context))
+    options.force_copy = TRUE;
 
-  if (removed_out)
-    {
-      GPtrArray *removed_paths = g_ptr_array_new_with_free_func (g_free);
+  options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
+  options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES;
+  options.devino_to_csum_cache = devino_to_csum_cache;
 
-      for (i = 0; i < removed->len; i++)
-        {
-          char *path = g_file_get_relative_path (to, g_ptr_array_index (removed, i));
-          g_ptr_array_add (removed_paths, path);
-        }
-      *removed_out = removed_paths;
-    }
+  if (!ostree_repo_checkout_at (self->repo, &options,
+                                AT_FDCWD, flatpak_file_get_path_cached (dest),
+                                commit, NULL, error))
+    return FALSE;
 
-  return g_steal_pointer (&changed_paths);
+  if (options.force_copy &&
+      !flatpak_zero_mtime (AT_FDCWD, flatpak_file_get_path_cached (dest),
+                           NULL, error))
+    return FALSE;
+
+  return TRUE;
 }
 
+/* Checks out @subpath of @commit from the ostree repo at @repo_dir,
+ * e.g. that of a flatpak installation, into @dest. The commit is
+ * first copied into the cache, and checked out from there, so that
+ * the hardlinks it can make are to the cache rather than to @repo_dir.
+ * Nothing refers to the copy, so it only stays in the cache for as long
+ * as a stage uses its files. */
+gboolean
+builder_cache_checkout_from_repo (BuilderCache *self,
+                                  GFile        *repo_dir,
+                                  const char   *commit,
+                                  const char   *subpath,
+                                  GFile        *dest,
+                                  GError      **error)
+{
+  const char *refs[] = { commit, NULL };
+  g_autofree char *repo_uri = g_file_get_uri (repo_dir);
+  g_autoptr(GVariant) pull_options = NULL;
+  OstreeRepoCheckoutAtOptions options = { 0, };
+  GVariantBuilder builder;
+
+  /* Untrusted, so that objects are verified and copied rather than
+     hardlinked when the repos are on the same filesystem */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "refs", g_variant_new_strv (refs, -1));
+  g_variant_builder_add (&builder, "{sv}", "flags", g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_UNTRUSTED));
+  g_variant_builder_add (&builder, "{sv}", "depth", g_variant_new_int32 (0));
+  pull_options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_pull_with_options (self->repo, repo_uri, pull_options,
+                                      NULL, NULL, error))
+    return FALSE;
 
-/* This returns removals too */
-static GPtrArray *
-get_all_changes (BuilderCache *self,
+  /* See builder_cache_checkout() */
+  if (!builder_context_get_use_rofiles (self->context))
+    options.force_copy = TRUE;
+
+  options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
+  options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_NONE;
+  options.subpath = subpath;
+  options.devino_to_csum_cache = self->devino_to_csum_cache;
+
+  if (!ostree_repo_checkout_at (self->repo, &options,
+                                AT_FDCWD, flatpak_file_get_path_cached (dest),
+                                commit, NULL, error))
+    return FALSE;
+
+  if (options.force_copy &&
+      !flatpak_zero_mtime (AT_FDCWD, flatpak_file_get_path_cached (dest),
+                           NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Returns the paths (relative to @staging_dir) that were added or
+ * changed, and the ones that were removed, since @base_commit was
+ * checked out there with builder_cache_checkout_staging(). */
+gboolean
+builder_cache_get_staged_changes (BuilderCache          *self,
+                                  const char            *base_commit,
+                                  GFile                 *staging_dir,
+                                  OstreeRepoDevInoCache *devino_to_csum_cache,
+                                  GPtrArray            **changed_out,
+                                  GPtrArray            **removed_out,
+                                  GError               **error)
+{
+  g_autoptr(GPtrArray) changed = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) changed_paths = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) removed_paths = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GFile) base_root = NULL;
+  int i;
+
+  if (base_commit &&
+      !ostree_repo_read_commit (self->repo, base_commit, &base_root, NULL, NULL, error))
+    return FALSE;
+
+  if (!diff_dirs (devino_to_csum_cache,
+                  base_root,
+                  staging_dir,
+                  changed,
+                  removed,
+                  NULL, error))
+    return FALSE;
+
+  for (i = 0; i < changed->len; i++)
+    g_ptr_array_add (changed_paths,
+                     g_file_get_relative_path (staging_dir, g_ptr_array_index (changed, i)));
+
+  for (i = 0; i < removed->len; i++)
+    g_ptr_array_add (removed_paths,
+                     g_file_get_relative_path (staging_dir, g_ptr_array_index (removed, i)));
+
+  *changed_out = g_steal_pointer (&changed_paths);
+  *removed_out = g_steal_pointer (&removed_paths);
+
+  return TRUE;
+}
+
+/* Looks up @path in the commit @root, returning a string that identifies
+ * its contents in @id_out, or %NULL if it doesn't exist. */
+static gboolean
+get_commit_entry (GFile       *root,
+                  const char  *path,
+                  char       **id_out,
+                  gboolean    *is_dir_out,
+                  GError     **error)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GError) my_error = NULL;
+
+  *id_out = NULL;
+  *is_dir_out = FALSE;
+
+  if (root == NULL)
+    return TRUE;
+
+  file = g_file_resolve_relative_path (root, path);
+  info = g_file_query_info (file, OSTREE_GIO_FAST_QUERYINFO,
+                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                            NULL, &my_error);
+  if (info == NULL)
+    {
+      if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
+          g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+    {
+      if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (file), error))
+        return FALSE;
+
+      *is_dir_out = TRUE;
+      *id_out = g_strconcat (ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (file)),
+                             ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (file)),
+                             NULL);
+    }
+  else
+    *id_out = g_strdup (ostree_repo_file_get_checksum (OSTREE_REPO_FILE (file)));
+
+  return TRUE;
+}
+
+static gboolean
+staged_path_conflicts (GFile       *base_root,
+                       GFile       *last_root,
+                       const char  *path,
+                       gboolean     staged_is_dir,
+                       gboolean    *conflicts_out,
+                       GError     **error)
+{
+  g_autofree char *base_id = NULL;
+  g_autofree char *last_id = NULL;
+  gboolean base_is_dir, last_is_dir;
+
+  if (!get_commit_entry (base_root, path, &base_id, &base_is_dir, error) ||
+      !get_commit_entry (last_root, path, &last_id, &last_is_dir, error))
+    return FALSE;
+
+  /* Directories can be created or replaced by several modules */
+  if (staged_is_dir && last_is_dir)
+    *conflicts_out = FALSE;
+  else
+    *conflicts_out = g_strcmp0 (base_id, last_id) != 0;
+
+  return TRUE;
+}
+
+/* Checks whether the changes of a module that was built on @base_commit
+ * (as returned by builder_cache_get_staged_changes()) can be applied to
+ * the last commit. They can't if any of the paths was also changed by a
+ * module that was committed since @base_commit, other than by both of
+ * them creating the same directory. The first such path is returned in
+ * @conflict_out, or %NULL if there is none. */
+gboolean
+builder_cache_check_staged_conflicts (BuilderCache *self,
+                                      const char   *base_commit,
+                                      GFile        *staging_dir,
+                                      GPtrArray    *changed,
+                                      GPtrArray    *removed,
+                                      char        **conflict_out,
+                                      GError      **error)
+{
+  g_autoptr(GFile) base_root = NULL;
+  g_autoptr(GFile) last_root = NULL;
+  gboolean conflicts = FALSE;
+  int i;
+
+  *conflict_out = NULL;
+
+  if (g_strcmp0 (base_commit, self->last_parent) == 0)
+    return TRUE;
+
+  if (base_commit &&
+      !ostree_repo_read_commit (self->repo, base_commit, &base_root, NULL, NULL, error))
+    return FALSE;
+
+  if (self->last_parent &&
+      !ostree_repo_read_commit (self->repo, self->last_parent, &last_root, NULL, NULL, error))
+    return FALSE;
+
+  for (i = 0; i < changed->len; i++)
+    {
+      const char *path = g_ptr_array_index (changed, i);
+      g_autoptr(GFile) staged = g_file_resolve_relative_path (staging_dir, path);
+      gboolean staged_is_dir =
+        g_file_query_file_type (staged, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_DIRECTORY;
+
+      if (!staged_path_conflicts (base_root, last_root, path, staged_is_dir, &conflicts, error))
+        return FALSE;
+
+      if (conflicts)
+        {
+          *conflict_out = g_strdup (path);
+          return TRUE;
+        }
+    }
+
+  for (i = 0; i < removed->len; i++)
+    {
+      const char *path = g_ptr_array_index (removed, i);
+
+      if (!staged_path_conflicts (base_root, last_root, path, FALSE, &conflicts, error))
+        return FALSE;
+
+      if (conflicts)
+        {
+          *conflict_out = g_strdup (path);
+          return TRUE;
+        }
+    }
+
+  return TRUE;
+}
+
+static int
+cmpstringp (const void *p1, const void *p2)
+{
+  return strcmp (*(char * const *) p1, *(char * const *) p2);
+}
+
+static GPtrArray *
+get_changes (BuilderCache *self,
+             GFile       *from,
+             GFile       *to,
+             GPtrArray  **removed_out,
+             GError      **error)
+{
+  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) changed_paths = g_ptr_array_new_with_free_func (g_free);
+  int i;
+
+  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE,
+                         from,
+                         to,
+                         modified,
+                         removed,
+                         added,
+                         NULL, error))
+    return NULL;
+
+  for (i = 0; i < added->len; i++)
+    {
+      char *path = g_file_get_relative_path (to, g_ptr_array_index (added, i));
+      g_ptr_array_add (changed_paths, path);
+    }
+
+  for (i = 0; i < modified->len; i++)
+    {
+      OstreeDiffItem *modified_item = g_ptr_array_index (modified, i);
+      char *path = g_file_get_relative_path (to, modified_item->target);
+      g_ptr_array_add (changed_paths, path);
+    }
+
+  g_ptr_array_sort (changed_paths, cmpstringp);
+
+  if (removed_out)
+    {
+      GPtrArray *removed_paths = g_ptr_array_new_with_free_func (g_free);
+
+      for (i = 0; i < removed->len; i++)
+        {
+          char *path = g_file_get_relative_path (to, g_ptr_array_index (removed, i));
+          g_ptr_array_add (removed_paths, path);
+        }
+      *removed_out = removed_paths;
+    }
+
+  return g_steal_pointer (&changed_paths);
+}
+
+
+/* This returns removals too */
+static GPtrArray *
+get_all_changes (BuilderCache *self,
                  GFile       *from,
                  GFile       *to,
                  GError      **error)
@@ -1218,10 +2390,18 @@ builder_cache_get_changes (BuilderCache *self,
 GPtrArray   *
 builder_cache_get_files (BuilderCache *self,
                          GError      **error)
+{
+  return builder_cache_get_commit_files (self, self->last_parent, error);
+}
+
+GPtrArray   *
+builder_cache_get_commit_files (BuilderCache *self,
+                                const char   *commit,
+                                GError      **error)
 {
   g_autoptr(GFile) current_root = NULL;
 
-  if (!ostree_repo_read_commit (self->repo, self->last_parent, &current_root, NULL, NULL, error))
+  if (!ostree_repo_read_commit (self->repo, commit, &current_root, NULL, NULL, error))
     return NULL;
 
   return get_changes (self, NULL, current_root, NULL, error);
@@ -1233,6 +2413,640 @@ builder_cache_disable_lookups (BuilderCache *self)
   self->disabled = TRUE;
 }
 
+typedef struct
+{
+  const char **excludes;
+  const char **includes;
+} ExportFilterData;
+
+static gboolean
+matches_patterns (const char **patterns,
+                  const char  *path)
+{
+  int i;
+
+  for (i = 0; patterns != NULL && patterns[i] != NULL; i++)
+    {
+      if (flatpak_path_match_prefix (patterns[i], path) != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Same semantics as the --exclude and --include options of flatpak build-export */
+static OstreeRepoCommitFilterResult
+export_filter (OstreeRepo *repo,
+               const char *path,
+               GFileInfo  *file_info,
+               gpointer    user_data)
+{
+  ExportFilterData *data = user_data;
+
+  if (matches_patterns (data->excludes, path) &&
+      !matches_patterns (data->includes, path))
+    return OSTREE_REPO_COMMIT_FILTER_SKIP;
+
+  return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+}
+
+static gboolean
+collect_dirtree_objects (OstreeRepo *repo,
+                         const char *dirtree_checksum,
+                         const char *dirmeta_checksum,
+                         GHashTable *objects,
+                         GError    **error)
+{
+  g_autoptr(GVariant) dirtree_key = ostree_object_name_serialize (dirtree_checksum, OSTREE_OBJECT_TYPE_DIR_TREE);
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  int i;
+
+  g_hash_table_add (objects, ostree_object_name_serialize (dirmeta_checksum, OSTREE_OBJECT_TYPE_DIR_META));
+
+  if (g_hash_table_contains (objects, dirtree_key))
+    return TRUE;
+  g_hash_table_add (objects, g_variant_ref (dirtree_key));
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &dirtree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  for (i = 0; i < g_variant_n_children (files); i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+      const char *name;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+      g_hash_table_add (objects, ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_FILE));
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  for (i = 0; i < g_variant_n_children (dirs); i++)
+    {
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *tree_checksum = NULL;
+      g_autofree char *meta_checksum = NULL;
+      const char *name;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+
+      if (!collect_dirtree_objects (repo, tree_checksum, meta_checksum, objects, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Writes the tree of the main ref, as flatpak build-export would lay
+ * it out, into the cache repo. All the file objects and most of the
+ * dirtrees are shared with the last cached stage, so nothing is
+ * re-read or re-checksummed. */
+static gboolean
+write_export_tree (BuilderCache *self,
+                   const char   *files_dir,
+                   const char  **excludes,
+                   const char  **includes,
+                   char        **metadata_contents_out,
+                   GFile       **root_out,
+                   GError      **error)
+{
+  g_autoptr(GFile) last_root = NULL;
+  g_autoptr(GFile) metadata = NULL;
+  g_autoptr(GFile) files = NULL;
+  g_autoptr(GFile) export = NULL;
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GKeyFile) metakey = g_key_file_new ();
+  g_autofree char *metadata_contents = NULL;
+  gsize metadata_size;
+  g_autoptr(OstreeMutableTree) files_mtree = NULL;
+  g_autoptr(OstreeMutableTree) export_mtree = NULL;
+  OstreeRepoCommitModifier *modifier = NULL;
+  ExportFilterData filter_data = { excludes, includes };
+  gboolean res = FALSE;
+
+  if (!ostree_repo_read_commit (self->repo, self->last_parent, &last_root, NULL, NULL, error) ||
+      !ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (last_root), error))
+    return FALSE;
+
+  metadata = g_file_get_child (last_root, "metadata");
+  if (!g_file_load_contents (metadata, NULL, &metadata_contents, &metadata_size, NULL, error) ||
+      !g_key_file_load_from_data (metakey, metadata_contents, metadata_size, G_KEY_FILE_NONE, error))
+    return FALSE;
+
+  /* flatpak build-export derives extra commit metadata for these */
+  if (g_key_file_has_group (metakey, "Extra Data"))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Extra data can't be exported from the cache");
+      return FALSE;
+    }
+
+  if (!ostree_repo_prepare_transaction (self->repo, NULL, NULL, error))
+    return FALSE;
+
+  mtree = ostree_mutable_tree_new ();
+  ostree_mutable_tree_set_metadata_checksum (mtree, ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (last_root)));
+
+  if (!ostree_mutable_tree_replace_file (mtree, "metadata",
+                                         ostree_repo_file_get_checksum (OSTREE_REPO_FILE (metadata)),
+                                         error))
+    goto out;
+
+  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
+                                              (OstreeRepoCommitFilter) export_filter, &filter_data, NULL);
+
+  files = g_file_get_child (last_root, files_dir);
+  if (!ostree_mutable_tree_ensure_dir (mtree, "files", &files_mtree, error) ||
+      !ostree_repo_write_directory_to_mtree (self->repo, files, files_mtree, modifier, NULL, error))
+    goto out;
+
+  export = g_file_get_child (last_root, "export");
+  if (g_file_query_exists (export, NULL))
+    {
+      if (!ostree_mutable_tree_ensure_dir (mtree, "export", &export_mtree, error) ||
+          !ostree_repo_write_directory_to_mtree (self->repo, export, export_mtree, NULL, NULL, error))
+        goto out;
+    }
+
+  if (!ostree_repo_write_mtree (self->repo, mtree, root_out, NULL, error))
+    goto out;
+
+  /* The new dirtrees are unreferenced in the cache, and get pruned
+     by builder_gc() unless this is also the export repo */
+  if (!ostree_repo_commit_transaction (self->repo, NULL, NULL, error))
+    goto out;
+
+  *metadata_contents_out = g_steal_pointer (&metadata_contents);
+  res = TRUE;
+
+out:
+  if (!res)
+    {
+      if (!ostree_repo_abort_transaction (self->repo, NULL, NULL))
+        g_warning ("failed to abort transaction");
+    }
+  if (modifier)
+    ostree_repo_commit_modifier_unref (modifier);
+
+  return res;
+}
+
+/* Exports the last cached stage as @ref into the ostree repo at
+ * @repo_path, like flatpak build-export of the app dir would, but
+ * copying the already checksummed objects over from the cache.
+ * Fails with G_IO_ERROR_NOT_SUPPORTED if that's not possible, in
+ * which case the caller should fall back to flatpak build-export.
+ * The repo summary is not updated. */
+gboolean
+builder_cache_export (BuilderCache *self,
+                      GFile        *repo_path,
+                      const char   *ref,
+                      const char   *collection_id,
+                      const char   *files_dir,
+                      const char  **excludes,
+                      const char  **includes,
+                      const char   *subject,
+                      const char   *body,
+                      const char  **gpg_key_ids,
+                      const char   *gpg_homedir,
+                      GError      **error)
+{
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_autoptr(GFile) cache_root = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GHashTable) objects = ostree_repo_traverse_new_reachable ();
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GVariantBuilder) metadata_builder = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autofree char *metadata_contents = NULL;
+  g_autofree char *parent = NULL;
+  g_autofree char *commit_checksum = NULL;
+  g_autofree char *default_subject = NULL;
+  const char *dirtree_checksum;
+  const char *dirmeta_checksum;
+  guint64 installed_size = 0;
+  guint64 download_size = 0;
+  GHashTableIter iter;
+  gpointer key;
+  int i;
+
+  if (self->last_parent == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Nothing cached to export");
+      return FALSE;
+    }
+
+  if (g_file_equal (repo_path, builder_context_get_cache_dir (self->context)))
+    repo = g_object_ref (self->repo);
+  else
+    {
+      /* Let build-export create new repos, with the right config */
+      if (!g_file_query_exists (repo_path, NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Repo %s doesn't exist yet", flatpak_file_get_path_cached (repo_path));
+          return FALSE;
+        }
+
+      repo = ostree_repo_new (repo_path);
+      if (!ostree_repo_open (repo, NULL, error))
+        return FALSE;
+    }
+
+  if (!write_export_tree (self, files_dir, excludes, includes,
+                          &metadata_contents, &cache_root, error))
+    return FALSE;
+
+  dirtree_checksum = ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (cache_root));
+  dirmeta_checksum = ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (cache_root));
+
+  if (!collect_dirtree_objects (self->repo, dirtree_checksum, dirmeta_checksum, objects, error))
+    return FALSE;
+
+  if (!ostree_repo_resolve_rev (repo, ref, TRUE, &parent, error))
+    return FALSE;
+
+  if (!ostree_repo_prepare_transaction (repo, NULL, NULL, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, objects);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean has_object;
+      guint64 size;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+
+      if (!ostree_repo_has_object (repo, objtype, checksum, &has_object, NULL, error))
+        goto fail;
+
+      /* The objects were checksummed when committed to the cache, so
+         they can be trusted and are only copied (or hardlinked) */
+      if (!has_object &&
+          !ostree_repo_import_object_from_with_trust (repo, self->repo, objtype, checksum,
+                                                      TRUE, NULL, error))
+        goto fail;
+
+      if (!ostree_repo_query_object_storage_size (repo, objtype, checksum, &size, NULL, error))
+        goto fail;
+      download_size += size;
+
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        {
+          g_autoptr(GFileInfo) file_info = NULL;
+
+          if (!ostree_repo_load_file (self->repo, checksum, NULL, &file_info, NULL, NULL, error))
+            goto fail;
+
+          installed_size += ((g_file_info_get_size (file_info) + 511) / 512) * 512;
+        }
+    }
+
+  mtree = ostree_mutable_tree_new ();
+  ostree_mutable_tree_set_contents_checksum (mtree, dirtree_checksum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+  if (!ostree_repo_write_mtree (repo, mtree, &root, NULL, error))
+    goto fail;
+
+  metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (metadata_builder, "{sv}", "xa.metadata",
+                         g_variant_new_string (metadata_contents));
+  g_variant_builder_add (metadata_builder, "{sv}", "xa.installed-size",
+                         g_variant_new_uint64 (GUINT64_TO_BE (installed_size)));
+  g_variant_builder_add (metadata_builder, "{sv}", "xa.download-size",
+                         g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
+  g_variant_builder_add (metadata_builder, "{sv}", "ostree.ref-binding",
+                         g_variant_new_strv (&ref, 1));
+  if (collection_id)
+    g_variant_builder_add (metadata_builder, "{sv}", "ostree.collection-binding",
+                           g_variant_new_string (collection_id));
+  metadata = g_variant_ref_sink (g_variant_builder_end (metadata_builder));
+
+  if (subject == NULL)
+    subject = default_subject = g_strdup_printf ("Export %s", ref);
+
+  if (!ostree_repo_write_commit (repo, parent, subject, body, metadata,
+                                 OSTREE_REPO_FILE (root),
+                                 &commit_checksum, NULL, error))
+    goto fail;
+
+  if (!ostree_repo_commit_transaction (repo, NULL, NULL, error))
+    goto fail;
+
+  /* Sign before the ref points to the commit, so nobody can pull
+     it unsigned */
+  for (i = 0; gpg_key_ids != NULL && gpg_key_ids[i] != NULL; i++)
+    {
+      if (!ostree_repo_sign_commit (repo, commit_checksum, gpg_key_ids[i], gpg_homedir, NULL, error))
+        return FALSE;
+    }
+
+  if (!ostree_repo_set_ref_immediate (repo, NULL, ref, commit_checksum, NULL, error))
+    return FALSE;
+
+  g_print ("Commit: %s\n", commit_checksum);
+
+  return TRUE;
+
+fail:
+  if (!ostree_repo_abort_transaction (repo, NULL, NULL))
+    g_warning ("failed to abort transaction");
+
+  return FALSE;
+}
+
+/* All the stage refs of one cache branch (i.e. one manifest and
+ * arch). Later stages are built on top of the earlier ones, so a
+ * branch is only ever used, and evicted, as a whole. */
+typedef struct
+{
+  char      *branch;
+  GPtrArray *refs;
+  gint64     last_used;
+  guint64    size;
+} StageChain;
+
+static void
+stage_chain_free (StageChain *chain)
+{
+  g_free (chain->branch);
+  g_ptr_array_unref (chain->refs);
+  g_free (chain);
+}
+
+static int
+stage_chain_cmp_last_used (gconstpointer a,
+                           gconstpointer b)
+{
+  const StageChain *chain_a = *(const StageChain **) a;
+  const StageChain *chain_b = *(const StageChain **) b;
+
+  if (chain_a->last_used < chain_b->last_used)
+    return -1;
+  if (chain_a->last_used > chain_b->last_used)
+    return 1;
+  return 0;
+}
+
+/* For stages that weren't committed here, i.e. that were pulled from
+ * --cache-url or are from before the sizes were recorded. This is the
+ * size of the objects the stage doesn't share with the stage before it. */
+static gboolean
+measure_stage_size (BuilderCache *self,
+                    const char   *commit,
+                    GVariant     *commitv,
+                    guint64      *size_out,
+                    GError      **error)
+{
+  g_autoptr(GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+  g_autoptr(GHashTable) parent_reachable = ostree_repo_traverse_new_reachable ();
+  g_autofree char *parent = ostree_commit_get_parent (commitv);
+  g_autoptr(GVariant) parentv = NULL;
+  guint64 size = 0;
+  GHashTableIter iter;
+  gpointer key;
+
+  if (!ostree_repo_traverse_commit_union (self->repo, commit, 0, reachable, NULL, error))
+    return FALSE;
+
+  if (parent != NULL)
+    {
+      if (!ostree_repo_load_variant_if_exists (self->repo, OSTREE_OBJECT_TYPE_COMMIT, parent,
+                                               &parentv, error))
+        return FALSE;
+
+      if (parentv != NULL &&
+          !ostree_repo_traverse_commit_union (self->repo, parent, 0, parent_reachable, NULL, error))
+        return FALSE;
+    }
+
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 object_size = 0;
+
+      if (g_hash_table_contains (parent_reachable, key))
+        continue;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      if (!ostree_repo_query_object_storage_size (self->repo, objtype, checksum,
+                                                  &object_size, NULL, error))
+        return FALSE;
+
+      size += object_size;
+    }
+
+  *size_out = size;
+  return TRUE;
+}
+
+/* Returns the stage chains in the cache, least recently used first,
+ * with their sizes from the ones recorded in @usage. Chains that have
+ * no recorded use (e.g. from before the use was recorded) count as
+ * last used when they were last committed to. */
+static GPtrArray *
+list_stage_chains (BuilderCache *self,
+                   GKeyFile     *usage,
+                   GError      **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GHashTable) chains_by_branch = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) chains = g_ptr_array_new_with_free_func ((GDestroyNotify) stage_chain_free);
+  g_auto(GStrv) sized_refs = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  int i;
+
+  if (!ostree_repo_list_refs (self->repo, NULL, &refs, NULL, error))
+    return NULL;
+
+  /* Forget the sizes of stages that are gone, e.g. unused ones */
+  sized_refs = g_key_file_get_keys (usage, "size", NULL, NULL);
+  for (i = 0; sized_refs != NULL && sized_refs[i] != NULL; i++)
+    {
+      if (!g_hash_table_contains (refs, sized_refs[i]))
+        g_key_file_remove_key (usage, "size", sized_refs[i], NULL);
+    }
+
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *slash = strchr (ref, '/');
+      g_autofree char *branch = NULL;
+      g_autoptr(GVariant) commit = NULL;
+      gboolean has_size = g_key_file_has_key (usage, "size", ref, NULL);
+      StageChain *chain;
+
+      if (slash == NULL)
+        continue;
+
+      branch = g_strndup (ref, slash - ref);
+      chain = g_hash_table_lookup (chains_by_branch, branch);
+      if (chain == NULL)
+        {
+          chain = g_new0 (StageChain, 1);
+          chain->branch = g_steal_pointer (&branch);
+          chain->refs = g_ptr_array_new_with_free_func (g_free);
+          chain->last_used = g_key_file_get_int64 (usage, "last-used", chain->branch, NULL);
+          g_hash_table_insert (chains_by_branch, chain->branch, chain);
+          g_ptr_array_add (chains, chain);
+        }
+
+      g_ptr_array_add (chain->refs, g_strdup (ref));
+
+      if ((!has_size || !g_key_file_has_key (usage, "last-used", chain->branch, NULL)) &&
+          !ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, value, &commit, error))
+        return NULL;
+
+      if (!g_key_file_has_key (usage, "last-used", chain->branch, NULL))
+        chain->last_used = MAX (chain->last_used, (gint64) ostree_commit_get_timestamp (commit));
+
+      if (!has_size)
+        {
+          guint64 size;
+
+          if (!measure_stage_size (self, value, commit, &size, error))
+            return NULL;
+
+          g_key_file_set_uint64 (usage, "size", ref, size);
+        }
+
+      chain->size += g_key_file_get_uint64 (usage, "size", ref, NULL);
+    }
+
+  g_ptr_array_sort (chains, stage_chain_cmp_last_used);
+
+  return g_steal_pointer (&chains);
+}
+
+static gboolean
+evict_stage_chain (BuilderCache *self,
+                   StageChain   *chain,
+                   GKeyFile     *usage,
+                   GError      **error)
+{
+  int i;
+
+  g_print ("Removing %s from cache\n", chain->branch);
+
+  for (i = 0; i < chain->refs->len; i++)
+    {
+      const char *ref = g_ptr_array_index (chain->refs, i);
+
+      if (!ostree_repo_set_ref_immediate (self->repo, NULL, ref, NULL, NULL, error))
+        return FALSE;
+
+      g_key_file_remove_key (usage, "size", ref, NULL);
+    }
+
+  g_key_file_remove_key (usage, "last-used", chain->branch, NULL);
+
+  return TRUE;
+}
+
+/* Removes the least recently used chains until the remaining ones fit
+ * in @max_size, going by the recorded sizes of their stages. An object
+ * is only counted for the first stage that added it to the cache, so
+ * this is an estimate when manifests share files, but it doesn't need
+ * to look at the objects themselves. */
+static gboolean
+evict_stage_chains_by_size (BuilderCache *self,
+                            GPtrArray    *chains,
+                            guint64       max_size,
+                            GKeyFile     *usage,
+                            GError      **error)
+{
+  guint64 total_size = 0;
+  int i;
+
+  for (i = 0; i < chains->len; i++)
+    {
+      StageChain *chain = g_ptr_array_index (chains, i);
+
+      total_size += chain->size;
+    }
+
+  for (i = 0; i < chains->len && total_size > max_size; i++)
+    {
+      StageChain *chain = g_ptr_array_index (chains, i);
+
+      if (strcmp (chain->branch, self->branch) == 0)
+        continue;
+
+      if (!evict_stage_chain (self, chain, usage, error))
+        return FALSE;
+
+      total_size -= chain->size;
+    }
+
+  return TRUE;
+}
+
+/* Records that the current branch was used now, and evicts other
+ * branches according to --cache-max-age and --cache-max-size. This
+ * only removes refs, the objects are freed by the prune after it. */
+static gboolean
+evict_stage_chains (BuilderCache *self,
+                    GError      **error)
+{
+  guint64 max_size = builder_context_get_cache_max_size (self->context);
+  int max_age = builder_context_get_cache_max_age (self->context);
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  g_autoptr(GFile) usage_file = get_usage_file (self);
+  g_autoptr(GKeyFile) usage = g_key_file_new ();
+  g_autoptr(GPtrArray) chains = NULL;
+  g_autoptr(GPtrArray) kept = g_ptr_array_new ();
+  int i;
+
+  /* A missing or broken usage file just means no recorded uses */
+  g_key_file_load_from_file (usage, flatpak_file_get_path_cached (usage_file),
+                             G_KEY_FILE_NONE, NULL);
+
+  g_key_file_set_int64 (usage, "last-used", self->branch, now);
+
+  if (max_size > 0 || max_age > 0)
+    {
+      chains = list_stage_chains (self, usage, error);
+      if (chains == NULL)
+        return FALSE;
+
+      for (i = 0; i < chains->len; i++)
+        {
+          StageChain *chain = g_ptr_array_index (chains, i);
+
+          if (max_age > 0 &&
+              strcmp (chain->branch, self->branch) != 0 &&
+              chain->last_used < now - max_age * (gint64) (24 * 60 * 60))
+            {
+              if (!evict_stage_chain (self, chain, usage, error))
+                return FALSE;
+            }
+          else
+            g_ptr_array_add (kept, chain);
+        }
+
+      if (max_size > 0 &&
+          !evict_stage_chains_by_size (self, kept, max_size, usage, error))
+        return FALSE;
+    }
+
+  return g_key_file_save_to_file (usage, flatpak_file_get_path_cached (usage_file), error);
+}
+
 gboolean
 builder_gc (BuilderCache *self,
             gboolean      prune_unused_stages,
@@ -1241,9 +3055,15 @@ builder_gc (BuilderCache *self,
   gint objects_total;
   gint objects_pruned;
   guint64 pruned_object_size_total;
+  int max_age = builder_context_get_cache_max_age (self->context);
+  g_autoptr(GFile) parse_cache_dir = NULL;
+  g_autoptr(GError) my_error = NULL;
   GHashTableIter iter;
   gpointer key, value;
 
+  if (!update_shared_cache_summary (self, &my_error))
+    g_printerr ("Failed to update the summary of the shared cache: %s\n", my_error->message);
+
   if (prune_unused_stages)
     {
       g_hash_table_iter_init (&iter, self->unused_stages);
@@ -1263,6 +3083,20 @@ builder_gc (BuilderCache *self,
         }
     }
 
+  if (!evict_stage_chains (self, error))
+    return FALSE;
+
+  if (!builder_context_prune_file_checksums (self->context, error))
+    return FALSE;
+
+  /* Parsed manifests are cheap to recreate, so these expire even
+     without --cache-max-age */
+  parse_cache_dir = g_file_get_child (builder_context_get_state_dir (self->context), "parse-cache");
+  if (!builder_prune_parse_cache (parse_cache_dir,
+                                  max_age > 0 ? max_age : PARSE_CACHE_MAX_AGE,
+                                  error))
+    return FALSE;
+
   g_print ("Pruning cache\n");
   return ostree_repo_prune (self->repo,
                             OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, -1,
@@ -1272,6 +3106,18 @@ builder_gc (BuilderCache *self,
                             NULL, error);
 }
 
+/* Everything is added both to the chained checksum and to the
+   checksum of just the current stage, which is used for
+   content-addressed stages. */
+static void
+checksum_update (BuilderCache *self,
+                 const guchar *data,
+                 gsize         len)
+{
+  g_checksum_update (self->checksum, data, len);
+  g_checksum_update (self->own_checksum, data, len);
+}
+
 /* Only add to cache if non-empty. This means we can add
    these things compatibly without invalidating the cache.
    This is useful if empty means no change from what was
@@ -1292,11 +3138,11 @@ builder_cache_checksum_str (BuilderCache *self,
    * a difference between NULL and "". */
 
   if (str)
-    g_checksum_update (self->checksum, (const guchar *) str, strlen (str) + 1);
+    checksum_update (self, (const guchar *) str, strlen (str) + 1);
   else
     /* Always add something so we can't be fooled by a sequence like
        NULL, "a" turning into "a", NULL. */
-    g_checksum_update (self->checksum, (const guchar *) "\1", 1);
+    checksum_update (self, (const guchar *) "\1", 1);
 }
 
 /* Only add to cache if non-empty. This means we can add
@@ -1320,13 +3166,13 @@ builder_cache_checksum_strv (BuilderCache *self,
 
   if (strv)
     {
-      g_checksum_update (self->checksum, (const guchar *) "\1", 1);
+      checksum_update (self, (const guchar *) "\1", 1);
       for (i = 0; strv[i] != NULL; i++)
         builder_cache_checksum_str (self, strv[i]);
     }
   else
     {
-      g_checksum_update (self->checksum, (const guchar *) "\2", 1);
+      checksum_update (self, (const guchar *) "\2", 1);
     }
 }
 
@@ -1335,9 +3181,9 @@ builder_cache_checksum_boolean (BuilderCache *self,
                                 gboolean      val)
 {
   if (val)
-    g_checksum_update (self->checksum, (const guchar *) "\1", 1);
+    checksum_update (self, (const guchar *) "\1", 1);
   else
-    g_checksum_update (self->checksum, (const guchar *) "\0", 1);
+    checksum_update (self, (const guchar *) "\0", 1);
 }
 
 /* Only add to cache if true. This means we can add
@@ -1362,12 +3208,13 @@ builder_cache_checksum_uint32 (BuilderCache *self,
   v[1] = (val >> 8) & 0xff;
   v[2] = (val >> 16) & 0xff;
   v[3] = (val >> 24) & 0xff;
-  g_checksum_update (self->checksum, v, 4);
+  checksum_update (self, v, 4);
 }
 
 void
 builder_cache_checksum_random (BuilderCache *self)
 {
+  self->has_random_checksum = TRUE;
   builder_cache_checksum_uint32 (self, g_random_int ());
   builder_cache_checksum_uint32 (self, g_random_int ());
 }
@@ -1387,7 +3234,7 @@ builder_cache_checksum_uint64 (BuilderCache *self,
   v[6] = (val >> 48) & 0xff;
   v[7] = (val >> 56) & 0xff;
 
-  g_checksum_update (self->checksum, v, 8);
+  checksum_update (self, v, 8);
 }
 
 void
@@ -1395,5 +3242,5 @@ builder_cache_checksum_data (BuilderCache *self,
                              guint8       *data,
                              gsize         len)
 {
-  g_checksum_update (self->checksum, data, len);
+  checksum_update (self, data, len);
 }
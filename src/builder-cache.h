@@ -23,6 +23,7 @@
 
 #include <gio/gio.h>
 #include <libglnx/libglnx.h>
+#include <ostree.h>
 
 G_BEGIN_DECLS
 
@@ -42,8 +43,14 @@ void          builder_cache_disable_lookups (BuilderCache *self);
 gboolean      builder_cache_open (BuilderCache *self,
                                   GError      **error);
 GChecksum *   builder_cache_get_checksum (BuilderCache *self);
+gboolean      builder_cache_has_random_checksum (BuilderCache *self);
 gboolean      builder_cache_lookup (BuilderCache *self,
-                                    const char   *stage);
+                                    const char   *stage,
+                                    GError      **error);
+gboolean      builder_cache_lookup_with_deps (BuilderCache *self,
+                                              const char   *stage,
+                                              const char  **deps,
+                                              GError      **error);
 void          builder_cache_ensure_checkout (BuilderCache *self);
 gboolean      builder_cache_has_checkout (BuilderCache *self);
 gboolean      builder_cache_commit (BuilderCache *self,
@@ -52,12 +59,54 @@ gboolean      builder_cache_commit (BuilderCache *self,
 gboolean      builder_cache_get_outstanding_changes (BuilderCache *self,
                                                      GPtrArray   **changed_out,
                                                      GError      **error);
+char         *builder_cache_get_stage_commit (BuilderCache *self,
+                                              const char   *stage);
+gboolean      builder_cache_checkout_staging (BuilderCache          *self,
+                                              const char            *commit,
+                                              GFile                 *dest,
+                                              OstreeRepoDevInoCache *devino_to_csum_cache,
+                                              GError               **error);
+gboolean      builder_cache_checkout_from_repo (BuilderCache *self,
+                                                GFile        *repo_dir,
+                                                const char   *commit,
+                                                const char   *subpath,
+                                                GFile        *dest,
+                                                GError      **error);
+gboolean      builder_cache_get_staged_changes (BuilderCache          *self,
+                                                const char            *base_commit,
+                                                GFile                 *staging_dir,
+                                                OstreeRepoDevInoCache *devino_to_csum_cache,
+                                                GPtrArray            **changed_out,
+                                                GPtrArray            **removed_out,
+                                                GError               **error);
+gboolean      builder_cache_check_staged_conflicts (BuilderCache *self,
+                                                    const char   *base_commit,
+                                                    GFile        *staging_dir,
+                                                    GPtrArray    *changed,
+                                                    GPtrArray    *removed,
+                                                    char        **conflict_out,
+                                                    GError      **error);
 GPtrArray   *builder_cache_get_files (BuilderCache *self,
                                       GError      **error);
+GPtrArray   *builder_cache_get_commit_files (BuilderCache *self,
+                                             const char   *commit,
+                                             GError      **error);
 GPtrArray   *builder_cache_get_changes (BuilderCache *self,
                                         GError      **error);
 GPtrArray   *builder_cache_get_all_changes (BuilderCache *self,
                                             GError      **error);
+gboolean      builder_cache_export (BuilderCache *self,
+                                    GFile        *repo_path,
+                                    const char   *ref,
+                                    const char   *collection_id,
+                                    const char   *files_dir,
+                                    const char  **excludes,
+                                    const char  **includes,
+                                    const char   *subject,
+                                    const char   *body,
+                                    const char  **gpg_key_ids,
+                                    const char   *gpg_homedir,
+                                    GError      **error);
 gboolean      builder_gc (BuilderCache *self,
                           gboolean      prune_unused_stages,
                           GError      **error);
@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <glib/gi18n.h>
 #include "builder-flatpak-utils.h"
@@ -37,6 +38,14 @@
 #include "builder-cache.h"
 #include "builder-utils.h"
 
+
+/* How long to wait for mirrors to answer a probe */
+#define MIRROR_PROBE_TIMEOUT_SECS 5
+/* Downloads smaller than this say little about the throughput */
+#define MIRROR_STATS_MIN_SIZE (64 * 1024)
+/* Assumed throughput of mirrors we have no stats for */
+#define MIRROR_DEFAULT_THROUGHPUT (1024.0 * 1024.0)
+
 struct BuilderContext
 {
   GObject         parent;
@@ -46,7 +55,13 @@ struct BuilderContext
   GFile          *base_dir; /* directory with json manifest, origin for source files */
   char           *state_subdir;
   SoupSession    *soup_session;
-  CURL           *curl_session;
+  GPtrArray      *idle_curl_sessions;
+  GHashTable     *host_downloads;
+  GHashTable     *dest_downloads;
+  GMutex          download_lock;
+  GCond           download_cond;
+  int             n_downloads;
+  GKeyFile       *mirror_stats;
   char           *arch;
   char           *default_branch;
   char           *stop_at;
@@ -59,6 +74,7 @@ struct BuilderContext
   GFile          *build_dir;
   GFile          *cache_dir;
   GFile          *checksums_dir;
+  GFile          *extract_cache_dir;
   GFile          *ccache_dir;
   GFile          *rofiles_dir;
   GFile          *rofiles_allocated_dir;
@@ -68,6 +84,27 @@ struct BuilderContext
   gboolean        keep_build_dirs;
   gboolean        delete_build_dirs;
   int             jobs;
+  int             module_jobs;
+  int             download_jobs;
+  int             download_jobs_per_host;
+  gboolean        content_cache;
+  char           *cache_url;
+  char           *push_cache_url;
+  guint64         cache_max_size;
+  int             cache_max_age;
+  gboolean        profile;
+  gint64          profile_start;
+  JsonArray      *profile_events;
+  GHashTable     *profile_threads;
+  int             profile_active;
+  guint           profile_overlaps;
+  GMutex          profile_lock;
+  GHashTable     *file_checksums;
+  gboolean        file_checksums_changed;
+  GHashTable     *verified_checksums;
+  GMutex          verified_checksums_lock;
+  gboolean        verified_checksums_changed;
+  gboolean        reverify;
   char          **cleanup;
   char          **cleanup_platform;
   gboolean        use_ccache;
@@ -75,12 +112,14 @@ struct BuilderContext
   gboolean        build_extension;
   gboolean        separate_locales;
   gboolean        bundle_sources;
+  gboolean        cache_extracted_sources;
   gboolean        sandboxed;
   gboolean        rebuild_on_sdk_change;
   gboolean        use_rofiles;
   gboolean        have_rofiles;
   gboolean        run_tests;
   gboolean        no_shallow_clone;
+  gboolean        persistent_sandbox;
 
   BuilderSdkConfig *sdk_config;
 };
@@ -92,6 +131,8 @@ typedef struct
 
 G_DEFINE_TYPE (BuilderContext, builder_context, G_TYPE_OBJECT);
 
+static void write_profile (BuilderContext *self);
+
 enum {
   PROP_0,
   PROP_APP_DIR,
@@ -105,12 +146,17 @@ static void
 builder_context_finalize (GObject *object)
 {
   BuilderContext *self = (BuilderContext *) object;
+  int i;
+
+  if (self->profile)
+    write_profile (self);
 
   g_clear_object (&self->state_dir);
   g_clear_object (&self->download_dir);
   g_clear_object (&self->build_dir);
   g_clear_object (&self->cache_dir);
   g_clear_object (&self->checksums_dir);
+  g_clear_object (&self->extract_cache_dir);
   g_clear_object (&self->rofiles_dir);
   g_clear_object (&self->ccache_dir);
   g_clear_object (&self->app_dir);
@@ -123,6 +169,8 @@ builder_context_finalize (GObject *object)
   g_free (self->default_branch);
   g_free (self->state_subdir);
   g_free (self->stop_at);
+  g_free (self->cache_url);
+  g_free (self->push_cache_url);
   g_strfreev (self->cleanup);
   g_strfreev (self->cleanup_platform);
   glnx_release_lock_file(&self->rofiles_file_lock);
@@ -130,8 +178,20 @@ builder_context_finalize (GObject *object)
   g_clear_pointer (&self->sources_dirs, g_ptr_array_unref);
   g_clear_pointer (&self->sources_urls, g_ptr_array_unref);
 
-  curl_easy_cleanup (self->curl_session);
-  self->curl_session = NULL;
+  for (i = 0; i < self->idle_curl_sessions->len; i++)
+    curl_easy_cleanup (g_ptr_array_index (self->idle_curl_sessions, i));
+  g_ptr_array_unref (self->idle_curl_sessions);
+  g_clear_pointer (&self->mirror_stats, g_key_file_unref);
+  g_hash_table_unref (self->host_downloads);
+  g_hash_table_unref (self->dest_downloads);
+  g_mutex_clear (&self->download_lock);
+  g_cond_clear (&self->download_cond);
+  json_array_unref (self->profile_events);
+  g_hash_table_unref (self->profile_threads);
+  g_mutex_clear (&self->profile_lock);
+  g_clear_pointer (&self->file_checksums, g_hash_table_unref);
+  g_clear_pointer (&self->verified_checksums, g_hash_table_unref);
+  g_mutex_clear (&self->verified_checksums_lock);
   curl_global_cleanup ();
 
   G_OBJECT_CLASS (builder_context_parent_class)->finalize (object);
@@ -202,6 +262,7 @@ builder_context_constructed (GObject *object)
   self->build_dir = g_file_get_child (self->state_dir, "build");
   self->cache_dir = g_file_get_child (self->state_dir, "cache");
   self->checksums_dir = g_file_get_child (self->state_dir, "checksums");
+  self->extract_cache_dir = g_file_get_child (self->state_dir, "extract-cache");
   self->ccache_dir = g_file_get_child (self->state_dir, "ccache");
 }
 
@@ -247,6 +308,18 @@ builder_context_init (BuilderContext *self)
   self->rofiles_file_lock = init;
   path = g_find_program_in_path ("rofiles-fuse");
   self->have_rofiles = path != NULL;
+
+  self->idle_curl_sessions = g_ptr_array_new ();
+  self->host_downloads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->dest_downloads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_mutex_init (&self->download_lock);
+  g_cond_init (&self->download_cond);
+
+  self->profile_start = g_get_monotonic_time ();
+  self->profile_events = json_array_new ();
+  self->profile_threads = g_hash_table_new (NULL, NULL);
+  g_mutex_init (&self->profile_lock);
+  g_mutex_init (&self->verified_checksums_lock);
 }
 
 GFile *
@@ -362,8 +435,307 @@ builder_context_set_sources_urls (BuilderContext *self,
   self->sources_urls = g_ptr_array_ref (sources_urls);
 }
 
-gboolean
-builder_context_download_uri (BuilderContext *self,
+/* The throughput and latency of each download host, averaged over the
+ * downloads from it, and the number of failed downloads since the last
+ * one that worked. These are kept in <state-dir>/mirror-stats, and are
+ * used to try the fastest mirrors first. Must be called with the
+ * download lock held. */
+static GKeyFile *
+get_mirror_stats (BuilderContext *self)
+{
+  if (self->mirror_stats == NULL)
+    {
+      g_autoptr(GFile) file = g_file_get_child (self->state_dir, "mirror-stats");
+
+      self->mirror_stats = g_key_file_new ();
+      g_key_file_load_from_file (self->mirror_stats, flatpak_file_get_path_cached (file),
+                                 G_KEY_FILE_NONE, NULL);
+    }
+
+  return self->mirror_stats;
+}
+
+static double
+average_stat (GKeyFile   *stats,
+              const char *host,
+              const char *key,
+              double      value)
+{
+  double old = g_key_file_get_double (stats, host, key, NULL);
+
+  if (old <= 0)
+    return value;
+
+  return 0.7 * old + 0.3 * value;
+}
+
+/* Must be called with the download lock held */
+static void
+update_mirror_stats (BuilderContext *self,
+                     const char     *host,
+                     CURL           *session,
+                     gboolean        res,
+                     GError         *error)
+{
+  GKeyFile *stats = get_mirror_stats (self);
+  g_autoptr(GFile) file = g_file_get_child (self->state_dir, "mirror-stats");
+  double size = 0, speed = 0, latency = 0;
+
+  if (res)
+    {
+      curl_easy_getinfo (session, CURLINFO_SIZE_DOWNLOAD, &size);
+      curl_easy_getinfo (session, CURLINFO_SPEED_DOWNLOAD, &speed);
+      curl_easy_getinfo (session, CURLINFO_STARTTRANSFER_TIME, &latency);
+
+      g_key_file_set_integer (stats, host, "failures", 0);
+      if (latency > 0)
+        g_key_file_set_double (stats, host, "latency", average_stat (stats, host, "latency", latency));
+      if (size >= MIRROR_STATS_MIN_SIZE && speed > 0)
+        g_key_file_set_double (stats, host, "throughput", average_stat (stats, host, "throughput", speed));
+    }
+  else if (error != NULL &&
+           !g_error_matches (error, BUILDER_CURL_ERROR, CURLE_REMOTE_FILE_NOT_FOUND) &&
+           !g_error_matches (error, BUILDER_CURL_ERROR, CURLE_HTTP_RETURNED_ERROR))
+    {
+      /* Only count failures of the host, not missing files */
+      g_key_file_set_integer (stats, host, "failures",
+                              g_key_file_get_integer (stats, host, "failures", NULL) + 1);
+    }
+  else
+    return;
+
+  /* Don't create the state dir just for this */
+  g_key_file_save_to_file (stats, flatpak_file_get_path_cached (file), NULL);
+}
+
+/* Downloads @uri with a curl session of its own, so this can be called
+ * from several threads at the same time. At most --download-jobs-per-host
+ * downloads from the same host run at once, the others wait here. */
+static gboolean
+download_uri_limited (BuilderContext *self,
+                      SoupURI        *uri,
+                      GFile          *dest,
+                      const char     *checksums[BUILDER_CHECKSUMS_LEN],
+                      GChecksumType   checksums_type[BUILDER_CHECKSUMS_LEN],
+                      GError        **error)
+{
+  const char *host = soup_uri_get_host (uri);
+  int max_per_host = builder_context_get_download_jobs_per_host (self);
+  CURL *session;
+  gboolean res;
+
+  g_mutex_lock (&self->download_lock);
+
+  if (host != NULL)
+    {
+      while (GPOINTER_TO_INT (g_hash_table_lookup (self->host_downloads, host)) >= max_per_host)
+        g_cond_wait (&self->download_cond, &self->download_lock);
+
+      g_hash_table_insert (self->host_downloads, g_strdup (host),
+                           GINT_TO_POINTER (GPOINTER_TO_INT (g_hash_table_lookup (self->host_downloads, host)) + 1));
+    }
+
+  if (self->idle_curl_sessions->len > 0)
+    {
+      session = g_ptr_array_index (self->idle_curl_sessions, self->idle_curl_sessions->len - 1);
+      g_ptr_array_set_size (self->idle_curl_sessions, self->idle_curl_sessions->len - 1);
+    }
+  else
+    session = flatpak_create_curl_session ("flatpak-builder " PACKAGE_VERSION);
+
+  /* Progress output from several downloads at once is unreadable */
+  curl_easy_setopt (session, CURLOPT_NOPROGRESS, self->n_downloads > 0 ? 1L : 0L);
+  self->n_downloads++;
+
+  g_mutex_unlock (&self->download_lock);
+
+  res = builder_download_uri (uri, dest, checksums, checksums_type, session, error);
+
+  g_mutex_lock (&self->download_lock);
+
+  if (host != NULL)
+    update_mirror_stats (self, host, session, res, error ? *error : NULL);
+
+  self->n_downloads--;
+  g_ptr_array_add (self->idle_curl_sessions, session);
+
+  if (host != NULL)
+    g_hash_table_insert (self->host_downloads, g_strdup (host),
+                         GINT_TO_POINTER (GPOINTER_TO_INT (g_hash_table_lookup (self->host_downloads, host)) - 1));
+
+  g_cond_broadcast (&self->download_cond);
+  g_mutex_unlock (&self->download_lock);
+
+  return res;
+}
+
+typedef struct
+{
+  SoupURI  *uri;
+  CURL     *probe;
+  gboolean  is_original;
+  gboolean  is_sources_url;
+  gboolean  failed;
+  int       order;
+  double    score;
+} DownloadCandidate;
+
+static void
+download_candidate_free (DownloadCandidate *candidate)
+{
+  soup_uri_free (candidate->uri);
+  g_free (candidate);
+}
+
+static void
+add_download_candidate (GPtrArray *candidates,
+                        SoupURI   *uri,
+                        gboolean   is_original,
+                        gboolean   is_sources_url)
+{
+  DownloadCandidate *candidate = g_new0 (DownloadCandidate, 1);
+
+  candidate->uri = uri;
+  candidate->is_original = is_original;
+  candidate->is_sources_url = is_sources_url;
+  candidate->order = candidates->len;
+  g_ptr_array_add (candidates, candidate);
+}
+
+/* Sends a HEAD request to all the candidates we have no throughput
+ * stats for at the same time, so that mirrors that are down or don't
+ * have the file are found without waiting for each to time out. */
+static void
+probe_download_candidates (GPtrArray *candidates,
+                           GKeyFile  *stats)
+{
+  CURLM *multi = curl_multi_init ();
+  CURLMsg *msg;
+  int running = 0;
+  int n_msgs;
+  guint i;
+
+  for (i = 0; i < candidates->len; i++)
+    {
+      DownloadCandidate *candidate = g_ptr_array_index (candidates, i);
+      const char *host = soup_uri_get_host (candidate->uri);
+      g_autofree char *url = NULL;
+
+      if (host != NULL && g_key_file_get_double (stats, host, "throughput", NULL) > 0)
+        continue;
+
+      url = soup_uri_to_string (candidate->uri, FALSE);
+      candidate->probe = flatpak_create_curl_session ("flatpak-builder " PACKAGE_VERSION);
+      curl_easy_setopt (candidate->probe, CURLOPT_URL, url);
+      curl_easy_setopt (candidate->probe, CURLOPT_NOBODY, 1L);
+      curl_easy_setopt (candidate->probe, CURLOPT_NOPROGRESS, 1L);
+      curl_easy_setopt (candidate->probe, CURLOPT_CONNECTTIMEOUT, (long) MIRROR_PROBE_TIMEOUT_SECS);
+      curl_easy_setopt (candidate->probe, CURLOPT_TIMEOUT, (long) MIRROR_PROBE_TIMEOUT_SECS);
+      curl_easy_setopt (candidate->probe, CURLOPT_PRIVATE, candidate);
+      curl_multi_add_handle (multi, candidate->probe);
+    }
+
+  do
+    {
+      if (curl_multi_perform (multi, &running) != CURLM_OK)
+        break;
+      if (running > 0)
+        curl_multi_wait (multi, NULL, 0, 1000, NULL);
+    }
+  while (running > 0);
+
+  while ((msg = curl_multi_info_read (multi, &n_msgs)) != NULL)
+    {
+      DownloadCandidate *candidate = NULL;
+      double latency = 0;
+
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &candidate);
+      if (msg->data.result == CURLE_OK)
+        {
+          curl_easy_getinfo (msg->easy_handle, CURLINFO_TOTAL_TIME, &latency);
+          candidate->score = latency + MIRROR_STATS_MIN_SIZE / MIRROR_DEFAULT_THROUGHPUT;
+          candidate->failed = FALSE;
+        }
+      else
+        candidate->failed = TRUE;
+    }
+
+  for (i = 0; i < candidates->len; i++)
+    {
+      DownloadCandidate *candidate = g_ptr_array_index (candidates, i);
+
+      if (candidate->probe == NULL)
+        continue;
+
+      curl_multi_remove_handle (multi, candidate->probe);
+      curl_easy_cleanup (candidate->probe);
+      candidate->probe = NULL;
+    }
+
+  curl_multi_cleanup (multi);
+}
+
+/* Candidates that failed go last, the others are ordered by the
+   expected time to fetch a small file from them */
+static int
+download_candidate_cmp (gconstpointer a,
+                        gconstpointer b)
+{
+  const DownloadCandidate *candidate_a = *(const DownloadCandidate **) a;
+  const DownloadCandidate *candidate_b = *(const DownloadCandidate **) b;
+
+  if (candidate_a->failed != candidate_b->failed)
+    return candidate_a->failed ? 1 : -1;
+
+  if (candidate_a->score < candidate_b->score)
+    return -1;
+  if (candidate_a->score > candidate_b->score)
+    return 1;
+
+  return candidate_a->order - candidate_b->order;
+}
+
+static void
+sort_download_candidates (BuilderContext *self,
+                          GPtrArray      *candidates)
+{
+  g_autoptr(GKeyFile) stats = g_key_file_new ();
+  g_autofree char *stats_data = NULL;
+  guint i;
+
+  /* Work on a copy, so the lock isn't held while probing */
+  g_mutex_lock (&self->download_lock);
+  stats_data = g_key_file_to_data (get_mirror_stats (self), NULL, NULL);
+  g_mutex_unlock (&self->download_lock);
+  g_key_file_load_from_data (stats, stats_data, -1, G_KEY_FILE_NONE, NULL);
+
+  for (i = 0; i < candidates->len; i++)
+    {
+      DownloadCandidate *candidate = g_ptr_array_index (candidates, i);
+      const char *host = soup_uri_get_host (candidate->uri);
+      double throughput, latency;
+
+      if (host == NULL)
+        continue;
+
+      throughput = g_key_file_get_double (stats, host, "throughput", NULL);
+      latency = g_key_file_get_double (stats, host, "latency", NULL);
+
+      if (throughput > 0)
+        candidate->score = latency + MIRROR_STATS_MIN_SIZE / throughput;
+      candidate->failed = g_key_file_get_integer (stats, host, "failures", NULL) > 0;
+    }
+
+  probe_download_candidates (candidates, stats);
+
+  g_ptr_array_sort (candidates, download_candidate_cmp);
+}
+
+static gboolean
+download_uri_from_candidates (BuilderContext *self,
                               const char     *url,
                               const char    **mirrors,
                               GFile          *dest,
@@ -373,7 +745,8 @@ builder_context_download_uri (BuilderContext *self,
 {
   int i;
   g_autoptr(SoupURI) original_uri = soup_uri_new (url);
-  g_autoptr(GError) first_error = NULL;
+  g_autoptr(GPtrArray) candidates = g_ptr_array_new_with_free_func ((GDestroyNotify) download_candidate_free);
+  g_autoptr(GError) original_error = NULL;
 
   if (original_uri == NULL)
     return flatpak_fail (error, _("Could not parse URI “%s”"), url);
@@ -388,63 +761,85 @@ builder_context_download_uri (BuilderContext *self,
       for (i = 0; i < self->sources_urls->len; i++)
         {
           SoupURI *base_uri = g_ptr_array_index (self->sources_urls, i);
-          g_autoptr(SoupURI) mirror_uri = soup_uri_new_with_base (base_uri, rel);
-          g_autofree char *mirror_uri_str = soup_uri_to_string (mirror_uri, FALSE);
-          g_print ("Trying mirror %s\n", mirror_uri_str);
-          g_autoptr(GError) my_error = NULL;
-
-          if (builder_download_uri (mirror_uri,
-                                    dest,
-                                    checksums, checksums_type,
-                                    builder_context_get_curl_session (self),
-                                    &my_error))
-            return TRUE;
-
-          if (!g_error_matches (my_error, BUILDER_CURL_ERROR, CURLE_REMOTE_FILE_NOT_FOUND))
-            g_warning ("Error downloading from mirror: %s\n", my_error->message);
+
+          add_download_candidate (candidates, soup_uri_new_with_base (base_uri, rel), FALSE, TRUE);
         }
     }
 
-  if (!builder_download_uri (original_uri,
-                             dest,
-                             checksums, checksums_type,
-                             builder_context_get_curl_session (self),
-                             &first_error))
+  add_download_candidate (candidates, soup_uri_copy (original_uri), TRUE, FALSE);
+
+  for (i = 0; mirrors != NULL && mirrors[i] != NULL; i++)
     {
-      gboolean mirror_ok = FALSE;
+      SoupURI *mirror_uri = soup_uri_new (mirrors[i]);
 
-      if (mirrors != NULL && mirrors[0] != NULL)
-        {
-          g_print ("Error downloading, trying mirrors\n");
-          for (i = 0; mirrors[i] != NULL; i++)
-            {
-              g_autoptr(GError) mirror_error = NULL;
-              g_autoptr(SoupURI) mirror_uri = soup_uri_new (mirrors[i]);
-              g_print ("Trying mirror %s\n", mirrors[i]);
-              if (!builder_download_uri (mirror_uri,
-                                         dest,
-                                         checksums, checksums_type,
-                                         builder_context_get_curl_session (self),
-                                         &mirror_error))
-                {
-                  g_print ("Error downloading mirror: %s\n", mirror_error->message);
-                }
-              else
-                {
-                  mirror_ok = TRUE;
-                  break;
-                }
-            }
-        }
+      if (mirror_uri != NULL)
+        add_download_candidate (candidates, mirror_uri, FALSE, FALSE);
+    }
 
-      if (!mirror_ok)
-        {
-          g_propagate_error (error, g_steal_pointer (&first_error));
-          return FALSE;
-        }
+  if (candidates->len > 1)
+    sort_download_candidates (self, candidates);
+
+  for (i = 0; i < candidates->len; i++)
+    {
+      DownloadCandidate *candidate = g_ptr_array_index (candidates, i);
+      g_autofree char *uri_str = soup_uri_to_string (candidate->uri, FALSE);
+      g_autoptr(GError) my_error = NULL;
+
+      if (!candidate->is_original)
+        g_print ("Trying mirror %s\n", uri_str);
+
+      if (download_uri_limited (self, candidate->uri,
+                                dest,
+                                checksums, checksums_type,
+                                &my_error))
+        return TRUE;
+
+      if (!(candidate->is_sources_url &&
+            g_error_matches (my_error, BUILDER_CURL_ERROR, CURLE_REMOTE_FILE_NOT_FOUND)))
+        g_print ("Error downloading %s: %s\n", uri_str, my_error->message);
+
+      if (candidate->is_original)
+        original_error = g_steal_pointer (&my_error);
     }
 
-  return TRUE;
+  g_propagate_error (error, g_steal_pointer (&original_error));
+  return FALSE;
+}
+
+/* Only one download at a time may go to @dest, as they would share
+ * its partial download file. Sources that download the same file wait
+ * here for the first one, and then find the file already there. */
+gboolean
+builder_context_download_uri (BuilderContext *self,
+                              const char     *url,
+                              const char    **mirrors,
+                              GFile          *dest,
+                              const char     *checksums[BUILDER_CHECKSUMS_LEN],
+                              GChecksumType   checksums_type[BUILDER_CHECKSUMS_LEN],
+                              GError        **error)
+{
+  const char *dest_path = flatpak_file_get_path_cached (dest);
+  gboolean res;
+
+  g_mutex_lock (&self->download_lock);
+  while (g_hash_table_contains (self->dest_downloads, dest_path))
+    g_cond_wait (&self->download_cond, &self->download_lock);
+  g_hash_table_add (self->dest_downloads, g_strdup (dest_path));
+  g_mutex_unlock (&self->download_lock);
+
+  /* The checksums are verified before a download is moved into place */
+  if (g_file_query_exists (dest, NULL))
+    res = TRUE;
+  else
+    res = download_uri_from_candidates (self, url, mirrors, dest,
+                                        checksums, checksums_type, error);
+
+  g_mutex_lock (&self->download_lock);
+  g_hash_table_remove (self->dest_downloads, dest_path);
+  g_cond_broadcast (&self->download_cond);
+  g_mutex_unlock (&self->download_lock);
+
+  return res;
 }
 
 GFile *
@@ -459,6 +854,12 @@ builder_context_get_build_dir (BuilderContext *self)
   return self->build_dir;
 }
 
+GFile *
+builder_context_get_extract_cache_dir (BuilderContext *self)
+{
+  return self->extract_cache_dir;
+}
+
 char *
 builder_context_get_checksum_for (BuilderContext *self,
                                   const char *name)
@@ -489,6 +890,375 @@ builder_context_set_checksum_for (BuilderContext  *self,
   return g_file_set_contents (flatpak_file_get_path_cached (checksum_file), checksum, -1, error);
 }
 
+/* The sha256 of a file, and the stat() data it was computed for */
+typedef struct
+{
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  guint64 mtime;
+  guint64 ctime;
+  char   *checksum;
+} FileChecksum;
+
+#define FILE_CHECKSUMS_TYPE "a{s(ttttts)}"
+
+static void
+file_checksum_free (FileChecksum *fc)
+{
+  g_free (fc->checksum);
+  g_free (fc);
+}
+
+static void
+file_checksum_set_stat (FileChecksum      *fc,
+                        const struct stat *st)
+{
+  fc->dev = st->st_dev;
+  fc->ino = st->st_ino;
+  fc->size = st->st_size;
+  fc->mtime = st->st_mtim.tv_sec * G_GUINT64_CONSTANT (1000000000) + st->st_mtim.tv_nsec;
+  fc->ctime = st->st_ctim.tv_sec * G_GUINT64_CONSTANT (1000000000) + st->st_ctim.tv_nsec;
+}
+
+static GFile *
+get_file_checksums_file (BuilderContext *self)
+{
+  return g_file_get_child (self->state_dir, "file-checksums");
+}
+
+static gboolean
+file_checksum_matches_stat (FileChecksum *fc,
+                            FileChecksum *current)
+{
+  return
+    fc->dev == current->dev &&
+    fc->ino == current->ino &&
+    fc->size == current->size &&
+    fc->mtime == current->mtime &&
+    fc->ctime == current->ctime;
+}
+
+/* A file changed in the same second as it was read could change again
+   without its mtime changing, so such files must not be remembered */
+static gboolean
+file_checksum_stat_is_stable (const struct stat *st)
+{
+  return st->st_mtim.tv_sec < g_get_real_time () / G_USEC_PER_SEC - 1;
+}
+
+static GHashTable *
+load_file_checksums (GFile *file)
+{
+  g_autoptr(GHashTable) file_checksums = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  GVariantIter iter;
+  const char *path;
+  FileChecksum entry;
+  const char *checksum;
+
+  file_checksums = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, (GDestroyNotify) file_checksum_free);
+
+  bytes = g_file_load_bytes (file, NULL, NULL, NULL);
+  if (bytes == NULL)
+    return g_steal_pointer (&file_checksums);
+
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FILE_CHECKSUMS_TYPE), bytes, FALSE));
+  g_variant_iter_init (&iter, variant);
+  while (g_variant_iter_next (&iter, "{&s(ttttt&s)}", &path,
+                              &entry.dev, &entry.ino, &entry.size, &entry.mtime, &entry.ctime,
+                              &checksum))
+    {
+      FileChecksum *fc = g_memdup (&entry, sizeof (FileChecksum));
+
+      fc->checksum = g_strdup (checksum);
+      g_hash_table_insert (file_checksums, g_strdup (path), fc);
+    }
+
+  return g_steal_pointer (&file_checksums);
+}
+
+static gboolean
+save_file_checksums (GHashTable *file_checksums,
+                     GFile      *file,
+                     GError    **error)
+{
+  g_autoptr(GFile) dir = g_file_get_parent (file);
+  g_autoptr(GVariant) variant = NULL;
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (FILE_CHECKSUMS_TYPE));
+  g_hash_table_iter_init (&iter, file_checksums);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      FileChecksum *fc = value;
+
+      g_variant_builder_add (&builder, "{s(ttttts)}", (const char *) key,
+                             fc->dev, fc->ino, fc->size, fc->mtime, fc->ctime,
+                             fc->checksum);
+    }
+  variant = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!flatpak_mkdir_p (dir, NULL, error))
+    return FALSE;
+
+  return g_file_set_contents (flatpak_file_get_path_cached (file),
+                              g_variant_get_data (variant), g_variant_get_size (variant),
+                              error);
+}
+
+static GHashTable *
+get_file_checksums (BuilderContext *self)
+{
+  g_autoptr(GFile) file = NULL;
+
+  if (self->file_checksums == NULL)
+    {
+      file = get_file_checksums_file (self);
+      self->file_checksums = load_file_checksums (file);
+    }
+
+  return self->file_checksums;
+}
+
+static char *
+checksum_fd (int      fd,
+             GError **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  guchar buf[64 * 1024];
+  gssize n;
+
+  while ((n = TEMP_FAILURE_RETRY (read (fd, buf, sizeof (buf)))) > 0)
+    g_checksum_update (checksum, buf, n);
+
+  if (n < 0)
+    return glnx_null_throw_errno_prefix (error, "read");
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Returns the sha256 of the regular file @name in @dfd, whose full path
+ * is @path and which was just stat()ed as @st. Checksums are kept in an
+ * index in the state dir, so a file is only read again if its size,
+ * inode, mtime or ctime changed since it was last checksummed. Call
+ * builder_context_save_file_checksums() to write out the index. */
+char *
+builder_context_get_file_checksum (BuilderContext    *self,
+                                   int                dfd,
+                                   const char        *name,
+                                   const char        *path,
+                                   const struct stat *st,
+                                   GError           **error)
+{
+  GHashTable *file_checksums = get_file_checksums (self);
+  FileChecksum current = { 0, };
+  FileChecksum *fc;
+  glnx_fd_close int fd = -1;
+  char *checksum;
+
+  file_checksum_set_stat (&current, st);
+
+  fc = g_hash_table_lookup (file_checksums, path);
+  if (fc != NULL && file_checksum_matches_stat (fc, &current))
+    return g_strdup (fc->checksum);
+
+  fd = openat (dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return glnx_null_throw_errno_prefix (error, "open %s", path);
+
+  checksum = checksum_fd (fd, error);
+  if (checksum == NULL)
+    return NULL;
+
+  if (!file_checksum_stat_is_stable (st))
+    return checksum;
+
+  fc = g_memdup (&current, sizeof (FileChecksum));
+  fc->checksum = g_strdup (checksum);
+  g_hash_table_insert (file_checksums, g_strdup (path), fc);
+  self->file_checksums_changed = TRUE;
+
+  return checksum;
+}
+
+gboolean
+builder_context_save_file_checksums (BuilderContext *self,
+                                     GError        **error)
+{
+  g_autoptr(GFile) file = NULL;
+
+  if (!self->file_checksums_changed)
+    return TRUE;
+
+  file = get_file_checksums_file (self);
+  if (!save_file_checksums (self->file_checksums, file, error))
+    return FALSE;
+
+  self->file_checksums_changed = FALSE;
+
+  return TRUE;
+}
+
+/* Drops the index entries for files that were removed or changed since
+ * they were checksummed. These would never be used again, and without
+ * this the index keeps every file any dir source ever contained. */
+gboolean
+builder_context_prune_file_checksums (BuilderContext *self,
+                                      GError        **error)
+{
+  GHashTable *file_checksums = get_file_checksums (self);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, file_checksums);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      FileChecksum current = { 0, };
+      struct stat st;
+
+      if (lstat ((const char *) key, &st) == 0 && S_ISREG (st.st_mode))
+        {
+          file_checksum_set_stat (&current, &st);
+          if (file_checksum_matches_stat (value, &current))
+            continue;
+        }
+
+      g_debug ("Removing stale file checksum for %s", (const char *) key);
+      g_hash_table_iter_remove (&iter);
+      self->file_checksums_changed = TRUE;
+    }
+
+  return builder_context_save_file_checksums (self, error);
+}
+
+/* Like builder_verify_checksums(), but remembers which checksums were
+ * verified for which file, in an index in the downloads dir. A file is
+ * only read again if it changed since, or with --reverify. The index
+ * maps the path to its stat data and the verified checksums, space
+ * separated, using the same format as the file checksum index. */
+gboolean
+builder_context_verify_checksums (BuilderContext *self,
+                                  const char     *name,
+                                  GFile          *file,
+                                  const char     *checksums[BUILDER_CHECKSUMS_LEN],
+                                  GChecksumType   checksums_type[BUILDER_CHECKSUMS_LEN],
+                                  GError        **error)
+{
+  const char *path = flatpak_file_get_path_cached (file);
+  g_autoptr(GFile) index_file = g_file_get_child (self->download_dir, "verified-checksums");
+  g_autoptr(GString) verified = g_string_new ("");
+  FileChecksum current = { 0, };
+  FileChecksum *fc;
+  struct stat st;
+  gsize i;
+
+  if (stat (path, &st) != 0)
+    return builder_verify_checksums (name, file, checksums, checksums_type, error);
+
+  file_checksum_set_stat (&current, &st);
+
+  for (i = 0; checksums[i] != NULL; i++)
+    {
+      g_autofree char *lower = g_ascii_strdown (checksums[i], -1);
+
+      if (i != 0)
+        g_string_append_c (verified, ' ');
+      g_string_append (verified, lower);
+    }
+
+  if (!self->reverify)
+    {
+      gboolean already_verified = FALSE;
+
+      g_mutex_lock (&self->verified_checksums_lock);
+
+      if (self->verified_checksums == NULL)
+        self->verified_checksums = load_file_checksums (index_file);
+
+      fc = g_hash_table_lookup (self->verified_checksums, path);
+      if (fc != NULL && file_checksum_matches_stat (fc, &current))
+        {
+          g_auto(GStrv) fc_checksums = g_strsplit (fc->checksum, " ", -1);
+          g_auto(GStrv) wanted = g_strsplit (verified->str, " ", -1);
+
+          for (i = 0; wanted[i] != NULL; i++)
+            {
+              if (!g_strv_contains ((const char * const *) fc_checksums, wanted[i]))
+                break;
+            }
+          already_verified = wanted[i] == NULL;
+        }
+
+      g_mutex_unlock (&self->verified_checksums_lock);
+
+      if (already_verified)
+        return TRUE;
+    }
+
+  if (!builder_verify_checksums (name, file, checksums, checksums_type, error))
+    return FALSE;
+
+  if (!file_checksum_stat_is_stable (&st))
+    return TRUE;
+
+  g_mutex_lock (&self->verified_checksums_lock);
+
+  if (self->verified_checksums == NULL)
+    self->verified_checksums = load_file_checksums (index_file);
+
+  fc = g_memdup (&current, sizeof (FileChecksum));
+  fc->checksum = g_strdup (verified->str);
+  g_hash_table_insert (self->verified_checksums, g_strdup (path), fc);
+  self->verified_checksums_changed = TRUE;
+
+  g_mutex_unlock (&self->verified_checksums_lock);
+
+  return TRUE;
+}
+
+/* Writes out the index of builder_context_verify_checksums(), if it
+ * changed. This is done once after the downloads, rather than after
+ * each verified file. */
+gboolean
+builder_context_save_verified_checksums (BuilderContext *self,
+                                         GError        **error)
+{
+  g_autoptr(GFile) index_file = NULL;
+  gboolean res = TRUE;
+
+  g_mutex_lock (&self->verified_checksums_lock);
+
+  if (self->verified_checksums_changed)
+    {
+      index_file = g_file_get_child (self->download_dir, "verified-checksums");
+      res = save_file_checksums (self->verified_checksums, index_file, error);
+      if (res)
+        self->verified_checksums_changed = FALSE;
+    }
+
+  g_mutex_unlock (&self->verified_checksums_lock);
+
+  return res;
+}
+
+gboolean
+builder_context_get_reverify (BuilderContext *self)
+{
+  return self->reverify;
+}
+
+void
+builder_context_set_reverify (BuilderContext *self,
+                              gboolean        reverify)
+{
+  self->reverify = reverify;
+}
+
 GFile *
 builder_context_allocate_build_subdir (BuilderContext *self,
                                        const char *name,
@@ -542,15 +1312,6 @@ builder_context_get_soup_session (BuilderContext *self)
   return self->soup_session;
 }
 
-CURL *
-builder_context_get_curl_session (BuilderContext *self)
-{
-  if (self->curl_session == NULL)
-    self->curl_session = flatpak_create_curl_session ("flatpak-builder " PACKAGE_VERSION);
-
-  return self->curl_session;
-}
-
 const char *
 builder_context_get_arch (BuilderContext *self)
 {
@@ -631,6 +1392,286 @@ builder_context_set_jobs (BuilderContext *self,
   self->jobs = jobs;
 }
 
+int
+builder_context_get_module_jobs (BuilderContext *self)
+{
+  if (self->module_jobs == 0)
+    return 1;
+  return self->module_jobs;
+}
+
+void
+builder_context_set_module_jobs (BuilderContext *self,
+                                 int module_jobs)
+{
+  self->module_jobs = module_jobs;
+}
+
+int
+builder_context_get_download_jobs (BuilderContext *self)
+{
+  if (self->download_jobs == 0)
+    return 4;
+  return self->download_jobs;
+}
+
+void
+builder_context_set_download_jobs (BuilderContext *self,
+                                   int download_jobs)
+{
+  self->download_jobs = download_jobs;
+}
+
+int
+builder_context_get_download_jobs_per_host (BuilderContext *self)
+{
+  if (self->download_jobs_per_host == 0)
+    return 4;
+  return self->download_jobs_per_host;
+}
+
+void
+builder_context_set_download_jobs_per_host (BuilderContext *self,
+                                            int download_jobs_per_host)
+{
+  self->download_jobs_per_host = download_jobs_per_host;
+}
+
+gboolean
+builder_context_get_content_cache (BuilderContext *self)
+{
+  return self->content_cache;
+}
+
+void
+builder_context_set_content_cache (BuilderContext *self,
+                                   gboolean        content_cache)
+{
+  self->content_cache = content_cache;
+}
+
+const char *
+builder_context_get_cache_url (BuilderContext *self)
+{
+  return self->cache_url;
+}
+
+void
+builder_context_set_cache_url (BuilderContext *self,
+                               const char     *url)
+{
+  g_free (self->cache_url);
+  self->cache_url = g_strdup (url);
+}
+
+const char *
+builder_context_get_push_cache_url (BuilderContext *self)
+{
+  return self->push_cache_url;
+}
+
+void
+builder_context_set_push_cache_url (BuilderContext *self,
+                                    const char     *url)
+{
+  g_free (self->push_cache_url);
+  self->push_cache_url = g_strdup (url);
+}
+
+guint64
+builder_context_get_cache_max_size (BuilderContext *self)
+{
+  return self->cache_max_size;
+}
+
+void
+builder_context_set_cache_max_size (BuilderContext *self,
+                                    guint64         max_size)
+{
+  self->cache_max_size = max_size;
+}
+
+int
+builder_context_get_cache_max_age (BuilderContext *self)
+{
+  return self->cache_max_age;
+}
+
+void
+builder_context_set_cache_max_age (BuilderContext *self,
+                                   int             max_age)
+{
+  self->cache_max_age = max_age;
+}
+
+gboolean
+builder_context_get_profile (BuilderContext *self)
+{
+  return self->profile;
+}
+
+void
+builder_context_set_profile (BuilderContext *self,
+                             gboolean        profile)
+{
+  self->profile = profile;
+}
+
+struct BuilderProfileSpan
+{
+  BuilderContext *context;
+  char           *module;
+  char           *phase;
+  gint64          start_time;
+  gboolean        started_alone;
+  guint           overlaps;
+  struct rusage   start_thread;
+  struct rusage   start_children;
+};
+
+/* Starts timing @phase of @module for the --profile report. Returns
+ * %NULL if profiling is disabled. The span ends and is added to the
+ * report when it is freed with builder_profile_span_end(). */
+BuilderProfileSpan *
+builder_context_profile_begin (BuilderContext *self,
+                               const char     *module,
+                               const char     *phase)
+{
+  BuilderProfileSpan *span;
+
+  if (!self->profile)
+    return NULL;
+
+  span = g_new0 (BuilderProfileSpan, 1);
+  span->context = g_object_ref (self);
+  span->module = g_strdup (module);
+  span->phase = g_strdup (phase);
+  span->start_time = g_get_monotonic_time ();
+
+  g_mutex_lock (&self->profile_lock);
+  span->started_alone = self->profile_active == 0;
+  if (!span->started_alone)
+    self->profile_overlaps++;
+  span->overlaps = self->profile_overlaps;
+  self->profile_active++;
+  g_mutex_unlock (&self->profile_lock);
+
+  getrusage (RUSAGE_THREAD, &span->start_thread);
+  getrusage (RUSAGE_CHILDREN, &span->start_children);
+
+  return span;
+}
+
+static gint64
+timeval_diff_usec (const struct timeval *end,
+                   const struct timeval *start)
+{
+  return (end->tv_sec - start->tv_sec) * G_USEC_PER_SEC + (end->tv_usec - start->tv_usec);
+}
+
+/* The report is in the Chrome trace event format, so it can be loaded
+ * in chrome://tracing as well as parsed. It is written once, when the
+ * context goes away at the end of the build, whether it failed or not. */
+static void
+write_profile (BuilderContext *self)
+{
+  g_autoptr(JsonNode) root = json_node_new (JSON_NODE_OBJECT);
+  g_autoptr(JsonObject) object = json_object_new ();
+  g_autoptr(JsonGenerator) generator = json_generator_new ();
+  g_autoptr(GFile) file = g_file_get_child (self->state_dir, "profile.json");
+  g_autoptr(GError) error = NULL;
+  g_autofree char *json = NULL;
+
+  json_object_set_array_member (object, "traceEvents", json_array_ref (self->profile_events));
+  json_object_set_string_member (object, "displayTimeUnit", "ms");
+  json_node_set_object (root, object);
+
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+  json = json_generator_to_data (generator, NULL);
+
+  if (!flatpak_mkdir_p (self->state_dir, NULL, &error) ||
+      !g_file_set_contents (flatpak_file_get_path_cached (file), json, -1, &error))
+    g_warning ("Failed to write profile: %s", error->message);
+}
+
+/* The cpu time and i/o of the span's own thread are always exact.
+ * Children can only be accounted for per process, so their usage is
+ * only reported for spans that didn't overlap any other span (e.g.
+ * with --module-jobs or --download-jobs), and their peak rss only if
+ * some child of the span raised it. */
+void
+builder_profile_span_end (BuilderProfileSpan *span)
+{
+  BuilderContext *self = span->context;
+  struct rusage end_thread, end_children;
+  gint64 end_time = g_get_monotonic_time ();
+  JsonObject *event = json_object_new ();
+  JsonObject *args = json_object_new ();
+  gboolean alone;
+  gpointer tid;
+
+  getrusage (RUSAGE_THREAD, &end_thread);
+  getrusage (RUSAGE_CHILDREN, &end_children);
+
+  json_object_set_string_member (args, "module", span->module);
+  json_object_set_int_member (args, "user-usec",
+                              timeval_diff_usec (&end_thread.ru_utime, &span->start_thread.ru_utime));
+  json_object_set_int_member (args, "system-usec",
+                              timeval_diff_usec (&end_thread.ru_stime, &span->start_thread.ru_stime));
+  /* Block counts from getrusage are always in 512 byte units */
+  json_object_set_int_member (args, "read-bytes",
+                              512 * (gint64) (end_thread.ru_inblock - span->start_thread.ru_inblock));
+  json_object_set_int_member (args, "write-bytes",
+                              512 * (gint64) (end_thread.ru_oublock - span->start_thread.ru_oublock));
+
+  json_object_set_string_member (event, "name", span->phase);
+  json_object_set_string_member (event, "cat", span->module);
+  json_object_set_string_member (event, "ph", "X");
+  json_object_set_int_member (event, "ts", span->start_time - self->profile_start);
+  json_object_set_int_member (event, "dur", end_time - span->start_time);
+  json_object_set_int_member (event, "pid", getpid ());
+  json_object_set_object_member (event, "args", args);
+
+  g_mutex_lock (&self->profile_lock);
+
+  self->profile_active--;
+  alone = span->started_alone && span->overlaps == self->profile_overlaps;
+
+  if (alone)
+    {
+      json_object_set_int_member (args, "children-user-usec",
+                                  timeval_diff_usec (&end_children.ru_utime, &span->start_children.ru_utime));
+      json_object_set_int_member (args, "children-system-usec",
+                                  timeval_diff_usec (&end_children.ru_stime, &span->start_children.ru_stime));
+      json_object_set_int_member (args, "children-read-bytes",
+                                  512 * (gint64) (end_children.ru_inblock - span->start_children.ru_inblock));
+      json_object_set_int_member (args, "children-write-bytes",
+                                  512 * (gint64) (end_children.ru_oublock - span->start_children.ru_oublock));
+      if (end_children.ru_maxrss > span->start_children.ru_maxrss)
+        json_object_set_int_member (args, "children-max-rss-kb", end_children.ru_maxrss);
+    }
+
+  /* Give each thread a small id of its own, so parallel phases are
+     shown on separate rows */
+  tid = g_hash_table_lookup (self->profile_threads, g_thread_self ());
+  if (tid == NULL)
+    {
+      tid = GINT_TO_POINTER (g_hash_table_size (self->profile_threads) + 1);
+      g_hash_table_insert (self->profile_threads, g_thread_self (), tid);
+    }
+  json_object_set_int_member (event, "tid", GPOINTER_TO_INT (tid));
+
+  json_array_add_object_element (self->profile_events, event);
+
+  g_mutex_unlock (&self->profile_lock);
+
+  g_object_unref (span->context);
+  g_free (span->module);
+  g_free (span->phase);
+  g_free (span);
+}
+
 void
 builder_context_set_keep_build_dirs (BuilderContext *self,
                                      gboolean        keep_build_dirs)
@@ -750,6 +1791,19 @@ builder_context_set_bundle_sources (BuilderContext *self,
   self->bundle_sources = !!bundle_sources;
 }
 
+gboolean
+builder_context_get_cache_extracted_sources (BuilderContext *self)
+{
+  return self->cache_extracted_sources;
+}
+
+void
+builder_context_set_cache_extracted_sources (BuilderContext *self,
+                                             gboolean        cache_extracted_sources)
+{
+  self->cache_extracted_sources = !!cache_extracted_sources;
+}
+
 static char *rofiles_unmount_path = NULL;
 
 static void
@@ -913,6 +1967,115 @@ builder_context_get_rofiles_active (BuilderContext *self)
   return self->rofiles_dir != NULL;
 }
 
+struct BuilderRofilesMount
+{
+  GFile *dir;
+  int    watcher_fd;
+};
+
+/* Mounts @source on @dir with rofiles-fuse, like
+ * builder_context_enable_rofiles() does for the app dir. This is used for
+ * the private app dirs of modules that are built in parallel. As the
+ * watcher process of the app dir only knows about that one, each mount
+ * gets a shell that unmounts it if its stdin is closed without saying
+ * "done" first, i.e. if flatpak-builder dies. */
+BuilderRofilesMount *
+builder_rofiles_mount (GFile   *source,
+                       GFile   *dir,
+                       GError **error)
+{
+  g_autofree BuilderRofilesMount *mount = g_new0 (BuilderRofilesMount, 1);
+  const char *watcher_argv[] = { "sh", "-c",
+                                 "trap '' INT; read done; [ \"$done\" = done ] || fusermount -uz \"$0\"",
+                                 flatpak_file_get_path_cached (dir),
+                                 NULL };
+  char *argv[] = { "rofiles-fuse",
+                   "-o",
+                   "kernel_cache,entry_timeout=60,attr_timeout=60,splice_write,splice_move",
+                   (char *)flatpak_file_get_path_cached (source),
+                   (char *)flatpak_file_get_path_cached (dir),
+                   NULL };
+  gint exit_status;
+
+  if (g_mkdir_with_parents (flatpak_file_get_path_cached (dir), 0755) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  g_debug ("starting: rofiles-fuse %s %s", argv[3], argv[4]);
+  if (!g_spawn_sync (NULL, (char **)argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_CLOEXEC_PIPES, rofiles_child_setup, NULL, NULL, NULL, &exit_status, error))
+    {
+      g_prefix_error (error, "Can't spawn rofiles-fuse");
+      return NULL;
+    }
+  else if (exit_status != 0)
+    {
+      flatpak_fail (error, "Failure spawning rofiles-fuse, exit_status: %d", exit_status);
+      return NULL;
+    }
+
+  if (!g_spawn_async_with_pipes (NULL, (char **)watcher_argv, NULL,
+                                 G_SPAWN_SEARCH_PATH | G_SPAWN_CLOEXEC_PIPES,
+                                 NULL, NULL, NULL,
+                                 &mount->watcher_fd, NULL, NULL, error))
+    {
+      char *umount_argv[] = { "fusermount", "-u", argv[4], NULL };
+
+      g_spawn_sync (NULL, umount_argv, NULL,
+                    G_SPAWN_SEARCH_PATH | G_SPAWN_CLOEXEC_PIPES,
+                    NULL, NULL, NULL, NULL, NULL, NULL);
+      return NULL;
+    }
+
+  mount->dir = g_object_ref (dir);
+
+  return g_steal_pointer (&mount);
+}
+
+GFile *
+builder_rofiles_mount_get_dir (BuilderRofilesMount *mount)
+{
+  return mount->dir;
+}
+
+/* Unmounts and frees @mount */
+gboolean
+builder_rofiles_unmount (BuilderRofilesMount *mount,
+                         GError             **error)
+{
+  char *argv[] = { "fusermount", "-u", NULL,
+                     NULL };
+  gint exit_status;
+  gboolean res = TRUE;
+
+  argv[2] = (char *)flatpak_file_get_path_cached (mount->dir);
+
+  g_debug ("unmounting rofiles-fuse %s", argv[2]);
+  if (!g_spawn_sync (NULL, (char **)argv, NULL,
+                     G_SPAWN_SEARCH_PATH | G_SPAWN_CLOEXEC_PIPES,
+                     NULL, NULL, NULL, NULL, &exit_status, error))
+    res = FALSE;
+  else if (exit_status != 0)
+    res = flatpak_fail (error, "Failure unmounting %s, exit_status: %d", argv[2], exit_status);
+
+  /* If this failed, leave it to the watcher to unmount lazily */
+  if (res)
+    (void) TEMP_FAILURE_RETRY (write (mount->watcher_fd, "done\n", 5));
+  close (mount->watcher_fd);
+
+  g_object_unref (mount->dir);
+  g_free (mount);
+
+  return res;
+}
+
+gboolean
+builder_context_get_have_rofiles (BuilderContext *self)
+{
+  return self->have_rofiles;
+}
+
 gboolean
 builder_context_get_use_rofiles (BuilderContext *self)
 {
@@ -939,6 +2102,19 @@ builder_context_set_run_tests (BuilderContext *self,
   self->run_tests = run_tests;
 }
 
+gboolean
+builder_context_get_persistent_sandbox (BuilderContext *self)
+{
+  return self->persistent_sandbox;
+}
+
+void
+builder_context_set_persistent_sandbox (BuilderContext *self,
+                                        gboolean        persistent_sandbox)
+{
+  self->persistent_sandbox = persistent_sandbox;
+}
+
 void
 builder_context_set_no_shallow_clone (BuilderContext *self,
                                       gboolean        no_shallow_clone)
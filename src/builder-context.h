@@ -21,6 +21,7 @@
 #ifndef __BUILDER_CONTEXT_H__
 #define __BUILDER_CONTEXT_H__
 
+#include <sys/stat.h>
 #include <gio/gio.h>
 #include <libsoup/soup.h>
 #include <curl/curl.h>
@@ -47,6 +48,7 @@ void            builder_context_set_base_dir (BuilderContext *self,
 GFile *         builder_context_get_state_dir (BuilderContext *self);
 GFile *         builder_context_get_cache_dir (BuilderContext *self);
 GFile *         builder_context_get_build_dir (BuilderContext *self);
+GFile *         builder_context_get_extract_cache_dir (BuilderContext *self);
 GFile *         builder_context_allocate_build_subdir (BuilderContext *self,
                                                        const char *name,
                                                        GError **error);
@@ -70,7 +72,6 @@ gboolean        builder_context_download_uri (BuilderContext *self,
                                               GChecksumType   checksums_type[BUILDER_CHECKSUMS_LEN],
                                               GError        **error);
 SoupSession *   builder_context_get_soup_session (BuilderContext *self);
-CURL *          builder_context_get_curl_session (BuilderContext *self);
 const char *    builder_context_get_arch (BuilderContext *self);
 void            builder_context_set_arch (BuilderContext *self,
                                           const char     *arch);
@@ -85,6 +86,40 @@ void            builder_context_set_stop_at (BuilderContext *self,
 int             builder_context_get_jobs (BuilderContext *self);
 void            builder_context_set_jobs (BuilderContext *self,
                                           int n_jobs);
+int             builder_context_get_module_jobs (BuilderContext *self);
+void            builder_context_set_module_jobs (BuilderContext *self,
+                                                 int n_jobs);
+int             builder_context_get_download_jobs (BuilderContext *self);
+void            builder_context_set_download_jobs (BuilderContext *self,
+                                                   int n_jobs);
+int             builder_context_get_download_jobs_per_host (BuilderContext *self);
+void            builder_context_set_download_jobs_per_host (BuilderContext *self,
+                                                            int n_jobs);
+gboolean        builder_context_get_content_cache (BuilderContext *self);
+void            builder_context_set_content_cache (BuilderContext *self,
+                                                   gboolean        content_cache);
+const char *    builder_context_get_cache_url (BuilderContext *self);
+void            builder_context_set_cache_url (BuilderContext *self,
+                                               const char     *url);
+const char *    builder_context_get_push_cache_url (BuilderContext *self);
+void            builder_context_set_push_cache_url (BuilderContext *self,
+                                                    const char     *url);
+guint64         builder_context_get_cache_max_size (BuilderContext *self);
+void            builder_context_set_cache_max_size (BuilderContext *self,
+                                                    guint64         max_size);
+int             builder_context_get_cache_max_age (BuilderContext *self);
+void            builder_context_set_cache_max_age (BuilderContext *self,
+                                                   int             max_age);
+gboolean        builder_context_get_profile (BuilderContext *self);
+void            builder_context_set_profile (BuilderContext *self,
+                                             gboolean        profile);
+
+typedef struct BuilderProfileSpan BuilderProfileSpan;
+
+BuilderProfileSpan * builder_context_profile_begin (BuilderContext *self,
+                                                    const char     *module,
+                                                    const char     *phase);
+void            builder_profile_span_end (BuilderProfileSpan *span);
 void            builder_context_set_keep_build_dirs (BuilderContext *self,
                                                      gboolean        keep_build_dirs);
 gboolean        builder_context_get_delete_build_dirs (BuilderContext *self);
@@ -115,6 +150,9 @@ void            builder_context_set_separate_locales (BuilderContext *self,
 void            builder_context_set_bundle_sources (BuilderContext *self,
                                                     gboolean        bundle_sources);
 gboolean        builder_context_get_bundle_sources (BuilderContext *self);
+void            builder_context_set_cache_extracted_sources (BuilderContext *self,
+                                                             gboolean        cache_extracted_sources);
+gboolean        builder_context_get_cache_extracted_sources (BuilderContext *self);
 gboolean        builder_context_get_rebuild_on_sdk_change (BuilderContext *self);
 void            builder_context_set_rebuild_on_sdk_change (BuilderContext *self,
                                                            gboolean        rebuild_on_sdk_change);
@@ -124,6 +162,27 @@ gboolean        builder_context_set_checksum_for (BuilderContext  *self,
                                                   const char      *name,
                                                   const char      *checksum,
                                                   GError         **error);
+char *          builder_context_get_file_checksum (BuilderContext    *self,
+                                                   int                dfd,
+                                                   const char        *name,
+                                                   const char        *path,
+                                                   const struct stat *st,
+                                                   GError           **error);
+gboolean        builder_context_save_file_checksums (BuilderContext *self,
+                                                     GError        **error);
+gboolean        builder_context_prune_file_checksums (BuilderContext *self,
+                                                      GError        **error);
+gboolean        builder_context_verify_checksums (BuilderContext *self,
+                                                  const char     *name,
+                                                  GFile          *file,
+                                                  const char     *checksums[BUILDER_CHECKSUMS_LEN],
+                                                  GChecksumType   checksums_type[BUILDER_CHECKSUMS_LEN],
+                                                  GError        **error);
+gboolean        builder_context_save_verified_checksums (BuilderContext *self,
+                                                         GError        **error);
+gboolean        builder_context_get_reverify (BuilderContext *self);
+void            builder_context_set_reverify (BuilderContext *self,
+                                              gboolean        reverify);
 
 BuilderContext *builder_context_new (GFile *run_dir,
                                      GFile *app_dir,
@@ -136,12 +195,26 @@ gboolean        builder_context_enable_rofiles (BuilderContext *self,
 gboolean        builder_context_disable_rofiles (BuilderContext *self,
                                                  GError        **error);
 gboolean        builder_context_get_rofiles_active (BuilderContext *self);
+gboolean        builder_context_get_have_rofiles (BuilderContext *self);
 gboolean        builder_context_get_use_rofiles (BuilderContext *self);
 void            builder_context_set_use_rofiles (BuilderContext *self,
                                                  gboolean use_rofiles);
+
+typedef struct BuilderRofilesMount BuilderRofilesMount;
+
+BuilderRofilesMount *builder_rofiles_mount (GFile   *source,
+                                            GFile   *dir,
+                                            GError **error);
+GFile               *builder_rofiles_mount_get_dir (BuilderRofilesMount *mount);
+gboolean             builder_rofiles_unmount (BuilderRofilesMount *mount,
+                                              GError             **error);
+
 gboolean        builder_context_get_run_tests (BuilderContext *self);
 void            builder_context_set_run_tests (BuilderContext *self,
                                                gboolean run_tests);
+gboolean        builder_context_get_persistent_sandbox (BuilderContext *self);
+void            builder_context_set_persistent_sandbox (BuilderContext *self,
+                                                        gboolean        persistent_sandbox);
 void            builder_context_set_no_shallow_clone (BuilderContext *self,
                                                       gboolean        no_shallow_clone);
 gboolean        builder_context_get_no_shallow_clone (BuilderContext *self);
@@ -157,6 +230,7 @@ gboolean        builder_context_load_sdk_config (BuilderContext       *self,
 BuilderSdkConfig * builder_context_get_sdk_config (BuilderContext *self);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderContext, g_object_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderProfileSpan, builder_profile_span_end)
 
 G_END_DECLS
 
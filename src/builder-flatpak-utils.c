@@ -560,6 +560,7 @@ flatpak_spawnv (GFile                *dir,
   GInputStream *in;
   g_autoptr(GOutputStream) out = NULL;
   g_autoptr(GMainLoop) loop = NULL;
+  g_autoptr(GMainContext) context = NULL;
   SpawnData data = {0};
   g_autofree gchar *commandline = NULL;
 
@@ -586,7 +587,12 @@ flatpak_spawnv (GFile                *dir,
   if (subp == NULL)
     return FALSE;
 
-  loop = g_main_loop_new (NULL, FALSE);
+  /* Use a private main context so that this can be called from
+     several threads at the same time */
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  loop = g_main_loop_new (context, FALSE);
 
   data.loop = loop;
   data.refs = 1;
@@ -609,6 +615,8 @@ flatpak_spawnv (GFile                *dir,
 
   g_main_loop_run (loop);
 
+  g_main_context_pop_thread_default (context);
+
   if (data.error)
     {
       g_propagate_error (error, data.error);
@@ -691,148 +699,334 @@ flatpak_file_get_path_cached (GFile *file)
   return path;
 }
 
-gboolean
-flatpak_cp_a (GFile         *src,
-              GFile         *dest,
-              FlatpakCpFlags flags,
-              GPtrArray     *skip_files,
-              GCancellable  *cancellable,
-              GError       **error)
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/* Copying files is mostly waiting for i/o, but there is no point in
+   having more than this many copies in flight */
+#define CP_A_MAX_THREADS 8
+
+typedef struct
 {
-  gboolean ret = FALSE;
-  GFileEnumerator *enumerator = NULL;
-  GFileInfo *src_info = NULL;
-  GFile *dest_child = NULL;
-  int dest_dfd = -1;
-  gboolean merge = (flags & FLATPAK_CP_FLAGS_MERGE) != 0;
-  gboolean no_chown = (flags & FLATPAK_CP_FLAGS_NO_CHOWN) != 0;
-  gboolean move = (flags & FLATPAK_CP_FLAGS_MOVE) != 0;
-  g_autoptr(GFileInfo) child_info = NULL;
-  GError *temp_error = NULL;
-  int r;
-
-  enumerator = g_file_enumerate_children (src, "standard::type,standard::name,unix::uid,unix::gid,unix::mode",
-                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                          cancellable, error);
-  if (!enumerator)
-    goto out;
-
-  src_info = g_file_query_info (src, "standard::name,unix::mode,unix::uid,unix::gid," \
-                                     "time::modified,time::modified-usec,time::access,time::access-usec",
-                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                cancellable, error);
-  if (!src_info)
-    goto out;
+  FlatpakCpFlags flags;
+  GHashTable    *skip_paths;
+  GThreadPool   *pool;
+  GMutex         lock;
+  GCond          cond;
+  guint          pending;
+  GError        *error;
+} CpAData;
 
-  do
-    r = mkdir (flatpak_file_get_path_cached (dest), 0755);
-  while (G_UNLIKELY (r == -1 && errno == EINTR));
-  if (r == -1 &&
-      (!merge || errno != EEXIST))
+typedef struct
+{
+  CpAData    *data;
+  char       *src_path;
+  char       *dest_path;
+  struct stat st;
+} CpAFile;
+
+/* Copies the non-directory @src_name in @src_dfd, which was stat()ed
+ * as @st, to @dest_name in @dest_dfd. Regular files are reflinked if
+ * the filesystem supports it, otherwise copied with copy_file_range()
+ * where possible. The timestamps are always kept, like g_file_copy()
+ * does, the owner only if @copy_owner is set. */
+static gboolean
+cp_a_file_at (int                src_dfd,
+              const char        *src_name,
+              const struct stat *st,
+              int                dest_dfd,
+              const char        *dest_name,
+              gboolean           copy_owner,
+              GError           **error)
+{
+  struct timespec times[2] = { st->st_atim, st->st_mtim };
+  glnx_fd_close int src_fd = -1;
+  glnx_fd_close int dest_fd = -1;
+
+  if (S_ISLNK (st->st_mode))
     {
-      glnx_set_error_from_errno (error);
-      goto out;
-    }
+      g_autofree char *target = glnx_readlinkat_malloc (src_dfd, src_name, NULL, error);
 
-  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (dest), TRUE,
-                       &dest_dfd, error))
-    goto out;
+      if (target == NULL)
+        return FALSE;
 
-  if (!no_chown)
-    {
-      do
-        r = fchown (dest_dfd,
-                    g_file_info_get_attribute_uint32 (src_info, "unix::uid"),
-                    g_file_info_get_attribute_uint32 (src_info, "unix::gid"));
-      while (G_UNLIKELY (r == -1 && errno == EINTR));
-      if (r == -1)
-        {
-          glnx_set_error_from_errno (error);
-          goto out;
-        }
+      if (TEMP_FAILURE_RETRY (symlinkat (target, dest_dfd, dest_name)) != 0)
+        return glnx_throw_errno_prefix (error, "symlinkat(%s)", dest_name);
+
+      if (copy_owner &&
+          TEMP_FAILURE_RETRY (fchownat (dest_dfd, dest_name, st->st_uid, st->st_gid,
+                                        AT_SYMLINK_NOFOLLOW)) != 0)
+        return glnx_throw_errno_prefix (error, "fchownat(%s)", dest_name);
+
+      if (TEMP_FAILURE_RETRY (utimensat (dest_dfd, dest_name, times, AT_SYMLINK_NOFOLLOW)) != 0)
+        return glnx_throw_errno_prefix (error, "utimensat(%s)", dest_name);
+
+      return TRUE;
     }
 
-  do
-    r = fchmod (dest_dfd, g_file_info_get_attribute_uint32 (src_info, "unix::mode"));
-  while (G_UNLIKELY (r == -1 && errno == EINTR));
+  if (!S_ISREG (st->st_mode))
+    return flatpak_fail (error, "Can't copy special file %s", src_name);
+
+  src_fd = TEMP_FAILURE_RETRY (openat (src_dfd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+  if (src_fd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", src_name);
 
-  if (dest_dfd != -1)
+  dest_fd = TEMP_FAILURE_RETRY (openat (dest_dfd, dest_name,
+                                        O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                                        0600));
+  if (dest_fd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", dest_name);
+
+  if (ioctl (dest_fd, FICLONE, src_fd) != 0 &&
+      glnx_regfile_copy_bytes (src_fd, dest_fd, (off_t) -1) < 0)
+    return glnx_throw_errno_prefix (error, "Copying %s", src_name);
+
+  /* chown before chmod, as chown clears the setuid bits */
+  if (copy_owner &&
+      TEMP_FAILURE_RETRY (fchown (dest_fd, st->st_uid, st->st_gid)) != 0)
+    return glnx_throw_errno_prefix (error, "fchown(%s)", dest_name);
+
+  if (TEMP_FAILURE_RETRY (fchmod (dest_fd, st->st_mode & 07777)) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod(%s)", dest_name);
+
+  if (TEMP_FAILURE_RETRY (futimens (dest_fd, times)) != 0)
+    return glnx_throw_errno_prefix (error, "futimens(%s)", dest_name);
+
+  return TRUE;
+}
+
+static gboolean
+cp_a_failed (CpAData *data)
+{
+  gboolean failed;
+
+  g_mutex_lock (&data->lock);
+  failed = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  return failed;
+}
+
+static void
+cp_a_file_free (CpAFile *file)
+{
+  g_free (file->src_path);
+  g_free (file->dest_path);
+  g_free (file);
+}
+
+static void
+cp_a_file_thread (gpointer item,
+                  gpointer user_data)
+{
+  CpAFile *file = item;
+  CpAData *data = file->data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!cp_a_failed (data) &&
+      !cp_a_file_at (AT_FDCWD, file->src_path, &file->st,
+                     AT_FDCWD, file->dest_path,
+                     (data->flags & FLATPAK_CP_FLAGS_NO_CHOWN) == 0,
+                     &local_error))
     {
-      (void) close (dest_dfd);
-      dest_dfd = -1;
+      g_mutex_lock (&data->lock);
+      if (data->error == NULL)
+        data->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&data->lock);
     }
 
-  while ((child_info = g_file_enumerator_next_file (enumerator, cancellable, &temp_error)))
+  cp_a_file_free (file);
+
+  g_mutex_lock (&data->lock);
+  if (--data->pending == 0)
+    g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* One pool is shared by all copies, rather than starting new threads
+   for every call, many of which only copy a handful of files */
+static GThreadPool *
+cp_a_get_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    g_once_init_leave (&pool, (gsize) g_thread_pool_new (cp_a_file_thread, NULL,
+                                                         MIN (g_get_num_processors (), CP_A_MAX_THREADS),
+                                                         FALSE, NULL));
+
+  return (GThreadPool *) pool;
+}
+
+static gboolean
+cp_a_dir_at (CpAData      *data,
+             int           src_parent_dfd,
+             const char   *src_name,
+             const char   *src_path,
+             int           dest_parent_dfd,
+             const char   *dest_name,
+             const char   *dest_path,
+             GCancellable *cancellable,
+             GError      **error)
+{
+  gboolean merge = (data->flags & FLATPAK_CP_FLAGS_MERGE) != 0;
+  gboolean no_chown = (data->flags & FLATPAK_CP_FLAGS_NO_CHOWN) != 0;
+  gboolean move = (data->flags & FLATPAK_CP_FLAGS_MOVE) != 0;
+  g_auto(GLnxDirFdIterator) src_iter = { 0 };
+  glnx_fd_close int dest_dfd = -1;
+  struct stat src_stbuf;
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (src_parent_dfd, src_name, FALSE, &src_iter, error))
+    return FALSE;
+
+  if (TEMP_FAILURE_RETRY (fstat (src_iter.fd, &src_stbuf)) != 0)
+    return glnx_throw_errno_prefix (error, "fstat(%s)", src_path);
+
+  if (TEMP_FAILURE_RETRY (mkdirat (dest_parent_dfd, dest_name, 0755)) != 0 &&
+      (!merge || errno != EEXIST))
+    return glnx_throw_errno_prefix (error, "mkdirat(%s)", dest_path);
+
+  if (!glnx_opendirat (dest_parent_dfd, dest_name, TRUE, &dest_dfd, error))
+    return FALSE;
+
+  if (!no_chown &&
+      TEMP_FAILURE_RETRY (fchown (dest_dfd, src_stbuf.st_uid, src_stbuf.st_gid)) != 0)
+    return glnx_throw_errno_prefix (error, "fchown(%s)", dest_path);
+
+  (void) TEMP_FAILURE_RETRY (fchmod (dest_dfd, src_stbuf.st_mode & 07777));
+
+  while (TRUE)
     {
-      const char *name = g_file_info_get_name (child_info);
-      g_autoptr(GFile) src_child = g_file_get_child (src, name);
-      gboolean skip = FALSE;
-      int i;
+      g_autofree char *child_src_path = NULL;
+      g_autofree char *child_dest_path = NULL;
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&src_iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (cp_a_failed (data))
+        return TRUE;
+
+      child_src_path = g_build_filename (src_path, dent->d_name, NULL);
+      if (g_hash_table_contains (data->skip_paths, child_src_path))
+        continue;
 
-      for (i = 0; skip_files != NULL && i < skip_files->len; i++)
+      child_dest_path = g_build_filename (dest_path, dent->d_name, NULL);
+
+      if (TEMP_FAILURE_RETRY (fstatat (src_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW)) != 0)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", child_src_path);
+
+      if (S_ISDIR (stbuf.st_mode))
         {
-          if (g_file_equal (src_child, g_ptr_array_index (skip_files, i)))
-            {
-              skip = TRUE;
-              break;
-            }
+          if (!cp_a_dir_at (data, src_iter.fd, dent->d_name, child_src_path,
+                            dest_dfd, dent->d_name, child_dest_path,
+                            cancellable, error))
+            return FALSE;
+          continue;
         }
 
-      if (dest_child)
-        g_object_unref (dest_child);
-      dest_child = g_file_get_child (dest, name);
+      (void) unlinkat (dest_dfd, dent->d_name, 0);
 
-      if (skip)
+      if (move)
         {
-          /* skip src */
+          if (renameat (src_iter.fd, dent->d_name, dest_dfd, dent->d_name) == 0)
+            continue;
+
+          if (errno != EXDEV)
+            return glnx_throw_errno_prefix (error, "renameat(%s)", child_src_path);
+
+          if (!cp_a_file_at (src_iter.fd, dent->d_name, &stbuf, dest_dfd, dent->d_name,
+                             !no_chown, error))
+            return FALSE;
+
+          if (unlinkat (src_iter.fd, dent->d_name, 0) != 0)
+            return glnx_throw_errno_prefix (error, "unlinkat(%s)", child_src_path);
         }
-      else if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+      else if (data->pool != NULL && S_ISREG (stbuf.st_mode))
         {
-          if (!flatpak_cp_a (src_child, dest_child, flags, skip_files,
-                             cancellable, error))
-            goto out;
+          CpAFile *file = g_new0 (CpAFile, 1);
+
+          file->data = data;
+          file->src_path = g_steal_pointer (&child_src_path);
+          file->dest_path = g_steal_pointer (&child_dest_path);
+          file->st = stbuf;
+
+          g_mutex_lock (&data->lock);
+          data->pending++;
+          g_mutex_unlock (&data->lock);
+
+          g_thread_pool_push (data->pool, file, NULL);
         }
       else
         {
-          (void) unlink (flatpak_file_get_path_cached (dest_child));
-          GFileCopyFlags copyflags = G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS;
-          if (!no_chown)
-            copyflags |= G_FILE_COPY_ALL_METADATA;
-          if (move)
-            {
-              if (!g_file_move (src_child, dest_child, copyflags,
-                                cancellable, NULL, NULL, error))
-                goto out;
-            }
-          else
-            {
-              if (!g_file_copy (src_child, dest_child, copyflags,
-                                cancellable, NULL, NULL, error))
-                goto out;
-            }
+          if (!cp_a_file_at (src_iter.fd, dent->d_name, &stbuf, dest_dfd, dent->d_name,
+                             !no_chown, error))
+            return FALSE;
         }
-
-      g_clear_object (&child_info);
     }
 
-  if (temp_error != NULL)
+  if (move &&
+      unlinkat (src_parent_dfd, src_name, AT_REMOVEDIR) != 0)
+    return glnx_throw_errno_prefix (error, "rmdir(%s)", src_path);
+
+  return TRUE;
+}
+
+/* Works on dirfds rather than GFiles. Regular files are reflinked
+ * when the filesystem supports it, and unless moving, they are copied
+ * on a thread pool while the tree is walked. */
+gboolean
+flatpak_cp_a (GFile         *src,
+              GFile         *dest,
+              FlatpakCpFlags flags,
+              GPtrArray     *skip_files,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  g_autoptr(GHashTable) skip_paths = g_hash_table_new (g_str_hash, g_str_equal);
+  const char *src_path = flatpak_file_get_path_cached (src);
+  const char *dest_path = flatpak_file_get_path_cached (dest);
+  CpAData data = { flags, skip_paths, };
+  gboolean res;
+  int i;
+
+  for (i = 0; skip_files != NULL && i < skip_files->len; i++)
+    g_hash_table_add (skip_paths, (char *) flatpak_file_get_path_cached (g_ptr_array_index (skip_files, i)));
+
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  if ((flags & FLATPAK_CP_FLAGS_MOVE) == 0)
+    data.pool = cp_a_get_pool ();
+
+  res = cp_a_dir_at (&data, AT_FDCWD, src_path, src_path,
+                     AT_FDCWD, dest_path, dest_path,
+                     cancellable, error);
+
+  /* Wait for the files of this copy, the pool may also be busy with
+     those of copies in other threads */
+  g_mutex_lock (&data.lock);
+  while (data.pending > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_cond_clear (&data.cond);
+  g_mutex_clear (&data.lock);
+
+  if (res && data.error != NULL)
     {
-      g_propagate_error (error, temp_error);
-      goto out;
+      g_propagate_error (error, g_steal_pointer (&data.error));
+      return FALSE;
     }
 
-  if (move &&
-      !g_file_delete (src, NULL, error))
-    goto out;
-
-  ret = TRUE;
-out:
-  if (dest_dfd != -1)
-    (void) close (dest_dfd);
-  g_clear_object (&src_info);
-  g_clear_object (&enumerator);
-  g_clear_object (&dest_child);
-  return ret;
+  g_clear_error (&data.error);
+
+  return res;
 }
 
 gboolean
@@ -254,6 +254,56 @@ git_get_mirror_dir (const char     *url_or_path,
   return g_file_get_child (git_dir, filename);
 }
 
+/* Only one mirror operation runs for a repo at a time. Identical
+   requests that have already succeeded in this run are skipped, so
+   a repo shared by several modules or submodules is fetched once. */
+static GMutex mirrors_lock;
+static GCond mirrors_cond;
+static GHashTable *mirrors_busy = NULL;
+static GHashTable *mirrors_done = NULL;
+
+static gboolean
+git_mirror_begin (const char *repo_location,
+                  const char *key)
+{
+  g_mutex_lock (&mirrors_lock);
+
+  if (mirrors_busy == NULL)
+    {
+      mirrors_busy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      mirrors_done = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+  while (g_hash_table_contains (mirrors_busy, repo_location))
+    g_cond_wait (&mirrors_cond, &mirrors_lock);
+
+  if (g_hash_table_contains (mirrors_done, key))
+    {
+      g_mutex_unlock (&mirrors_lock);
+      return FALSE;
+    }
+
+  g_hash_table_add (mirrors_busy, g_strdup (repo_location));
+  g_mutex_unlock (&mirrors_lock);
+
+  return TRUE;
+}
+
+static void
+git_mirror_end (const char *repo_location,
+                const char *key,
+                gboolean    success)
+{
+  g_mutex_lock (&mirrors_lock);
+
+  g_hash_table_remove (mirrors_busy, repo_location);
+  if (success)
+    g_hash_table_add (mirrors_done, g_strdup (key));
+
+  g_cond_broadcast (&mirrors_cond);
+  g_mutex_unlock (&mirrors_lock);
+}
+
 static char *
 git_get_current_commit (GFile          *repo_dir,
                         const char     *branch,
@@ -333,6 +383,131 @@ make_absolute (const char *orig_parent, const char *orig_relpath, GError **error
   return g_strconcat (parent, "/", relpath, NULL);
 }
 
+typedef struct
+{
+  char           *url;
+  char           *revision;
+  const char     *destination_path;
+  gboolean        shallow;
+  FlatpakGitMirrorFlags flags;
+  BuilderContext *context;
+  GError         *error;
+} SubmoduleJob;
+
+static void
+submodule_job_free (SubmoduleJob *job)
+{
+  g_free (job->url);
+  g_free (job->revision);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+submodule_job_thread (gpointer data,
+                      gpointer user_data)
+{
+  SubmoduleJob *job = data;
+
+  g_debug ("mirror submodule %s at revision %s\n", job->url, job->revision);
+  if (job->shallow)
+    builder_git_shallow_mirror_ref (job->url, job->destination_path, job->revision,
+                                    job->context, &job->error);
+  else
+    builder_git_mirror_repo (job->url, job->destination_path, job->flags, job->revision,
+                             job->context, &job->error);
+}
+
+/* The submodules of one repo. Whoever mirrors the repo works through
+   them, with the help of any idle threads of the shared pool. */
+typedef struct
+{
+  GPtrArray *jobs;
+  gint       next;
+  gint       failed;
+  guint      helpers;
+  GMutex     lock;
+  GCond      cond;
+} SubmoduleBatch;
+
+static void
+submodule_batch_run (SubmoduleBatch *batch)
+{
+  guint i;
+
+  while (!g_atomic_int_get (&batch->failed) &&
+         (i = g_atomic_int_add (&batch->next, 1)) < batch->jobs->len)
+    {
+      SubmoduleJob *job = g_ptr_array_index (batch->jobs, i);
+
+      submodule_job_thread (job, NULL);
+      if (job->error)
+        g_atomic_int_set (&batch->failed, TRUE);
+    }
+}
+
+static void
+submodule_batch_helper_thread (gpointer data,
+                               gpointer user_data)
+{
+  SubmoduleBatch *batch = data;
+
+  submodule_batch_run (batch);
+
+  g_mutex_lock (&batch->lock);
+  if (--batch->helpers == 0)
+    g_cond_signal (&batch->cond);
+  g_mutex_unlock (&batch->lock);
+}
+
+/* One pool of up to --download-jobs threads is shared by the
+   submodules of all repos, at any depth. As the thread that asks for a
+   batch also runs its jobs, a batch finishes even when every thread of
+   the pool is busy, so nested submodules can't deadlock the pool. */
+static GThreadPool *
+get_submodule_pool (BuilderContext *context)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    g_once_init_leave (&pool, (gsize) g_thread_pool_new (submodule_batch_helper_thread, NULL,
+                                                         MAX (builder_context_get_download_jobs (context) - 1, 1),
+                                                         FALSE, NULL));
+
+  return (GThreadPool *) pool;
+}
+
+static void
+submodule_batch_run_all (SubmoduleBatch *batch,
+                         BuilderContext *context)
+{
+  int max_jobs = MIN (builder_context_get_download_jobs (context), batch->jobs->len);
+  int i;
+
+  g_mutex_init (&batch->lock);
+  g_cond_init (&batch->cond);
+
+  if (max_jobs > 1)
+    {
+      GThreadPool *pool = get_submodule_pool (context);
+
+      batch->helpers = max_jobs - 1;
+      for (i = 0; i < max_jobs - 1; i++)
+        g_thread_pool_push (pool, batch, NULL);
+    }
+
+  submodule_batch_run (batch);
+
+  /* The helpers that start late just find no jobs left */
+  g_mutex_lock (&batch->lock);
+  while (batch->helpers > 0)
+    g_cond_wait (&batch->cond, &batch->lock);
+  g_mutex_unlock (&batch->lock);
+
+  g_cond_clear (&batch->cond);
+  g_mutex_clear (&batch->lock);
+}
+
 static gboolean
 git_mirror_submodules (const char     *repo_location,
                        const char     *destination_path,
@@ -348,7 +523,10 @@ git_mirror_submodules (const char     *repo_location,
   g_autofree gchar *submodule_data = NULL;
   g_autofree gchar **submodules = NULL;
   g_autofree gchar *gitmodules = g_strconcat (revision, ":.gitmodules", NULL);
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) submodule_job_free);
+  SubmoduleBatch batch = { jobs, };
   gsize num_submodules;
+  int i;
 
   /* The submodule update will fetch from this repo */
   flags |= FLATPAK_GIT_MIRROR_FLAGS_WILL_FETCH_FROM;
@@ -364,7 +542,6 @@ git_mirror_submodules (const char     *repo_location,
 
       submodules = g_key_file_get_groups (key_file, &num_submodules);
 
-      int i;
       for (i = 0; i < num_submodules; i++)
         {
           g_autofree gchar *submodule = NULL;
@@ -374,6 +551,7 @@ git_mirror_submodules (const char     *repo_location,
           g_autofree gchar *ls_tree = NULL;
           g_auto(GStrv) lines = NULL;
           g_auto(GStrv) words = NULL;
+          SubmoduleJob *job;
 
           submodule = submodules[i];
 
@@ -406,17 +584,27 @@ git_mirror_submodules (const char     *repo_location,
           if (g_strcmp0 (words[0], "160000") != 0)
             continue;
 
-          g_debug ("mirror submodule %s at revision %s\n", absolute_url, words[2]);
-          if (shallow)
-            {
-              if (!builder_git_shallow_mirror_ref (absolute_url, destination_path, words[2], context, error))
-                return FALSE;
-            }
-          else
-            {
-              if (!builder_git_mirror_repo (absolute_url, destination_path, flags, words[2], context, error))
-                return FALSE;
-            }
+          job = g_new0 (SubmoduleJob, 1);
+          job->url = g_steal_pointer (&absolute_url);
+          job->revision = g_strdup (words[2]);
+          job->destination_path = destination_path;
+          job->shallow = shallow;
+          job->flags = flags;
+          job->context = context;
+          g_ptr_array_add (jobs, job);
+        }
+    }
+
+  submodule_batch_run_all (&batch, context);
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      SubmoduleJob *job = g_ptr_array_index (jobs, i);
+
+      if (job->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&job->error));
+          return FALSE;
         }
     }
 
@@ -430,19 +618,19 @@ git_mirror_submodules (const char     *repo_location,
    If it is just a random commit id then we're forced to do
    a deep fetch of the entire remote repo.
 */
-gboolean
-builder_git_mirror_repo (const char     *repo_location,
-                         const char     *destination_path,
-                         FlatpakGitMirrorFlags flags,
-                         const char     *ref,
-                         BuilderContext *context,
-                         GError        **error)
+static gboolean
+git_mirror_repo (const char     *repo_location,
+                 const char     *destination_path,
+                 FlatpakGitMirrorFlags flags,
+                 const char     *ref,
+                 BuilderContext *context,
+                 GFile         **mirror_dir_out,
+                 GError        **error)
 {
   g_autoptr(GFile) cache_mirror_dir = NULL;
   g_autoptr(GFile) mirror_dir = NULL;
   g_autoptr(GFile) real_mirror_dir = NULL;
   g_autoptr(FlatpakTempDir) tmp_mirror_dir = NULL;
-  g_autofree char *current_commit = NULL;
   g_autoptr(GHashTable) refs = NULL;
   gboolean already_exists = FALSE;
   gboolean created = FALSE;
@@ -629,34 +817,64 @@ builder_git_mirror_repo (const char     *repo_location,
       mirror_dir = g_steal_pointer (&real_mirror_dir);
     }
 
-  if (flags & FLATPAK_GIT_MIRROR_FLAGS_MIRROR_SUBMODULES)
-    {
-      current_commit = git_get_current_commit (mirror_dir, ref, FALSE, context, error);
-      if (current_commit == NULL)
-        return FALSE;
-
-      if (!git_mirror_submodules (repo_location, destination_path, FALSE, flags,
-                                  mirror_dir, current_commit, context, error))
-        return FALSE;
-    }
+  /* Only set when the repo was fetched, so its submodules need to be too */
+  *mirror_dir_out = g_steal_pointer (&mirror_dir);
 
   return TRUE;
 }
 
+gboolean
+builder_git_mirror_repo (const char     *repo_location,
+                         const char     *destination_path,
+                         FlatpakGitMirrorFlags flags,
+                         const char     *ref,
+                         BuilderContext *context,
+                         GError        **error)
+{
+  g_autofree char *key = g_strdup_printf ("mirror %s %s %s %x", repo_location,
+                                          destination_path ? destination_path : "",
+                                          ref, flags);
+  g_autoptr(GFile) mirror_dir = NULL;
+  g_autofree char *current_commit = NULL;
+  gboolean res;
+
+  if (!git_mirror_begin (repo_location, key))
+    return TRUE;
+
+  res = git_mirror_repo (repo_location, destination_path, flags, ref, context,
+                         &mirror_dir, error);
+
+  /* A submodule may point back at this repo, so it is released before
+     mirroring those. Like everything fetched, they are only used after
+     all downloads finished. */
+  git_mirror_end (repo_location, key, res);
+
+  if (!res || mirror_dir == NULL ||
+      (flags & FLATPAK_GIT_MIRROR_FLAGS_MIRROR_SUBMODULES) == 0)
+    return res;
+
+  current_commit = git_get_current_commit (mirror_dir, ref, FALSE, context, error);
+  if (current_commit == NULL)
+    return FALSE;
+
+  return git_mirror_submodules (repo_location, destination_path, FALSE, flags,
+                                mirror_dir, current_commit, context, error);
+}
+
 /* In contrast with builder_git_mirror_repo this always does a shallow
    mirror. However, it only works for sources that are local, because
    it handles the case builder_git_mirror_repo fails at by creating refs
    in the source repo. */
-gboolean
-builder_git_shallow_mirror_ref (const char     *repo_location,
-                                const char     *destination_path,
-                                const char     *ref,
-                                BuilderContext *context,
-                                GError        **error)
+static gboolean
+git_shallow_mirror_ref (const char     *repo_location,
+                        const char     *destination_path,
+                        const char     *ref,
+                        BuilderContext *context,
+                        GFile         **mirror_dir_out,
+                        GError        **error)
 {
   g_autoptr(GFile) cache_mirror_dir = NULL;
   g_autoptr(GFile) mirror_dir = NULL;
-  g_autofree char *current_commit = NULL;
   g_autofree char *file_name = NULL;
   g_autofree char *destination_file_path = NULL;
   g_autofree char *full_ref = NULL;
@@ -705,17 +923,44 @@ builder_git_shallow_mirror_ref (const char     *repo_location,
             "fetch", "--depth", "1", "origin", full_ref_colon_full_ref, NULL))
     return FALSE;
 
-  /* Always mirror submodules */
-  current_commit = git_get_current_commit (mirror_dir, ref, FALSE, context, error);
-  if (current_commit == NULL)
+  *mirror_dir_out = g_steal_pointer (&mirror_dir);
+
+  return TRUE;
+}
+
+gboolean
+builder_git_shallow_mirror_ref (const char     *repo_location,
+                                const char     *destination_path,
+                                const char     *ref,
+                                BuilderContext *context,
+                                GError        **error)
+{
+  g_autofree char *key = g_strdup_printf ("shallow %s %s %s", repo_location,
+                                          destination_path, ref);
+  g_autoptr(GFile) mirror_dir = NULL;
+  g_autofree char *current_commit = NULL;
+  gboolean res;
+
+  if (!git_mirror_begin (repo_location, key))
+    return TRUE;
+
+  res = git_shallow_mirror_ref (repo_location, destination_path, ref, context,
+                                &mirror_dir, error);
+
+  /* As in builder_git_mirror_repo(), release the repo before its
+     submodules, which are always mirrored here */
+  git_mirror_end (repo_location, key, res);
+
+  if (!res)
     return FALSE;
 
-  if (!git_mirror_submodules (repo_location, destination_path, TRUE,
-                              FLATPAK_GIT_MIRROR_FLAGS_MIRROR_SUBMODULES | FLATPAK_GIT_MIRROR_FLAGS_DISABLE_FSCK,
-                              mirror_dir, current_commit, context, error))
+  current_commit = git_get_current_commit (mirror_dir, ref, FALSE, context, error);
+  if (current_commit == NULL)
     return FALSE;
 
-  return TRUE;
+  return git_mirror_submodules (repo_location, destination_path, TRUE,
+                                FLATPAK_GIT_MIRROR_FLAGS_MIRROR_SUBMODULES | FLATPAK_GIT_MIRROR_FLAGS_DISABLE_FSCK,
+                                mirror_dir, current_commit, context, error);
 }
 
 static gboolean
@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,14 +39,22 @@ static gboolean opt_verbose;
 static gboolean opt_version;
 static gboolean opt_run;
 static gboolean opt_disable_cache;
+static gboolean opt_content_cache;
+static char *opt_cache_url;
+static char *opt_push_cache;
+static char *opt_cache_max_size;
+static int opt_cache_max_age;
 static gboolean opt_disable_tests;
+static gboolean opt_reverify;
 static gboolean opt_disable_rofiles;
 static gboolean opt_download_only;
 static gboolean opt_no_shallow_clone;
 static gboolean opt_bundle_sources;
+static gboolean opt_cache_extracted_sources;
 static gboolean opt_build_only;
 static gboolean opt_finish_only;
 static gboolean opt_export_only;
+static gboolean opt_export_from_cache;
 static gboolean opt_show_deps;
 static gboolean opt_disable_download;
 static gboolean opt_disable_updates;
@@ -77,6 +86,11 @@ static char **opt_sources_urls;
 static char **opt_add_tags;
 static char **opt_remove_tags;
 static int opt_jobs;
+static int opt_module_jobs;
+static int opt_download_jobs;
+static int opt_download_jobs_per_host;
+static gboolean opt_profile;
+static gboolean opt_persistent_sandbox;
 static char *opt_mirror_screenshots_url;
 static char *opt_install_deps_from;
 static gboolean opt_install_deps_only;
@@ -96,12 +110,19 @@ static GOptionEntry entries[] = {
   { "run", 0, 0, G_OPTION_ARG_NONE, &opt_run, "Run a command in the build directory (see --run --help)", NULL },
   { "ccache", 0, 0, G_OPTION_ARG_NONE, &opt_ccache, "Use ccache", NULL },
   { "disable-cache", 0, 0, G_OPTION_ARG_NONE, &opt_disable_cache, "Disable cache lookups", NULL },
+  { "content-cache", 0, 0, G_OPTION_ARG_NONE, &opt_content_cache, "Cache modules with dependencies independently of other modules", NULL },
+  { "cache-url", 0, 0, G_OPTION_ARG_STRING, &opt_cache_url, "Look up stages that are not in the local cache in this shared cache repo", "URL" },
+  { "push-cache", 0, 0, G_OPTION_ARG_STRING, &opt_push_cache, "Publish newly built stages to this shared cache repo", "DIR" },
+  { "cache-max-size", 0, 0, G_OPTION_ARG_STRING, &opt_cache_max_size, "Remove the least recently used builds from the cache to keep it below this size", "SIZE" },
+  { "cache-max-age", 0, 0, G_OPTION_ARG_INT, &opt_cache_max_age, "Remove builds that were not used in this many days from the cache", "DAYS" },
   { "disable-tests", 0, 0, G_OPTION_ARG_NONE, &opt_disable_tests, "Don't run tests", NULL },
+  { "reverify", 0, 0, G_OPTION_ARG_NONE, &opt_reverify, "Verify the checksums of all downloaded and local files again", NULL },
   { "disable-rofiles-fuse", 0, 0, G_OPTION_ARG_NONE, &opt_disable_rofiles, "Disable rofiles-fuse use", NULL },
   { "disable-download", 0, 0, G_OPTION_ARG_NONE, &opt_disable_download, "Don't download any new sources", NULL },
   { "disable-updates", 0, 0, G_OPTION_ARG_NONE, &opt_disable_updates, "Only download missing sources, never update to latest vcs version", NULL },
   { "download-only", 0, 0, G_OPTION_ARG_NONE, &opt_download_only, "Only download sources, don't build", NULL },
   { "bundle-sources", 0, 0, G_OPTION_ARG_NONE, &opt_bundle_sources, "Bundle module sources as runtime", NULL },
+  { "cache-extracted-sources", 0, 0, G_OPTION_ARG_NONE, &opt_cache_extracted_sources, "Keep extracted and patched sources to reuse when rebuilding", NULL },
   { "extra-sources", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_sources_dirs, "Add a directory of sources specified by SOURCE-DIR, multiple uses of this option possible", "SOURCE-DIR"},
   { "extra-sources-url", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_sources_urls, "Add a url of sources specified by SOURCE-URL multiple uses of this option possible", "SOURCE-URL"},
   { "build-only", 0, 0, G_OPTION_ARG_NONE, &opt_build_only, "Stop after build, don't run clean and finish phases", NULL },
@@ -113,6 +134,7 @@ static GOptionEntry entries[] = {
   { "keep-build-dirs", 0, 0, G_OPTION_ARG_NONE, &opt_keep_build_dirs, "Don't remove build directories after install", NULL },
   { "delete-build-dirs", 0, 0, G_OPTION_ARG_NONE, &opt_delete_build_dirs, "Always remove build directories, even after build failure", NULL },
   { "repo", 0, 0, G_OPTION_ARG_STRING, &opt_repo, "Repo to export into", "DIR"},
+  { "export-from-cache", 0, 0, G_OPTION_ARG_NONE, &opt_export_from_cache, "Export the app from the build cache instead of re-reading the app dir", NULL },
   { "subject", 's', 0, G_OPTION_ARG_STRING, &opt_subject, "One line subject (passed to build-export)", "SUBJECT" },
   { "body", 'b', 0, G_OPTION_ARG_STRING, &opt_body, "Full description (passed to build-export)", "BODY" },
   { "collection-id", 0, 0, G_OPTION_ARG_STRING, &opt_collection_id, "Collection ID (passed to build-export)", "COLLECTION-ID" },
@@ -122,6 +144,11 @@ static GOptionEntry entries[] = {
   { "sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_sandboxed, "Enforce sandboxing, disabling build-args", NULL },
   { "stop-at", 0, 0, G_OPTION_ARG_STRING, &opt_stop_at, "Stop building at this module (implies --build-only)", "MODULENAME"},
   { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, "Number of parallel jobs to build (default=NCPU)", "JOBS"},
+  { "module-jobs", 0, 0, G_OPTION_ARG_INT, &opt_module_jobs, "Number of modules to build at the same time (default=1)", "JOBS"},
+  { "download-jobs", 0, 0, G_OPTION_ARG_INT, &opt_download_jobs, "Number of files to download at the same time (default=4)", "JOBS"},
+  { "download-jobs-per-host", 0, 0, G_OPTION_ARG_INT, &opt_download_jobs_per_host, "Number of files to download from the same host at the same time (default=4)", "JOBS"},
+  { "profile", 0, 0, G_OPTION_ARG_NONE, &opt_profile, "Write the time and resources used by each build phase to profile.json in the state dir", NULL },
+  { "persistent-sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_persistent_sandbox, "Run all the build commands of a module in the same sandbox", NULL },
   { "rebuild-on-sdk-change", 0, 0, G_OPTION_ARG_NONE, &opt_rebuild_on_sdk_change, "Rebuild if sdk changes", NULL },
   { "skip-if-unchanged", 0, 0, G_OPTION_ARG_NONE, &opt_skip_if_unchanged, "Don't do anything if the json didn't change", NULL },
   { "build-shell", 0, 0, G_OPTION_ARG_STRING, &opt_build_shell, "Extract and prepare sources for module, then start build shell", "MODULENAME"},
@@ -180,12 +207,160 @@ usage (GOptionContext *context, const char *message)
   return 1;
 }
 
+/* Parses a size in bytes, with an optional K, M, G or T suffix */
+static gboolean
+parse_size (const char *str,
+            guint64    *size_out)
+{
+  char *end;
+  guint64 size;
+  guint64 unit = 1;
+
+  /* strtoull() would silently negate a minus sign */
+  if (!g_ascii_isdigit (*str))
+    return FALSE;
+
+  errno = 0;
+  size = g_ascii_strtoull (str, &end, 10);
+  if (end == str || errno == ERANGE)
+    return FALSE;
+
+  switch (g_ascii_toupper (*end))
+    {
+    case 'T':
+      unit *= 1024;
+      /* fallthrough */
+    case 'G':
+      unit *= 1024;
+      /* fallthrough */
+    case 'M':
+      unit *= 1024;
+      /* fallthrough */
+    case 'K':
+      unit *= 1024;
+      end++;
+      break;
+
+    case 0:
+      break;
+
+    default:
+      return FALSE;
+    }
+
+  if (*end != 0 || size > G_MAXUINT64 / unit)
+    return FALSE;
+
+  size *= unit;
+  *size_out = size;
+  return TRUE;
+}
+
 static const char skip_arg[] = "skip";
 
+/* Waits for the oldest running export in @exports and removes it */
+static gboolean
+wait_for_export (GPtrArray *exports,
+                 GError   **error)
+{
+  g_autoptr(GSubprocess) subp = NULL;
+
+  subp = g_object_ref (g_ptr_array_index (exports, 0));
+  g_ptr_array_remove_index (exports, 0);
+
+  if (!g_subprocess_wait_check (subp, NULL, error))
+    {
+      g_prefix_error (error, "%s: ", (char *) g_object_get_data (G_OBJECT (subp), "export-ref"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Waits for all running exports, even if one of them fails, so that
+   we never leave build-export processes behind us. The first error is
+   reported. */
+static gboolean
+wait_for_exports (GPtrArray *exports,
+                  GError   **error)
+{
+  g_autoptr(GError) first_error = NULL;
+
+  while (exports->len > 0)
+    {
+      g_autoptr(GError) my_error = NULL;
+
+      if (!wait_for_export (exports, &my_error) && first_error == NULL)
+        first_error = g_steal_pointer (&my_error);
+    }
+
+  if (first_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&first_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Reports a failed export and returns the exit status for main(),
+   after waiting for the exports that are still running */
+static int
+export_failed (GPtrArray *exports,
+               GError    *error)
+{
+  g_printerr ("Export failed: %s\n", error->message);
+  if (exports)
+    wait_for_exports (exports, NULL);
+  return 1;
+}
+
+/* Concurrent exports skip the summary update, as those would race each
+   other. Instead we regenerate (and sign) the summary once they are all done. */
+static gboolean
+update_export_summary (const gchar *location,
+                       GError     **error)
+{
+  int i;
+
+  g_autoptr(GPtrArray) args = NULL;
+  g_autoptr(GSubprocess) subp = NULL;
+
+  args = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (args, g_strdup ("flatpak"));
+  g_ptr_array_add (args, g_strdup ("build-update-repo"));
+  g_ptr_array_add (args, g_strdup ("--no-update-appstream"));
+
+  if (opt_gpg_homedir)
+    g_ptr_array_add (args, g_strdup_printf ("--gpg-homedir=%s", opt_gpg_homedir));
+
+  for (i = 0; opt_key_ids != NULL && opt_key_ids[i] != NULL; i++)
+    g_ptr_array_add (args, g_strdup_printf ("--gpg-sign=%s", opt_key_ids[i]));
+
+  g_ptr_array_add (args, g_strdup (location));
+
+  g_ptr_array_add (args, NULL);
+
+  subp =
+    g_subprocess_newv ((const gchar * const *) args->pdata,
+                       G_SUBPROCESS_FLAGS_NONE,
+                       error);
+
+  if (subp == NULL ||
+      !g_subprocess_wait_check (subp, NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* If @exports is non-NULL the export runs in the background and is
+   appended to it, otherwise this waits for the export to finish. */
 static gboolean
 do_export (BuilderContext *build_context,
            GError        **error,
+           GPtrArray      *exports,
            gboolean        runtime,
+           const gchar    *id,
            const gchar    *location,
            const gchar    *directory,
            char          **exclude_dirs,
@@ -199,6 +374,9 @@ do_export (BuilderContext *build_context,
 
   g_autoptr(GPtrArray) args = NULL;
   g_autoptr(GSubprocess) subp = NULL;
+  g_autofree char *ref = g_strdup_printf ("%s/%s/%s", id,
+                                          builder_context_get_arch (build_context),
+                                          branch);
 
   args = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (args, g_strdup ("flatpak"));
@@ -224,6 +402,9 @@ do_export (BuilderContext *build_context,
   if (collection_id)
     g_ptr_array_add (args, g_strdup_printf ("--collection-id=%s", collection_id));
 
+  if (exports)
+    g_ptr_array_add (args, g_strdup ("--no-update-summary"));
+
   /* Additional flags. */
   va_start (ap, collection_id);
   while ((arg = va_arg (ap, const gchar *)))
@@ -244,15 +425,152 @@ do_export (BuilderContext *build_context,
 
   g_ptr_array_add (args, NULL);
 
+  /* Keep at most one export per cpu running, they are mostly busy
+     checksumming and compressing */
+  while (exports && exports->len >= MAX (builder_context_get_jobs (build_context), 1))
+    {
+      if (!wait_for_export (exports, error))
+        return FALSE;
+    }
+
   subp =
     g_subprocess_newv ((const gchar * const *) args->pdata,
                        G_SUBPROCESS_FLAGS_NONE,
                        error);
 
-  if (subp == NULL ||
-      !g_subprocess_wait_check (subp, NULL, error))
+  if (subp == NULL)
+    {
+      g_prefix_error (error, "%s: ", ref);
+      return FALSE;
+    }
+
+  if (exports)
+    {
+      g_object_set_data_full (G_OBJECT (subp), "export-ref", g_steal_pointer (&ref), g_free);
+      g_ptr_array_add (exports, g_steal_pointer (&subp));
+      return TRUE;
+    }
+
+  if (!g_subprocess_wait_check (subp, NULL, error))
+    {
+      g_prefix_error (error, "%s: ", ref);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The checks flatpak build-export does on the exported files: they
+   all have to be prefixed by the app id, and desktop files have to
+   pass desktop-file-validate */
+static gboolean
+validate_exports (GFile      *dir,
+                  const char *app_id,
+                  GError    **error)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GError) my_error = NULL;
+  GFileInfo *next;
+
+  dir_enum = g_file_enumerate_children (dir, "standard::name,standard::type",
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        NULL, &my_error);
+  if (dir_enum == NULL)
+    {
+      if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  while ((next = g_file_enumerator_next_file (dir_enum, NULL, &my_error)))
+    {
+      g_autoptr(GFileInfo) child_info = next;
+      const char *name = g_file_info_get_name (child_info);
+      g_autoptr(GFile) child = g_file_get_child (dir, name);
+      const char *path = flatpak_file_get_path_cached (child);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!validate_exports (child, app_id, error))
+            return FALSE;
+          continue;
+        }
+
+      if (!flatpak_has_name_prefix (name, app_id))
+        return flatpak_fail (error, "Non-prefixed filename %s in exported directory", path);
+
+      if (g_str_has_suffix (name, ".desktop") &&
+          g_str_has_suffix (flatpak_file_get_path_cached (dir), "/share/applications"))
+        {
+          const char *argv[] = { "desktop-file-validate", path, NULL };
+          g_autoptr(GError) validate_error = NULL;
+
+          if (!flatpak_spawnv (NULL, NULL, 0, &validate_error, argv))
+            {
+              if (!g_error_matches (validate_error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT))
+                return flatpak_fail (error, "Failed to validate desktop file %s: %s",
+                                     path, validate_error->message);
+
+              g_print ("Warning: desktop-file-validate not installed, not validating %s\n", name);
+            }
+        }
+    }
+
+  if (my_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Exports the main app ref straight from the cache repo, with the
+   same filters and checks as the build-export call in main() */
+static gboolean
+do_export_from_cache (BuilderContext  *build_context,
+                      BuilderCache    *cache,
+                      BuilderManifest *manifest,
+                      GFile           *app_dir,
+                      GFile           *export_repo,
+                      char           **exclude_dirs,
+                      GError         **error)
+{
+  g_autoptr(GPtrArray) excludes = g_ptr_array_new_with_free_func (g_free);
+  const char *includes[] = { "/lib/debug/app", NULL };
+  g_autoptr(GFile) export_dir = g_file_get_child (app_dir, "export");
+  g_autofree char *ref = NULL;
+  int i;
+
+  if (!validate_exports (export_dir, builder_manifest_get_id (manifest), error))
     return FALSE;
 
+  g_ptr_array_add (excludes, g_strdup ("/lib/debug/*"));
+  if (builder_context_get_separate_locales (build_context))
+    g_ptr_array_add (excludes, g_strdup ("/share/runtime/locale/*/*"));
+  for (i = 0; exclude_dirs != NULL && exclude_dirs[i] != NULL; i++)
+    g_ptr_array_add (excludes, g_strdup_printf ("/%s/*", exclude_dirs[i]));
+  g_ptr_array_add (excludes, NULL);
+
+  ref = flatpak_build_app_ref (builder_manifest_get_id (manifest),
+                               builder_manifest_get_branch (manifest, build_context),
+                               builder_context_get_arch (build_context));
+
+  if (!builder_cache_export (cache, export_repo, ref,
+                             builder_manifest_get_collection_id (manifest),
+                             "files",
+                             (const char **) excludes->pdata,
+                             includes,
+                             opt_subject, opt_body,
+                             (const char **) opt_key_ids, opt_gpg_homedir,
+                             error))
+    {
+      g_prefix_error (error, "%s: ", ref);
+      return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -424,6 +742,7 @@ main (int    argc,
   g_autoptr(BuilderContext) build_context = NULL;
   g_autoptr(GFile) base_dir = NULL;
   g_autoptr(GFile) manifest_file = NULL;
+  g_autoptr(GFile) parse_cache_dir = NULL;
   g_autoptr(GFile) app_dir = NULL;
   g_autoptr(BuilderCache) cache = NULL;
   g_autofree char *cache_branch = NULL;
@@ -552,13 +871,34 @@ main (int    argc,
 
   builder_context_set_use_rofiles (build_context, !opt_disable_rofiles);
   builder_context_set_run_tests (build_context, !opt_disable_tests);
+  builder_context_set_reverify (build_context, opt_reverify);
   builder_context_set_no_shallow_clone (build_context, opt_no_shallow_clone);
   builder_context_set_keep_build_dirs (build_context, opt_keep_build_dirs);
   builder_context_set_delete_build_dirs (build_context, opt_delete_build_dirs);
   builder_context_set_sandboxed (build_context, opt_sandboxed);
   builder_context_set_jobs (build_context, opt_jobs);
+  builder_context_set_module_jobs (build_context, opt_module_jobs);
+  builder_context_set_download_jobs (build_context, opt_download_jobs);
+  builder_context_set_download_jobs_per_host (build_context, opt_download_jobs_per_host);
+  builder_context_set_content_cache (build_context, opt_content_cache);
+  builder_context_set_cache_url (build_context, opt_cache_url);
+  builder_context_set_push_cache_url (build_context, opt_push_cache);
+  builder_context_set_cache_max_age (build_context, opt_cache_max_age);
+  builder_context_set_profile (build_context, opt_profile);
+  builder_context_set_persistent_sandbox (build_context, opt_persistent_sandbox);
   builder_context_set_rebuild_on_sdk_change (build_context, opt_rebuild_on_sdk_change);
   builder_context_set_bundle_sources (build_context, opt_bundle_sources);
+  builder_context_set_cache_extracted_sources (build_context, opt_cache_extracted_sources);
+
+  if (opt_cache_max_size)
+    {
+      guint64 max_size;
+
+      if (!parse_size (opt_cache_max_size, &max_size))
+        return usage (context, "Invalid --cache-max-size");
+
+      builder_context_set_cache_max_size (build_context, max_size);
+    }
 
   git_init_email ();
 
@@ -681,11 +1021,14 @@ main (int    argc,
 
   /* Can't push this as user data to the demarshalling :/ */
   builder_manifest_set_demarshal_base_dir (builder_context_get_base_dir (build_context));
+  parse_cache_dir = g_file_get_child (builder_context_get_state_dir (build_context), "parse-cache");
+  builder_set_parse_cache_dir (parse_cache_dir);
 
   manifest = (BuilderManifest *) builder_gobject_from_data (BUILDER_TYPE_MANIFEST, manifest_rel_path,
                                                             manifest_contents, &error);
 
   builder_manifest_set_demarshal_base_dir (NULL);
+  builder_set_parse_cache_dir (NULL);
 
   if (manifest == NULL)
     {
@@ -879,11 +1222,16 @@ main (int    argc,
 
   if (!opt_finish_only && !opt_export_only)
     {
-      if (!builder_cache_lookup (cache, "init"))
+      if (!builder_cache_lookup (cache, "init", &error))
         {
           g_autofree char *body =
             g_strdup_printf ("Initialized %s\n",
                              builder_manifest_get_id (manifest));
+          if (error != NULL)
+            {
+              g_printerr ("Error: %s\n", error->message);
+              return 1;
+            }
           if (!builder_manifest_init_app_dir (manifest, cache, build_context, &error))
             {
               g_printerr ("Error: %s\n", error->message);
@@ -1007,18 +1355,47 @@ main (int    argc,
       g_autoptr(GFile) debuginfo_metadata = NULL;
       g_autoptr(GFile) sourcesinfo_metadata = NULL;
       g_auto(GStrv) exclude_dirs = builder_manifest_get_exclude_dirs (manifest);
+      g_autoptr(GPtrArray) exports = NULL;
+      g_autoptr(BuilderProfileSpan) span = NULL;
+      gboolean exported_from_cache = FALSE;
       GList *l;
 
+      span = builder_context_profile_begin (build_context, builder_manifest_get_id (manifest), "export");
+
       if (opt_repo)
         export_repo = g_file_new_for_path (opt_repo);
       else if (opt_install)
         export_repo = g_object_ref (builder_context_get_cache_dir (build_context));
 
+      /* Older versions lack build-update-repo --no-update-appstream,
+         which we need to update the summary after concurrent exports */
+      if (flatpak_version_check (1, 0, 0))
+        exports = g_ptr_array_new_with_free_func (g_object_unref);
+
       g_print ("Exporting %s to repo\n", builder_manifest_get_id (manifest));
       builder_set_term_title (_("Exporting to repository"));
 
-      if (!do_export (build_context, &error,
-                      FALSE,
+      /* This relies on the summary being updated after the concurrent
+         exports. Mirroring screenshots changes the app dir after the
+         last cached stage, and runtimes are laid out differently. */
+      if (opt_export_from_cache && exports != NULL &&
+          opt_mirror_screenshots_url == NULL &&
+          !builder_context_get_build_runtime (build_context))
+        {
+          g_autoptr(GError) my_error = NULL;
+
+          if (do_export_from_cache (build_context, cache, manifest, app_dir,
+                                    export_repo, exclude_dirs, &my_error))
+            exported_from_cache = TRUE;
+          else if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+            g_print ("Can't export from cache, using build-export: %s\n", my_error->message);
+          else
+            return export_failed (exports, my_error);
+        }
+
+      if (!exported_from_cache &&
+          !do_export (build_context, &error, exports,
+                      FALSE, builder_manifest_get_id (manifest),
                       flatpak_file_get_path_cached (export_repo),
                       app_dir_path, exclude_dirs, builder_manifest_get_branch (manifest, build_context),
                       builder_manifest_get_collection_id (manifest),
@@ -1026,10 +1403,7 @@ main (int    argc,
                       "--include=/lib/debug/app",
                       builder_context_get_separate_locales (build_context) ? "--exclude=/share/runtime/locale/*/*" : skip_arg,
                       NULL))
-        {
-          g_printerr ("Export failed: %s\n", error->message);
-          return 1;
-        }
+        return export_failed (exports, error);
 
       /* Export regular locale extensions */
       dir_enum = g_file_enumerate_children (app_dir, "standard::name,standard::type",
@@ -1052,17 +1426,14 @@ main (int    argc,
           metadata_arg = g_strdup_printf ("--metadata=%s", name);
           files_arg = g_strconcat (builder_context_get_build_runtime (build_context) ? "--files=usr" : "--files=files",
                                    "/share/runtime/locale/", NULL);
-          if (!do_export (build_context, &error, TRUE,
+          if (!do_export (build_context, &error, exports, TRUE, locale_id,
                           flatpak_file_get_path_cached (export_repo),
                           app_dir_path, NULL, builder_manifest_get_branch (manifest, build_context),
                           builder_manifest_get_collection_id (manifest),
                           metadata_arg,
                           files_arg,
                           NULL))
-            {
-              g_printerr ("Export failed: %s\n", error->message);
-              return 1;
-            }
+            return export_failed (exports, error);
         }
 
       /* Export debug extensions */
@@ -1072,17 +1443,14 @@ main (int    argc,
           g_autofree char *debug_id = builder_manifest_get_debug_id (manifest);
           g_print ("Exporting %s to repo\n", debug_id);
 
-          if (!do_export (build_context, &error, TRUE,
+          if (!do_export (build_context, &error, exports, TRUE, debug_id,
                           flatpak_file_get_path_cached (export_repo),
                           app_dir_path, NULL, builder_manifest_get_branch (manifest, build_context),
                           builder_manifest_get_collection_id (manifest),
                           "--metadata=metadata.debuginfo",
                           builder_context_get_build_runtime (build_context) ? "--files=usr/lib/debug" : "--files=files/lib/debug",
                           NULL))
-            {
-              g_printerr ("Export failed: %s\n", error->message);
-              return 1;
-            }
+            return export_failed (exports, error);
         }
 
       for (l = builder_manifest_get_add_extensions (manifest); l != NULL; l = l->next)
@@ -1103,16 +1471,13 @@ main (int    argc,
                                        builder_context_get_build_runtime (build_context) ? "usr" : "files",
                                        builder_extension_get_directory (e));
 
-          if (!do_export (build_context, &error, TRUE,
+          if (!do_export (build_context, &error, exports, TRUE, extension_id,
                           flatpak_file_get_path_cached (export_repo),
                           app_dir_path, NULL, builder_manifest_get_branch (manifest, build_context),
                           builder_manifest_get_collection_id (manifest),
                           metadata_arg, files_arg,
                           NULL))
-            {
-              g_printerr ("Export failed: %s\n", error->message);
-              return 1;
-            }
+            return export_failed (exports, error);
         }
 
       /* Export sources extensions */
@@ -1122,17 +1487,14 @@ main (int    argc,
           g_autofree char *sources_id = builder_manifest_get_sources_id (manifest);
           g_print ("Exporting %s to repo\n", sources_id);
 
-          if (!do_export (build_context, &error, TRUE,
+          if (!do_export (build_context, &error, exports, TRUE, sources_id,
                           flatpak_file_get_path_cached (export_repo),
                           app_dir_path, NULL, builder_manifest_get_branch (manifest, build_context),
                           builder_manifest_get_collection_id (manifest),
                           "--metadata=metadata.sources",
                           "--files=sources",
                           NULL))
-            {
-              g_printerr ("Export failed: %s\n", error->message);
-              return 1;
-            }
+            return export_failed (exports, error);
         }
 
       /* Export platform */
@@ -1142,7 +1504,7 @@ main (int    argc,
         {
           g_print ("Exporting %s to repo\n", platform_id);
 
-          if (!do_export (build_context, &error, TRUE,
+          if (!do_export (build_context, &error, exports, TRUE, platform_id,
                           flatpak_file_get_path_cached (export_repo),
                           app_dir_path, NULL, builder_manifest_get_branch (manifest, build_context),
                           builder_manifest_get_collection_id (manifest),
@@ -1150,10 +1512,7 @@ main (int    argc,
                           "--files=platform",
                           builder_context_get_separate_locales (build_context) ? "--exclude=/share/runtime/locale/*/*" : skip_arg,
                           NULL))
-            {
-              g_printerr ("Export failed: %s\n", error->message);
-              return 1;
-            }
+            return export_failed (exports, error);
         }
 
       /* Export platform locales */
@@ -1176,15 +1535,24 @@ main (int    argc,
 
           metadata_arg = g_strdup_printf ("--metadata=%s", name);
           files_arg = g_strconcat ("--files=platform/share/runtime/locale/", NULL);
-          if (!do_export (build_context, &error, TRUE,
+          if (!do_export (build_context, &error, exports, TRUE, locale_id,
                           flatpak_file_get_path_cached (export_repo),
                           app_dir_path, NULL, builder_manifest_get_branch (manifest, build_context),
                           builder_manifest_get_collection_id (manifest),
                           metadata_arg,
                           files_arg,
                           NULL))
+            return export_failed (exports, error);
+        }
+
+      if (exports)
+        {
+          if (!wait_for_exports (exports, &error))
+            return export_failed (exports, error);
+
+          if (!update_export_summary (flatpak_file_get_path_cached (export_repo), &error))
             {
-              g_printerr ("Export failed: %s\n", error->message);
+              g_printerr ("Updating repo summary failed: %s\n", error->message);
               return 1;
             }
         }
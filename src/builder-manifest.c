@@ -33,6 +33,9 @@
 #include "builder-flatpak-utils.h"
 #include "builder-post-process.h"
 #include "builder-extension.h"
+#include "builder-source-archive.h"
+#include "builder-source-file.h"
+#include "builder-source-git.h"
 
 #include <libxml/parser.h>
 
@@ -1477,6 +1480,79 @@ builder_manifest_get_base_version (BuilderManifest *self)
   return self->base_version ? self->base_version : builder_manifest_get_branch (self, NULL);
 }
 
+/* The output of a flatpak info command line, or the error it failed
+   with */
+typedef struct
+{
+  char   *output;
+  GError *error;
+} FlatpakInfoResult;
+
+static void
+flatpak_info_result_free (FlatpakInfoResult *result)
+{
+  g_free (result->output);
+  g_clear_error (&result->error);
+  g_free (result);
+}
+
+/* Command line => FlatpakInfoResult. The installed refs don't change
+   during a run, except when we install dependencies, so each info is
+   looked up only once. The lock is held while running flatpak, so a
+   caller on another thread waits for a lookup in progress rather than
+   repeating it. */
+static GHashTable *flatpak_info_cache = NULL;
+G_LOCK_DEFINE_STATIC (flatpak_info_cache);
+
+/* Must be called whenever refs are installed or updated */
+static void
+flatpak_info_cache_clear (void)
+{
+  AUTOLOCK (flatpak_info_cache);
+
+  if (flatpak_info_cache)
+    g_hash_table_remove_all (flatpak_info_cache);
+}
+
+static char *
+flatpak_info_spawnv (GSubprocessFlags    flags,
+                     const gchar * const *argv,
+                     GError            **error)
+{
+  AUTOLOCK (flatpak_info_cache);
+  g_autofree char *commandline = NULL;
+  FlatpakInfoResult *result;
+
+  if (flatpak_info_cache == NULL)
+    flatpak_info_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify) flatpak_info_result_free);
+
+  commandline = g_strjoinv (" ", (char **) argv);
+  result = g_hash_table_lookup (flatpak_info_cache, commandline);
+  if (result == NULL)
+    {
+      result = g_new0 (FlatpakInfoResult, 1);
+      if (builder_maybe_host_spawnv (NULL, &result->output, flags, &result->error, argv))
+        g_strchomp (result->output);
+      else
+        {
+          g_clear_pointer (&result->output, g_free);
+          if (result->error == NULL)
+            flatpak_fail (&result->error, "running `%s` failed", commandline);
+        }
+
+      g_hash_table_insert (flatpak_info_cache, g_steal_pointer (&commandline), result);
+    }
+
+  if (result->error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (result->error));
+      return NULL;
+    }
+
+  return g_strdup (result->output);
+}
+
 G_GNUC_NULL_TERMINATED
 static char *
 flatpak (GError **error,
@@ -1498,6 +1574,9 @@ flatpak (GError **error,
     }
   va_end (ap);
 
+  if (strcmp (g_ptr_array_index (ar, 1), "info") == 0)
+    return flatpak_info_spawnv (0, (const gchar * const *)ar->pdata, error);
+
   res = builder_maybe_host_spawnv (NULL, &output, 0, error,
                                    (const gchar * const *)ar->pdata);
 
@@ -1530,8 +1609,6 @@ flatpak_info (gboolean opt_user,
               const char *extra_arg,
               GError **error)
 {
-  gboolean res;
-  g_autofree char *output = NULL;
   g_autoptr(GPtrArray) args = NULL;
 
   args = g_ptr_array_new_with_free_func (g_free);
@@ -1543,14 +1620,8 @@ flatpak_info (gboolean opt_user,
   g_ptr_array_add (args, g_strdup (ref));
   g_ptr_array_add (args, NULL);
 
-  res = builder_maybe_host_spawnv (NULL, &output, G_SUBPROCESS_FLAGS_STDERR_SILENCE, error, (const char * const *)args->pdata);
-
-  if (res)
-    {
-      g_strchomp (output);
-      return g_steal_pointer (&output);
-    }
-  return NULL;
+  return flatpak_info_spawnv (G_SUBPROCESS_FLAGS_STDERR_SILENCE,
+                              (const char * const *)args->pdata, error);
 }
 
 static char *
@@ -1915,6 +1986,67 @@ builder_manifest_checksum_for_platform (BuilderManifest *self,
     }
 }
 
+typedef struct
+{
+  BuilderModule  *module;
+  BuilderSource  *source;
+  BuilderContext *context;
+  gboolean        update_vcs;
+  GError         *error;
+} DownloadJob;
+
+static void
+download_job_free (DownloadJob *job)
+{
+  g_object_unref (job->module);
+  g_object_unref (job->source);
+  g_object_unref (job->context);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+download_job_thread (gpointer data,
+                     gpointer user_data)
+{
+  DownloadJob *job = data;
+  g_autoptr(BuilderProfileSpan) span = NULL;
+
+  span = builder_context_profile_begin (job->context, builder_module_get_name (job->module), "download");
+
+  if (!builder_source_download (job->source, job->update_vcs, job->context, &job->error))
+    g_prefix_error (&job->error, "module %s: ", builder_module_get_name (job->module));
+}
+
+static char *
+serialize_source (BuilderSource *source)
+{
+  JsonNode *node;
+  JsonGenerator *generator;
+  char *json;
+
+  node = builder_source_to_json (source);
+  generator = json_generator_new ();
+  json_generator_set_root (generator, node);
+  json = json_generator_to_data (generator, NULL);
+  g_object_unref (generator);
+  json_node_free (node);
+
+  return json;
+}
+
+/* Archive and file sources are plain http downloads into a file of
+ * their own, and builder-git.c serializes the updates of each mirror
+ * repo, so these are downloaded on the thread pool. The other vcs
+ * sources are fetched in order on this thread. */
+static gboolean
+source_downloads_in_parallel (BuilderSource *source)
+{
+  return BUILDER_IS_SOURCE_ARCHIVE (source) ||
+         BUILDER_IS_SOURCE_FILE (source) ||
+         BUILDER_IS_SOURCE_GIT (source);
+}
+
 gboolean
 builder_manifest_download (BuilderManifest *self,
                            gboolean         update_vcs,
@@ -1923,82 +2055,721 @@ builder_manifest_download (BuilderManifest *self,
                            GError         **error)
 {
   const char *stop_at = builder_context_get_stop_at (context);
-  GList *l;
+  int max_downloads = builder_context_get_download_jobs (context);
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) download_job_free);
+  g_autoptr(GHashTable) queued = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GError) first_error = NULL;
+  g_autoptr(GError) my_error = NULL;
+  GThreadPool *pool = NULL;
+  GList *l, *s;
+  int i;
+
+  if (max_downloads > 1)
+    pool = g_thread_pool_new (download_job_thread, NULL, max_downloads, FALSE, NULL);
 
   g_print ("Downloading sources\n");
+  for (l = self->expanded_modules; first_error == NULL && l != NULL; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      const char *name = builder_module_get_name (m);
+
+      if (only_module && strcmp (name, only_module) != 0)
+        continue;
+
+      if (stop_at != NULL && strcmp (name, stop_at) == 0)
+        {
+          g_print ("Stopping at module %s\n", stop_at);
+          break;
+        }
+
+      if (pool == NULL)
+        {
+          g_autoptr(BuilderProfileSpan) span = NULL;
+
+          span = builder_context_profile_begin (context, name, "download");
+          if (!builder_module_download_sources (m, update_vcs, context, &first_error))
+            break;
+          continue;
+        }
+
+      for (s = builder_module_get_sources (m); s != NULL; s = s->next)
+        {
+          BuilderSource *source = s->data;
+          DownloadJob *job;
+          char *key;
+
+          if (!builder_source_is_enabled (source, context))
+            continue;
+
+          if (!source_downloads_in_parallel (source))
+            {
+              g_autoptr(BuilderProfileSpan) span = NULL;
+
+              builder_set_term_title (_("Downloading %s"), name);
+
+              span = builder_context_profile_begin (context, name, "download");
+
+              if (!builder_source_download (source, update_vcs, context, &first_error))
+                {
+                  g_prefix_error (&first_error, "module %s: ", name);
+                  break;
+                }
+              continue;
+            }
+
+          /* The same source may be used by several modules, which
+             only needs to be downloaded once */
+          key = serialize_source (source);
+          if (!g_hash_table_add (queued, key))
+            continue;
+
+          job = g_new0 (DownloadJob, 1);
+          job->module = g_object_ref (m);
+          job->source = g_object_ref (source);
+          job->context = g_object_ref (context);
+          job->update_vcs = update_vcs;
+          g_ptr_array_add (jobs, job);
+          g_thread_pool_push (pool, job, NULL);
+        }
+    }
+
+  /* On failure drop the downloads that haven't started yet. The running
+     ones can't be cancelled, so wait for them; anything they don't get
+     to finish is kept as a partial download to resume next time */
+  if (pool != NULL)
+    g_thread_pool_free (pool, first_error != NULL, TRUE);
+
+  for (i = 0; first_error == NULL && i < jobs->len; i++)
+    {
+      DownloadJob *job = g_ptr_array_index (jobs, i);
+
+      if (job->error)
+        first_error = g_steal_pointer (&job->error);
+    }
+
+  /* Also keep what was verified before a failure */
+  if (!builder_context_save_verified_checksums (context, &my_error))
+    g_warning ("Failed to save verified checksums: %s", my_error->message);
+
+  if (first_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&first_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+setup_context (BuilderManifest *self,
+               BuilderContext  *context,
+               GError         **error)
+{
+  builder_context_set_options (context, self->build_options);
+  builder_context_set_global_cleanup (context, (const char **) self->cleanup);
+  builder_context_set_global_cleanup_platform (context, (const char **) self->cleanup_platform);
+  if (self->build_runtime && self->build_extension)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Can't build both a runtime and an extension");
+      return FALSE;
+    }
+  builder_context_set_build_runtime (context, self->build_runtime);
+  builder_context_set_build_extension (context, self->build_extension);
+  builder_context_set_separate_locales (context, self->separate_locales);
+  return TRUE;
+}
+
+gboolean
+builder_manifest_build_shell (BuilderManifest *self,
+                              BuilderContext  *context,
+                              const char      *modulename,
+                              GError         **error)
+{
+  GList *l;
+  BuilderModule *found = NULL;
+
+  if (!builder_context_enable_rofiles (context, error))
+    return FALSE;
+
+  if (!setup_context (self, context, error))
+    return FALSE;
+
+  for (l = self->expanded_modules; l != NULL; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      const char *name = builder_module_get_name (m);
+
+      if (strcmp (name, modulename) == 0)
+        {
+          found = m;
+          break;
+        }
+    }
+
+  if (found == NULL)
+    return flatpak_fail (error, "Can't find module %s", modulename);
+
+  if (!builder_module_build (found, NULL, context, TRUE, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* With --module-jobs, a module that lists its dependencies is built on
+ * top of the stage of the last of them rather than of the module before
+ * it, so that it can be built at the same time as the modules in
+ * between. This returns the stage that each module that is built is
+ * built on top of in @bases_out, and adds the ones where that is not
+ * the previous stage to @rebased_out. It fails if a module depends on
+ * one that doesn't exist or comes after it. */
+static gboolean
+get_build_bases (BuilderManifest *self,
+                 GHashTable     **bases_out,
+                 GHashTable     **rebased_out,
+                 GError         **error)
+{
+  g_autoptr(GHashTable) bases = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+  g_autoptr(GHashTable) rebased = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) all_names = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) earlier = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) built = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autofree char *prev_stage = g_strdup ("init");
+  int n_built = 0;
+  GList *l;
+  int i;
+
   for (l = self->expanded_modules; l != NULL; l = l->next)
+    g_hash_table_add (all_names, (char *) builder_module_get_name (l->data));
+
+  for (l = self->expanded_modules; l != NULL; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      const char *name = builder_module_get_name (m);
+      const char **depends = builder_module_get_depends (m);
+      const char *last_dep = NULL;
+      int last_index = 0;
+      char *base;
+
+      for (i = 0; depends != NULL && depends[i] != NULL; i++)
+        {
+          int index;
+
+          if (!g_hash_table_contains (all_names, depends[i]))
+            return flatpak_fail (error, "module %s: Unknown dependency %s", name, depends[i]);
+
+          /* Dependencies must come earlier in the manifest, since that
+             is the order the modules are committed in */
+          if (!g_hash_table_contains (earlier, depends[i]))
+            return flatpak_fail (error, "module %s: Dependency %s is not built before it",
+                                 name, depends[i]);
+
+          index = GPOINTER_TO_INT (g_hash_table_lookup (built, depends[i]));
+          if (index > last_index)
+            {
+              last_index = index;
+              last_dep = depends[i];
+            }
+        }
+
+      g_hash_table_add (earlier, (char *) name);
+
+      if (!builder_module_should_build (m))
+        continue;
+
+      if (depends == NULL)
+        base = g_strdup (prev_stage);
+      else if (last_dep != NULL)
+        base = g_strdup_printf ("build-%s", last_dep);
+      else
+        base = g_strdup ("init");
+
+      if (strcmp (base, prev_stage) != 0)
+        g_hash_table_add (rebased, (char *) name);
+
+      g_hash_table_insert (bases, (char *) name, base);
+      g_hash_table_insert (built, (char *) name, GINT_TO_POINTER (++n_built));
+
+      g_free (prev_stage);
+      prev_stage = g_strdup_printf ("build-%s", name);
+    }
+
+  *bases_out = g_steal_pointer (&bases);
+  *rebased_out = g_steal_pointer (&rebased);
+
+  return TRUE;
+}
+
+static void
+checksum_module (BuilderModule  *m,
+                 GHashTable     *bases,
+                 GHashTable     *rebased,
+                 BuilderCache   *cache,
+                 BuilderContext *context)
+{
+  const char *name = builder_module_get_name (m);
+
+  builder_module_checksum (m, cache, context);
+
+  /* A module that isn't built on top of the previous stage can't be
+     mixed up with the same module built serially */
+  if (rebased != NULL && g_hash_table_contains (rebased, name))
+    {
+      builder_cache_checksum_str (cache, "build-base");
+      builder_cache_checksum_str (cache, g_hash_table_lookup (bases, name));
+    }
+}
+
+typedef struct
+{
+  BuilderModule         *module;
+  BuilderContext        *context;
+  GFile                 *staging_dir;
+  GFile                 *mount_dir;
+  const char            *base_stage;
+  int                    base_job;
+  char                  *base_commit;
+  OstreeRepoDevInoCache *devino_to_csum_cache;
+  BuilderRofilesMount   *mount;
+  GFile                 *source_dir;
+  GError                *error;
+  gboolean               started;
+  gboolean               done;
+} ModuleJob;
+
+static void
+module_job_free (ModuleJob *job)
+{
+  if (job->mount)
+    builder_rofiles_unmount (job->mount, NULL);
+  g_object_unref (job->module);
+  g_object_unref (job->context);
+  g_object_unref (job->staging_dir);
+  g_object_unref (job->mount_dir);
+  g_free (job->base_commit);
+  g_clear_pointer (&job->devino_to_csum_cache, ostree_repo_devino_cache_unref);
+  g_clear_object (&job->source_dir);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+module_job_thread (gpointer data,
+                   gpointer user_data)
+{
+  ModuleJob *job = data;
+  GAsyncQueue *done_queue = user_data;
+  GFile *app_dir = job->staging_dir;
+
+  if (job->mount)
+    app_dir = builder_rofiles_mount_get_dir (job->mount);
+
+  builder_module_build_staged (job->module, job->context, app_dir,
+                               &job->source_dir, &job->error);
+
+  if (job->mount)
+    builder_rofiles_unmount (g_steal_pointer (&job->mount),
+                             job->error == NULL ? &job->error : NULL);
+
+  g_async_queue_push (done_queue, job);
+}
+
+/* Checks out the stage that @job is built on top of into its staging
+ * dir, and mounts that with rofiles-fuse if the checkout is made of
+ * hardlinks into the cache. */
+static gboolean
+prepare_module_job (ModuleJob      *job,
+                    BuilderCache   *cache,
+                    BuilderContext *context,
+                    GError        **error)
+{
+  const char *name = builder_module_get_name (job->module);
+
+  job->base_commit = builder_cache_get_stage_commit (cache, job->base_stage);
+  if (job->base_commit == NULL)
+    return flatpak_fail (error, "module %s: Stage %s is not in the cache", name, job->base_stage);
+
+  job->devino_to_csum_cache = ostree_repo_devino_cache_new ();
+
+  if (!builder_cache_checkout_staging (cache, job->base_commit, job->staging_dir,
+                                       job->devino_to_csum_cache, error))
+    return FALSE;
+
+  if (!builder_module_ensure_writable_staged (job->module, cache, job->base_commit,
+                                              job->staging_dir, error))
+    return FALSE;
+
+  if (builder_context_get_use_rofiles (context) &&
+      builder_context_get_have_rofiles (context))
+    {
+      job->mount = builder_rofiles_mount (job->staging_dir, job->mount_dir, error);
+      if (job->mount == NULL)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Moves the changes from a staged build into the real app dir. This
+ * replaces files rather than writing to them, so hardlinks into the
+ * cache are never modified. The changes must have been checked with
+ * builder_cache_check_staged_conflicts() first. */
+static gboolean
+merge_staged_changes (GFile     *staging_dir,
+                      GFile     *app_dir,
+                      GPtrArray *changed,
+                      GPtrArray *removed,
+                      GError   **error)
+{
+  int i;
+
+  for (i = 0; i < removed->len; i++)
+    {
+      g_autoptr(GFile) dest = g_file_resolve_relative_path (app_dir, g_ptr_array_index (removed, i));
+
+      if (!flatpak_rm_rf (dest, NULL, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < changed->len; i++)
+    {
+      const char *path = g_ptr_array_index (changed, i);
+      g_autoptr(GFile) src = g_file_resolve_relative_path (staging_dir, path);
+      g_autoptr(GFile) dest = g_file_resolve_relative_path (app_dir, path);
+      const char *src_path = flatpak_file_get_path_cached (src);
+      const char *dest_path = flatpak_file_get_path_cached (dest);
+      struct stat src_buf, dest_buf;
+      gboolean dest_exists;
+
+      if (lstat (src_path, &src_buf) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          g_prefix_error (error, "Can't merge %s: ", path);
+          return FALSE;
+        }
+
+      dest_exists = lstat (dest_path, &dest_buf) == 0;
+
+      if (S_ISDIR (src_buf.st_mode))
+        {
+          if (dest_exists && S_ISDIR (dest_buf.st_mode))
+            continue;
+
+          if (dest_exists && !flatpak_rm_rf (dest, NULL, error))
+            return FALSE;
+
+          if (mkdir (dest_path, src_buf.st_mode & 07777) != 0)
+            {
+              glnx_set_error_from_errno (error);
+              g_prefix_error (error, "Can't merge %s: ", path);
+              return FALSE;
+            }
+
+          continue;
+        }
+
+      if (dest_exists && !flatpak_rm_rf (dest, NULL, error))
+        return FALSE;
+
+      if (rename (src_path, dest_path) != 0)
+        {
+          if (errno != EXDEV)
+            {
+              glnx_set_error_from_errno (error);
+              g_prefix_error (error, "Can't merge %s: ", path);
+              return FALSE;
+            }
+
+          if (!g_file_copy (src, dest,
+                            G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_ALL_METADATA,
+                            NULL, NULL, NULL, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+commit_staged_module (ModuleJob      *job,
+                      gboolean        do_lookup,
+                      GHashTable     *bases,
+                      GHashTable     *rebased,
+                      BuilderCache   *cache,
+                      BuilderContext *context,
+                      GError        **error)
+{
+  BuilderModule *m = job->module;
+  const char *name = builder_module_get_name (m);
+  g_autofree char *stage = g_strdup_printf ("build-%s", name);
+  g_autofree char *body = g_strdup_printf ("Built %s\n", name);
+  g_autofree char *conflict = NULL;
+  g_autoptr(GError) lookup_error = NULL;
+  g_autoptr(GPtrArray) changed = NULL;
+  g_autoptr(GPtrArray) removed = NULL;
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(BuilderProfileSpan) span = NULL;
+  gboolean res;
+
+  /* The stages have to be committed in order so that the checksums
+     are chained exactly as in a serial build */
+  if (do_lookup)
+    {
+      checksum_module (m, bases, rebased, cache, context);
+      if (!builder_cache_lookup (cache, stage, &lookup_error) &&
+          lookup_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&lookup_error));
+          return FALSE;
+        }
+    }
+
+  if (!builder_cache_get_staged_changes (cache, job->base_commit, job->staging_dir,
+                                         job->devino_to_csum_cache,
+                                         &changed, &removed, error))
+    return FALSE;
+
+  if (!builder_cache_check_staged_conflicts (cache, job->base_commit, job->staging_dir,
+                                             changed, removed, &conflict, error))
+    return FALSE;
+
+  if (conflict != NULL)
+    {
+      /* Another module that this one was built alongside changed the
+         same file, so build it again on top of that one */
+      g_print ("Module %s and an earlier module both changed %s, rebuilding %s\n",
+               name, conflict, name);
+
+      if (!builder_module_cleanup_build_dir (m, context, job->source_dir, TRUE, error))
+        return FALSE;
+      g_clear_object (&job->source_dir);
+
+      if (!flatpak_rm_rf (job->staging_dir, NULL, error))
+        return FALSE;
+
+      if (!builder_module_ensure_writable (m, cache, context, error))
+        return FALSE;
+      if (!builder_context_enable_rofiles (context, error))
+        return FALSE;
+      if (!builder_module_build (m, cache, context, FALSE, error))
+        return FALSE;
+      if (!builder_context_disable_rofiles (context, error))
+        return FALSE;
+    }
+  else
+    {
+      g_print ("Merging staged build of module %s\n", name);
+
+      if (!merge_staged_changes (job->staging_dir, builder_context_get_app_dir (context),
+                                 changed, removed, error))
+        {
+          g_prefix_error (error, "module %s: ", name);
+          return FALSE;
+        }
+
+      if (!flatpak_rm_rf (job->staging_dir, NULL, error))
+        return FALSE;
+
+      if (!builder_context_enable_rofiles (context, error))
+        return FALSE;
+
+      res = builder_module_post_process (m, cache, context, error);
+
+      if (!builder_context_disable_rofiles (context, res ? error : NULL))
+        return FALSE;
+
+      if (!builder_module_cleanup_build_dir (m, context, job->source_dir, res, res ? error : NULL))
+        return FALSE;
+
+      g_clear_object (&job->source_dir);
+
+      if (!res)
+        return FALSE;
+    }
+
+  span = builder_context_profile_begin (context, builder_module_get_name (m), "cache-commit");
+  if (!builder_cache_commit (cache, body, error))
+    return FALSE;
+  g_clear_pointer (&span, builder_profile_span_end);
+
+  changes = builder_cache_get_changes (cache, error);
+  if (changes == NULL)
+    return FALSE;
+
+  builder_module_set_changes (m, changes);
+
+  builder_module_update (m, context, error);
+
+  return TRUE;
+}
+
+/* Builds the modules starting at @first (which has already been looked
+ * up in the cache and missed) with up to --module-jobs of them running
+ * at the same time. Each one is built in a private checkout of the stage
+ * it is built on top of (see get_build_bases()), so what it is built
+ * against doesn't depend on which other modules happen to be done. The
+ * results are then merged, post-processed and committed one at a time in
+ * manifest order. If a module changed a file that one committed after
+ * its base stage changed too, it is built again on top of that instead,
+ * as it would be serially. */
+static gboolean
+build_modules_parallel (BuilderManifest *self,
+                        GList           *first,
+                        GHashTable      *bases,
+                        GHashTable      *rebased,
+                        BuilderCache    *cache,
+                        BuilderContext  *context,
+                        GError         **error)
+{
+  const char *stop_at = builder_context_get_stop_at (context);
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) module_job_free);
+  g_autoptr(GHashTable) job_index = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GAsyncQueue) done_queue = g_async_queue_new ();
+  g_autoptr(GFile) staging_base = NULL;
+  g_autoptr(GFile) mount_base = NULL;
+  g_autoptr(GError) first_error = NULL;
+  GThreadPool *pool;
+  int max_running = builder_context_get_module_jobs (context);
+  int running = 0;
+  int next_commit = 0;
+  gboolean build_failed = FALSE;
+  gboolean stopped = FALSE;
+  GList *l;
+  int i;
+
+  staging_base = g_file_get_child (builder_context_get_state_dir (context), "staging");
+  mount_base = g_file_get_child (builder_context_get_state_dir (context), "staging-rofiles");
+
+  for (l = first; l != NULL; l = l->next)
     {
       BuilderModule *m = l->data;
       const char *name = builder_module_get_name (m);
+      ModuleJob *job;
+      gpointer base_job;
+      const char *base_stage;
+
+      if (stop_at != NULL && strcmp (name, stop_at) == 0)
+        {
+          stopped = TRUE;
+          break;
+        }
+
+      if (!builder_module_should_build (m))
+        {
+          g_print ("Skipping module %s (no sources)\n", name);
+          continue;
+        }
+
+      base_stage = g_hash_table_lookup (bases, name);
+
+      job = g_new0 (ModuleJob, 1);
+      job->module = g_object_ref (m);
+      job->context = g_object_ref (context);
+      job->staging_dir = g_file_get_child (staging_base, name);
+      job->mount_dir = g_file_get_child (mount_base, name);
+      job->base_stage = base_stage;
+
+      /* Stages that aren't in job_index were committed before */
+      if (g_str_has_prefix (base_stage, "build-") &&
+          g_hash_table_lookup_extended (job_index, base_stage + strlen ("build-"), NULL, &base_job))
+        job->base_job = GPOINTER_TO_INT (base_job);
+      else
+        job->base_job = -1;
+
+      g_hash_table_insert (job_index, (char *) name, GINT_TO_POINTER (jobs->len));
+      g_ptr_array_add (jobs, job);
+    }
+
+  g_print ("Building %d modules with up to %d at a time\n", jobs->len, max_running);
+
+  pool = g_thread_pool_new (module_job_thread, done_queue, max_running, FALSE, NULL);
+
+  while (TRUE)
+    {
+      ModuleJob *job;
+
+      /* Commit whatever is finished, in order */
+      while (first_error == NULL && next_commit < jobs->len)
+        {
+          job = g_ptr_array_index (jobs, next_commit);
+          if (!job->done)
+            break;
+
+          if (job->error)
+            {
+              first_error = g_steal_pointer (&job->error);
+              break;
+            }
+
+          if (!commit_staged_module (job, next_commit > 0, bases, rebased,
+                                     cache, context, &first_error))
+            break;
+
+          next_commit++;
+        }
+
+      if (next_commit == jobs->len)
+        break;
+
+      /* Start any modules whose base stage has been committed */
+      for (i = next_commit; !build_failed && first_error == NULL && i < jobs->len && running < max_running; i++)
+        {
+          job = g_ptr_array_index (jobs, i);
+          if (job->started || job->base_job >= next_commit)
+            continue;
+
+          if (!prepare_module_job (job, cache, context, &first_error))
+            break;
+
+          job->started = TRUE;
+          running++;
+          g_thread_pool_push (pool, job, NULL);
+        }
 
-      if (only_module && strcmp (name, only_module) != 0)
-        continue;
+      if (running == 0)
+        break;
 
-      if (stop_at != NULL && strcmp (name, stop_at) == 0)
+      job = g_async_queue_pop (done_queue);
+      job->done = TRUE;
+      running--;
+
+      if (job->error)
         {
-          g_print ("Stopping at module %s\n", stop_at);
-          return TRUE;
+          build_failed = TRUE;
+          if (running > 0)
+            g_printerr ("Building module %s failed, waiting for %d other modules\n",
+                        builder_module_get_name (job->module), running);
         }
-
-      if (!builder_module_download_sources (m, update_vcs, context, error))
-        return FALSE;
     }
 
-  return TRUE;
-}
+  g_thread_pool_free (pool, FALSE, TRUE);
 
-static gboolean
-setup_context (BuilderManifest *self,
-               BuilderContext  *context,
-               GError         **error)
-{
-  builder_context_set_options (context, self->build_options);
-  builder_context_set_global_cleanup (context, (const char **) self->cleanup);
-  builder_context_set_global_cleanup_platform (context, (const char **) self->cleanup_platform);
-  if (self->build_runtime && self->build_extension)
+  /* Clean up after anything that was built but not committed */
+  for (i = next_commit; i < jobs->len; i++)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Can't build both a runtime and an extension");
-      return FALSE;
-    }
-  builder_context_set_build_runtime (context, self->build_runtime);
-  builder_context_set_build_extension (context, self->build_extension);
-  builder_context_set_separate_locales (context, self->separate_locales);
-  return TRUE;
-}
+      ModuleJob *job = g_ptr_array_index (jobs, i);
 
-gboolean
-builder_manifest_build_shell (BuilderManifest *self,
-                              BuilderContext  *context,
-                              const char      *modulename,
-                              GError         **error)
-{
-  GList *l;
-  BuilderModule *found = NULL;
+      if (job->mount)
+        builder_rofiles_unmount (g_steal_pointer (&job->mount), NULL);
+      if (job->source_dir)
+        builder_module_cleanup_build_dir (job->module, context, job->source_dir,
+                                          job->error == NULL, NULL);
+      flatpak_rm_rf (job->staging_dir, NULL, NULL);
 
-  if (!builder_context_enable_rofiles (context, error))
-    return FALSE;
+      if (first_error == NULL && job->error != NULL)
+        first_error = g_steal_pointer (&job->error);
+    }
 
-  if (!setup_context (self, context, error))
-    return FALSE;
+  flatpak_rm_rf (mount_base, NULL, NULL);
 
-  for (l = self->expanded_modules; l != NULL; l = l->next)
+  if (first_error)
     {
-      BuilderModule *m = l->data;
-      const char *name = builder_module_get_name (m);
-
-      if (strcmp (name, modulename) == 0)
-        {
-          found = m;
-          break;
-        }
+      g_propagate_error (error, g_steal_pointer (&first_error));
+      return FALSE;
     }
 
-  if (found == NULL)
-    return flatpak_fail (error, "Can't find module %s", modulename);
-
-  if (!builder_module_build (found, NULL, context, TRUE, error))
-    return FALSE;
+  if (stopped)
+    g_print ("Stopping at module %s\n", stop_at);
 
   return TRUE;
 }
@@ -2010,17 +2781,44 @@ builder_manifest_build (BuilderManifest *self,
                         GError         **error)
 {
   const char *stop_at = builder_context_get_stop_at (context);
+  g_autoptr(GHashTable) bases = NULL;
+  g_autoptr(GHashTable) rebased = NULL;
+  gboolean parallel = FALSE;
   GList *l;
 
   if (!setup_context (self, context, error))
     return FALSE;
 
+  if (builder_context_get_module_jobs (context) > 1)
+    {
+      /* Host commands are run via the portal, which needs the
+         main context, so this is only supported outside a sandbox */
+      if (flatpak_is_in_sandbox ())
+        g_printerr ("Warning: --module-jobs is not supported in a sandbox, building one module at a time\n");
+      /* With --content-cache, modules after a miss may still be cache
+         hits, which is only known when it is their turn */
+      else if (builder_context_get_content_cache (context))
+        g_printerr ("Warning: --module-jobs is not supported with --content-cache, building one module at a time\n");
+      else
+        parallel = TRUE;
+    }
+
+  if (!get_build_bases (self, &bases, &rebased, error))
+    return FALSE;
+
+  /* Serially every module is built on top of the previous one */
+  if (!parallel)
+    g_clear_pointer (&rebased, g_hash_table_unref);
+
   g_print ("Starting build of %s\n", self->id ? self->id : "app");
   for (l = self->expanded_modules; l != NULL; l = l->next)
     {
       BuilderModule *m = l->data;
       g_autoptr(GPtrArray) changes = NULL;
       const char *name = builder_module_get_name (m);
+      const char **depends = builder_module_get_depends (m);
+      g_auto(GStrv) dep_stages = NULL;
+      g_autoptr(GError) lookup_error = NULL;
 
       g_autofree char *stage = g_strdup_printf ("build-%s", name);
 
@@ -2036,12 +2834,37 @@ builder_manifest_build (BuilderManifest *self,
           continue;
         }
 
-      builder_module_checksum (m, cache, context);
+      if (depends != NULL)
+        {
+          int i, j;
+
+          dep_stages = g_new0 (char *, g_strv_length ((char **) depends) + 1);
+          for (i = 0, j = 0; depends[i] != NULL; i++)
+            {
+              /* Modules without sources have no stage */
+              if (g_hash_table_contains (bases, depends[i]))
+                dep_stages[j++] = g_strdup_printf ("build-%s", depends[i]);
+            }
+        }
+
+      checksum_module (m, bases, rebased, cache, context);
 
-      if (!builder_cache_lookup (cache, stage))
+      if (!builder_cache_lookup_with_deps (cache, stage, (const char **) dep_stages, &lookup_error))
         {
           g_autofree char *body =
             g_strdup_printf ("Built %s\n", name);
+          g_autoptr(BuilderProfileSpan) span = NULL;
+
+          if (lookup_error != NULL)
+            {
+              g_propagate_error (error, g_steal_pointer (&lookup_error));
+              return FALSE;
+            }
+
+          /* Everything after the first cache miss has to be built */
+          if (parallel)
+            return build_modules_parallel (self, l, bases, rebased, cache, context, error);
+
           if (!builder_module_ensure_writable (m, cache, context, error))
             return FALSE;
           if (!builder_context_enable_rofiles (context, error))
@@ -2050,8 +2873,11 @@ builder_manifest_build (BuilderManifest *self,
             return FALSE;
           if (!builder_context_disable_rofiles (context, error))
             return FALSE;
+
+          span = builder_context_profile_begin (context, name, "cache-commit");
           if (!builder_cache_commit (cache, body, error))
             return FALSE;
+          g_clear_pointer (&span, builder_profile_span_end);
         }
       else
         {
@@ -2410,15 +3236,25 @@ builder_manifest_cleanup (BuilderManifest *self,
                           GError         **error)
 {
   g_autoptr(GFile) app_root = NULL;
+  g_autoptr(GError) lookup_error = NULL;
   GList *l;
   g_auto(GStrv) env = NULL;
   g_autoptr(GFile) appdata_file = NULL;
   g_autoptr(GFile) appdata_source = NULL;
+  g_autoptr(BuilderProfileSpan) span = NULL;
   int i;
 
+  span = builder_context_profile_begin (context, self->id, "cleanup");
+
   builder_manifest_checksum_for_cleanup (self, cache, context);
-  if (!builder_cache_lookup (cache, "cleanup"))
+  if (!builder_cache_lookup (cache, "cleanup", &lookup_error))
     {
+      if (lookup_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&lookup_error));
+          return FALSE;
+        }
+
       g_autoptr(GHashTable) to_remove_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
       g_autofree char **keys = NULL;
       GFile *app_dir = NULL;
@@ -2752,6 +3588,7 @@ builder_manifest_finish (BuilderManifest *self,
                          BuilderContext  *context,
                          GError         **error)
 {
+  g_autoptr(GError) lookup_error = NULL;
   g_autoptr(GFile) manifest_file = NULL;
   g_autoptr(GFile) debuginfo_dir = NULL;
   g_autoptr(GFile) sources_dir = NULL;
@@ -2761,12 +3598,21 @@ builder_manifest_finish (BuilderManifest *self,
   g_autoptr(GPtrArray) args = NULL;
   g_autoptr(GPtrArray) inherit_extensions = NULL;
   g_autoptr(GSubprocess) subp = NULL;
+  g_autoptr(BuilderProfileSpan) span = NULL;
   int i;
   GList *l;
 
+  span = builder_context_profile_begin (context, self->id, "finish");
+
   builder_manifest_checksum_for_finish (self, cache, context);
-  if (!builder_cache_lookup (cache, "finish"))
+  if (!builder_cache_lookup (cache, "finish", &lookup_error))
     {
+      if (lookup_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&lookup_error));
+          return FALSE;
+        }
+
       GFile *app_dir = NULL;
       g_autoptr(GPtrArray) sub_ids = g_ptr_array_new_with_free_func (g_free);
       g_autofree char *ref = NULL;
@@ -3161,30 +4007,187 @@ builder_manifest_finish (BuilderManifest *self,
   return TRUE;
 }
 
+/* Creates the platform dir as a writable copy of the runtime,
+   with the platform extensions added */
+static gboolean
+init_platform_dir (BuilderManifest *self,
+                   BuilderContext  *context,
+                   GFile           *app_dir,
+                   GError         **error)
+{
+  g_autofree char *commandline = NULL;
+  g_autoptr(GSubprocess) subp = NULL;
+  g_autoptr(GPtrArray) args = NULL;
+  int i;
+
+  args = g_ptr_array_new_with_free_func (g_free);
+
+  g_ptr_array_add (args, g_strdup ("flatpak"));
+  g_ptr_array_add (args, g_strdup ("build-init"));
+  g_ptr_array_add (args, g_strdup ("--update"));
+  g_ptr_array_add (args, g_strdup ("--writable-sdk"));
+  g_ptr_array_add (args, g_strdup ("--sdk-dir=platform"));
+  g_ptr_array_add (args, g_strdup_printf ("--arch=%s", builder_context_get_arch (context)));
+
+  for (i = 0; self->platform_extensions != NULL && self->platform_extensions[i] != NULL; i++)
+    {
+      const char *ext = self->platform_extensions[i];
+      g_ptr_array_add (args, g_strdup_printf ("--sdk-extension=%s", ext));
+    }
+
+  g_ptr_array_add (args, g_file_get_path (app_dir));
+  g_ptr_array_add (args, g_strdup (self->id));
+  g_ptr_array_add (args, g_strdup (self->runtime));
+  g_ptr_array_add (args, g_strdup (self->runtime));
+  g_ptr_array_add (args, g_strdup (builder_manifest_get_runtime_version (self)));
+
+  g_ptr_array_add (args, NULL);
+
+  commandline = flatpak_quote_argv ((const char **) args->pdata);
+  g_debug ("Running '%s'", commandline);
+
+  subp =
+    g_subprocess_newv ((const gchar * const *) args->pdata,
+                       G_SUBPROCESS_FLAGS_NONE,
+                       error);
+
+  if (subp == NULL ||
+      !g_subprocess_wait_check (subp, NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+G_GNUC_PRINTF (2, 3)
+static gboolean
+not_supported (GError    **error,
+               const char *format,
+               ...)
+{
+  g_autofree char *message = NULL;
+  va_list args;
+
+  va_start (args, format);
+  message = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, message);
+  return FALSE;
+}
+
+/* Like init_platform_dir(), but imports the installed runtime commit
+ * from the repo of its installation into the cache, and checks it out
+ * from there, hardlinking the files when possible instead of copying
+ * them all. The installation itself is never linked to. Later changes
+ * go through rofiles-fuse, which never modifies the hardlinked files
+ * in place, so this is only done when that is in use. Fails with
+ * G_IO_ERROR_NOT_SUPPORTED if the platform dir has to be created
+ * with init_platform_dir(). */
+static gboolean
+checkout_platform_runtime (BuilderManifest *self,
+                           BuilderCache    *cache,
+                           BuilderContext  *context,
+                           GError         **error)
+{
+  g_autofree char *deploy_path = NULL;
+  g_autoptr(GFile) base_dir = NULL;
+  g_autoptr(GFile) repo_dir = NULL;
+  g_autoptr(GFile) platform_dir = NULL;
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_autoptr(GError) my_error = NULL;
+  OstreeRepoCommitState commit_state;
+  int i;
+
+  if (self->platform_extensions != NULL)
+    return not_supported (error, "platform extensions are added by flatpak build-init");
+
+  /* These may edit runtime files in place, which rofiles-fuse refuses for hardlinks */
+  if (self->prepare_platform_commands != NULL || self->cleanup_platform_commands != NULL)
+    return not_supported (error, "platform commands may modify the runtime files");
+
+  if (g_file_equal (builder_context_get_app_dir (context),
+                    builder_context_get_app_dir_raw (context)))
+    return not_supported (error, "rofiles-fuse is not in use");
+
+  if (self->runtime_commit == NULL)
+    return not_supported (error, "runtime %s is not installed", self->runtime);
+
+  /* The deploy dir is $installation/runtime/$id/$arch/$branch/$commit */
+  deploy_path = flatpak_info_show_path (self->runtime, builder_manifest_get_runtime_version (self), context);
+  if (deploy_path == NULL)
+    return not_supported (error, "can't find the deploy dir of %s", self->runtime);
+
+  base_dir = g_file_new_for_path (deploy_path);
+  for (i = 0; i < 5 && base_dir != NULL; i++)
+    {
+      GFile *parent = g_file_get_parent (base_dir);
+      g_object_unref (base_dir);
+      base_dir = parent;
+    }
+
+  if (base_dir == NULL)
+    return not_supported (error, "unexpected deploy dir %s", deploy_path);
+
+  repo_dir = g_file_get_child (base_dir, "repo");
+  repo = ostree_repo_new (repo_dir);
+  if (!ostree_repo_open (repo, NULL, &my_error) ||
+      !ostree_repo_load_commit (repo, self->runtime_commit, NULL, &commit_state, &my_error))
+    return not_supported (error, "can't load %s from %s: %s", self->runtime_commit,
+                          flatpak_file_get_path_cached (repo_dir), my_error->message);
+
+  if ((commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL) != 0)
+    return not_supported (error, "commit %s is partial", self->runtime_commit);
+
+  /* Write to the real app dir, as hardlinks can't be made through the fuse mount */
+  platform_dir = g_file_get_child (builder_context_get_app_dir_raw (context), "platform");
+  if (!flatpak_rm_rf (platform_dir, NULL, &my_error) &&
+      !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  g_print ("Checking out %s from %s\n", self->runtime, flatpak_file_get_path_cached (repo_dir));
+
+  /* Ostree falls back to copying for files that can't be hardlinked */
+  if (!builder_cache_checkout_from_repo (cache, repo_dir, self->runtime_commit, "/files",
+                                         platform_dir, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 gboolean
 builder_manifest_create_platform (BuilderManifest *self,
                                   BuilderCache    *cache,
                                   BuilderContext  *context,
                                   GError         **error)
 {
-  g_autofree char *commandline = NULL;
-
   g_autoptr(GFile) locale_dir = NULL;
+  g_autoptr(GError) lookup_error = NULL;
+  g_autoptr(BuilderProfileSpan) span = NULL;
   int i;
 
   if (!self->build_runtime ||
       self->id_platform == NULL)
     return TRUE;
 
+  span = builder_context_profile_begin (context, self->id, "platform");
+
   builder_manifest_checksum_for_platform (self, cache, context);
-  if (!builder_cache_lookup (cache, "platform"))
+  if (!builder_cache_lookup (cache, "platform", &lookup_error))
     {
+      if (lookup_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&lookup_error));
+          return FALSE;
+        }
+
       g_autoptr(GHashTable) to_remove_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
       g_autoptr(GPtrArray) changes = NULL;
       GList *l;
       g_autoptr(GFile) platform_dir = NULL;
-      g_autoptr(GSubprocess) subp = NULL;
-      g_autoptr(GPtrArray) args = NULL;
+      g_autoptr(GError) my_error = NULL;
       GFile *app_dir = NULL;
       g_autofree char *ref = NULL;
       g_autoptr(GPtrArray) sub_ids = g_ptr_array_new_with_free_func (g_free);
@@ -3206,40 +4209,19 @@ builder_manifest_create_platform (BuilderManifest *self,
 
       platform_dir = g_file_get_child (app_dir, "platform");
 
-      args = g_ptr_array_new_with_free_func (g_free);
-
-      g_ptr_array_add (args, g_strdup ("flatpak"));
-      g_ptr_array_add (args, g_strdup ("build-init"));
-      g_ptr_array_add (args, g_strdup ("--update"));
-      g_ptr_array_add (args, g_strdup ("--writable-sdk"));
-      g_ptr_array_add (args, g_strdup ("--sdk-dir=platform"));
-      g_ptr_array_add (args, g_strdup_printf ("--arch=%s", builder_context_get_arch (context)));
-
-      for (i = 0; self->platform_extensions != NULL && self->platform_extensions[i] != NULL; i++)
+      if (!checkout_platform_runtime (self, cache, context, &my_error))
         {
-          const char *ext = self->platform_extensions[i];
-          g_ptr_array_add (args, g_strdup_printf ("--sdk-extension=%s", ext));
-        }
-
-      g_ptr_array_add (args, g_file_get_path (app_dir));
-      g_ptr_array_add (args, g_strdup (self->id));
-      g_ptr_array_add (args, g_strdup (self->runtime));
-      g_ptr_array_add (args, g_strdup (self->runtime));
-      g_ptr_array_add (args, g_strdup (builder_manifest_get_runtime_version (self)));
-
-      g_ptr_array_add (args, NULL);
-
-      commandline = flatpak_quote_argv ((const char **) args->pdata);
-      g_debug ("Running '%s'", commandline);
+          if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              return FALSE;
+            }
 
-      subp =
-        g_subprocess_newv ((const gchar * const *) args->pdata,
-                           G_SUBPROCESS_FLAGS_NONE,
-                           error);
+          g_debug ("Copying the runtime for the platform: %s", my_error->message);
 
-      if (subp == NULL ||
-          !g_subprocess_wait_check (subp, NULL, error))
-        return FALSE;
+          if (!init_platform_dir (self, context, app_dir, error))
+            return FALSE;
+        }
 
       if (self->separate_locales)
         {
@@ -3539,10 +4521,17 @@ builder_manifest_bundle_sources (BuilderManifest *self,
                                  BuilderContext  *context,
                                  GError         **error)
 {
+  g_autoptr(GError) lookup_error = NULL;
 
   builder_manifest_checksum_for_bundle_sources (self, cache, context);
-  if (!builder_cache_lookup (cache, "bundle-sources"))
+  if (!builder_cache_lookup (cache, "bundle-sources", &lookup_error))
     {
+      if (lookup_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&lookup_error));
+          return FALSE;
+        }
+
       g_autofree char *sources_id = builder_manifest_get_sources_id (self);
       GFile *app_dir;
       g_autoptr(GFile) metadata_sources_file = NULL;
@@ -3655,21 +4644,34 @@ builder_manifest_show_deps (BuilderManifest *self,
   return TRUE;
 }
 
-static gboolean
-builder_manifest_install_dep (BuilderManifest *self,
-                              BuilderContext  *context,
-                              const char *remote,
-                              gboolean opt_user,
-                              const char *opt_installation,
-                              const char *runtime,
-                              const char *version,
-                              gboolean opt_yes,
-                              GError         **error)
+static void
+add_ref_unique (GPtrArray  *refs,
+                const char *ref)
+{
+  int i;
+
+  for (i = 0; i < refs->len; i++)
+    {
+      if (strcmp (g_ptr_array_index (refs, i), ref) == 0)
+        return;
+    }
+
+  g_ptr_array_add (refs, g_strdup (ref));
+}
+
+/* Queues the dependency for installation, or for update if it is already installed */
+static void
+builder_manifest_add_dep (BuilderManifest *self,
+                          BuilderContext  *context,
+                          gboolean opt_user,
+                          const char *opt_installation,
+                          const char *runtime,
+                          const char *version,
+                          GPtrArray *install_refs,
+                          GPtrArray *update_refs)
 {
   g_autofree char *ref = NULL;
   g_autofree char *commit = NULL;
-  g_autoptr(GPtrArray) args = NULL;
-  gboolean installed;
 
   if (version == NULL)
     version = builder_manifest_get_runtime_version (self);
@@ -3679,25 +4681,39 @@ builder_manifest_install_dep (BuilderManifest *self,
                                    builder_context_get_arch (context));
 
   commit = flatpak_info (opt_user, opt_installation, "--show-commit", ref, NULL);
-  installed = (commit != NULL);
+  if (commit != NULL)
+    add_ref_unique (update_refs, ref);
+  else
+    add_ref_unique (install_refs, ref);
+}
+
+static gboolean
+run_install_deps (const char *command,
+                  const char *remote,
+                  gboolean opt_user,
+                  const char *opt_installation,
+                  GPtrArray *refs,
+                  GError **error)
+{
+  g_autoptr(GPtrArray) args = NULL;
+  int i;
+
+  if (refs->len == 0)
+    return TRUE;
 
   args = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (args, g_strdup ("flatpak"));
   add_installation_args (args, opt_user, opt_installation);
-  if (installed)
-    {
-      g_ptr_array_add (args, g_strdup ("update"));
-      g_ptr_array_add (args, g_strdup ("--subpath="));
-    }
+  g_ptr_array_add (args, g_strdup (command));
+  if (remote)
+    g_ptr_array_add (args, g_strdup (remote));
   else
-    {
-      g_ptr_array_add (args, g_strdup ("install"));
-      g_ptr_array_add (args, g_strdup (remote));
-    }
+    g_ptr_array_add (args, g_strdup ("--subpath="));
 
   g_ptr_array_add (args, g_strdup ("-y"));
 
-  g_ptr_array_add (args, g_strdup (ref));
+  for (i = 0; i < refs->len; i++)
+    g_ptr_array_add (args, g_strdup (g_ptr_array_index (refs, i)));
   g_ptr_array_add (args, NULL);
 
   if (!builder_maybe_host_spawnv (NULL, NULL, 0, error, (const char * const *)args->pdata))
@@ -3710,17 +4726,41 @@ builder_manifest_install_dep (BuilderManifest *self,
   return TRUE;
 }
 
+/* Installs and updates all the queued dependencies, using one
+   flatpak transaction for each, so everything is resolved and pulled together */
+static gboolean
+builder_manifest_install_queued_deps (const char *remote,
+                                      gboolean opt_user,
+                                      const char *opt_installation,
+                                      GPtrArray *install_refs,
+                                      GPtrArray *update_refs,
+                                      GError **error)
+{
+  gboolean res;
+
+  res = run_install_deps ("install", remote, opt_user, opt_installation, install_refs, error) &&
+        run_install_deps ("update", NULL, opt_user, opt_installation, update_refs, error);
+
+  if (install_refs->len > 0 || update_refs->len > 0)
+    flatpak_info_cache_clear ();
+
+  g_ptr_array_set_size (install_refs, 0);
+  g_ptr_array_set_size (update_refs, 0);
+
+  return res;
+}
+
 static gboolean
-builder_manifest_install_extension_deps (BuilderManifest *self,
-                                         BuilderContext  *context,
-                                         const char *runtime,
-                                         const char *runtime_version,
-                                         char **runtime_extensions,
-                                         const char *remote,
-                                         gboolean opt_user,
-                                         const char *opt_installation,
-                                         gboolean opt_yes,
-                                         GError **error)
+builder_manifest_add_extension_deps (BuilderManifest *self,
+                                     BuilderContext  *context,
+                                     const char *runtime,
+                                     const char *runtime_version,
+                                     char **runtime_extensions,
+                                     gboolean opt_user,
+                                     const char *opt_installation,
+                                     GPtrArray *install_refs,
+                                     GPtrArray *update_refs,
+                                     GError **error)
 {
   g_autofree char *runtime_ref = flatpak_build_runtime_ref (runtime, runtime_version,
                                                             builder_context_get_arch (context));
@@ -3764,11 +4804,9 @@ builder_manifest_install_extension_deps (BuilderManifest *self,
         extension_version = g_strdup (runtime_version);
 
       g_print ("Dependency Extension: %s %s\n", runtime_extensions[i], extension_version);
-      if (!builder_manifest_install_dep (self, context, remote, opt_user, opt_installation,
-                                         runtime_extensions[i], extension_version,
-                                         opt_yes,
-                                         error))
-        return FALSE;
+      builder_manifest_add_dep (self, context, opt_user, opt_installation,
+                                runtime_extensions[i], extension_version,
+                                install_refs, update_refs);
     }
 
   return TRUE;
@@ -3783,6 +4821,8 @@ builder_manifest_install_deps (BuilderManifest *self,
                                gboolean opt_yes,
                                GError **error)
 {
+  g_autoptr(GPtrArray) install_refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) update_refs = g_ptr_array_new_with_free_func (g_free);
   GList *l;
 
   const char *sdk = NULL;
@@ -3802,45 +4842,24 @@ builder_manifest_install_deps (BuilderManifest *self,
 
   /* Sdk */
   g_print ("Dependency Sdk: %s %s\n", sdk, sdk_branch);
-  if (!builder_manifest_install_dep (self, context, remote, opt_user, opt_installation,
-                                     sdk, sdk_branch,
-                                     opt_yes,
-                                     error))
-    return FALSE;
+  builder_manifest_add_dep (self, context, opt_user, opt_installation,
+                            sdk, sdk_branch,
+                            install_refs, update_refs);
 
   /* Runtime */
   g_print ("Dependency Runtime: %s %s\n", self->runtime, builder_manifest_get_runtime_version (self));
-  if (!builder_manifest_install_dep (self, context, remote, opt_user, opt_installation,
-                                     self->runtime, builder_manifest_get_runtime_version (self),
-                                     opt_yes,
-                                     error))
-    return FALSE;
+  builder_manifest_add_dep (self, context, opt_user, opt_installation,
+                            self->runtime, builder_manifest_get_runtime_version (self),
+                            install_refs, update_refs);
 
   if (self->base)
     {
       g_print ("Dependency Base: %s %s\n", self->base, builder_manifest_get_base_version (self));
-      if (!builder_manifest_install_dep (self, context, remote, opt_user, opt_installation,
-                                         self->base, builder_manifest_get_base_version (self),
-                                         opt_yes,
-                                         error))
-        return FALSE;
+      builder_manifest_add_dep (self, context, opt_user, opt_installation,
+                                self->base, builder_manifest_get_base_version (self),
+                                install_refs, update_refs);
     }
 
-  if (!builder_manifest_install_extension_deps (self, context,
-                                                sdk, sdk_branch, self->sdk_extensions,
-                                                remote,opt_user, opt_installation,
-                                                opt_yes,
-                                                error))
-    return FALSE;
-
-  if (!builder_manifest_install_extension_deps (self, context,
-                                                self->runtime, builder_manifest_get_runtime_version (self),
-                                                self->platform_extensions,
-                                                remote, opt_user, opt_installation,
-                                                opt_yes,
-                                                error))
-    return FALSE;
-
   for (l = self->add_build_extensions; l != NULL; l = l->next)
     {
       BuilderExtension *extension = l->data;
@@ -3851,13 +4870,36 @@ builder_manifest_install_deps (BuilderManifest *self,
         continue;
 
       g_print ("Dependency Extension: %s %s\n", name, version);
-      if (!builder_manifest_install_dep (self, context, remote, opt_user, opt_installation,
-                                         name, version,
-                                         opt_yes,
-                                         error))
-        return FALSE;
+      builder_manifest_add_dep (self, context, opt_user, opt_installation,
+                                name, version,
+                                install_refs, update_refs);
     }
 
+  /* The versions of the sdk and platform extensions are in the
+     metadata of the sdk and runtime, so those must be installed first */
+  if (!builder_manifest_install_queued_deps (remote, opt_user, opt_installation,
+                                             install_refs, update_refs, error))
+    return FALSE;
+
+  if (!builder_manifest_add_extension_deps (self, context,
+                                            sdk, sdk_branch, self->sdk_extensions,
+                                            opt_user, opt_installation,
+                                            install_refs, update_refs,
+                                            error))
+    return FALSE;
+
+  if (!builder_manifest_add_extension_deps (self, context,
+                                            self->runtime, builder_manifest_get_runtime_version (self),
+                                            self->platform_extensions,
+                                            opt_user, opt_installation,
+                                            install_refs, update_refs,
+                                            error))
+    return FALSE;
+
+  if (!builder_manifest_install_queued_deps (remote, opt_user, opt_installation,
+                                             install_refs, update_refs, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -26,9 +26,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/statfs.h>
+#include <sys/stat.h>
 
 #include <glib/gi18n.h>
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
 #include "libglnx/libglnx.h"
 
 #include "builder-flatpak-utils.h"
@@ -36,6 +38,7 @@
 #include "builder-module.h"
 #include "builder-post-process.h"
 #include "builder-manifest.h"
+#include "builder-source-shell.h"
 
 struct BuilderModule
 {
@@ -54,6 +57,7 @@ struct BuilderModule
   char          **ensure_writable;
   char          **only_arches;
   char          **skip_arches;
+  char          **depends;
   gboolean        disabled;
   gboolean        rm_configure;
   gboolean        no_autogen;
@@ -113,24 +117,10 @@ enum {
   PROP_MODULES,
   PROP_BUILD_COMMANDS,
   PROP_TEST_COMMANDS,
+  PROP_DEPENDS,
   LAST_PROP
 };
 
-static void
-collect_cleanup_for_path (const char **patterns,
-                          const char  *path,
-                          const char  *add_prefix,
-                          GHashTable  *to_remove_ht)
-{
-  int i;
-
-  if (patterns == NULL)
-    return;
-
-  for (i = 0; patterns[i] != NULL; i++)
-    flatpak_collect_matches_for_path_pattern (path, patterns[i], add_prefix, to_remove_ht);
-}
-
 static void
 builder_module_finalize (GObject *object)
 {
@@ -149,6 +139,7 @@ builder_module_finalize (GObject *object)
   g_strfreev (self->ensure_writable);
   g_strfreev (self->only_arches);
   g_strfreev (self->skip_arches);
+  g_strfreev (self->depends);
   g_clear_object (&self->build_options);
   g_list_free_full (self->sources, g_object_unref);
   g_strfreev (self->cleanup);
@@ -285,6 +276,10 @@ builder_module_get_property (GObject    *object,
       g_value_set_boolean (value, self->run_tests);
       break;
 
+    case PROP_DEPENDS:
+      g_value_set_boxed (value, self->depends);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -450,6 +445,12 @@ builder_module_set_property (GObject      *object,
       self->run_tests = g_value_get_boolean (value);
       break;
 
+    case PROP_DEPENDS:
+      tmp = self->depends;
+      self->depends = g_strdupv (g_value_get_boxed (value));
+      g_strfreev (tmp);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -658,6 +659,13 @@ builder_module_class_init (BuilderModuleClass *klass)
                                                          "",
                                                          FALSE,
                                                          G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_DEPENDS,
+                                   g_param_spec_boxed ("depends",
+                                                       "",
+                                                       "",
+                                                       G_TYPE_STRV,
+                                                       G_PARAM_READWRITE));
 }
 
 static void
@@ -749,7 +757,7 @@ load_sources_from_json (const char *sources_relpath)
     }
 
   builder_manifest_set_demarshal_base_dir (sources_file_dir);
-  sources_root = json_from_string (sources_json, &error);
+  sources_root = builder_json_node_from_data (sources_relpath, sources_json, &error);
   if (sources_root == NULL)
     {
       g_printerr ("Error parsing %s: %s\n", sources_relpath, error->message);
@@ -974,6 +982,12 @@ builder_module_get_disabled (BuilderModule *self)
   return self->disabled;
 }
 
+const char **
+builder_module_get_depends (BuilderModule *self)
+{
+  return (const char **) self->depends;
+}
+
 GList *
 builder_module_get_sources (BuilderModule *self)
 {
@@ -1036,18 +1050,125 @@ builder_module_download_sources (BuilderModule  *self,
   return TRUE;
 }
 
+/* Returns the checksum of everything that goes into the extracted
+   sources of the module, or NULL if they can't be cached. Shell
+   sources run commands in the app dir, so their result depends on
+   more than the sources themselves. */
+static char *
+get_extracted_sources_checksum (BuilderModule  *self,
+                                BuilderContext *context)
+{
+  g_autoptr(BuilderCache) cache = builder_cache_new (context, builder_context_get_app_dir (context), self->name);
+  GList *l;
+
+  builder_cache_checksum_str (cache, BUILDER_MODULE_CHECKSUM_VERSION);
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      if (!builder_source_is_enabled (source, context))
+        continue;
+
+      if (BUILDER_IS_SOURCE_SHELL (source))
+        return NULL;
+
+      builder_cache_checksum_str (cache, G_OBJECT_TYPE_NAME (source));
+      builder_source_checksum (source, cache, context);
+    }
+
+  if (builder_cache_has_random_checksum (cache))
+    return NULL;
+
+  return g_strdup (g_checksum_get_string (builder_cache_get_checksum (cache)));
+}
+
+/* The extracted sources are kept in extract-cache/$module/$checksum,
+   with only the latest version of each module kept around */
+static gboolean
+save_extracted_sources (GFile   *source_dir,
+                        GFile   *cached_dir,
+                        GError **error)
+{
+  g_autoptr(GFile) module_dir = g_file_get_parent (cached_dir);
+  g_autofree char *basename = g_file_get_basename (cached_dir);
+  g_autofree char *tmp_name = g_strconcat (".tmp-", basename, NULL);
+  g_autoptr(GFile) tmp_dir = g_file_get_child (module_dir, tmp_name);
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  GFileInfo *next;
+
+  if (!flatpak_mkdir_p (module_dir, NULL, error))
+    return FALSE;
+
+  dir_enum = g_file_enumerate_children (module_dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        NULL, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while ((next = g_file_enumerator_next_file (dir_enum, NULL, NULL)))
+    {
+      g_autoptr(GFileInfo) child_info = next;
+      g_autoptr(GFile) child = g_file_get_child (module_dir, g_file_info_get_name (child_info));
+
+      if (!flatpak_rm_rf (child, NULL, error))
+        return FALSE;
+    }
+
+  if (!flatpak_cp_a (source_dir, tmp_dir, FLATPAK_CP_FLAGS_NO_CHOWN, NULL, NULL, error))
+    return FALSE;
+
+  if (rename (flatpak_file_get_path_cached (tmp_dir), flatpak_file_get_path_cached (cached_dir)) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 builder_module_extract_sources (BuilderModule  *self,
                                 GFile          *dest,
                                 BuilderContext *context,
                                 GError        **error)
 {
+  g_autofree char *sources_checksum = NULL;
+  g_autoptr(GFile) cached_dir = NULL;
+  g_autoptr(GError) my_error = NULL;
   GList *l;
 
   if (!g_file_query_exists (dest, NULL) &&
       !g_file_make_directory_with_parents (dest, NULL, error))
     return FALSE;
 
+  if (builder_context_get_cache_extracted_sources (context))
+    sources_checksum = get_extracted_sources_checksum (self, context);
+
+  if (sources_checksum != NULL)
+    {
+      g_autoptr(GFile) module_dir = g_file_get_child (builder_context_get_extract_cache_dir (context), self->name);
+
+      cached_dir = g_file_get_child (module_dir, sources_checksum);
+      if (g_file_query_exists (cached_dir, NULL))
+        {
+          g_print ("Using cached sources for %s\n", self->name);
+
+          /* This is a copy rather than hardlinks, as the build modifies
+             the sources in place. On filesystems with reflinks it doesn't
+             copy any data though. */
+          if (!flatpak_cp_a (cached_dir, dest,
+                             FLATPAK_CP_FLAGS_MERGE | FLATPAK_CP_FLAGS_NO_CHOWN,
+                             NULL, NULL, error))
+            {
+              g_prefix_error (error, "module %s: ", self->name);
+              return FALSE;
+            }
+
+          return TRUE;
+        }
+    }
+
   for (l = self->sources; l != NULL; l = l->next)
     {
       BuilderSource *source = l->data;
@@ -1062,6 +1183,11 @@ builder_module_extract_sources (BuilderModule  *self,
         }
     }
 
+  /* Failing to cache the sources doesn't fail the build */
+  if (cached_dir != NULL &&
+      !save_extracted_sources (dest, cached_dir, &my_error))
+    g_warning ("Failed to cache sources of module %s: %s", self->name, my_error->message);
+
   return TRUE;
 }
 
@@ -1136,6 +1262,27 @@ builder_module_bundle_sources (BuilderModule  *self,
   return TRUE;
 }
 
+static const char *
+get_sandbox_builddir (BuilderContext *context)
+{
+  if (builder_context_get_build_runtime (context))
+    return "/run/build-runtime/";
+  else
+    return "/run/build/";
+}
+
+/* The path of the directory to run commands in, inside the sandbox */
+static char *
+get_sandbox_build_dir (BuilderContext *context,
+                       const char     *module_name,
+                       const char     *cwd_subdir)
+{
+  if (cwd_subdir)
+    return g_strdup_printf ("%s%s/%s", get_sandbox_builddir (context), module_name, cwd_subdir);
+  else
+    return g_strdup_printf ("%s%s", get_sandbox_builddir (context), module_name);
+}
+
 static GPtrArray *
 setup_build_args (GFile          *app_dir,
                   const char     *module_name,
@@ -1150,6 +1297,7 @@ setup_build_args (GFile          *app_dir,
   g_autofree char *source_dir_path = g_file_get_path (source_dir);
   g_autofree char *source_dir_path_canonical = NULL;
   g_autofree char *ccache_dir_path = NULL;
+  g_autofree char *sandbox_build_dir = NULL;
   const char *builddir;
   int i;
 
@@ -1162,10 +1310,7 @@ setup_build_args (GFile          *app_dir,
   if (source_dir_path_canonical == NULL)
     source_dir_path_canonical = g_strdup (source_dir_path);
 
-  if (builder_context_get_build_runtime (context))
-    builddir = "/run/build-runtime/";
-  else
-    builddir = "/run/build/";
+  builddir = get_sandbox_builddir (context);
 
   g_ptr_array_add (args, g_strdup_printf ("--env=FLATPAK_BUILDER_BUILDDIR=%s%s", builddir, module_name));
   g_ptr_array_add (args, g_strdup ("--nofilesystem=host"));
@@ -1178,10 +1323,8 @@ setup_build_args (GFile          *app_dir,
     g_ptr_array_add (args, g_strdup_printf ("--bind-mount=%s=%s", source_dir_path, source_dir_path_canonical));
 
   g_ptr_array_add (args, g_strdup_printf ("--bind-mount=%s%s=%s", builddir, module_name, source_dir_path_canonical));
-  if (cwd_subdir)
-    g_ptr_array_add (args, g_strdup_printf ("--build-dir=%s%s/%s", builddir, module_name, cwd_subdir));
-  else
-    g_ptr_array_add (args, g_strdup_printf ("--build-dir=%s%s", builddir, module_name));
+  sandbox_build_dir = get_sandbox_build_dir (context, module_name, cwd_subdir);
+  g_ptr_array_add (args, g_strdup_printf ("--build-dir=%s", sandbox_build_dir));
 
   if (g_file_query_exists (builder_context_get_ccache_dir (context), NULL))
     {
@@ -1208,6 +1351,258 @@ setup_build_args (GFile          *app_dir,
   return g_steal_pointer (&args);
 }
 
+/* With --persistent-sandbox the commands of a module run in one
+ * long-lived "flatpak build" instead of each setting up its own
+ * sandbox. The shell started in the sandbox waits for a line on the
+ * commands fifo in the control dir, runs the command script next to
+ * it and writes the exit status to the status fifo. We keep both
+ * fifos open read-write, so opening them in the sandbox never blocks
+ * and closing our end of the commands fifo makes the shell exit. */
+#define SANDBOX_CONTROL_DIR "/run/build-control"
+
+static const char sandbox_shell_script[] =
+  "while read -r line <&3; do "
+  "sh " SANDBOX_CONTROL_DIR "/command 3<&-; "
+  "echo $? >" SANDBOX_CONTROL_DIR "/status; "
+  "done 3<" SANDBOX_CONTROL_DIR "/commands";
+
+typedef struct
+{
+  char             **flatpak_opts;
+  char             **env_vars;
+  char              *control_dir;
+  int                commands_fd;
+  GDataInputStream  *status_in;
+  GSubprocess       *subp;
+} BuildSandbox;
+
+static void
+build_sandbox_free (BuildSandbox *sandbox)
+{
+  if (sandbox->commands_fd != -1)
+    close (sandbox->commands_fd);
+  if (sandbox->subp)
+    g_subprocess_wait (sandbox->subp, NULL, NULL);
+  g_clear_object (&sandbox->subp);
+  g_clear_object (&sandbox->status_in);
+  if (sandbox->control_dir)
+    glnx_shutil_rm_rf_at (AT_FDCWD, sandbox->control_dir, NULL, NULL);
+  g_free (sandbox->control_dir);
+  g_strfreev (sandbox->flatpak_opts);
+  g_strfreev (sandbox->env_vars);
+  g_free (sandbox);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuildSandbox, build_sandbox_free)
+
+static gboolean
+strv_equal (char **a,
+            char **b)
+{
+  int i;
+
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  for (i = 0; a[i] != NULL && b[i] != NULL; i++)
+    {
+      if (strcmp (a[i], b[i]) != 0)
+        return FALSE;
+    }
+
+  return a[i] == b[i];
+}
+
+static BuildSandbox *
+build_sandbox_new (GFile          *app_dir,
+                   const char     *module_name,
+                   BuilderContext *context,
+                   GFile          *source_dir,
+                   char          **flatpak_opts,
+                   char          **env_vars,
+                   GError        **error)
+{
+  g_autoptr(BuildSandbox) sandbox = g_new0 (BuildSandbox, 1);
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GInputStream) status_fd_in = NULL;
+  g_autoptr(GFile) cwd_file = NULL;
+  g_autoptr(GPtrArray) args = NULL;
+  g_autofree char *commands_path = NULL;
+  g_autofree char *status_path = NULL;
+  g_autofree char *commandline = NULL;
+  int status_fd;
+
+  sandbox->commands_fd = -1;
+  sandbox->flatpak_opts = g_strdupv (flatpak_opts);
+  sandbox->env_vars = g_strdupv (env_vars);
+
+  sandbox->control_dir = g_dir_make_tmp ("flatpak-builder-sandbox-XXXXXX", error);
+  if (sandbox->control_dir == NULL)
+    return NULL;
+
+  commands_path = g_build_filename (sandbox->control_dir, "commands", NULL);
+  status_path = g_build_filename (sandbox->control_dir, "status", NULL);
+  if (mkfifo (commands_path, 0600) != 0 ||
+      mkfifo (status_path, 0600) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  sandbox->commands_fd = open (commands_path, O_RDWR | O_CLOEXEC);
+  if (sandbox->commands_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  status_fd = open (status_path, O_RDWR | O_CLOEXEC);
+  if (status_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  status_fd_in = g_unix_input_stream_new (status_fd, TRUE);
+  sandbox->status_in = g_data_input_stream_new (status_fd_in);
+
+  args = setup_build_args (app_dir, module_name, context, source_dir, NULL, flatpak_opts, env_vars, &cwd_file);
+  /* The last argument is the app dir, the options go before it */
+  g_ptr_array_insert (args, args->len - 1,
+                      g_strdup_printf ("--bind-mount=" SANDBOX_CONTROL_DIR "=%s", sandbox->control_dir));
+  g_ptr_array_add (args, g_strdup ("/bin/sh"));
+  g_ptr_array_add (args, g_strdup ("-c"));
+  g_ptr_array_add (args, g_strdup (sandbox_shell_script));
+  g_ptr_array_add (args, NULL);
+
+  commandline = flatpak_quote_argv ((const char **) args->pdata);
+  g_debug ("Starting sandbox: %s", commandline);
+
+  launcher = g_subprocess_launcher_new (0);
+  g_subprocess_launcher_setenv (launcher, "LANGUAGE", "C", TRUE);
+  g_subprocess_launcher_set_cwd (launcher, flatpak_file_get_path_cached (cwd_file));
+
+  sandbox->subp = g_subprocess_launcher_spawnv (launcher, (const char * const *) args->pdata, error);
+  if (sandbox->subp == NULL)
+    return NULL;
+
+  return g_steal_pointer (&sandbox);
+}
+
+typedef struct
+{
+  GMainLoop    *loop;
+  int           refs;
+  GCancellable *cancellable;
+  char         *status;
+  gboolean      exited;
+  GError       *error;
+} BuildSandboxRunData;
+
+static void
+build_sandbox_run_data_exit (BuildSandboxRunData *data)
+{
+  g_cancellable_cancel (data->cancellable);
+  data->refs--;
+  if (data->refs == 0)
+    g_main_loop_quit (data->loop);
+}
+
+static void
+build_sandbox_status_cb (GObject      *obj,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  BuildSandboxRunData *data = user_data;
+
+  data->status = g_data_input_stream_read_line_finish (G_DATA_INPUT_STREAM (obj), result, NULL, &data->error);
+  build_sandbox_run_data_exit (data);
+}
+
+static void
+build_sandbox_exit_cb (GObject      *obj,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  BuildSandboxRunData *data = user_data;
+
+  data->exited = g_subprocess_wait_finish (G_SUBPROCESS (obj), result, NULL);
+  build_sandbox_run_data_exit (data);
+}
+
+static gboolean
+build_sandbox_run (BuildSandbox        *sandbox,
+                   const char          *cwd,
+                   const char * const  *argv,
+                   GError             **error)
+{
+  g_autoptr(GMainContext) context = NULL;
+  g_autoptr(GMainLoop) loop = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autofree char *command_path = g_build_filename (sandbox->control_dir, "command", NULL);
+  g_autofree char *quoted_cwd = g_shell_quote (cwd);
+  g_autofree char *commandline = flatpak_quote_argv ((const char **) argv);
+  g_autofree char *script = NULL;
+  BuildSandboxRunData data = {0};
+  gint64 exit_status;
+
+  g_debug ("Running in sandbox: %s", commandline);
+
+  script = g_strdup_printf ("cd %s && exec %s\n", quoted_cwd, commandline);
+  if (!g_file_set_contents (command_path, script, -1, error))
+    return FALSE;
+
+  if (TEMP_FAILURE_RETRY (write (sandbox->commands_fd, "\n", 1)) != 1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  /* Use a private main context so that this can be called from
+     several threads at the same time */
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  loop = g_main_loop_new (context, FALSE);
+
+  data.loop = loop;
+  data.refs = 2;
+  data.cancellable = cancellable;
+
+  g_data_input_stream_read_line_async (sandbox->status_in, G_PRIORITY_DEFAULT, cancellable,
+                                       build_sandbox_status_cb, &data);
+  g_subprocess_wait_async (sandbox->subp, cancellable, build_sandbox_exit_cb, &data);
+
+  g_main_loop_run (loop);
+
+  g_main_context_pop_thread_default (context);
+
+  if (data.status == NULL)
+    {
+      if (data.exited || data.error == NULL)
+        {
+          g_clear_error (&data.error);
+          return flatpak_fail (error, "Build sandbox exited unexpectedly");
+        }
+
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+
+  exit_status = g_ascii_strtoll (data.status, NULL, 10);
+  g_free (data.status);
+  g_clear_error (&data.error);
+
+  if (exit_status != 0)
+    {
+      g_set_error (error, G_SPAWN_EXIT_ERROR, exit_status,
+                   "Child process exited with code %d", (int) exit_status);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 shell (GFile          *app_dir,
        const char     *module_name,
@@ -1244,7 +1639,8 @@ static const char skip_arg[] = "skip";
 static const char strv_arg[] = "strv";
 
 static gboolean
-build (GFile          *app_dir,
+build (BuildSandbox  **sandbox,
+       GFile          *app_dir,
        const char     *module_name,
        BuilderContext *context,
        GFile          *source_dir,
@@ -1256,15 +1652,15 @@ build (GFile          *app_dir,
        ...)
 {
   g_autoptr(GFile) cwd_file = NULL;
-  g_autoptr(GPtrArray) args =
-    setup_build_args (app_dir, module_name, context, source_dir, cwd_subdir, flatpak_opts, env_vars, &cwd_file);
+  g_autoptr(GPtrArray) args = NULL;
+  g_autoptr(GPtrArray) command = g_ptr_array_new_with_free_func (g_free);
   const gchar *arg;
   const gchar **argv;
   va_list ap;
   int i;
 
   va_start (ap, argv1);
-  g_ptr_array_add (args, g_strdup (argv1));
+  g_ptr_array_add (command, g_strdup (argv1));
   while ((arg = va_arg (ap, const gchar *)))
     {
       if (arg == strv_arg)
@@ -1273,16 +1669,44 @@ build (GFile          *app_dir,
           if (argv != NULL)
             {
               for (i = 0; argv[i] != NULL; i++)
-                g_ptr_array_add (args, g_strdup (argv[i]));
+                g_ptr_array_add (command, g_strdup (argv[i]));
             }
         }
       else if (arg != skip_arg)
         {
-          g_ptr_array_add (args, g_strdup (arg));
+          g_ptr_array_add (command, g_strdup (arg));
         }
     }
   va_end (ap);
 
+  g_ptr_array_add (command, NULL);
+
+  if (sandbox != NULL)
+    {
+      g_autofree char *sandbox_build_dir = get_sandbox_build_dir (context, module_name, cwd_subdir);
+
+      /* Commands with different options need a sandbox of their own */
+      if (*sandbox != NULL &&
+          !(strv_equal ((*sandbox)->flatpak_opts, flatpak_opts) &&
+            strv_equal ((*sandbox)->env_vars, env_vars)))
+        g_clear_pointer (sandbox, build_sandbox_free);
+
+      if (*sandbox == NULL)
+        *sandbox = build_sandbox_new (app_dir, module_name, context, source_dir, flatpak_opts, env_vars, error);
+
+      if (*sandbox == NULL ||
+          !build_sandbox_run (*sandbox, sandbox_build_dir, (const char * const *) command->pdata, error))
+        {
+          g_prefix_error (error, "module %s: ", module_name);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  args = setup_build_args (app_dir, module_name, context, source_dir, cwd_subdir, flatpak_opts, env_vars, &cwd_file);
+  for (i = 0; i < command->len - 1; i++)
+    g_ptr_array_add (args, g_strdup (command->pdata[i]));
   g_ptr_array_add (args, NULL);
 
   if (!builder_maybe_host_spawnv (cwd_file, NULL, 0, error, (const char * const *)args->pdata))
@@ -1294,33 +1718,24 @@ build (GFile          *app_dir,
   return TRUE;
 }
 
-gboolean
-builder_module_ensure_writable (BuilderModule  *self,
-                                BuilderCache   *cache,
-                                BuilderContext *context,
-                                GError        **error)
+static gboolean
+ensure_writable_in_dir (BuilderModule  *self,
+                        GPtrArray      *files,
+                        GFile          *app_dir,
+                        GError        **error)
 {
-  g_autoptr(GPtrArray) changes = NULL;
   g_autoptr(GHashTable) matches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  GFile *app_dir = builder_context_get_app_dir (context);
+  g_autoptr(BuilderPathMatcher) matcher = NULL;
   GHashTableIter iter;
   gpointer key, value;
   int i;
 
-  if (cache == NULL)
-    return TRUE;
+  matcher = builder_path_matcher_new ();
+  builder_path_matcher_add_patterns (matcher, (const char **) self->ensure_writable);
 
-  if (self->ensure_writable == NULL ||
-      self->ensure_writable[0] == NULL)
-    return TRUE;
-
-  changes = builder_cache_get_files (cache, error);
-  if (changes == NULL)
-    return FALSE;
-
-  for (i = 0; i < changes->len; i++)
+  for (i = 0; i < files->len; i++)
     {
-      const char *path = g_ptr_array_index (changes, i);
+      const char *path = g_ptr_array_index (files, i);
       const char *unprefixed_path;
       const char *prefix;
 
@@ -1333,7 +1748,7 @@ builder_module_ensure_writable (BuilderModule  *self,
 
       unprefixed_path = path + strlen (prefix);
 
-      collect_cleanup_for_path ((const char **)self->ensure_writable, unprefixed_path, prefix, matches);
+      builder_path_matcher_collect (matcher, unprefixed_path, prefix, matches);
     }
 
   g_hash_table_iter_init (&iter, matches);
@@ -1351,6 +1766,53 @@ builder_module_ensure_writable (BuilderModule  *self,
   return TRUE;
 }
 
+gboolean
+builder_module_ensure_writable (BuilderModule  *self,
+                                BuilderCache   *cache,
+                                BuilderContext *context,
+                                GError        **error)
+{
+  g_autoptr(GPtrArray) changes = NULL;
+
+  if (cache == NULL)
+    return TRUE;
+
+  if (self->ensure_writable == NULL ||
+      self->ensure_writable[0] == NULL)
+    return TRUE;
+
+  changes = builder_cache_get_files (cache, error);
+  if (changes == NULL)
+    return FALSE;
+
+  return ensure_writable_in_dir (self, changes, builder_context_get_app_dir (context), error);
+}
+
+/* Like builder_module_ensure_writable(), for a module that is built in
+ * @staging_dir, a checkout of @base_commit, rather than in the app dir. */
+gboolean
+builder_module_ensure_writable_staged (BuilderModule  *self,
+                                       BuilderCache   *cache,
+                                       const char     *base_commit,
+                                       GFile          *staging_dir,
+                                       GError        **error)
+{
+  g_autoptr(GPtrArray) files = NULL;
+
+  if (base_commit == NULL)
+    return TRUE;
+
+  if (self->ensure_writable == NULL ||
+      self->ensure_writable[0] == NULL)
+    return TRUE;
+
+  files = builder_cache_get_commit_files (cache, base_commit, error);
+  if (files == NULL)
+    return FALSE;
+
+  return ensure_writable_in_dir (self, files, staging_dir, error);
+}
+
 static GFile *
 find_file_with_extension (GFile *dir,
                           const char *extension)
@@ -1375,13 +1837,12 @@ find_file_with_extension (GFile *dir,
 
 static gboolean
 builder_module_build_helper (BuilderModule  *self,
-                             BuilderCache   *cache,
                              BuilderContext *context,
+                             GFile          *app_dir,
                              GFile          *source_dir,
                              gboolean        run_shell,
                              GError        **error)
 {
-  GFile *app_dir = builder_context_get_app_dir (context);
   g_autofree char *make_j = NULL;
   g_autofree char *make_l = NULL;
   g_autofree char *n_jobs = NULL;
@@ -1402,7 +1863,9 @@ builder_module_build_helper (BuilderModule  *self,
   g_autoptr(GFile) source_subdir = NULL;
   const char *source_subdir_relative = NULL;
   g_autofree char *source_dir_path = NULL;
-  BuilderPostProcessFlags post_process_flags = 0;
+  g_autoptr(BuilderProfileSpan) span = NULL;
+  g_autoptr(BuildSandbox) sandbox = NULL;
+  BuildSandbox **sandboxp = NULL;
 
   source_dir_path = g_file_get_path (source_dir);
 
@@ -1412,9 +1875,13 @@ builder_module_build_helper (BuilderModule  *self,
 
   builder_set_term_title (_("Building %s"), self->name);
 
+  span = builder_context_profile_begin (context, self->name, "extract");
+
   if (!builder_module_extract_sources (self, source_dir, context, error))
     return FALSE;
 
+  g_clear_pointer (&span, builder_profile_span_end);
+
   if (self->subdir != NULL && self->subdir[0] != 0)
     {
       source_subdir = g_file_resolve_relative_path (source_dir, self->subdir);
@@ -1520,6 +1987,13 @@ builder_module_build_helper (BuilderModule  *self,
   if (configure_file)
     has_configure = g_file_query_exists (configure_file, NULL);
 
+  span = builder_context_profile_begin (context, self->name, "configure");
+
+  /* When we're sandboxed ourselves, builds are spawned on the host,
+     which can't see the control dir of a persistent sandbox */
+  if (builder_context_get_persistent_sandbox (context) && !flatpak_is_in_sandbox ())
+    sandboxp = &sandbox;
+
   if (configure_file && !has_configure && !self->no_autogen)
     {
       const char *autogen_names[] =  {"autogen", "autogen.sh", "bootstrap", "bootstrap.sh", NULL};
@@ -1543,7 +2017,7 @@ builder_module_build_helper (BuilderModule  *self,
         }
 
       env_with_noconfigure = g_environ_setenv (g_strdupv (env), "NOCONFIGURE", "1", TRUE);
-      if (!build (app_dir, self->name, context, source_dir, source_subdir_relative, build_args, env_with_noconfigure, error,
+      if (!build (sandboxp, app_dir, self->name, context, source_dir, source_subdir_relative, build_args, env_with_noconfigure, error,
                   autogen_cmd, NULL))
         {
           g_prefix_error (error, "module %s: ", self->name);
@@ -1669,7 +2143,7 @@ builder_module_build_helper (BuilderModule  *self,
 
       configure_args = (char **) g_ptr_array_free (g_steal_pointer (&configure_args_arr), FALSE);
 
-      if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
+      if (!build (sandboxp, app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
                   configure_cmd, strv_arg, configure_args, strv_arg, config_opts, NULL))
         return FALSE;
     }
@@ -1726,6 +2200,9 @@ builder_module_build_helper (BuilderModule  *self,
 
   /* Build and install */
 
+  g_clear_pointer (&span, builder_profile_span_end);
+  span = builder_context_profile_begin (context, self->name, "build");
+
   builder_set_term_title (_("Installing %s"), self->name);
 
   if (meson || cmake_ninja)
@@ -1748,7 +2225,7 @@ builder_module_build_helper (BuilderModule  *self,
     {
       g_auto(GStrv) make_args = builder_options_get_make_args (self->build_options, context, self->make_args);
 
-      if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
+      if (!build (sandboxp, app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
                   make_cmd, make_j ? make_j : skip_arg, make_l ? make_l : skip_arg, strv_arg, make_args, NULL))
         return FALSE;
     }
@@ -1756,15 +2233,18 @@ builder_module_build_helper (BuilderModule  *self,
   for (i = 0; self->build_commands != NULL && self->build_commands[i] != NULL; i++)
     {
       g_print ("Running: %s\n", self->build_commands[i]);
-      if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
+      if (!build (sandboxp, app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
                   "/bin/sh", "-c", self->build_commands[i], NULL))
         return FALSE;
     }
 
+  g_clear_pointer (&span, builder_profile_span_end);
+  span = builder_context_profile_begin (context, self->name, "install");
+
   if (!self->no_make_install && make_cmd)
     {
       g_auto(GStrv) make_install_args = builder_options_get_make_install_args (self->build_options, context, self->make_install_args);
-      if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
+      if (!build (sandboxp, app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
                   make_cmd, self->install_rule ? self->install_rule : "install",
                   strv_arg, make_install_args, NULL))
         return FALSE;
@@ -1794,7 +2274,7 @@ builder_module_build_helper (BuilderModule  *self,
     {
       for (i = 0; self->post_install[i] != NULL; i++)
         {
-          if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
+          if (!build (sandboxp, app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
                       "/bin/sh", "-c", self->post_install[i], NULL))
             return FALSE;
         }
@@ -1806,6 +2286,9 @@ builder_module_build_helper (BuilderModule  *self,
     {
       g_auto(GStrv) test_args = NULL;
 
+      g_clear_pointer (&span, builder_profile_span_end);
+      span = builder_context_profile_begin (context, self->name, "test");
+
       builder_set_term_title (_("Testing %s"), self->name);
       g_print ("Running tests\n");
 
@@ -1815,7 +2298,7 @@ builder_module_build_helper (BuilderModule  *self,
 
       if (make_cmd && test_arg && *test_arg != 0)
         {
-          if (!build (app_dir, self->name, context, source_dir, build_dir_relative, test_args, env, error,
+          if (!build (sandboxp, app_dir, self->name, context, source_dir, build_dir_relative, test_args, env, error,
                       make_cmd, test_arg, NULL))
             {
               g_prefix_error (error, "Running %s %s failed: ", make_cmd, test_arg);
@@ -1826,7 +2309,7 @@ builder_module_build_helper (BuilderModule  *self,
       for (i = 0; self->test_commands != NULL && self->test_commands[i] != NULL; i++)
         {
           g_print ("Running: %s\n", self->test_commands[i]);
-          if (!build (app_dir, self->name, context, source_dir, build_dir_relative, test_args, env, error,
+          if (!build (sandboxp, app_dir, self->name, context, source_dir, build_dir_relative, test_args, env, error,
                       "/bin/sh", "-c", self->test_commands[i], NULL))
             {
               g_prefix_error (error, "Running test command '%s' failed: ", self->test_commands[i]);
@@ -1835,6 +2318,19 @@ builder_module_build_helper (BuilderModule  *self,
         }
     }
 
+  return TRUE;
+}
+
+gboolean
+builder_module_post_process (BuilderModule  *self,
+                             BuilderCache   *cache,
+                             BuilderContext *context,
+                             GError        **error)
+{
+  GFile *app_dir = builder_context_get_app_dir (context);
+  BuilderPostProcessFlags post_process_flags = 0;
+  g_autoptr(BuilderProfileSpan) span = NULL;
+
   if (!self->no_python_timestamp_fix)
     post_process_flags |= BUILDER_POST_PROCESS_FLAGS_PYTHON_TIMESTAMPS;
 
@@ -1849,6 +2345,8 @@ builder_module_build_helper (BuilderModule  *self,
 	post_process_flags |= BUILDER_POST_PROCESS_FLAGS_DEBUGINFO_COMPRESSION;
     }
 
+  span = builder_context_profile_begin (context, self->name, "post-process");
+
   if (!builder_post_process (post_process_flags, app_dir,
                              cache, context, error))
     {
@@ -1856,29 +2354,25 @@ builder_module_build_helper (BuilderModule  *self,
       return FALSE;
     }
 
-
   return TRUE;
 }
 
-gboolean
-builder_module_build (BuilderModule  *self,
-                      BuilderCache   *cache,
-                      BuilderContext *context,
-                      gboolean        run_shell,
-                      GError        **error)
+static GFile *
+allocate_build_dir (BuilderModule  *self,
+                    BuilderContext *context,
+                    GError        **error)
 {
   g_autoptr(GFile) source_dir = NULL;
   g_autoptr(GFile) build_parent_dir = NULL;
   g_autoptr(GFile) build_link = NULL;
   g_autoptr(GError) my_error = NULL;
   g_autofree char *buildname = NULL;
-  gboolean res;
 
   source_dir = builder_context_allocate_build_subdir (context, self->name, error);
   if (source_dir == NULL)
     {
       g_prefix_error (error, "module %s: ", self->name);
-      return FALSE;
+      return NULL;
     }
 
   build_parent_dir = g_file_get_parent (source_dir);
@@ -1891,42 +2385,110 @@ builder_module_build (BuilderModule  *self,
     {
       g_propagate_error (error, g_steal_pointer (&my_error));
       g_prefix_error (error, "module %s: ", self->name);
-      return FALSE;
+      return NULL;
     }
   g_clear_error (&my_error);
 
   if (!g_file_make_symbolic_link (build_link,
                                   buildname,
                                   NULL, error))
+    {
+      g_prefix_error (error, "module %s: ", self->name);
+      return NULL;
+    }
+
+  return g_steal_pointer (&source_dir);
+}
+
+/* Removes the build directory (and its unversioned symlink) after a
+ * build, unless the context says it should be kept around. */
+gboolean
+builder_module_cleanup_build_dir (BuilderModule  *self,
+                                  BuilderContext *context,
+                                  GFile          *source_dir,
+                                  gboolean        success,
+                                  GError        **error)
+{
+  g_autoptr(GFile) build_parent_dir = NULL;
+  g_autoptr(GFile) build_link = NULL;
+  g_autoptr(BuilderProfileSpan) span = NULL;
+
+  if (builder_context_get_keep_build_dirs (context) ||
+      !(success || builder_context_get_delete_build_dirs (context)))
+    return TRUE;
+
+  builder_set_term_title (_("Cleanup %s"), self->name);
+
+  span = builder_context_profile_begin (context, self->name, "remove-build-dir");
+
+  build_parent_dir = g_file_get_parent (source_dir);
+  build_link = g_file_get_child (build_parent_dir, self->name);
+
+  if (!g_file_delete (build_link, NULL, error))
     {
       g_prefix_error (error, "module %s: ", self->name);
       return FALSE;
     }
 
-  res = builder_module_build_helper (self, cache, context, source_dir, run_shell, error);
+  if (!flatpak_rm_rf (source_dir, NULL, error))
+    {
+      g_prefix_error (error, "module %s: ", self->name);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+gboolean
+builder_module_build (BuilderModule  *self,
+                      BuilderCache   *cache,
+                      BuilderContext *context,
+                      gboolean        run_shell,
+                      GError        **error)
+{
+  g_autoptr(GFile) source_dir = NULL;
+  gboolean res;
+
+  source_dir = allocate_build_dir (self, context, error);
+  if (source_dir == NULL)
+    return FALSE;
+
+  res = builder_module_build_helper (self, context, builder_context_get_app_dir (context),
+                                     source_dir, run_shell, error);
+  if (res && !run_shell)
+    res = builder_module_post_process (self, cache, context, error);
 
   /* Clean up build dir */
 
   if (!run_shell &&
-      (!builder_context_get_keep_build_dirs (context) &&
-       (res || builder_context_get_delete_build_dirs (context))))
-    {
-      builder_set_term_title (_("Cleanup %s"), self->name);
+      !builder_module_cleanup_build_dir (self, context, source_dir, res, res ? error : NULL))
+    return FALSE;
 
-      if (!g_file_delete (build_link, NULL, error))
-        {
-          g_prefix_error (error, "module %s: ", self->name);
-          return FALSE;
-        }
+  return res;
+}
 
-      if (!flatpak_rm_rf (source_dir, NULL, error))
-        {
-          g_prefix_error (error, "module %s: ", self->name);
-          return FALSE;
-        }
-    }
+/* Builds the module into @app_dir, which is a private copy of the
+ * current app dir rather than the real one, so that several modules
+ * can be built at the same time. Post-processing and removal of the
+ * build directory are left to the caller, which does them once the
+ * result has been merged back into the real app dir. This may be called
+ * from a worker thread. */
+gboolean
+builder_module_build_staged (BuilderModule  *self,
+                             BuilderContext *context,
+                             GFile          *app_dir,
+                             GFile         **source_dir_out,
+                             GError        **error)
+{
+  g_autoptr(GFile) source_dir = NULL;
 
-  return res;
+  source_dir = allocate_build_dir (self, context, error);
+  if (source_dir == NULL)
+    return FALSE;
+
+  *source_dir_out = g_object_ref (source_dir);
+
+  return builder_module_build_helper (self, context, app_dir, source_dir, FALSE, error);
 }
 
 gboolean
@@ -2052,24 +2614,6 @@ builder_module_set_changes (BuilderModule *self,
     }
 }
 
-static gboolean
-matches_cleanup_for_path (const char **patterns,
-                          const char  *path)
-{
-  int i;
-
-  if (patterns == NULL)
-    return FALSE;
-
-  for (i = 0; patterns[i] != NULL; i++)
-    {
-      if (flatpak_matches_path_pattern (path, patterns[i]))
-        return TRUE;
-    }
-
-  return FALSE;
-}
-
 void
 builder_module_cleanup_collect (BuilderModule  *self,
                                 gboolean        platform,
@@ -2080,6 +2624,7 @@ builder_module_cleanup_collect (BuilderModule  *self,
   int i;
   const char **global_patterns;
   const char **local_patterns;
+  g_autoptr(BuilderPathMatcher) matcher = NULL;
 
   if (!self->changes)
     return;
@@ -2095,6 +2640,10 @@ builder_module_cleanup_collect (BuilderModule  *self,
       local_patterns = (const char **) self->cleanup;
     }
 
+  matcher = builder_path_matcher_new ();
+  builder_path_matcher_add_patterns (matcher, global_patterns);
+  builder_path_matcher_add_patterns (matcher, local_patterns);
+
   changed_files = self->changes;
   for (i = 0; i < changed_files->len; i++)
     {
@@ -2111,8 +2660,7 @@ builder_module_cleanup_collect (BuilderModule  *self,
 
       unprefixed_path = path + strlen (prefix);
 
-      collect_cleanup_for_path (global_patterns, unprefixed_path, prefix, to_remove_ht);
-      collect_cleanup_for_path (local_patterns, unprefixed_path, prefix, to_remove_ht);
+      builder_path_matcher_collect (matcher, unprefixed_path, prefix, to_remove_ht);
 
       if (g_str_has_prefix (unprefixed_path, "lib/debug/") &&
           g_str_has_suffix (unprefixed_path, ".debug"))
@@ -2127,8 +2675,7 @@ builder_module_cleanup_collect (BuilderModule  *self,
 
           while (TRUE)
             {
-              if (matches_cleanup_for_path (global_patterns, debug_path) ||
-                  matches_cleanup_for_path (local_patterns, debug_path))
+              if (builder_path_matcher_matches (matcher, debug_path))
                 g_hash_table_insert (to_remove_ht, g_strconcat (prefix, real_path, NULL), GINT_TO_POINTER (1));
 
               real_parent = g_path_get_dirname (real_path);
@@ -44,6 +44,7 @@ gboolean     builder_module_is_enabled (BuilderModule *self,
                                         BuilderContext *context);
 gboolean     builder_module_get_disabled (BuilderModule *self);
 gboolean     builder_module_should_build (BuilderModule *self);
+const char **builder_module_get_depends (BuilderModule *self);
 GList *      builder_module_get_sources (BuilderModule *self);
 GList *      builder_module_get_modules (BuilderModule *self);
 void         builder_module_set_json_path (BuilderModule *self,
@@ -75,12 +76,31 @@ gboolean builder_module_ensure_writable (BuilderModule  *self,
                                          BuilderCache   *cache,
                                          BuilderContext *context,
                                          GError        **error);
+gboolean builder_module_ensure_writable_staged (BuilderModule  *self,
+                                                BuilderCache   *cache,
+                                                const char     *base_commit,
+                                                GFile          *staging_dir,
+                                                GError        **error);
 gboolean builder_module_build (BuilderModule  *self,
                                BuilderCache   *cache,
                                BuilderContext *context,
                                gboolean        run_shell,
                                GError        **error);
-gboolean builder_module_update (BuilderModule  *self,
+gboolean builder_module_build_staged (BuilderModule  *self,
+                                      BuilderContext *context,
+                                      GFile          *app_dir,
+                                      GFile         **source_dir_out,
+                                      GError        **error);
+gboolean builder_module_post_process (BuilderModule  *self,
+                                      BuilderCache   *cache,
+                                      BuilderContext *context,
+                                      GError        **error);
+gboolean builder_module_cleanup_build_dir (BuilderModule  *self,
+                                           BuilderContext *context,
+                                           GFile          *source_dir,
+                                           gboolean        success,
+                                           GError        **error);
+gboolean builder_module_update(BuilderModule  *self,
                                 BuilderContext *context,
                                 GError        **error);
 void     builder_module_checksum (BuilderModule  *self,
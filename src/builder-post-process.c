@@ -348,6 +348,10 @@ builder_post_process_strip (GFile *app_dir,
                             GPtrArray *changed,
                             GError        **error)
 {
+  const char *shared_args[] = { "--remove-section=.comment", "--remove-section=.note", "--strip-unneeded", NULL };
+  const char *exec_args[] = { "--remove-section=.comment", "--remove-section=.note", NULL };
+  g_autoptr(GPtrArray) shared = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) exec = g_ptr_array_new_with_free_func (g_free);
   int i;
 
   for (i = 0; i < changed->len; i++)
@@ -365,164 +369,394 @@ builder_post_process_strip (GFile *app_dir,
 
       g_print ("stripping: %s\n", rel_path);
       if (is_shared)
-        {
-          if (!strip (error, "--remove-section=.comment", "--remove-section=.note", "--strip-unneeded", path, NULL))
-            return FALSE;
-        }
+        g_ptr_array_add (shared, g_steal_pointer (&path));
       else
-        {
-          if (!strip (error, "--remove-section=.comment", "--remove-section=.note", path, NULL))
-            return FALSE;
-        }
+        g_ptr_array_add (exec, g_steal_pointer (&path));
     }
 
+  /* strip handles each file on its own, so do them all in one go */
+  if (!builder_spawn_for_files ("strip", shared_args, shared, error))
+    return FALSE;
+
+  if (!builder_spawn_for_files ("strip", exec_args, exec, error))
+    return FALSE;
+
   return TRUE;
 }
 
+typedef struct
+{
+  char *path;
+  char *debug_path;
+  char *real_debug_path;
+} DebuginfoFile;
+
+static void
+debuginfo_file_free (DebuginfoFile *file)
+{
+  g_free (file->path);
+  g_free (file->debug_path);
+  g_free (file->real_debug_path);
+  g_free (file);
+}
+
+typedef struct
+{
+  GFile          *app_dir;
+  BuilderPostProcessFlags flags;
+  BuilderContext *context;
+  GMutex          lock;
+  GHashTable     *copied_sources;
+  GPtrArray      *files;
+  GPtrArray      *compress;
+  gboolean        no_elfcompress;
+  GError         *error;
+} DebuginfoJobs;
+
 static gboolean
-builder_post_process_debuginfo (GFile          *app_dir,
-                                GPtrArray      *changed,
-				BuilderPostProcessFlags flags,
-                                BuilderContext *context,
-                                GError        **error)
+debuginfo_failed (DebuginfoJobs *jobs)
 {
-  g_autofree char *app_dir_path = g_file_get_path (app_dir);
-  int j;
+  gboolean failed;
 
-  for (j = 0; j < changed->len; j++)
-    {
-      const char *rel_path = (char *) g_ptr_array_index (changed, j);
-      g_autoptr(GFile) file = g_file_resolve_relative_path (app_dir, rel_path);
-      g_autofree char *path = g_file_get_path (file);
-      g_autofree char *debug_path = NULL;
-      g_autofree char *real_debug_path = NULL;
-      g_autofree char *rel_path_dir = g_path_get_dirname (rel_path);
-      g_autofree char *filename = g_path_get_basename (rel_path);
-      g_autofree char *filename_debug = g_strconcat (filename, ".debug", NULL);
-      g_autofree char *debug_dir = NULL;
-      g_autofree char *source_dir_path = NULL;
-      g_autoptr(GFile) source_dir = NULL;
-      g_autofree char *real_debug_dir = NULL;
-      gboolean is_shared, is_stripped;
+  g_mutex_lock (&jobs->lock);
+  failed = jobs->error != NULL;
+  g_mutex_unlock (&jobs->lock);
 
-      if (!is_elf_file (path, &is_shared, &is_stripped))
-        continue;
+  return failed;
+}
 
-      if (is_stripped)
-        continue;
+static void
+debuginfo_set_error (DebuginfoJobs *jobs,
+                     GError        *error)
+{
+  g_mutex_lock (&jobs->lock);
+  if (jobs->error == NULL)
+    jobs->error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&jobs->lock);
+}
 
-      if (g_str_has_prefix (rel_path_dir, "files/"))
-        {
-          debug_dir = g_build_filename (app_dir_path, "files/lib/debug", rel_path_dir + strlen ("files/"), NULL);
-          real_debug_dir = g_build_filename ("/app/lib/debug", rel_path_dir + strlen ("files/"), NULL);
-          source_dir_path = g_build_filename (app_dir_path, "files/lib/debug/source", NULL);
-        }
-      else if (g_str_has_prefix (rel_path_dir, "usr/"))
-        {
-          debug_dir = g_build_filename (app_dir_path, "usr/lib/debug", rel_path_dir, NULL);
-          real_debug_dir = g_build_filename ("/usr/lib/debug", rel_path_dir, NULL);
-          source_dir_path = g_build_filename (app_dir_path, "usr/lib/debug/source", NULL);
-        }
+/* Returns TRUE if @dst_path hasn't been copied by any of the workers
+   yet, many ELF files usually reference the same headers */
+static gboolean
+debuginfo_claim_source (DebuginfoJobs *jobs,
+                        const char    *dst_path)
+{
+  gboolean res = FALSE;
 
-      if (debug_dir)
-        {
-          const char *builddir;
-          g_autoptr(GError) local_error = NULL;
-          g_auto(GStrv) file_refs = NULL;
+  g_mutex_lock (&jobs->lock);
+  if (!g_hash_table_contains (jobs->copied_sources, dst_path))
+    {
+      g_hash_table_add (jobs->copied_sources, g_strdup (dst_path));
+      res = TRUE;
+    }
+  g_mutex_unlock (&jobs->lock);
 
-          if (g_mkdir_with_parents (debug_dir, 0755) != 0)
-            {
-              glnx_set_error_from_errno (error);
-              return FALSE;
-            }
+  return res;
+}
 
-          source_dir = g_file_new_for_path (source_dir_path);
-          if (g_mkdir_with_parents (source_dir_path, 0755) != 0)
-            {
-              glnx_set_error_from_errno (error);
-              return FALSE;
-            }
+/* Splits out the debuginfo with libelf where possible, otherwise
+   queues the file for eu-elfcompress and eu-strip, which are run
+   later for all the files that need it */
+static gboolean
+debuginfo_prepare_file (DebuginfoJobs  *jobs,
+                        const char     *rel_path,
+                        GError        **error)
+{
+  BuilderContext *context = jobs->context;
+  g_autofree char *app_dir_path = g_file_get_path (jobs->app_dir);
+  g_autoptr(GFile) file = g_file_resolve_relative_path (jobs->app_dir, rel_path);
+  g_autofree char *path = g_file_get_path (file);
+  g_autofree char *debug_path = NULL;
+  g_autofree char *real_debug_path = NULL;
+  g_autofree char *rel_path_dir = g_path_get_dirname (rel_path);
+  g_autofree char *filename = g_path_get_basename (rel_path);
+  g_autofree char *filename_debug = g_strconcat (filename, ".debug", NULL);
+  g_autofree char *debug_dir = NULL;
+  g_autofree char *source_dir_path = NULL;
+  g_autoptr(GFile) source_dir = NULL;
+  g_autofree char *real_debug_dir = NULL;
+  gboolean is_shared, is_stripped;
+  const char *builddir;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GError) split_error = NULL;
+  g_auto(GStrv) file_refs = NULL;
+  DebuginfoFile *debuginfo_file;
+  gboolean compress;
+
+  if (!is_elf_file (path, &is_shared, &is_stripped))
+    return TRUE;
+
+  if (is_stripped)
+    return TRUE;
+
+  if (g_str_has_prefix (rel_path_dir, "files/"))
+    {
+      debug_dir = g_build_filename (app_dir_path, "files/lib/debug", rel_path_dir + strlen ("files/"), NULL);
+      real_debug_dir = g_build_filename ("/app/lib/debug", rel_path_dir + strlen ("files/"), NULL);
+      source_dir_path = g_build_filename (app_dir_path, "files/lib/debug/source", NULL);
+    }
+  else if (g_str_has_prefix (rel_path_dir, "usr/"))
+    {
+      debug_dir = g_build_filename (app_dir_path, "usr/lib/debug", rel_path_dir, NULL);
+      real_debug_dir = g_build_filename ("/usr/lib/debug", rel_path_dir, NULL);
+      source_dir_path = g_build_filename (app_dir_path, "usr/lib/debug/source", NULL);
+    }
 
-          if (builder_context_get_build_runtime (context))
-            builddir = "/run/build-runtime/";
-          else
-            builddir = "/run/build/";
+  if (debug_dir == NULL)
+    return TRUE;
 
-          debug_path = g_build_filename (debug_dir, filename_debug, NULL);
-          real_debug_path = g_build_filename (real_debug_dir, filename_debug, NULL);
+  if (g_mkdir_with_parents (debug_dir, 0755) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-          file_refs = builder_get_debuginfo_file_references (path, &local_error);
+  source_dir = g_file_new_for_path (source_dir_path);
+  if (g_mkdir_with_parents (source_dir_path, 0755) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-          if (file_refs == NULL)
-            {
-              g_warning ("%s", local_error->message);
-            }
-          else
+  if (builder_context_get_build_runtime (context))
+    builddir = "/run/build-runtime/";
+  else
+    builddir = "/run/build/";
+
+  debug_path = g_build_filename (debug_dir, filename_debug, NULL);
+  real_debug_path = g_build_filename (real_debug_dir, filename_debug, NULL);
+
+  file_refs = builder_get_debuginfo_file_references (path, &local_error);
+
+  if (file_refs == NULL)
+    {
+      g_warning ("%s", local_error->message);
+    }
+  else
+    {
+      GFile *build_dir = builder_context_get_build_dir (context);
+      int i;
+      for (i = 0; file_refs[i] != NULL; i++)
+        {
+          if (g_str_has_prefix (file_refs[i], builddir))
             {
-              GFile *build_dir = builder_context_get_build_dir (context);
-              int i;
-              for (i = 0; file_refs[i] != NULL; i++)
+              const char *relative_path = file_refs[i] + strlen (builddir);
+              g_autoptr(GFile) src = g_file_resolve_relative_path (build_dir, relative_path);
+              g_autoptr(GFile) dst = g_file_resolve_relative_path (source_dir, relative_path);
+              g_autoptr(GFile) dst_parent = g_file_get_parent (dst);
+              GFileType file_type;
+
+              if (!debuginfo_claim_source (jobs, flatpak_file_get_path_cached (dst)))
+                continue;
+
+              if (!flatpak_mkdir_p (dst_parent, NULL, error))
+                return FALSE;
+
+              file_type = g_file_query_file_type (src, 0, NULL);
+              if (file_type == G_FILE_TYPE_DIRECTORY)
+                {
+                  if (!flatpak_mkdir_p (dst, NULL, error))
+                    return FALSE;
+                }
+              else if (file_type == G_FILE_TYPE_REGULAR)
                 {
-                  if (g_str_has_prefix (file_refs[i], builddir))
-                    {
-                      const char *relative_path = file_refs[i] + strlen (builddir);
-                      g_autoptr(GFile) src = g_file_resolve_relative_path (build_dir, relative_path);
-                      g_autoptr(GFile) dst = g_file_resolve_relative_path (source_dir, relative_path);
-                      g_autoptr(GFile) dst_parent = g_file_get_parent (dst);
-                      GFileType file_type;
-
-                      if (!flatpak_mkdir_p (dst_parent, NULL, error))
-                        return FALSE;
-
-                      file_type = g_file_query_file_type (src, 0, NULL);
-                      if (file_type == G_FILE_TYPE_DIRECTORY)
-                        {
-                          if (!flatpak_mkdir_p (dst, NULL, error))
-                            return FALSE;
-                        }
-                      else if (file_type == G_FILE_TYPE_REGULAR)
-                        {
-                          /* Make sure the target is gone, because g_file_copy does
-                             truncation on hardlinked destinations */
-                          (void)g_file_delete (dst, NULL, NULL);
-
-                          if (!g_file_copy (src, dst,
-                                            G_FILE_COPY_OVERWRITE,
-                                            NULL, NULL, NULL, error))
-                            return FALSE;
-                        }
-                    }
+                  /* Make sure the target is gone, because g_file_copy does
+                     truncation on hardlinked destinations */
+                  (void)g_file_delete (dst, NULL, NULL);
+
+                  if (!g_file_copy (src, dst,
+                                    G_FILE_COPY_OVERWRITE,
+                                    NULL, NULL, NULL, error))
+                    return FALSE;
                 }
             }
+        }
+    }
 
-          /* Some files are hardlinked and eu-strip modifies in-place,
-             which breaks rofiles-fuse. Unlink them */
-          if (!flatpak_break_hardlink (file, error))
-            return FALSE;
+  /* Some files are hardlinked and eu-strip modifies in-place,
+     which breaks rofiles-fuse. Unlink them */
+  if (!flatpak_break_hardlink (file, error))
+    return FALSE;
 
-	  if (flags & BUILDER_POST_PROCESS_FLAGS_DEBUGINFO_COMPRESSION)
-	    {
-	      g_autoptr(GError) my_error = NULL;
-	      g_print ("compressing debuginfo in: %s\n", path);
-	      if (!eu_elfcompress (&my_error, "-t", "zlib-gnu", "-v", path, NULL))
-		{
-		  if (g_error_matches (my_error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT))
-		    g_print ("Warning: eu-elfcompress not installed, will not compress debuginfo\n");
-		  else
-		    {
-		      g_propagate_error (error, g_steal_pointer (&my_error));
-		      return FALSE;
-		    }
-		}
-	    }
-
-          g_print ("stripping %s to %s\n", path, debug_path);
-          if (!eu_strip (error, "--remove-comment", "--reloc-debug-sections",
-                         "-f", debug_path,
-                         "-F", real_debug_path,
-                         path, NULL))
-            return FALSE;
+  compress = (jobs->flags & BUILDER_POST_PROCESS_FLAGS_DEBUGINFO_COMPRESSION) != 0;
+
+  g_print ("stripping %s to %s\n", path, debug_path);
+  if (builder_elf_split_debuginfo (path, debug_path, real_debug_path, compress, &split_error))
+    return TRUE;
+
+  if (!g_error_matches (split_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+    {
+      g_propagate_error (error, g_steal_pointer (&split_error));
+      return FALSE;
+    }
+
+  /* Anything libelf can't split on its own goes through eu-strip,
+     which is spawned once per file as it only takes one -f */
+  debuginfo_file = g_new0 (DebuginfoFile, 1);
+  debuginfo_file->path = g_strdup (path);
+  debuginfo_file->debug_path = g_steal_pointer (&debug_path);
+  debuginfo_file->real_debug_path = g_steal_pointer (&real_debug_path);
+
+  /* Files built without -g only have a symtab, don't spawn
+     eu-elfcompress for those */
+  compress = compress && elf_has_debuginfo_to_compress (path);
+
+  g_mutex_lock (&jobs->lock);
+  g_ptr_array_add (jobs->files, debuginfo_file);
+  if (compress)
+    g_ptr_array_add (jobs->compress, g_strdup (path));
+  g_mutex_unlock (&jobs->lock);
+
+  return TRUE;
+}
+
+static void
+debuginfo_prepare_thread (gpointer data,
+                          gpointer user_data)
+{
+  const char *rel_path = data;
+  DebuginfoJobs *jobs = user_data;
+  GError *local_error = NULL;
+
+  /* Don't start on more files once one of them failed */
+  if (debuginfo_failed (jobs))
+    return;
+
+  if (!debuginfo_prepare_file (jobs, rel_path, &local_error))
+    debuginfo_set_error (jobs, local_error);
+}
+
+static void
+debuginfo_compress_thread (gpointer data,
+                           gpointer user_data)
+{
+  GPtrArray *paths = data;
+  DebuginfoJobs *jobs = user_data;
+  const char *args[] = { "-t", "zlib-gnu", "-v", NULL };
+  GError *local_error = NULL;
+  int i;
+
+  if (debuginfo_failed (jobs))
+    return;
+
+  for (i = 0; i < paths->len; i++)
+    g_print ("compressing debuginfo in: %s\n", (char *) g_ptr_array_index (paths, i));
+
+  if (!builder_spawn_for_files ("eu-elfcompress", args, paths, &local_error))
+    {
+      if (g_error_matches (local_error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT))
+        {
+          g_mutex_lock (&jobs->lock);
+          jobs->no_elfcompress = TRUE;
+          g_mutex_unlock (&jobs->lock);
+          g_error_free (local_error);
         }
+      else
+        debuginfo_set_error (jobs, local_error);
+    }
+}
+
+static void
+debuginfo_strip_thread (gpointer data,
+                        gpointer user_data)
+{
+  DebuginfoFile *file = data;
+  DebuginfoJobs *jobs = user_data;
+  GError *local_error = NULL;
+
+  if (debuginfo_failed (jobs))
+    return;
+
+  if (!eu_strip (&local_error, "--remove-comment", "--reloc-debug-sections",
+                 "-f", file->debug_path,
+                 "-F", file->real_debug_path,
+                 file->path, NULL))
+    debuginfo_set_error (jobs, local_error);
+}
+
+/* Runs @func on each of @items on a pool of @n_jobs threads, or on
+   this thread if there is only one */
+static void
+debuginfo_run (GFunc          func,
+               GPtrArray     *items,
+               int            n_jobs,
+               DebuginfoJobs *jobs)
+{
+  int i;
+
+  if (n_jobs > 1 && items->len > 1)
+    {
+      GThreadPool *pool = g_thread_pool_new (func, jobs, MIN (n_jobs, items->len), FALSE, NULL);
+
+      for (i = 0; i < items->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (items, i), NULL);
+
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+  else
+    {
+      for (i = 0; i < items->len; i++)
+        func (g_ptr_array_index (items, i), jobs);
+    }
+}
+
+/* The changed files are processed on a pool of up to
+   builder_context_get_jobs() threads. Most files are split and
+   compressed in-process, the rest wait for eu-strip and
+   eu-elfcompress. eu-elfcompress handles several files per run, so it
+   is only spawned once per thread. */
+static gboolean
+builder_post_process_debuginfo (GFile          *app_dir,
+                                GPtrArray      *changed,
+				BuilderPostProcessFlags flags,
+                                BuilderContext *context,
+                                GError        **error)
+{
+  DebuginfoJobs jobs = { 0 };
+  g_autoptr(GPtrArray) batches = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+  int n_jobs = builder_context_get_jobs (context);
+  int j;
+
+  jobs.app_dir = app_dir;
+  jobs.flags = flags;
+  jobs.context = context;
+  jobs.copied_sources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  jobs.files = g_ptr_array_new_with_free_func ((GDestroyNotify) debuginfo_file_free);
+  jobs.compress = g_ptr_array_new_with_free_func (g_free);
+  g_mutex_init (&jobs.lock);
+
+  debuginfo_run (debuginfo_prepare_thread, changed, n_jobs, &jobs);
+
+  if (jobs.error == NULL && jobs.compress->len > 0)
+    {
+      int n_batches = MIN (n_jobs, jobs.compress->len);
+
+      for (j = 0; j < n_batches; j++)
+        g_ptr_array_add (batches, g_ptr_array_new ());
+      for (j = 0; j < jobs.compress->len; j++)
+        g_ptr_array_add (g_ptr_array_index (batches, j % n_batches),
+                         g_ptr_array_index (jobs.compress, j));
+
+      debuginfo_run (debuginfo_compress_thread, batches, n_jobs, &jobs);
+
+      if (jobs.no_elfcompress)
+        g_print ("Warning: eu-elfcompress not installed, will not compress debuginfo\n");
+    }
+
+  if (jobs.error == NULL)
+    debuginfo_run (debuginfo_strip_thread, jobs.files, n_jobs, &jobs);
+
+  g_ptr_array_unref (jobs.files);
+  g_ptr_array_unref (jobs.compress);
+  g_hash_table_unref (jobs.copied_sources);
+  g_mutex_clear (&jobs.lock);
+
+  if (jobs.error)
+    {
+      g_propagate_error (error, jobs.error);
+      return FALSE;
     }
 
   return TRUE;
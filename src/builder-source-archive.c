@@ -27,6 +27,13 @@
 #include <stdlib.h>
 #include <sys/statfs.h>
 
+#ifdef FLATPAK_BUILDER_ENABLE_LIBARCHIVE
+#include <sched.h>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+#endif
+
 #include "builder-flatpak-utils.h"
 
 #include "builder-utils.h"
@@ -84,6 +91,8 @@ typedef enum {
   ZIP
 } BuilderArchiveType;
 
+#ifndef FLATPAK_BUILDER_ENABLE_LIBARCHIVE
+
 static gboolean
 is_tar (BuilderArchiveType type)
 {
@@ -122,6 +131,8 @@ tar_decompress_flag (BuilderArchiveType type)
     }
 }
 
+#endif
+
 static void
 builder_source_archive_finalize (GObject *object)
 {
@@ -397,10 +408,10 @@ builder_source_archive_download (BuilderSource  *source,
 
   if (g_file_query_exists (file, NULL))
     {
-      return !is_local || checksums[0] == NULL ||
-             builder_verify_checksums (base_name, file,
-                                       checksums, checksums_type,
-                                       error);
+      return (!is_local && !builder_context_get_reverify (context)) || checksums[0] == NULL ||
+             builder_context_verify_checksums (context, base_name, file,
+                                               checksums, checksums_type,
+                                               error);
     }
 
   if (is_local)
@@ -421,6 +432,8 @@ builder_source_archive_download (BuilderSource  *source,
   return TRUE;
 }
 
+#ifndef FLATPAK_BUILDER_ENABLE_LIBARCHIVE
+
 static gboolean
 tar (GFile   *dir,
      GError **error,
@@ -467,6 +480,8 @@ unrpm (GFile   *dir,
   return res;
 }
 
+#endif
+
 static BuilderArchiveType
 get_type (GFile *archivefile)
 {
@@ -517,6 +532,216 @@ get_type (GFile *archivefile)
   return UNKNOWN;
 }
 
+#ifdef FLATPAK_BUILDER_ENABLE_LIBARCHIVE
+
+typedef struct archive BuilderAutoArchiveRead;
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderAutoArchiveRead, archive_read_free)
+
+typedef struct archive BuilderAutoArchiveWrite;
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderAutoArchiveWrite, archive_write_free)
+
+/* Big reads, as source tarballs are usually read sequentially and
+   only once */
+#define ARCHIVE_BLOCK_SIZE (1024 * 1024)
+
+static gboolean
+archive_error (struct archive *a,
+               const char     *archive_path,
+               GError        **error)
+{
+  const char *msg = archive_error_string (a);
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to extract %s: %s",
+               archive_path, msg ? msg : "unknown error");
+  return FALSE;
+}
+
+/* Returns @path without its first @level components, or %NULL if that
+ * leaves nothing, like tar --strip-components. Leading slashes are
+ * dropped, as tar does. */
+static const char *
+strip_path_components (const char *path,
+                       guint       level)
+{
+  while (*path == '/')
+    path++;
+
+  for (; level > 0; level--)
+    {
+      path = strchr (path, '/');
+      if (path == NULL)
+        return NULL;
+
+      while (*path == '/')
+        path++;
+    }
+
+  if (*path == 0)
+    return NULL;
+
+  return path;
+}
+
+static gboolean
+copy_archive_data (struct archive *a,
+                   struct archive *ext,
+                   const char     *archive_path,
+                   GError        **error)
+{
+  const void *buf;
+  size_t size;
+  int64_t offset;
+  int r;
+
+  while ((r = archive_read_data_block (a, &buf, &size, &offset)) == ARCHIVE_OK)
+    {
+      if (archive_write_data_block (ext, buf, size, offset) < ARCHIVE_OK)
+        return archive_error (ext, archive_path, error);
+    }
+
+  if (r != ARCHIVE_EOF)
+    return archive_error (a, archive_path, error);
+
+  return TRUE;
+}
+
+/* Extracts any of the supported archive types in-process, into the
+ * current directory. Leading path components are stripped from each
+ * entry as it is read, so unlike with unzip and rpm2cpio nothing has
+ * to be moved into place afterwards. Entries are extracted by their
+ * relative path, so that libarchive can refuse any that would end up
+ * outside the current directory, through ".." or a symlink. */
+static gboolean
+extract_archive_here (const char *archive_path,
+                      guint       strip_components,
+                      GError    **error)
+{
+  g_autoptr(BuilderAutoArchiveRead) a = archive_read_new ();
+  g_autoptr(BuilderAutoArchiveWrite) ext = archive_write_disk_new ();
+  struct archive_entry *entry;
+  int r;
+
+  /* This covers tar with any compression, zip, and rpm (cpio inside
+     the rpm filter) */
+  archive_read_support_filter_all (a);
+  archive_read_support_format_all (a);
+
+  /* Like tar --no-same-owner */
+  archive_write_disk_set_options (ext,
+                                  ARCHIVE_EXTRACT_TIME |
+                                  ARCHIVE_EXTRACT_PERM |
+                                  ARCHIVE_EXTRACT_SECURE_NODOTDOT |
+                                  ARCHIVE_EXTRACT_SECURE_SYMLINKS |
+                                  ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS);
+
+  if (archive_read_open_filename (a, archive_path, ARCHIVE_BLOCK_SIZE) != ARCHIVE_OK)
+    return archive_error (a, archive_path, error);
+
+  while (TRUE)
+    {
+      g_autofree char *entry_dest = NULL;
+      g_autofree char *hardlink_dest = NULL;
+      const char *path;
+      const char *hardlink;
+
+      r = archive_read_next_header (a, &entry);
+      if (r == ARCHIVE_EOF)
+        break;
+      if (r < ARCHIVE_WARN)
+        return archive_error (a, archive_path, error);
+
+      path = strip_path_components (archive_entry_pathname (entry), strip_components);
+      if (path == NULL)
+        continue;
+
+      hardlink = archive_entry_hardlink (entry);
+      if (hardlink != NULL)
+        {
+          hardlink = strip_path_components (hardlink, strip_components);
+          if (hardlink == NULL)
+            continue;
+
+          hardlink_dest = g_strdup (hardlink);
+        }
+
+      /* These point into the entry, so copy them before setting */
+      entry_dest = g_strdup (path);
+      archive_entry_set_pathname (entry, entry_dest);
+      if (hardlink_dest)
+        archive_entry_set_hardlink (entry, hardlink_dest);
+
+      r = archive_write_header (ext, entry);
+      if (r < ARCHIVE_WARN)
+        return archive_error (ext, archive_path, error);
+
+      /* Streamed zip entries don't have their size in the header */
+      if ((!archive_entry_size_is_set (entry) || archive_entry_size (entry) > 0) &&
+          !copy_archive_data (a, ext, archive_path, error))
+        return FALSE;
+
+      if (archive_write_finish_entry (ext) < ARCHIVE_WARN)
+        return archive_error (ext, archive_path, error);
+    }
+
+  if (archive_write_close (ext) != ARCHIVE_OK)
+    return archive_error (ext, archive_path, error);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  int         dest_dfd;
+  const char *archive_path;
+  guint       strip_components;
+  gboolean    res;
+  GError     *error;
+} ExtractArchiveData;
+
+static gpointer
+extract_archive_thread (gpointer user_data)
+{
+  ExtractArchiveData *data = user_data;
+
+  /* Modules are built in parallel, so the cwd must only change for
+     this thread */
+  if (unshare (CLONE_FS) != 0 || fchdir (data->dest_dfd) != 0)
+    {
+      glnx_set_error_from_errno (&data->error);
+      return NULL;
+    }
+
+  data->res = extract_archive_here (data->archive_path, data->strip_components, &data->error);
+
+  return NULL;
+}
+
+static gboolean
+extract_archive (GFile      *dest,
+                 const char *archive_path,
+                 guint       strip_components,
+                 GError    **error)
+{
+  glnx_fd_close int dest_dfd = -1;
+  ExtractArchiveData data = { -1, archive_path, strip_components, };
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (dest), TRUE, &dest_dfd, error))
+    return FALSE;
+
+  data.dest_dfd = dest_dfd;
+  g_thread_join (g_thread_new ("extract-archive", extract_archive_thread, &data));
+
+  if (!data.res)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+#else
+
 static gboolean
 strip_components_into (GFile   *dest,
                        GFile   *src,
@@ -596,6 +821,8 @@ create_uncompress_directory (BuilderSourceArchive *self, GFile *dest, GError **e
   return uncompress_dest;
 }
 
+#endif
+
 static gboolean
 git (GFile   *dir,
      GError **error,
@@ -651,6 +878,16 @@ builder_source_archive_extract (BuilderSource  *source,
 
   archive_path = g_file_get_path (archivefile);
 
+  if (type == UNKNOWN)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown archive format of '%s'", archive_path);
+      return FALSE;
+    }
+
+#ifdef FLATPAK_BUILDER_ENABLE_LIBARCHIVE
+  if (!extract_archive (dest, archive_path, self->strip_components, error))
+    return FALSE;
+#else
   if (is_tar (type))
     {
       g_autofree char *strip_components = g_strdup_printf ("--strip-components=%u", self->strip_components);
@@ -692,11 +929,7 @@ builder_source_archive_extract (BuilderSource  *source,
             return FALSE;
         }
     }
-  else
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown archive format of '%s'", archive_path);
-      return FALSE;
-    }
+#endif
 
   if (self->git_init)
     {
@@ -257,12 +257,128 @@ builder_source_dir_update (BuilderSource  *source,
   return TRUE;
 }
 
+static int
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+/* Checksums the names, modes, symlink targets and file contents in the
+ * directory @path (open as @dfd), in name order so that the checksum
+ * doesn't depend on the order of the directory entries. */
+static gboolean
+checksum_dir_recurse (BuilderCache   *cache,
+                      BuilderContext *context,
+                      int             dfd,
+                      const char     *path,
+                      GHashTable     *skip,
+                      GError        **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  struct dirent *dent;
+  int i;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      g_ptr_array_add (names, g_strdup (dent->d_name));
+    }
+
+  g_ptr_array_sort (names, compare_names);
+
+  for (i = 0; i < names->len; i++)
+    {
+      const char *name = g_ptr_array_index (names, i);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+      struct stat st;
+
+      if (g_hash_table_contains (skip, child_path))
+        continue;
+
+      if (fstatat (iter.fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return glnx_throw_errno_prefix (error, "stat %s", child_path);
+
+      builder_cache_checksum_str (cache, name);
+      builder_cache_checksum_uint32 (cache, st.st_mode);
+
+      if (S_ISDIR (st.st_mode))
+        {
+          if (!checksum_dir_recurse (cache, context, iter.fd, child_path, skip, error))
+            return FALSE;
+
+          /* Names are never empty, so this marks the end of the directory */
+          builder_cache_checksum_str (cache, "");
+        }
+      else if (S_ISLNK (st.st_mode))
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (iter.fd, name, NULL, error);
+
+          if (target == NULL)
+            return FALSE;
+
+          builder_cache_checksum_str (cache, target);
+        }
+      else if (S_ISREG (st.st_mode))
+        {
+          g_autofree char *checksum = builder_context_get_file_checksum (context, iter.fd, name,
+                                                                         child_path, &st, error);
+          if (checksum == NULL)
+            return FALSE;
+
+          builder_cache_checksum_str (cache, checksum);
+        }
+    }
+
+  return TRUE;
+}
+
 static void
 builder_source_dir_checksum (BuilderSource  *source,
                               BuilderCache   *cache,
                               BuilderContext *context)
 {
-  /* We can't realistically checksum a directory, so always rebuild */
+  BuilderSourceDir *self = BUILDER_SOURCE_DIR (source);
+  g_autoptr(GFile) src = NULL;
+  g_autoptr(GPtrArray) skip = NULL;
+  g_autoptr(GHashTable) skip_paths = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GError) error = NULL;
+  int i;
+
+  builder_cache_checksum_str (cache, self->path);
+  builder_cache_checksum_strv (cache, self->skip);
+
+  src = get_source_file (self, context, &error);
+  if (src == NULL)
+    goto fail;
+
+  /* Skip the same things as extract does */
+  skip = builder_source_dir_get_skip (source, context);
+  for (i = 0; i < skip->len; i++)
+    g_hash_table_add (skip_paths, (char *) flatpak_file_get_path_cached (g_ptr_array_index (skip, i)));
+
+  if (!checksum_dir_recurse (cache, context, AT_FDCWD,
+                             flatpak_file_get_path_cached (src),
+                             skip_paths, &error))
+    goto fail;
+
+  if (!builder_context_save_file_checksums (context, &error))
+    g_warning ("Failed to save file checksums: %s", error->message);
+
+  return;
+
+fail:
+  /* Without a checksum of the contents, always rebuild */
+  g_warning ("Can't checksum directory %s, it will be rebuilt: %s", self->path, error->message);
   builder_cache_checksum_random (cache);
 }
 
@@ -361,10 +361,10 @@ builder_source_file_download (BuilderSource  *source,
 
   if (g_file_query_exists (file, NULL))
     {
-      return !is_local || checksums[0] == NULL ||
-             builder_verify_checksums (base_name, file,
-                                       checksums, checksums_type,
-                                       error);
+      return (!is_local && !builder_context_get_reverify (context)) || checksums[0] == NULL ||
+             builder_context_verify_checksums (context, base_name, file,
+                                               checksums, checksums_type,
+                                               error);
     }
 
   if (is_inline)
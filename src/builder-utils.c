@@ -30,6 +30,10 @@
 #include <stdio.h>
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <glib-unix.h>
 #include <gio/gunixfdlist.h>
@@ -141,6 +145,295 @@ flatpak_matches_path_pattern (const char *path,
   return flatpak_path_match_prefix (pattern, path) != NULL;
 }
 
+/* A set of cleanup patterns, compiled so that a path can be matched
+ * against all of them at once, with the same results as calling
+ * flatpak_collect_matches_for_path_pattern() for each one.
+ *
+ * Absolute patterns are stored in a trie with one level per path
+ * component, with literal components in a hash table and the ones
+ * with wildcards in a list. A path is matched by walking the set of
+ * trie nodes that match its components so far. Relative patterns only
+ * match the basename, and most of them are either literal names or
+ * "*.ext", so those are looked up in hash tables. */
+typedef struct PathMatcherNode PathMatcherNode;
+
+struct PathMatcherNode
+{
+  GHashTable *children;      /* component -> PathMatcherNode */
+  GPtrArray  *glob_children; /* PathMatcherGlob */
+  gboolean    match;
+};
+
+typedef struct
+{
+  char            *pattern;
+  PathMatcherNode *node;
+} PathMatcherGlob;
+
+struct BuilderPathMatcher
+{
+  PathMatcherNode *root;
+  GHashTable      *basenames;
+  GHashTable      *suffixes;
+  GPtrArray       *basename_globs;
+};
+
+static void path_matcher_node_free (PathMatcherNode *node);
+
+static void
+path_matcher_glob_free (PathMatcherGlob *glob)
+{
+  g_free (glob->pattern);
+  path_matcher_node_free (glob->node);
+  g_free (glob);
+}
+
+static void
+path_matcher_node_free (PathMatcherNode *node)
+{
+  g_clear_pointer (&node->children, g_hash_table_unref);
+  g_clear_pointer (&node->glob_children, g_ptr_array_unref);
+  g_free (node);
+}
+
+static gboolean
+has_wildcard (const char *pattern)
+{
+  return strpbrk (pattern, "*?") != NULL;
+}
+
+static PathMatcherNode *
+path_matcher_node_ensure_child (PathMatcherNode *node,
+                                const char      *component)
+{
+  PathMatcherNode *child;
+  PathMatcherGlob *glob;
+  int i;
+
+  if (!has_wildcard (component))
+    {
+      if (node->children == NULL)
+        node->children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify) path_matcher_node_free);
+
+      child = g_hash_table_lookup (node->children, component);
+      if (child == NULL)
+        {
+          child = g_new0 (PathMatcherNode, 1);
+          g_hash_table_insert (node->children, g_strdup (component), child);
+        }
+
+      return child;
+    }
+
+  if (node->glob_children == NULL)
+    node->glob_children = g_ptr_array_new_with_free_func ((GDestroyNotify) path_matcher_glob_free);
+
+  for (i = 0; i < node->glob_children->len; i++)
+    {
+      glob = g_ptr_array_index (node->glob_children, i);
+      if (strcmp (glob->pattern, component) == 0)
+        return glob->node;
+    }
+
+  glob = g_new0 (PathMatcherGlob, 1);
+  glob->pattern = g_strdup (component);
+  glob->node = g_new0 (PathMatcherNode, 1);
+  g_ptr_array_add (node->glob_children, glob);
+
+  return glob->node;
+}
+
+BuilderPathMatcher *
+builder_path_matcher_new (void)
+{
+  BuilderPathMatcher *self = g_new0 (BuilderPathMatcher, 1);
+
+  self->root = g_new0 (PathMatcherNode, 1);
+  self->basenames = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->suffixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->basename_globs = g_ptr_array_new_with_free_func (g_free);
+
+  return self;
+}
+
+void
+builder_path_matcher_free (BuilderPathMatcher *self)
+{
+  path_matcher_node_free (self->root);
+  g_hash_table_unref (self->basenames);
+  g_hash_table_unref (self->suffixes);
+  g_ptr_array_unref (self->basename_globs);
+  g_free (self);
+}
+
+void
+builder_path_matcher_add_patterns (BuilderPathMatcher *self,
+                                   const char        **patterns)
+{
+  int i, j;
+
+  for (i = 0; patterns != NULL && patterns[i] != NULL; i++)
+    {
+      const char *pattern = patterns[i];
+
+      if (pattern[0] == '/')
+        {
+          g_auto(GStrv) components = NULL;
+          PathMatcherNode *node = self->root;
+
+          while (*pattern == '/')
+            pattern++;
+
+          components = g_strsplit (pattern, "/", -1);
+          for (j = 0; components[j] != NULL; j++)
+            node = path_matcher_node_ensure_child (node, components[j]);
+
+          node->match = TRUE;
+        }
+      else if (!has_wildcard (pattern))
+        g_hash_table_add (self->basenames, g_strdup (pattern));
+      else if (pattern[0] == '*' && pattern[1] == '.' && !has_wildcard (pattern + 1))
+        g_hash_table_add (self->suffixes, g_strdup (pattern + 1));
+      else
+        g_ptr_array_add (self->basename_globs, g_strdup (pattern));
+    }
+}
+
+/* Returns the length of the shortest prefix of @path that matches an
+ * absolute pattern, or -1 if there is none. As patterns can't match
+ * across a slash, each pattern can only match one prefix. */
+static gssize
+path_matcher_match_prefix (BuilderPathMatcher *self,
+                           const char         *path)
+{
+  g_autofree char *components = g_strdup (path);
+  g_autoptr(GPtrArray) active = g_ptr_array_new ();
+  g_autoptr(GPtrArray) next = g_ptr_array_new ();
+  char *component = components;
+  GPtrArray *tmp;
+  int i, j;
+
+  g_ptr_array_add (active, self->root);
+
+  while (TRUE)
+    {
+      char *end;
+      gboolean last;
+
+      while (*component == '/')
+        component++;
+      if (*component == 0)
+        return -1;
+
+      end = strchr (component, '/');
+      last = end == NULL;
+      if (end == NULL)
+        end = component + strlen (component);
+      *end = 0;
+
+      g_ptr_array_set_size (next, 0);
+      for (i = 0; i < active->len; i++)
+        {
+          PathMatcherNode *node = g_ptr_array_index (active, i);
+          PathMatcherNode *child;
+
+          if (node->children != NULL &&
+              (child = g_hash_table_lookup (node->children, component)) != NULL)
+            g_ptr_array_add (next, child);
+
+          for (j = 0; node->glob_children != NULL && j < node->glob_children->len; j++)
+            {
+              PathMatcherGlob *glob = g_ptr_array_index (node->glob_children, j);
+
+              if (flatpak_path_match_prefix (glob->pattern, component) != NULL)
+                g_ptr_array_add (next, glob->node);
+            }
+        }
+
+      for (i = 0; i < next->len; i++)
+        {
+          PathMatcherNode *node = g_ptr_array_index (next, i);
+
+          if (node->match)
+            return end - components;
+        }
+
+      if (next->len == 0 || last)
+        return -1;
+
+      tmp = active;
+      active = next;
+      next = tmp;
+      component = end + 1;
+    }
+}
+
+static gboolean
+path_matcher_match_basename (BuilderPathMatcher *self,
+                             const char         *basename)
+{
+  const char *dot;
+  int i;
+
+  if (g_hash_table_contains (self->basenames, basename))
+    return TRUE;
+
+  for (dot = strchr (basename, '.'); dot != NULL; dot = strchr (dot + 1, '.'))
+    {
+      if (g_hash_table_contains (self->suffixes, dot))
+        return TRUE;
+    }
+
+  for (i = 0; i < self->basename_globs->len; i++)
+    {
+      if (flatpak_path_match_prefix (g_ptr_array_index (self->basename_globs, i), basename) != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+gboolean
+builder_path_matcher_matches (BuilderPathMatcher *self,
+                              const char         *path)
+{
+  return path_matcher_match_prefix (self, path) >= 0 ||
+         path_matcher_match_basename (self, inplace_basename (path));
+}
+
+/* Like flatpak_collect_matches_for_path_pattern(), for all patterns */
+void
+builder_path_matcher_collect (BuilderPathMatcher *self,
+                              const char         *path,
+                              const char         *add_prefix,
+                              GHashTable         *to_remove_ht)
+{
+  gssize prefix_len = path_matcher_match_prefix (self, path);
+
+  if (prefix_len >= 0)
+    {
+      const char *rest = path + prefix_len;
+
+      /* A prefix match removes everything below it, so add every
+         longer prefix too, down to the full path */
+      while (TRUE)
+        {
+          const char *slash;
+          g_autofree char *prefix = g_strndup (path, rest - path);
+          g_hash_table_insert (to_remove_ht, g_strconcat (add_prefix ? add_prefix : "", prefix, NULL), GINT_TO_POINTER (1));
+          while (*rest == '/')
+            rest++;
+          if (*rest == 0)
+            break;
+          slash = strchr (rest, '/');
+          rest = slash ? slash : rest + strlen (rest);
+        }
+    }
+  else if (path_matcher_match_basename (self, inplace_basename (path)))
+    g_hash_table_insert (to_remove_ht, g_strconcat (add_prefix ? add_prefix : "", path, NULL), GINT_TO_POINTER (1));
+}
+
 gboolean
 strip (GError **error,
        ...)
@@ -183,6 +476,37 @@ eu_elfcompress (GError **error,
   return res;
 }
 
+#define MAX_FILES_PER_SPAWN 256
+
+/* Runs @tool with @args followed by @files, passing as many files as
+   possible to each invocation. Only works for tools that handle each
+   file on their own, like strip and eu-elfcompress. */
+gboolean
+builder_spawn_for_files (const char         *tool,
+                         const char * const *args,
+                         GPtrArray          *files,
+                         GError            **error)
+{
+  int i, j;
+
+  for (i = 0; i < files->len; i += MAX_FILES_PER_SPAWN)
+    {
+      g_autoptr(GPtrArray) argv = g_ptr_array_new ();
+
+      g_ptr_array_add (argv, (char *) tool);
+      for (j = 0; args[j] != NULL; j++)
+        g_ptr_array_add (argv, (char *) args[j]);
+      for (j = i; j < files->len && j < i + MAX_FILES_PER_SPAWN; j++)
+        g_ptr_array_add (argv, g_ptr_array_index (files, j));
+      g_ptr_array_add (argv, NULL);
+
+      if (!flatpak_spawnv (NULL, NULL, 0, error, (const char * const *) argv->pdata))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 
 static gboolean
 elf_has_symtab (Elf *elf)
@@ -238,7 +562,7 @@ is_elf_file (const char *path,
           GElf_Ehdr ehdr;
           gboolean res = FALSE;
 
-          if (elf_version (EV_CURRENT) == EV_NONE )
+          if (elf_version (EV_CURRENT) == EV_NONE)
             return FALSE;
 
           elf = elf_begin (fd, ELF_C_READ, NULL);
@@ -264,6 +588,695 @@ is_elf_file (const char *path,
   return FALSE;
 }
 
+/* Returns TRUE if @path has any .debug_* sections that are not in
+   the zlib-gnu format yet, so there is something for eu-elfcompress
+   to do. That includes sections compressed the gABI way
+   (SHF_COMPRESSED), which get converted to zlib-gnu too. */
+gboolean
+elf_has_debuginfo_to_compress (const char *path)
+{
+  glnx_fd_close int fd = -1;
+  Elf *elf;
+  Elf_Scn *scn;
+  GElf_Shdr shdr;
+  size_t shstrndx;
+  gboolean res = FALSE;
+
+  fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+
+  if (elf_version (EV_CURRENT) == EV_NONE)
+    return FALSE;
+
+  elf = elf_begin (fd, ELF_C_READ, NULL);
+  if (elf == NULL)
+    return FALSE;
+
+  if (elf_kind (elf) == ELF_K_ELF &&
+      elf_getshdrstrndx (elf, &shstrndx) == 0)
+    {
+      scn = NULL;
+      while (!res && (scn = elf_nextscn (elf, scn)) != NULL)
+        {
+          const char *name;
+
+          if (gelf_getshdr (scn, &shdr) == NULL)
+            continue;
+
+          name = elf_strptr (elf, shstrndx, shdr.sh_name);
+          if (name != NULL && g_str_has_prefix (name, ".debug_") &&
+              shdr.sh_type != SHT_NOBITS)
+            res = TRUE;
+        }
+    }
+
+  elf_end (elf);
+  return res;
+}
+
+static guint32 debuglink_crc_table[256];
+
+static gpointer
+init_debuglink_crc_table (gpointer data)
+{
+  guint32 i, j, c;
+
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      debuglink_crc_table[i] = c;
+    }
+
+  return NULL;
+}
+
+/* The CRC-32 that .gnu_debuglink uses for the debug file */
+static gboolean
+debuglink_crc32 (int       fd,
+                 guint32  *crc_out,
+                 GError  **error)
+{
+  static GOnce once = G_ONCE_INIT;
+  guint32 crc = 0xffffffff;
+  char buf[65536];
+  off_t offset = 0;
+  ssize_t n, i;
+
+  g_once (&once, init_debuglink_crc_table, NULL);
+
+  while ((n = pread (fd, buf, sizeof (buf), offset)) != 0)
+    {
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      for (i = 0; i < n; i++)
+        crc = debuglink_crc_table[(crc ^ (guchar) buf[i]) & 0xff] ^ (crc >> 8);
+      offset += n;
+    }
+
+  *crc_out = crc ^ 0xffffffff;
+  return TRUE;
+}
+
+/* The sections "eu-strip --remove-comment" moves to the debug file */
+static gboolean
+elf_section_is_debuginfo (const GElf_Shdr *shdr,
+                          const char      *name)
+{
+  if (shdr->sh_flags & SHF_ALLOC)
+    return FALSE;
+
+  if (shdr->sh_type == SHT_SYMTAB)
+    return TRUE;
+
+  return
+    g_str_has_prefix (name, ".debug") ||
+    g_str_has_prefix (name, ".zdebug") ||
+    g_str_has_prefix (name, ".stab") ||
+    strcmp (name, ".line") == 0 ||
+    strcmp (name, ".gdb_index") == 0 ||
+    strcmp (name, ".comment") == 0;
+}
+
+static guint
+elf_add_string (GString    *strtab,
+                const char *str)
+{
+  guint offset = strtab->len;
+
+  g_string_append_len (strtab, str, strlen (str) + 1);
+  return offset;
+}
+
+static gboolean
+elf_copy_header (Elf        *elf,
+                 Elf        *out,
+                 GElf_Ehdr  *ehdr,
+                 GError    **error)
+{
+  GElf_Phdr phdr;
+  int i;
+
+  if (gelf_newehdr (out, gelf_getclass (elf)) == NULL ||
+      (ehdr->e_phnum > 0 && gelf_newphdr (out, ehdr->e_phnum) == NULL))
+    return flatpak_fail (error, "Failed to create ELF header: %s", elf_errmsg (-1));
+
+  for (i = 0; i < ehdr->e_phnum; i++)
+    {
+      if (gelf_getphdr (elf, i, &phdr) == NULL ||
+          !gelf_update_phdr (out, i, &phdr))
+        return flatpak_fail (error, "Failed to copy program header: %s", elf_errmsg (-1));
+    }
+
+  return TRUE;
+}
+
+static gboolean
+elf_copy_data (Elf_Scn  *scn,
+               Elf_Scn  *out_scn,
+               GError  **error)
+{
+  Elf_Data *data = NULL;
+
+  while ((data = elf_getdata (scn, data)) != NULL)
+    {
+      Elf_Data *out_data = elf_newdata (out_scn);
+
+      if (out_data == NULL)
+        return flatpak_fail (error, "Failed to copy section data: %s", elf_errmsg (-1));
+
+      *out_data = *data;
+    }
+
+  return TRUE;
+}
+
+#ifdef HAVE_ELF_COMPRESS_GNU
+/* Compresses the section @scn of the debug file being written like
+   "eu-elfcompress -t zlib-gnu", which turns it into a .zdebug one if
+   that makes it smaller */
+static gboolean
+elf_compress_section_gnu (Elf_Scn    *scn,
+                          const char *name,
+                          gboolean   *compressed,
+                          GError    **error)
+{
+  GElf_Shdr shdr;
+
+  if (gelf_getshdr (scn, &shdr) == NULL)
+    return flatpak_fail (error, "Failed to compress %s: %s", name, elf_errmsg (-1));
+
+  if ((shdr.sh_flags & SHF_COMPRESSED) != 0 &&
+      elf_compress (scn, 0, 0) < 0)
+    return flatpak_fail (error, "Failed to decompress %s: %s", name, elf_errmsg (-1));
+
+  switch (elf_compress_gnu (scn, 1, 0))
+    {
+    case 1:
+      *compressed = TRUE;
+      return TRUE;
+
+    case 0:
+      *compressed = FALSE;
+      return TRUE;
+
+    default:
+      return flatpak_fail (error, "Failed to compress %s: %s", name, elf_errmsg (-1));
+    }
+}
+#endif
+
+static gboolean
+elf_write_debug_file (Elf        *elf,
+                      GElf_Ehdr  *ehdr,
+                      size_t      shnum,
+                      size_t      shstrndx,
+                      char      **names,
+                      gboolean    compress,
+                      int         fd,
+                      GError    **error)
+{
+  g_autoptr(GString) strtab = g_string_new_len ("", 1);
+  GElf_Ehdr out_ehdr;
+  Elf_Data *data;
+  Elf *out;
+  size_t i;
+  gboolean res = FALSE;
+
+  out = elf_begin (fd, ELF_C_WRITE, NULL);
+  if (out == NULL)
+    return flatpak_fail (error, "Failed to write debug file: %s", elf_errmsg (-1));
+
+  if (!elf_copy_header (elf, out, ehdr, error))
+    goto out;
+
+  /* The debug file keeps all the sections, at the same indexes, but
+     only has the contents of the debug ones and the notes (for the
+     build-id) */
+  for (i = 1; i < shnum; i++)
+    {
+      Elf_Scn *scn = elf_getscn (elf, i);
+      Elf_Scn *out_scn = elf_newscn (out);
+      g_autofree char *zname = NULL;
+      gboolean compressed = FALSE;
+      GElf_Shdr shdr;
+
+      if (out_scn == NULL || gelf_getshdr (scn, &shdr) == NULL)
+        {
+          flatpak_fail (error, "Failed to copy section: %s", elf_errmsg (-1));
+          goto out;
+        }
+
+      if (i == shstrndx)
+        {
+          /* Filled in below */
+        }
+      else if ((shdr.sh_flags & SHF_ALLOC) != 0 && shdr.sh_type != SHT_NOTE)
+        shdr.sh_type = SHT_NOBITS;
+      else if (!elf_copy_data (scn, out_scn, error))
+        goto out;
+
+      if (!gelf_update_shdr (out_scn, &shdr))
+        {
+          flatpak_fail (error, "Failed to copy section header: %s", elf_errmsg (-1));
+          goto out;
+        }
+
+      /* Compressing changes the header, so the name is set after */
+#ifdef HAVE_ELF_COMPRESS_GNU
+      if (compress && g_str_has_prefix (names[i], ".debug_") &&
+          shdr.sh_type != SHT_NOBITS &&
+          !elf_compress_section_gnu (out_scn, names[i], &compressed, error))
+        goto out;
+#endif
+
+      if (compressed)
+        zname = g_strconcat (".z", names[i] + 1, NULL);
+
+      if (gelf_getshdr (out_scn, &shdr) == NULL)
+        {
+          flatpak_fail (error, "Failed to copy section header: %s", elf_errmsg (-1));
+          goto out;
+        }
+
+      shdr.sh_name = elf_add_string (strtab, zname ? zname : names[i]);
+
+      if (!gelf_update_shdr (out_scn, &shdr))
+        {
+          flatpak_fail (error, "Failed to copy section header: %s", elf_errmsg (-1));
+          goto out;
+        }
+    }
+
+  data = elf_newdata (elf_getscn (out, shstrndx));
+  if (data == NULL)
+    {
+      flatpak_fail (error, "Failed to write section names: %s", elf_errmsg (-1));
+      goto out;
+    }
+
+  data->d_buf = strtab->str;
+  data->d_size = strtab->len;
+  data->d_type = ELF_T_BYTE;
+  data->d_align = 1;
+  data->d_version = EV_CURRENT;
+
+  out_ehdr = *ehdr;
+  out_ehdr.e_shstrndx = shstrndx;
+  if (!gelf_update_ehdr (out, &out_ehdr) ||
+      elf_update (out, ELF_C_WRITE) < 0)
+    {
+      flatpak_fail (error, "Failed to write debug file: %s", elf_errmsg (-1));
+      goto out;
+    }
+
+  res = TRUE;
+
+out:
+  elf_end (out);
+  return res;
+}
+
+static gboolean
+elf_write_stripped_file (Elf        *elf,
+                         GElf_Ehdr  *ehdr,
+                         size_t      shnum,
+                         size_t      shstrndx,
+                         char      **names,
+                         gboolean   *removed,
+                         size_t     *new_index,
+                         const char *debuglink,
+                         guint32     debuglink_crc,
+                         int         fd,
+                         GError    **error)
+{
+  g_autoptr(GString) strtab = g_string_new_len ("", 1);
+  size_t debuglink_len = (strlen (debuglink) + 1 + 3) & ~3;
+  g_autofree char *debuglink_buf = g_malloc0 (debuglink_len);
+  Elf_Scn *out_shstrtab = NULL;
+  GElf_Shdr shdr;
+  GElf_Phdr phdr;
+  GElf_Ehdr out_ehdr;
+  GElf_Off offset;
+  Elf_Scn *out_scn;
+  Elf_Data *data;
+  Elf *out;
+  size_t i;
+  gboolean res = FALSE;
+
+  out = elf_begin (fd, ELF_C_WRITE, NULL);
+  if (out == NULL)
+    return flatpak_fail (error, "Failed to write stripped file: %s", elf_errmsg (-1));
+
+  /* Everything that is loaded stays exactly where it was, only the
+     non-allocated sections are laid out again after it */
+  elf_flagelf (out, ELF_C_SET, ELF_F_LAYOUT);
+
+  if (!elf_copy_header (elf, out, ehdr, error))
+    goto out;
+
+  offset = ehdr->e_phoff + (GElf_Off) ehdr->e_phnum * ehdr->e_phentsize;
+  for (i = 0; i < ehdr->e_phnum; i++)
+    {
+      if (gelf_getphdr (elf, i, &phdr) != NULL)
+        offset = MAX (offset, phdr.p_offset + phdr.p_filesz);
+    }
+
+  for (i = 1; i < shnum; i++)
+    {
+      if (removed[i] || gelf_getshdr (elf_getscn (elf, i), &shdr) == NULL)
+        continue;
+      if ((shdr.sh_flags & SHF_ALLOC) != 0 && shdr.sh_type != SHT_NOBITS)
+        offset = MAX (offset, shdr.sh_offset + shdr.sh_size);
+    }
+
+  for (i = 1; i < shnum; i++)
+    {
+      Elf_Scn *scn = elf_getscn (elf, i);
+
+      if (removed[i])
+        continue;
+
+      out_scn = elf_newscn (out);
+      if (out_scn == NULL || gelf_getshdr (scn, &shdr) == NULL)
+        {
+          flatpak_fail (error, "Failed to copy section: %s", elf_errmsg (-1));
+          goto out;
+        }
+
+      shdr.sh_name = elf_add_string (strtab, names[i]);
+      if (shdr.sh_link != 0)
+        shdr.sh_link = new_index[shdr.sh_link];
+      if ((shdr.sh_flags & SHF_INFO_LINK) != 0 ||
+          shdr.sh_type == SHT_REL || shdr.sh_type == SHT_RELA)
+        shdr.sh_info = new_index[shdr.sh_info];
+
+      if (i == shstrndx)
+        out_shstrtab = out_scn;
+      else if (!elf_copy_data (scn, out_scn, error))
+        goto out;
+
+      if ((shdr.sh_flags & SHF_ALLOC) == 0 && i != shstrndx)
+        {
+          if (shdr.sh_addralign > 1)
+            offset = (offset + shdr.sh_addralign - 1) & ~(shdr.sh_addralign - 1);
+          shdr.sh_offset = offset;
+          if (shdr.sh_type != SHT_NOBITS)
+            offset += shdr.sh_size;
+        }
+
+      if (!gelf_update_shdr (out_scn, &shdr))
+        {
+          flatpak_fail (error, "Failed to copy section header: %s", elf_errmsg (-1));
+          goto out;
+        }
+    }
+
+  /* The .gnu_debuglink section: the name of the debug file, padded to
+     4 bytes, followed by its CRC in the byte order of the file */
+  out_scn = elf_newscn (out);
+  if (out_scn == NULL || gelf_getshdr (out_scn, &shdr) == NULL)
+    {
+      flatpak_fail (error, "Failed to add .gnu_debuglink: %s", elf_errmsg (-1));
+      goto out;
+    }
+
+  strcpy (debuglink_buf, debuglink);
+
+  data = elf_newdata (out_scn);
+  if (data == NULL)
+    {
+      flatpak_fail (error, "Failed to add .gnu_debuglink: %s", elf_errmsg (-1));
+      goto out;
+    }
+  data->d_buf = debuglink_buf;
+  data->d_size = debuglink_len;
+  data->d_off = 0;
+  data->d_type = ELF_T_BYTE;
+  data->d_align = 1;
+  data->d_version = EV_CURRENT;
+
+  data = elf_newdata (out_scn);
+  if (data == NULL)
+    {
+      flatpak_fail (error, "Failed to add .gnu_debuglink: %s", elf_errmsg (-1));
+      goto out;
+    }
+  data->d_buf = &debuglink_crc;
+  data->d_size = sizeof (debuglink_crc);
+  data->d_off = debuglink_len;
+  data->d_type = ELF_T_WORD;
+  data->d_align = 4;
+  data->d_version = EV_CURRENT;
+
+  offset = (offset + 3) & ~3;
+  shdr.sh_name = elf_add_string (strtab, ".gnu_debuglink");
+  shdr.sh_type = SHT_PROGBITS;
+  shdr.sh_flags = 0;
+  shdr.sh_addr = 0;
+  shdr.sh_offset = offset;
+  shdr.sh_size = debuglink_len + sizeof (debuglink_crc);
+  shdr.sh_link = 0;
+  shdr.sh_info = 0;
+  shdr.sh_addralign = 4;
+  shdr.sh_entsize = 0;
+  offset += shdr.sh_size;
+
+  if (!gelf_update_shdr (out_scn, &shdr))
+    {
+      flatpak_fail (error, "Failed to add .gnu_debuglink: %s", elf_errmsg (-1));
+      goto out;
+    }
+
+  /* The section names go last, now that they are all known */
+  data = elf_newdata (out_shstrtab);
+  if (data == NULL || gelf_getshdr (out_shstrtab, &shdr) == NULL)
+    {
+      flatpak_fail (error, "Failed to write section names: %s", elf_errmsg (-1));
+      goto out;
+    }
+
+  data->d_buf = strtab->str;
+  data->d_size = strtab->len;
+  data->d_off = 0;
+  data->d_type = ELF_T_BYTE;
+  data->d_align = 1;
+  data->d_version = EV_CURRENT;
+
+  shdr.sh_offset = offset;
+  shdr.sh_size = strtab->len;
+  offset += shdr.sh_size;
+
+  if (!gelf_update_shdr (out_shstrtab, &shdr))
+    {
+      flatpak_fail (error, "Failed to write section names: %s", elf_errmsg (-1));
+      goto out;
+    }
+
+  out_ehdr = *ehdr;
+  out_ehdr.e_shstrndx = new_index[shstrndx];
+  out_ehdr.e_shoff = (offset + 7) & ~7;
+  if (!gelf_update_ehdr (out, &out_ehdr) ||
+      elf_update (out, ELF_C_WRITE) < 0)
+    {
+      flatpak_fail (error, "Failed to write stripped file: %s", elf_errmsg (-1));
+      goto out;
+    }
+
+  res = TRUE;
+
+out:
+  elf_end (out);
+  return res;
+}
+
+/* Does what "eu-strip --remove-comment -f @debug_path -F
+   @real_debug_path" followed by "eu-elfcompress -t zlib-gnu" on the
+   debug file would do, without spawning anything. This only handles
+   the usual layout of linked executables and libraries, where all the
+   debug sections come after the loaded ones, and fails with
+   G_IO_ERROR_NOT_SUPPORTED for anything else, so that the caller can
+   fall back to the tools. */
+gboolean
+builder_elf_split_debuginfo (const char *path,
+                             const char *debug_path,
+                             const char *real_debug_path,
+                             gboolean    compress,
+                             GError    **error)
+{
+  glnx_fd_close int fd = -1;
+  glnx_fd_close int debug_fd = -1;
+  glnx_fd_close int tmp_fd = -1;
+  g_autofree char *tmp_path = NULL;
+  g_autofree char *debuglink = NULL;
+  g_autofree gboolean *removed = NULL;
+  g_autofree size_t *new_index = NULL;
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  struct stat stbuf;
+  GElf_Ehdr ehdr;
+  GElf_Shdr shdr;
+  size_t shnum, shstrndx, i, n_kept;
+  gboolean seen_removed = FALSE;
+  guint32 crc;
+  Elf *elf = NULL;
+  gboolean res = FALSE;
+
+  if (elf_version (EV_CURRENT) == EV_NONE)
+    return flatpak_fail (error, "Failed to initialize libelf");
+
+  fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0 || fstat (fd, &stbuf) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  elf = elf_begin (fd, ELF_C_READ, NULL);
+  if (elf == NULL)
+    return flatpak_fail (error, "Failed to read %s: %s", path, elf_errmsg (-1));
+
+  if (elf_kind (elf) != ELF_K_ELF ||
+      gelf_getehdr (elf, &ehdr) == NULL ||
+      elf_getshdrnum (elf, &shnum) != 0 ||
+      elf_getshdrstrndx (elf, &shstrndx) != 0)
+    {
+      flatpak_fail (error, "Failed to read %s: %s", path, elf_errmsg (-1));
+      goto out;
+    }
+
+  if ((ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) ||
+      shnum >= SHN_LORESERVE || shstrndx == SHN_UNDEF)
+    goto not_supported;
+
+#ifndef HAVE_ELF_COMPRESS_GNU
+  if (compress)
+    goto not_supported;
+#endif
+
+  g_ptr_array_set_size (names, shnum);
+  removed = g_new0 (gboolean, shnum);
+  new_index = g_new0 (size_t, shnum);
+
+  for (i = 1; i < shnum; i++)
+    {
+      Elf_Scn *scn = elf_getscn (elf, i);
+      const char *name;
+
+      if (scn == NULL || gelf_getshdr (scn, &shdr) == NULL ||
+          (name = elf_strptr (elf, shstrndx, shdr.sh_name)) == NULL)
+        {
+          flatpak_fail (error, "Failed to read %s: %s", path, elf_errmsg (-1));
+          goto out;
+        }
+
+      if (shdr.sh_type == SHT_GROUP || shdr.sh_type == SHT_SYMTAB_SHNDX ||
+          strcmp (name, ".gnu_debuglink") == 0)
+        goto not_supported;
+
+      if (shdr.sh_type == SHT_SYMTAB && shdr.sh_link != shstrndx &&
+          shdr.sh_link > 0 && shdr.sh_link < shnum)
+        removed[shdr.sh_link] = TRUE;
+
+      if (elf_section_is_debuginfo (&shdr, name))
+        removed[i] = TRUE;
+
+      names->pdata[i] = g_strdup (name);
+    }
+
+  /* The loaded sections have to keep their indexes, as symbols refer
+     to them, and nothing that stays may refer to what goes */
+  for (i = 1, n_kept = 1; i < shnum; i++)
+    {
+      if (gelf_getshdr (elf_getscn (elf, i), &shdr) == NULL)
+        goto not_supported;
+
+      if (removed[i])
+        {
+          seen_removed = TRUE;
+          continue;
+        }
+
+      if (seen_removed && (shdr.sh_flags & SHF_ALLOC) != 0)
+        goto not_supported;
+
+      new_index[i] = n_kept++;
+    }
+
+  if (!seen_removed)
+    goto not_supported;
+
+  for (i = 1; i < shnum; i++)
+    {
+      if (removed[i] || gelf_getshdr (elf_getscn (elf, i), &shdr) == NULL)
+        continue;
+
+      if (shdr.sh_link >= shnum || (shdr.sh_link != 0 && removed[shdr.sh_link]))
+        goto not_supported;
+
+      if (((shdr.sh_flags & SHF_INFO_LINK) != 0 ||
+           shdr.sh_type == SHT_REL || shdr.sh_type == SHT_RELA) &&
+          (shdr.sh_info >= shnum || removed[shdr.sh_info]))
+        goto not_supported;
+    }
+
+  debug_fd = open (debug_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (debug_fd < 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  if (!elf_write_debug_file (elf, &ehdr, shnum, shstrndx, (char **) names->pdata,
+                             compress, debug_fd, error) ||
+      !debuglink_crc32 (debug_fd, &crc, error))
+    goto out;
+
+  tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+  tmp_fd = g_mkstemp_full (tmp_path, O_RDWR | O_CLOEXEC, 0600);
+  if (tmp_fd < 0)
+    {
+      glnx_set_error_from_errno (error);
+      g_clear_pointer (&tmp_path, g_free);
+      goto out;
+    }
+
+  debuglink = g_path_get_basename (real_debug_path);
+  if (!elf_write_stripped_file (elf, &ehdr, shnum, shstrndx, (char **) names->pdata,
+                                removed, new_index, debuglink, crc, tmp_fd, error))
+    goto out;
+
+  if (fchmod (tmp_fd, stbuf.st_mode & 07777) != 0 ||
+      rename (tmp_path, path) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  g_clear_pointer (&tmp_path, g_free);
+  res = TRUE;
+  goto out;
+
+not_supported:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+               "Can't strip %s without eu-strip", path);
+
+out:
+  if (tmp_path)
+    unlink (tmp_path);
+  if (!res && debug_fd >= 0)
+    unlink (debug_path);
+  elf_end (elf);
+  return res;
+}
+
 gboolean
 directory_is_empty (const char *path)
 {
@@ -509,22 +1522,170 @@ parse_yaml_to_json (const gchar *contents,
 
 #endif  // FLATPAK_BUILDER_ENABLE_YAML
 
+static GFile *parse_cache_dir = NULL;
+
+/* Can't push this as user data to the demarshalling either, so like
+   the demarshal base dir this is set around loading the manifest */
+void
+builder_set_parse_cache_dir (GFile *dir)
+{
+  g_set_object (&parse_cache_dir, dir);
+}
+
+/* Parsed files are cached as the GVariant form of their json, which
+   loads a lot faster than parsing the yaml, or even the json, again */
+static JsonNode *
+load_cached_json (const char *checksum)
+{
+  g_autoptr(GFile) cache_file = g_file_get_child (parse_cache_dir, checksum);
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) json_variant = NULL;
+  char *contents;
+  gsize len;
+
+  if (!g_file_load_contents (cache_file, NULL, &contents, &len, NULL, NULL))
+    return NULL;
+
+  /* The mtime records the last use, see builder_prune_parse_cache() */
+  (void) utimensat (AT_FDCWD, flatpak_file_get_path_cached (cache_file), NULL, 0);
+
+  data = g_bytes_new_take (contents, len);
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARIANT, data, FALSE));
+  json_variant = g_variant_get_variant (variant);
+
+  return json_gvariant_deserialize (json_variant, NULL, NULL);
+}
+
+static void
+save_cached_json (const char *checksum,
+                  JsonNode   *json)
+{
+  g_autoptr(GFile) cache_file = g_file_get_child (parse_cache_dir, checksum);
+  g_autoptr(GVariant) variant = NULL;
+
+  /* Don't create the state dir just for this */
+  if (g_mkdir (flatpak_file_get_path_cached (parse_cache_dir), 0755) != 0 && errno != EEXIST)
+    return;
+
+  variant = g_variant_ref_sink (g_variant_new_variant (json_gvariant_serialize (json)));
+  g_file_set_contents (flatpak_file_get_path_cached (cache_file),
+                       g_variant_get_data (variant), g_variant_get_size (variant),
+                       NULL);
+}
+
+/* Removes the parsed files in @dir that were not used in the last
+ * @max_age days. Each manifest version leaves its own entries behind,
+ * so without this the cache only ever grows. */
+gboolean
+builder_prune_parse_cache (GFile   *dir,
+                           int      max_age,
+                           GError **error)
+{
+  g_auto(GLnxDirFdIterator) iter = {0};
+  g_autoptr(GError) my_error = NULL;
+  gint64 cutoff = g_get_real_time () / G_USEC_PER_SEC - max_age * (gint64) (24 * 60 * 60);
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (dir),
+                                    FALSE, &iter, &my_error))
+    {
+      if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          if (errno == ENOENT)
+            continue;
+          return glnx_throw_errno_prefix (error, "stat %s", dent->d_name);
+        }
+
+      if (!S_ISREG (stbuf.st_mode) || stbuf.st_mtime >= cutoff)
+        continue;
+
+      g_debug ("Removing unused parse cache entry %s", dent->d_name);
+      if (unlinkat (iter.fd, dent->d_name, 0) != 0 && errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "unlink %s", dent->d_name);
+    }
+
+  return TRUE;
+}
+
+JsonNode *
+builder_json_node_from_data (const char *relpath,
+                             const char *contents,
+                             GError    **error)
+{
+  gboolean is_yaml = g_str_has_suffix (relpath, ".yaml") || g_str_has_suffix (relpath, ".yml");
+  g_autofree char *checksum = NULL;
+  g_autoptr(JsonNode) json = NULL;
+
+  if (parse_cache_dir != NULL)
+    {
+      g_autoptr(GChecksum) cs = g_checksum_new (G_CHECKSUM_SHA256);
+
+      g_checksum_update (cs, (const guchar *) (is_yaml ? "yaml" : "json"), 4);
+      g_checksum_update (cs, (const guchar *) contents, strlen (contents));
+      checksum = g_strdup (g_checksum_get_string (cs));
+
+      json = load_cached_json (checksum);
+      if (json != NULL)
+        return g_steal_pointer (&json);
+    }
+
+  if (is_yaml)
+    json = parse_yaml_to_json (contents, error);
+  else
+    json = json_from_string (contents, error);
+
+  if (json == NULL)
+    {
+      /* json_from_string() doesn't set an error for empty documents */
+      if (error != NULL && *error == NULL)
+        g_set_error (error, JSON_PARSER_ERROR, JSON_PARSER_ERROR_PARSE, "Document is empty");
+      return NULL;
+    }
+
+  if (checksum != NULL)
+    save_cached_json (checksum, json);
+
+  return g_steal_pointer (&json);
+}
+
 GObject *
 builder_gobject_from_data (GType       gtype,
                            const char *relpath,
                            const char *contents,
                            GError    **error)
 {
-  if (g_str_has_suffix (relpath, ".yaml") || g_str_has_suffix (relpath, ".yml"))
+  g_autoptr(JsonNode) json = builder_json_node_from_data (relpath, contents, error);
+
+  if (json == NULL)
+    return NULL;
+
+  if (!JSON_NODE_HOLDS_OBJECT (json))
     {
-      g_autoptr(JsonNode) json = parse_yaml_to_json (contents, error);
-      if (json != NULL)
-        return json_gobject_deserialize (gtype, json);
-      else
-        return NULL;
+      g_set_error (error, JSON_PARSER_ERROR, JSON_PARSER_ERROR_PARSE,
+                   "Expecting a JSON object, but the root node is of type `%s'",
+                   json_node_type_name (json));
+      return NULL;
     }
-  else
-    return json_gobject_from_data (gtype, contents, -1, error);
+
+  return json_gobject_deserialize (gtype, json);
 }
 
 /*
@@ -1393,9 +2554,13 @@ strptr (Elf_Scn **scns, GElf_Shdr *shdr, int sec, off_t offset)
   return NULL;
 }
 
+/* The DWARF parser above keeps its state in globals */
+G_LOCK_DEFINE_STATIC (debuginfo);
+
 char **
 builder_get_debuginfo_file_references (const char *filename, GError **error)
 {
+  AUTOLOCK (debuginfo);
   Elf *elf = NULL;
   GElf_Ehdr ehdr;
   int i, j;
@@ -1977,19 +3142,22 @@ static gboolean
 builder_download_uri_curl (SoupURI        *uri,
                            CURL           *session,
                            GOutputStream  *out,
+                           goffset         resume_from,
                            GChecksum     **checksums,
                            gsize           n_checksums,
                            GError        **error)
 {
   CURLcode retcode;
   CURLWriteData write_data;
-  static gchar error_buffer[CURL_ERROR_SIZE];
+  gchar error_buffer[CURL_ERROR_SIZE];
   g_autofree gchar *url = soup_uri_to_string (uri, FALSE);
 
   curl_easy_setopt (session, CURLOPT_URL, url);
   curl_easy_setopt (session, CURLOPT_WRITEFUNCTION, builder_curl_write_cb);
   curl_easy_setopt (session, CURLOPT_WRITEDATA, &write_data);
   curl_easy_setopt (session, CURLOPT_ERRORBUFFER, error_buffer);
+  /* The session is reused, so this is always set */
+  curl_easy_setopt (session, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) resume_from);
 
   write_data.out = out;
   write_data.checksums = checksums;
@@ -1998,6 +3166,7 @@ builder_download_uri_curl (SoupURI        *uri,
 
   *error_buffer = '\0';
   retcode = curl_easy_perform (session);
+  curl_easy_setopt (session, CURLOPT_ERRORBUFFER, NULL);
 
   if (retcode != CURLE_OK)
     {
@@ -2009,6 +3178,56 @@ builder_download_uri_curl (SoupURI        *uri,
   return TRUE;
 }
 
+/* Opens the partial download @tmp for appending, after feeding what
+ * is already in it to @checksums. Returns the size of the existing
+ * data in @resume_from, which is 0 if there was none. */
+static GFileOutputStream *
+open_partial_download (GFile      *tmp,
+                       GPtrArray  *checksum_array,
+                       goffset    *resume_from,
+                       GError    **error)
+{
+  g_autoptr(GFileInputStream) in = NULL;
+  g_autoptr(GError) my_error = NULL;
+  guchar buffer[GET_BUFFER_SIZE];
+  gssize bytes_read;
+  goffset size = 0;
+  gsize i;
+
+  *resume_from = 0;
+
+  in = g_file_read (tmp, NULL, &my_error);
+  if (in == NULL)
+    {
+      if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return NULL;
+        }
+
+      return g_file_replace (tmp, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                             NULL, error);
+    }
+
+  while ((bytes_read = g_input_stream_read (G_INPUT_STREAM (in), buffer, sizeof (buffer),
+                                            NULL, error)) > 0)
+    {
+      for (i = 0; i < checksum_array->len; i++)
+        g_checksum_update (g_ptr_array_index (checksum_array, i), buffer, bytes_read);
+      size += bytes_read;
+    }
+
+  if (bytes_read < 0)
+    return NULL;
+
+  *resume_from = size;
+
+  return g_file_append_to (tmp, G_FILE_CREATE_NONE, NULL, error);
+}
+
+/* Downloads go to .$basename.partial next to @dest, which is kept if
+ * the transfer fails, and resumed with a range request next time. If
+ * the server can't resume, the download starts over. */
 gboolean
 builder_download_uri (SoupURI        *uri,
                       GFile          *dest,
@@ -2021,8 +3240,11 @@ builder_download_uri (SoupURI        *uri,
   g_autoptr(GFile) tmp = NULL;
   g_autoptr(GFile) dir = NULL;
   g_autoptr(GPtrArray) checksum_array = g_ptr_array_new_with_free_func ((GDestroyNotify)g_checksum_free);
+  g_autoptr(GError) my_error = NULL;
   g_autofree char *basename = g_file_get_basename (dest);
-  g_autofree char *template = g_strconcat (".", basename, "XXXXXX", NULL);
+  g_autofree char *tmp_name = g_strconcat (".", basename, ".partial", NULL);
+  goffset resume_from;
+  long response_code = 0;
   gsize i;
 
   for (i = 0; checksums[i] != NULL; i++)
@@ -2032,24 +3254,66 @@ builder_download_uri (SoupURI        *uri,
   dir = g_file_get_parent (dest);
   g_mkdir_with_parents (flatpak_file_get_path_cached (dir), 0755);
 
-  tmp = flatpak_file_new_tmp_in (dir, template, error);
-  if (tmp == NULL)
-    return FALSE;
+  tmp = g_file_get_child (dir, tmp_name);
 
-  out = g_file_replace (tmp, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
-                        NULL, error);
+  out = open_partial_download (tmp, checksum_array, &resume_from, error);
   if (out == NULL)
     return FALSE;
 
+  if (resume_from > 0)
+    g_print ("Resuming download of %s at %" G_GOFFSET_FORMAT " bytes\n", basename, resume_from);
+
   if (!builder_download_uri_curl (uri,
                                   curl_session,
                                   G_OUTPUT_STREAM (out),
+                                  resume_from,
                                   (GChecksum **)checksum_array->pdata,
                                   checksum_array->len,
-                                  error))
+                                  &my_error))
     {
-      unlink (flatpak_file_get_path_cached (tmp));
-      return FALSE;
+      if (resume_from > 0)
+        curl_easy_getinfo (curl_session, CURLINFO_RESPONSE_CODE, &response_code);
+
+      /* The server doesn't do ranges, or the partial file is already
+         as large as the whole file, so it's of no use */
+      if (resume_from > 0 &&
+          (g_error_matches (my_error, BUILDER_CURL_ERROR, CURLE_RANGE_ERROR) ||
+           (g_error_matches (my_error, BUILDER_CURL_ERROR, CURLE_HTTP_RETURNED_ERROR) &&
+            response_code == 416)))
+        {
+          g_clear_error (&my_error);
+          g_clear_object (&out);
+
+          for (i = 0; checksums[i] != NULL; i++)
+            {
+              g_checksum_free (g_ptr_array_index (checksum_array, i));
+              checksum_array->pdata[i] = g_checksum_new (checksums_type[i]);
+            }
+
+          out = g_file_replace (tmp, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                NULL, error);
+          if (out == NULL)
+            return FALSE;
+
+          if (!builder_download_uri_curl (uri,
+                                          curl_session,
+                                          G_OUTPUT_STREAM (out),
+                                          0,
+                                          (GChecksum **)checksum_array->pdata,
+                                          checksum_array->len,
+                                          error))
+            {
+              /* Keep what we got, to resume from next time */
+              g_output_stream_close (G_OUTPUT_STREAM (out), NULL, NULL);
+              return FALSE;
+            }
+        }
+      else
+        {
+          g_output_stream_close (G_OUTPUT_STREAM (out), NULL, NULL);
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return FALSE;
+        }
     }
 
   /* Manually close to flush and detect write errors */
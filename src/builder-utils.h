@@ -43,10 +43,20 @@ gboolean eu_strip (GError **error,
                    ...);
 gboolean eu_elfcompress (GError **error,
 			 ...);
+gboolean builder_spawn_for_files (const char         *tool,
+                                  const char * const *args,
+                                  GPtrArray          *files,
+                                  GError            **error);
 
 gboolean is_elf_file (const char *path,
                       gboolean   *is_shared,
                       gboolean   *is_stripped);
+gboolean elf_has_debuginfo_to_compress (const char *path);
+gboolean builder_elf_split_debuginfo (const char *path,
+                                      const char *debug_path,
+                                      const char *real_debug_path,
+                                      gboolean    compress,
+                                      GError    **error);
 
 char ** builder_get_debuginfo_file_references (const char *filename,
                                                GError    **error);
@@ -59,6 +69,19 @@ void     flatpak_collect_matches_for_path_pattern (const char *path,
                                                    const char *pattern,
                                                    const char *add_prefix,
                                                    GHashTable *to_remove_ht);
+
+typedef struct BuilderPathMatcher BuilderPathMatcher;
+
+BuilderPathMatcher *builder_path_matcher_new (void);
+void     builder_path_matcher_free (BuilderPathMatcher *self);
+void     builder_path_matcher_add_patterns (BuilderPathMatcher *self,
+                                            const char        **patterns);
+gboolean builder_path_matcher_matches (BuilderPathMatcher *self,
+                                       const char         *path);
+void     builder_path_matcher_collect (BuilderPathMatcher *self,
+                                       const char         *path,
+                                       const char         *add_prefix,
+                                       GHashTable         *to_remove_ht);
 gboolean builder_migrate_locale_dirs (GFile   *root_dir,
                                       GError **error);
 
@@ -68,10 +91,17 @@ GQuark builder_curl_error_quark (void);
 GQuark builder_yaml_parse_error_quark (void);
 #define BUILDER_YAML_PARSE_ERROR (builder_yaml_parse_error_quark ())
 
-GObject * builder_gobject_from_data (GType       gtype,
-                                     const char *relpath,
-                                     const char *contents,
-                                     GError    **error);
+void       builder_set_parse_cache_dir (GFile *dir);
+gboolean   builder_prune_parse_cache (GFile   *dir,
+                                      int      max_age,
+                                      GError **error);
+JsonNode * builder_json_node_from_data (const char *relpath,
+                                        const char *contents,
+                                        GError    **error);
+GObject *  builder_gobject_from_data (GType       gtype,
+                                      const char *relpath,
+                                      const char *contents,
+                                      GError    **error);
 
 gboolean builder_host_spawnv (GFile                *dir,
                               char                **output,
@@ -178,6 +208,7 @@ GVariant * flatpak_variant_uncompress (GVariant *variant, const GVariantType *ty
 
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakXml, flatpak_xml_free);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderPathMatcher, builder_path_matcher_free);
 
 G_END_DECLS
 
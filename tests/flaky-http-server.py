@@ -0,0 +1,55 @@
+#!/usr/bin/python3
+#
+# Serves the files in the current directory over http, but drops the
+# connection halfway through the first full download of each file.
+# Range requests are served properly, so a client that resumes gets
+# the rest of the file. All requests are logged to requests.log.
+#
+# Usage: flaky-http-server.py PORT-FILE
+
+import sys
+from http.server import HTTPServer, SimpleHTTPRequestHandler
+
+dropped = set()
+
+
+class FlakyHandler(SimpleHTTPRequestHandler):
+    def do_GET(self):
+        try:
+            with open(self.translate_path(self.path), 'rb') as f:
+                data = f.read()
+        except OSError:
+            self.send_error(404)
+            return
+
+        range_header = self.headers.get('Range')
+        with open('requests.log', 'a') as log:
+            log.write('%s %s\n' % (self.path, range_header or 'full'))
+
+        if range_header:
+            start = int(range_header.split('=')[1].split('-')[0])
+            if start >= len(data):
+                self.send_error(416)
+                return
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, len(data) - 1, len(data)))
+            self.send_header('Content-Length', str(len(data) - start))
+            self.end_headers()
+            self.wfile.write(data[start:])
+            return
+
+        self.send_response(200)
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        if self.path in dropped:
+            self.wfile.write(data)
+        else:
+            dropped.add(self.path)
+            self.wfile.write(data[:len(data) // 2])
+            self.close_connection = True
+
+
+server = HTTPServer(('127.0.0.1', 0), FlakyHandler)
+with open(sys.argv[1], 'w') as f:
+    f.write('%d\n' % server.server_port)
+server.serve_forever()
@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Tests resuming downloads that were interrupted, using
+# flaky-http-server.py.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+if ! command -v python3 >/dev/null; then
+    echo "1..0 # SKIP this test requires python3"
+    exit 0
+fi
+
+echo "1..1"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+HTTP_SERVER=$(cd $(dirname $0) && pwd)/flaky-http-server.py
+cd $TEST_DATA_DIR/
+
+mkdir http
+seq 1 100000 > http/bigfile
+BIGFILE_SHA256=$(sha256sum http/bigfile | cut -d ' ' -f 1)
+
+(cd http && exec python3 $HTTP_SERVER ../http-port) &
+HTTP_PID=$!
+trap 'kill $HTTP_PID 2>/dev/null || true; cleanup' EXIT
+
+for i in $(seq 50); do
+    test -s http-port && break
+    sleep 0.1
+done
+HTTP_PORT=$(cat http-port)
+
+cat > org.test.Download.json <<EOF2
+{
+    "app-id": "org.test.Download",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "modules": [
+        {
+            "name": "download",
+            "buildsystem": "simple",
+            "build-commands": [ "install -D bigfile /app/share/bigfile" ],
+            "sources": [
+                {
+                    "type": "file",
+                    "url": "http://127.0.0.1:${HTTP_PORT}/bigfile",
+                    "sha256": "${BIGFILE_SHA256}"
+                }
+            ]
+        }
+    ]
+}
+EOF2
+
+if ${FLATPAK_BUILDER} --download-only appdir org.test.Download.json; then
+    assert_not_reached "Download should have failed"
+fi
+
+find .flatpak-builder/downloads -name .bigfile.partial > partial
+assert_file_has_content partial bigfile.partial
+
+${FLATPAK_BUILDER} --download-only appdir org.test.Download.json
+
+assert_file_has_content http/requests.log '^/bigfile full$'
+assert_file_has_content http/requests.log '^/bigfile bytes=[1-9][0-9]*-$'
+find .flatpak-builder/downloads -name bigfile -exec cmp http/bigfile {} \;
+find .flatpak-builder/downloads -name .bigfile.partial > partial
+assert_not_file_has_content partial bigfile.partial
+
+echo "ok resumed download"
@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_fuse
 
-echo "1..4"
+echo "1..10"
 
 setup_repo
 install_repo
@@ -59,7 +59,7 @@ assert_file_has_content appdir/metadata tags=test;
 assert_file_has_content appdir/files/ran_module1 module1
 assert_file_has_content appdir/files/ran_module2 module2
 
-assert_not_has_file appdir/files/cleanup/a_filee
+assert_not_has_file appdir/files/cleanup/a_file
 assert_not_has_file appdir/files/bin/file.cleanup
 
 assert_has_file appdir/files/cleaned_up > out
@@ -101,3 +101,121 @@ ${FLATPAK_BUILDER} $FL_GPGARGS --repo=$REPO --force-clean runtimedir \
     test-runtime.json
 
 echo "ok runtime build cleanup with build-args"
+
+# Building modules in parallel should give the same result
+${FLATPAK_BUILDER} $FL_GPGARGS --disable-cache --module-jobs=2 --force-clean appdir test.json
+assert_file_has_content appdir/files/share/app-data version2
+assert_file_has_content appdir/files/ran_module1 module1
+assert_file_has_content appdir/files/ran_module2 module2
+assert_not_has_file appdir/files/cleanup/a_file
+
+# Modules with "depends" are built on top of their last dependency, and
+# ones that change the same file are merged as if built one by one
+cp $(dirname $0)/test-parallel.json .
+${FLATPAK_BUILDER} $FL_GPGARGS --module-jobs=3 --force-clean parallel-appdir test-parallel.json > parallel-out
+assert_file_has_content parallel-appdir/files/share/parallel/left '^left$'
+assert_file_has_content parallel-appdir/files/share/parallel/right-saw '^base$'
+assert_not_file_has_content parallel-appdir/files/share/parallel/right-saw left
+assert_file_has_content parallel-appdir/files/share/parallel/both '^left$'
+assert_file_has_content parallel-appdir/files/share/parallel/both '^other$'
+assert_file_has_content parallel-appdir/files/share/parallel/top '^left$'
+assert_file_has_content parallel-out 'rebuilding other'
+
+${FLATPAK_BUILDER} $FL_GPGARGS --module-jobs=3 --force-clean parallel-appdir test-parallel.json > parallel-out
+assert_file_has_content parallel-out 'Cache hit for right, skipping build'
+assert_file_has_content parallel-out 'Cache hit for top, skipping build'
+assert_not_file_has_content parallel-out '^Building module'
+assert_file_has_content parallel-appdir/files/share/parallel/both '^other$'
+
+echo "ok parallel module build"
+
+# Exporting straight from the cache should give the same commit
+# contents as flatpak build-export, and be signed before the ref is set
+APP_REF=app/org.test.Hello2/$ARCH/master
+ostree --repo=export-normal init --mode=archive-z2
+ostree --repo=export-cached init --mode=archive-z2
+${FLATPAK_BUILDER} $FL_GPGARGS --repo=export-normal --force-clean appdir test.json
+${FLATPAK_BUILDER} $FL_GPGARGS --repo=export-cached --export-from-cache --force-clean appdir test.json > export-out
+assert_not_file_has_content export-out "Can't export from cache"
+ostree --repo=export-normal ls -R -C $APP_REF > export-normal-files
+ostree --repo=export-cached ls -R -C $APP_REF > export-cached-files
+cmp export-normal-files export-cached-files
+ostree --repo=export-normal show --print-metadata-key=xa.metadata $APP_REF > export-normal-metadata
+ostree --repo=export-cached show --print-metadata-key=xa.metadata $APP_REF > export-cached-metadata
+cmp export-normal-metadata export-cached-metadata
+ostree --repo=export-cached show --print-detached-metadata-key=ostree.gpgsigs $APP_REF > /dev/null
+
+echo "ok export from cache"
+
+# Files of dir sources are remembered in the file checksum index, and
+# forgotten again once they are removed
+mkdir dir-source
+echo kept > dir-source/kept
+echo removed > dir-source/removed
+touch -d "1 hour ago" dir-source/kept dir-source/removed
+cat > test-dir.json <<END
+{
+    "app-id": "org.test.Dir",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "command": "hello.sh",
+    "modules": [
+        {
+            "name": "dir",
+            "buildsystem": "simple",
+            "build-commands": [ "cp kept /app/kept" ],
+            "sources": [ { "type": "dir", "path": "dir-source" } ]
+        }
+    ]
+}
+END
+${FLATPAK_BUILDER} --force-clean dir-appdir test-dir.json
+assert_file_has_content .flatpak-builder/file-checksums dir-source/kept
+assert_file_has_content .flatpak-builder/file-checksums dir-source/removed
+
+${FLATPAK_BUILDER} --force-clean dir-appdir test-dir.json > dir-out
+assert_file_has_content dir-out 'Cache hit for dir'
+
+rm dir-source/removed
+${FLATPAK_BUILDER} --force-clean dir-appdir test-dir.json > dir-out
+assert_not_file_has_content dir-out 'Cache hit for dir'
+assert_file_has_content .flatpak-builder/file-checksums dir-source/kept
+assert_not_file_has_content .flatpak-builder/file-checksums dir-source/removed
+
+echo "ok prune file checksums"
+
+# With --persistent-sandbox all the commands of a module are run by the
+# same shell in one sandbox, so what one leaves in /tmp the next can see
+cp $(dirname $0)/test-persistent.json .
+${FLATPAK_BUILDER} --persistent-sandbox --force-clean persistent-appdir test-persistent.json
+assert_file_has_content persistent-appdir/files/share/persistent/state '^state$'
+cmp persistent-appdir/files/share/persistent/shell1 persistent-appdir/files/share/persistent/shell2
+
+echo "ok persistent sandbox"
+
+# Sources are copied with their mtimes, both when extracted and when
+# restored from --cache-extracted-sources
+mkdir mtime-source
+echo stamp > mtime-source/stamp
+touch -d "2001-02-03 04:05:06" mtime-source/stamp
+cp $(dirname $0)/test-mtime.json .
+${FLATPAK_BUILDER} --cache-extracted-sources --force-clean mtime-appdir test-mtime.json
+assert_file_has_content mtime-appdir/files/share/stamp-time 20010203
+
+${FLATPAK_BUILDER} --disable-cache --cache-extracted-sources --force-clean mtime-appdir test-mtime.json > mtime-out
+assert_file_has_content mtime-out 'Using cached sources for mtime'
+assert_file_has_content mtime-appdir/files/share/stamp-time 20010203
+
+echo "ok source mtimes"
+
+# The platform is checked out from a copy of the installed runtime in
+# the cache, so the build never links to, or writes to, the installation
+cp $(dirname $0)/test-platform.json .
+${FLATPAK_BUILDER} --force-clean platform-appdir test-platform.json > platform-out
+assert_file_has_content platform-out 'Checking out org.test.Platform from'
+assert_has_file platform-appdir/platform/bin/bash
+RUNTIME_FILES=${FL_DIR}/runtime/org.test.Platform/$ARCH/master/active/files
+assert_not_streq $(stat -c %i platform-appdir/platform/bin/bash) $(stat -c %i ${RUNTIME_FILES}/bin/bash)
+ostree --repo=${FL_DIR}/repo fsck
+
+echo "ok platform checkout"
@@ -0,0 +1,274 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libelf.h>
+#include <gelf.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "libglnx/libglnx.h"
+
+#include "builder-utils.h"
+
+/* builder_elf_split_debuginfo() is checked on this test program
+ * itself, which is a linked executable with a symtab, and usually
+ * with debug info. Its output has to have the same sections as that
+ * of eu-strip, and a .gnu_debuglink that matches the debug file. */
+
+static GPtrArray *
+read_section_names (const char *path)
+{
+  GPtrArray *names = g_ptr_array_new_with_free_func (g_free);
+  Elf_Scn *scn = NULL;
+  size_t shstrndx;
+  Elf *elf;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  elf = elf_begin (fd, ELF_C_READ, NULL);
+  g_assert_nonnull (elf);
+  g_assert_cmpint (elf_getshdrstrndx (elf, &shstrndx), ==, 0);
+
+  while ((scn = elf_nextscn (elf, scn)) != NULL)
+    {
+      GElf_Shdr shdr;
+
+      g_assert_nonnull (gelf_getshdr (scn, &shdr));
+      g_ptr_array_add (names, g_strdup (elf_strptr (elf, shstrndx, shdr.sh_name)));
+    }
+
+  elf_end (elf);
+  close (fd);
+
+  return names;
+}
+
+static gboolean
+has_section (GPtrArray  *names,
+             const char *name)
+{
+  guint i;
+
+  for (i = 0; i < names->len; i++)
+    {
+      if (strcmp (g_ptr_array_index (names, i), name) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static int
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+static void
+assert_same_sections (const char *path,
+                      const char *expected_path)
+{
+  g_autoptr(GPtrArray) names = read_section_names (path);
+  g_autoptr(GPtrArray) expected = read_section_names (expected_path);
+  guint i;
+
+  g_ptr_array_sort (names, compare_names);
+  g_ptr_array_sort (expected, compare_names);
+
+  g_assert_cmpuint (names->len, ==, expected->len);
+  for (i = 0; i < names->len; i++)
+    g_assert_cmpstr (g_ptr_array_index (names, i), ==, g_ptr_array_index (expected, i));
+}
+
+/* Computed bit by bit, independently of the table in builder-utils.c */
+static guint32
+file_crc32 (const char *path)
+{
+  g_autofree char *contents = NULL;
+  guint32 crc = 0xffffffff;
+  gsize len, i;
+  int j;
+
+  g_assert_true (g_file_get_contents (path, &contents, &len, NULL));
+
+  for (i = 0; i < len; i++)
+    {
+      crc ^= (guchar) contents[i];
+      for (j = 0; j < 8; j++)
+        crc = (crc & 1) ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+    }
+
+  return crc ^ 0xffffffff;
+}
+
+static void
+assert_debuglink (const char *path,
+                  const char *debug_path,
+                  const char *debuglink)
+{
+  size_t debuglink_len = (strlen (debuglink) + 1 + 3) & ~3;
+  Elf_Scn *scn = NULL;
+  gboolean found = FALSE;
+  size_t shstrndx;
+  Elf *elf;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  elf = elf_begin (fd, ELF_C_READ, NULL);
+  g_assert_nonnull (elf);
+  g_assert_cmpint (elf_getshdrstrndx (elf, &shstrndx), ==, 0);
+
+  while ((scn = elf_nextscn (elf, scn)) != NULL)
+    {
+      GElf_Shdr shdr;
+      Elf_Data *data;
+      guint32 crc;
+
+      g_assert_nonnull (gelf_getshdr (scn, &shdr));
+      if (strcmp (elf_strptr (elf, shstrndx, shdr.sh_name), ".gnu_debuglink") != 0)
+        continue;
+
+      data = elf_getdata (scn, NULL);
+      g_assert_nonnull (data);
+      g_assert_cmpuint (data->d_size, ==, debuglink_len + 4);
+      g_assert_cmpstr ((const char *) data->d_buf, ==, debuglink);
+
+      /* The CRC is in the byte order of the file, which is ours */
+      memcpy (&crc, (char *) data->d_buf + debuglink_len, 4);
+      g_assert_cmphex (crc, ==, file_crc32 (debug_path));
+      found = TRUE;
+    }
+
+  g_assert_true (found);
+
+  elf_end (elf);
+  close (fd);
+}
+
+/* Returns FALSE if @argv[0] isn't installed */
+static gboolean
+run_tool (const char * const *argv)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *err = NULL;
+  int status;
+
+  if (!g_spawn_sync (NULL, (char **) argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
+                     NULL, NULL, NULL, &err, &status, &error))
+    {
+      g_assert_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT);
+      return FALSE;
+    }
+
+  if (!g_spawn_check_exit_status (status, &error))
+    g_error ("%s failed: %s\n%s", argv[0], error->message, err);
+
+  return TRUE;
+}
+
+static char *
+copy_self (const char *dir,
+           const char *name)
+{
+  g_autoptr(GFile) self = g_file_new_for_path ("/proc/self/exe");
+  g_autofree char *copy_path = g_build_filename (dir, name, NULL);
+  g_autoptr(GFile) copy = g_file_new_for_path (copy_path);
+
+  g_assert_true (g_file_copy (self, copy, G_FILE_COPY_NONE, NULL, NULL, NULL, NULL));
+
+  return g_file_get_path (copy);
+}
+
+static void
+test_split (gconstpointer data)
+{
+  gboolean compress = GPOINTER_TO_INT (data);
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = g_dir_make_tmp ("test-elf-split-XXXXXX", NULL);
+  g_autofree char *path = copy_self (dir, "binary");
+  g_autofree char *expected_path = copy_self (dir, "expected");
+  g_autofree char *debug_path = g_strconcat (path, ".debug", NULL);
+  g_autofree char *expected_debug_path = g_strconcat (expected_path, ".debug", NULL);
+  const char *real_debug_path = "/usr/lib/debug/app/binary.debug";
+  g_autoptr(GPtrArray) input_names = read_section_names (path);
+  g_autoptr(GPtrArray) names = NULL;
+  g_autoptr(GPtrArray) debug_names = NULL;
+  const char *readelf[] = { "eu-readelf", "-a", NULL, NULL };
+  const char *strip[] = { "eu-strip", "--remove-comment", "-f", expected_debug_path,
+                          "-F", real_debug_path, expected_path, NULL };
+  const char *elfcompress[] = { "eu-elfcompress", "-t", "zlib-gnu", expected_debug_path, NULL };
+
+  if (!builder_elf_split_debuginfo (path, debug_path, real_debug_path, compress, &error))
+    {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+      g_test_skip (error->message);
+      glnx_shutil_rm_rf_at (AT_FDCWD, dir, NULL, NULL);
+      return;
+    }
+
+  names = read_section_names (path);
+  debug_names = read_section_names (debug_path);
+
+  g_assert_false (has_section (names, ".symtab"));
+  g_assert_false (has_section (names, ".debug_info"));
+  g_assert_false (has_section (names, ".zdebug_info"));
+  g_assert_true (has_section (debug_names, ".symtab"));
+  g_assert_cmpuint (debug_names->len, ==, input_names->len);
+
+  if (has_section (input_names, ".debug_info"))
+    g_assert_true (has_section (debug_names, compress ? ".zdebug_info" : ".debug_info"));
+
+  assert_debuglink (path, debug_path, "binary.debug");
+
+  readelf[2] = path;
+  if (!run_tool (readelf))
+    {
+      g_test_message ("eu-readelf not installed, not comparing with elfutils");
+      glnx_shutil_rm_rf_at (AT_FDCWD, dir, NULL, NULL);
+      return;
+    }
+  readelf[2] = debug_path;
+  run_tool (readelf);
+
+  if (run_tool (strip) && (!compress || run_tool (elfcompress)))
+    {
+      assert_same_sections (path, expected_path);
+      assert_same_sections (debug_path, expected_debug_path);
+    }
+
+  glnx_shutil_rm_rf_at (AT_FDCWD, dir, NULL, NULL);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  elf_version (EV_CURRENT);
+
+  g_test_add_data_func ("/elf-split/split", GINT_TO_POINTER (FALSE), test_split);
+  g_test_add_data_func ("/elf-split/split-compressed", GINT_TO_POINTER (TRUE), test_split);
+
+  return g_test_run ();
+}
@@ -0,0 +1,259 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "builder-utils.h"
+
+/* BuilderPathMatcher has to give the same results as matching each
+ * pattern on its own, which is what the cleanup code did before */
+
+static const char *patterns[] = {
+  "/include",
+  "/lib/pkgconfig",
+  "/share/man",
+  "/share/doc/*",
+  "/lib/*.a",
+  "/lib/debug/*/tmp",
+  "/bin/tool?",
+  "//share/aclocal",
+  "*.la",
+  "*.a",
+  "*.tar.gz",
+  "README",
+  "*-config",
+  "lib*-test.so",
+  NULL
+};
+
+static const char *paths[] = {
+  "include",
+  "include/foo",
+  "include/foo/bar.h",
+  "lib",
+  "lib/libfoo.so",
+  "lib/libfoo.la",
+  "lib/libfoo.a",
+  "lib/sub/libfoo.a",
+  "lib/pkgconfig",
+  "lib/pkgconfig/foo.pc",
+  "lib/debug/x/tmp",
+  "lib/debug/x/tmp/file",
+  "lib/debug/x/y/tmp",
+  "lib/libfoo-test.so",
+  "lib/libfoo-test.so.1",
+  "share/man/man1/foo.1",
+  "share/doc",
+  "share/doc/foo",
+  "share/doc/foo/README",
+  "share/aclocal/foo.m4",
+  "share/foo/README",
+  "share/foo/README.md",
+  "share/foo/data.tar.gz",
+  "share/foo/data.gz",
+  "bin/tool1",
+  "bin/tool12",
+  "bin/tool",
+  "bin/foo-config",
+  "bin/foo-config.sh",
+  NULL
+};
+
+static GHashTable *
+collect_each (const char **pats,
+              const char  *path)
+{
+  GHashTable *ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  int i;
+
+  for (i = 0; pats[i] != NULL; i++)
+    flatpak_collect_matches_for_path_pattern (path, pats[i], "/prefix/", ht);
+
+  return ht;
+}
+
+static GHashTable *
+collect_matcher (BuilderPathMatcher *matcher,
+                 const char         *path)
+{
+  GHashTable *ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  builder_path_matcher_collect (matcher, path, "/prefix/", ht);
+
+  return ht;
+}
+
+static void
+assert_same_keys (GHashTable *a,
+                  GHashTable *b,
+                  const char *path)
+{
+  GHashTableIter iter;
+  gpointer key;
+
+  if (g_hash_table_size (a) != g_hash_table_size (b))
+    g_error ("%s: %u matches expected, got %u", path,
+             g_hash_table_size (a), g_hash_table_size (b));
+
+  g_hash_table_iter_init (&iter, a);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (!g_hash_table_contains (b, key))
+        g_error ("%s: %s not matched", path, (char *) key);
+    }
+}
+
+static void
+test_same_as_each_pattern (void)
+{
+  BuilderPathMatcher *matcher = builder_path_matcher_new ();
+  int i, j;
+
+  builder_path_matcher_add_patterns (matcher, patterns);
+
+  for (i = 0; paths[i] != NULL; i++)
+    {
+      g_autoptr(GHashTable) expected = collect_each (patterns, paths[i]);
+      g_autoptr(GHashTable) got = collect_matcher (matcher, paths[i]);
+      gboolean any = FALSE;
+
+      assert_same_keys (expected, got, paths[i]);
+
+      for (j = 0; patterns[j] != NULL; j++)
+        any = any || flatpak_matches_path_pattern (paths[i], patterns[j]);
+      g_assert_cmpint (any, ==, builder_path_matcher_matches (matcher, paths[i]));
+    }
+
+  builder_path_matcher_free (matcher);
+}
+
+static void
+assert_collects (BuilderPathMatcher *matcher,
+                 const char         *path,
+                 const char        **expected)
+{
+  g_autoptr(GHashTable) got = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  int i;
+
+  builder_path_matcher_collect (matcher, path, NULL, got);
+
+  for (i = 0; expected[i] != NULL; i++)
+    g_assert_true (g_hash_table_contains (got, expected[i]));
+  g_assert_cmpuint (g_hash_table_size (got), ==, i);
+}
+
+static void
+test_semantics (void)
+{
+  BuilderPathMatcher *matcher = builder_path_matcher_new ();
+  const char *none[] = { NULL };
+  const char *include[] = { "include", "include/foo", "include/foo/bar.h", NULL };
+  const char *doc[] = { "share/doc/foo", "share/doc/foo/README", NULL };
+  const char *la[] = { "lib/sub/libfoo.la", NULL };
+
+  builder_path_matcher_add_patterns (matcher, patterns);
+
+  /* An absolute match removes the matching prefix and all below it */
+  assert_collects (matcher, "include/foo/bar.h", include);
+  assert_collects (matcher, "share/doc/foo/README", doc);
+  /* Wildcards don't match across slashes */
+  assert_collects (matcher, "share/doc", none);
+  assert_collects (matcher, "lib/debug/x/y/tmp", none);
+  /* Relative patterns only match the basename */
+  assert_collects (matcher, "lib/sub/libfoo.la", la);
+  assert_collects (matcher, "share/foo/data.gz", none);
+
+  g_assert_true (builder_path_matcher_matches (matcher, "bin/tool1"));
+  g_assert_false (builder_path_matcher_matches (matcher, "bin/tool12"));
+  g_assert_true (builder_path_matcher_matches (matcher, "share/foo/data.tar.gz"));
+  g_assert_false (builder_path_matcher_matches (matcher, "share/foo/README.md"));
+
+  builder_path_matcher_free (matcher);
+}
+
+/* Run with -m perf to compare the matcher with matching each pattern
+ * on a tree and pattern list about the size of a big app */
+static void
+test_perf (void)
+{
+  g_autoptr(GPtrArray) pats = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) tree = g_ptr_array_new_with_free_func (g_free);
+  BuilderPathMatcher *matcher;
+  double each_time, matcher_time;
+  guint n_each = 0, n_matcher = 0;
+  int i;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run with -m perf");
+      return;
+    }
+
+  for (i = 0; patterns[i] != NULL; i++)
+    g_ptr_array_add (pats, g_strdup (patterns[i]));
+  for (i = 0; i < 100; i++)
+    {
+      g_ptr_array_add (pats, g_strdup_printf ("/share/module%d", i));
+      g_ptr_array_add (pats, g_strdup_printf ("*.ext%d", i));
+      g_ptr_array_add (pats, g_strdup_printf ("name%d", i));
+    }
+  g_ptr_array_add (pats, NULL);
+
+  for (i = 0; i < 50000; i++)
+    g_ptr_array_add (tree, g_strdup_printf ("%s/dir%d/file%d.ext%d",
+                                            paths[i % (G_N_ELEMENTS (paths) - 1)],
+                                            i % 97, i, i % 200));
+
+  g_test_timer_start ();
+  for (i = 0; i < tree->len; i++)
+    {
+      g_autoptr(GHashTable) ht = collect_each ((const char **) pats->pdata, g_ptr_array_index (tree, i));
+      n_each += g_hash_table_size (ht);
+    }
+  each_time = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  matcher = builder_path_matcher_new ();
+  builder_path_matcher_add_patterns (matcher, (const char **) pats->pdata);
+  for (i = 0; i < tree->len; i++)
+    {
+      g_autoptr(GHashTable) ht = collect_matcher (matcher, g_ptr_array_index (tree, i));
+      n_matcher += g_hash_table_size (ht);
+    }
+  builder_path_matcher_free (matcher);
+  matcher_time = g_test_timer_elapsed ();
+
+  g_assert_cmpuint (n_each, ==, n_matcher);
+
+  g_test_message ("%u paths, %u patterns: each pattern %.3fs, matcher %.3fs",
+                  tree->len, pats->len - 1, each_time, matcher_time);
+  g_test_minimized_result (matcher_time, "matcher: %.3fs", matcher_time);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/path-matcher/same-as-each-pattern", test_same_as_each_pattern);
+  g_test_add_func ("/path-matcher/semantics", test_semantics);
+  g_test_add_func ("/path-matcher/perf", test_perf);
+
+  return g_test_run ();
+}